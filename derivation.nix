@@ -20,10 +20,14 @@ stdenv.mkDerivation {
     pkgs.catch2
     pkgs.nlohmann_json
     pkgs.cryptopp
+    pkgs.zstd
+    pkgs.lz4
   ];
 
   cmakeFlags = [
     "-DBUILD_STATIC=On"
+    "-DUSE_ZSTD=ON"
+    "-DUSE_LZ4=ON"
   ];
 
   installPhase = ''
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+namespace mfsync::filetransfer
+{
+
+// Adapts the size of the chunks a sender puts on the wire.
+// After every written chunk the sender reports how long the write took. From that the
+// controller estimates the throughput and picks a chunk size that needs roughly a
+// couple of round trips to drain, staying within [min, max].
+class chunk_size_controller
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+  chunk_size_controller() = default;
+  chunk_size_controller(size_t initial, size_t min, size_t max);
+
+  size_t get_chunksize() const;
+  double get_throughput() const;
+  void set_rtt(std::chrono::microseconds rtt);
+  void update(size_t bytes_written, clock::duration duration);
+
+private:
+  clock::duration get_target_duration() const;
+
+  static constexpr double SMOOTHING = 0.25;
+  static constexpr auto MIN_TARGET_DURATION = std::chrono::milliseconds(5);
+  static constexpr auto MAX_TARGET_DURATION = std::chrono::milliseconds(100);
+
+  size_t chunksize_ = 0;
+  size_t min_ = 0;
+  size_t max_ = 0;
+  double throughput_ = 0;
+  std::chrono::microseconds rtt_{0};
+};
+
+} //closing namespace mfsync::filetransfer
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <deque>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <span>
 
 #include <utility>
 #include <boost/asio.hpp>
@@ -8,10 +14,21 @@
 
 #include "spdlog/spdlog.h"
 
+#include "mfsync/compression.h"
+#include "mfsync/content_chunking.h"
+#include "mfsync/delta.h"
 #include "mfsync/file_handler.h"
 #include "mfsync/deque.h"
+#include "mfsync/multicast_transfer.h"
 #include "mfsync/progress_handler.h"
+#include "mfsync/protocol.h"
 #include "mfsync/crypto.h"
+#include "mfsync/rate_limiter.h"
+#include "mfsync/segmented_download.h"
+#include "mfsync/sha256.h"
+#include "mfsync/stream_output.h"
+#include "mfsync/transfer_options.h"
+#include "mfsync/uring_context.h"
 
 namespace mfsync::filetransfer
 {
@@ -28,8 +45,46 @@ public:
     progress_ = progress;
   }
 
+  void set_options(const transfer_options& options)
+  {
+    options_ = options;
+  }
+
+  void set_uring(uring_context* uring)
+  {
+    uring_ = uring;
+  }
+
+  void set_downloads(download_registry* downloads)
+  {
+    downloads_ = downloads;
+  }
+
+  void set_limiter(rate_limiter* limiter)
+  {
+    limiter_ = limiter;
+  }
+
+  //received files are written to output instead of being stored
+  void set_output(mfsync::stream_output* output)
+  {
+    output_ = output;
+  }
+
+  //stored copies are signed on workers instead of the io threads
+  void set_workers(boost::asio::thread_pool* workers)
+  {
+    workers_ = workers;
+  }
+
 protected:
   progress_handler* progress_ = nullptr;
+  transfer_options options_;
+  uring_context* uring_ = nullptr;
+  download_registry* downloads_ = nullptr;
+  rate_limiter* limiter_ = nullptr;
+  mfsync::stream_output* output_ = nullptr;
+  boost::asio::thread_pool* workers_ = nullptr;
 };
 
 template<typename SocketType>
@@ -78,6 +133,35 @@ public:
   virtual void start_request() override;
 };
 
+// a file that is received as one of the streams of a connection
+struct incoming_stream
+{
+  requested_file requested;
+  mfsync::ofstream_wrapper ofstream;
+  mfsync::sha256 checksum;
+  size_t bytes_written = 0;
+  //received bytes the sender wasnt granted again yet
+  size_t unacknowledged = 0;
+  progress::file_progress_information* bar = nullptr;
+  //set if only a segment of a file that is fetched from several sources is received
+  std::optional<segmented_download::lease> segment;
+  //the rest of the segment is fetched from another source
+  bool cancelled = false;
+  //first stream of the bundle the file was requested in, 0 if it was requested alone
+  uint32_t bundle = 0;
+  //stored copy an update is rebuilt from, copy frames reference its blocks
+  file_descriptor basis;
+  size_t basis_block_size = 0;
+  size_t basis_blocks = 0;
+  //set if only the chunk manifest of the file was requested, the chunks
+  //that arent stored anywhere are fetched once it is complete
+  bool manifest = false;
+  std::vector<content_chunk> chunks;
+  //set if the file is received from a multicast group, the stream only
+  //carries where to join it
+  bool cast = false;
+};
+
 template<typename SocketType>
 class client_session_base : public session_base, public std::enable_shared_from_this<client_session_base<SocketType>>
 {
@@ -91,7 +175,6 @@ public:
   virtual ~client_session_base() = default;
 
   SocketType& get_socket();
-  void request_file();
 
   void initialize_communication();
   void read_handshake();
@@ -100,26 +183,99 @@ public:
   void handle_read_encrypted_response(boost::system::error_code const &error, std::size_t bytes_transferred);
 
 protected:
-  void read_file_request_response();
-  void handle_read_file_request_response(boost::system::error_code const &error, std::size_t bytes_transferred);
-  void read_file_chunk();
-  void handle_read_file_chunk(boost::system::error_code const &error, std::size_t bytes_transferred);
+  //io_uring can only receive directly from unencrypted sockets
+  static constexpr bool RAW_SOCKET =
+      std::is_same_v<SocketType, boost::asio::ip::tcp::socket>;
+
+  //requests files of the same host until max_streams are in flight
+  void fill_streams();
+  void request_file(requested_file requested);
+  void request_bundle(requested_file first);
+  bool open_stream(requested_file& requested, uint32_t bundle = 0);
+  //signs the stored copy of a requested file off the strand, false if there
+  //is none and the request can be sent right away
+  bool sign_basis(const requested_file& requested);
+  //sends the signature of the stored copy ahead of the request
+  void request_update(const requested_file& requested, file_descriptor basis,
+                      const std::optional<file_signature>& signature);
+  //a bundle takes up one slot no matter how many of its files are left
+  size_t get_requests_in_flight() const;
+  void request_segment(const std::shared_ptr<segmented_download>& download,
+                       requested_file requested);
+  bool wants_manifest(const requested_file& requested) const;
+  void request_manifest(requested_file requested);
+  bool wants_cast(const requested_file& requested) const;
+  void request_cast(requested_file requested);
+  //receives the file from the multicast group the sender named
+  void join_cast(incoming_stream& stream, const std::string& payload);
+  std::optional<requested_file> get_next_file(
+      size_t max_size = std::numeric_limits<size_t>::max());
+  void queue_message(std::string message);
+  void write_next_message();
+  void read_frame_header();
+  //waits until the limiter allows receiving bytes more before reading on
+  void read_frame_header_after(size_t bytes);
+  void handle_read_frame_header(boost::system::error_code const &error, std::size_t bytes_transferred);
+  void read_frame_payload();
+  void handle_read_frame_payload(boost::system::error_code const &error, std::size_t bytes_transferred);
+  void handle_data(incoming_stream& stream, size_t size);
+  void handle_segment_data(incoming_stream& stream, size_t size);
+  void handle_copy(incoming_stream& stream, size_t size);
+  void handle_manifest(incoming_stream& stream, size_t size);
+  //copies the chunks that are stored already off the strand and fetches the
+  //rest as segments once they are
+  void rebuild_from_chunks(incoming_stream& stream);
+  void handle_copied_chunks(uint32_t stream_id, byte_ranges written);
+  //decrypts the payload of a data frame, which starts where the stream got
+  //to, and restores compressed chunks. nullopt if it cant be
+  std::optional<std::span<const unsigned char>> decode_payload(const incoming_stream& stream,
+                                                               size_t size);
+  void acknowledge(incoming_stream& stream, size_t size);
+  void handle_end(incoming_stream& stream, const std::string& payload);
+  void finish_file(incoming_stream& stream);
+  void finish_output(incoming_stream& stream);
+  void finish_segment(incoming_stream& stream);
+  void close_stream(uint32_t stream_id);
+  //closes a stream that failed on our side, the sender is told to free its slot
+  void drop_stream(incoming_stream& stream);
+  void close();
+  //ends the session after a read or write error, its streams are dropped
   void handle_error();
 
   boost::asio::io_context& io_context_;
   SocketType socket_;
-  requested_file requested_;
-  size_t bytes_written_to_requested_ = 0;
+  available_file source_;
+  std::optional<requested_file> next_requested_;
   mfsync::concurrent::deque<available_file>& deque_;
   mfsync::file_handler& file_handler_;
   mfsync::crypto::crypto_handler& crypto_handler_;
   std::unique_ptr<mfsync::crypto::crypto_handler> derived_crypto_handler_;
   std::string pub_key_;
   std::string message_;
+  capabilities capabilities_;
   boost::asio::streambuf stream_buffer_;
+  protocol::frame_header frame_header_;
+  protocol::frame frame_;
   std::vector<uint8_t> readbuf_;
-  mfsync::ofstream_wrapper ofstream_;
-  progress::file_progress_information* bar_ = nullptr;
+  std::vector<unsigned char> plain_buffer_;
+  //negotiated codec of compressed data frames
+  codec codec_ = codec::NONE;
+  std::vector<unsigned char> decompress_buffer_;
+  std::vector<unsigned char> basis_buffer_;
+  //handlers of a session run on the strand of its socket, one at a time
+  std::map<uint32_t, incoming_stream> streams_;
+  uint32_t next_stream_id_ = 1;
+  //files a manifest was requested for already, if it didnt help they are
+  //fetched without one
+  std::set<std::string, std::less<>> deduplicated_;
+  //files a cast was requested for already, they arent asked for again
+  std::set<std::string, std::less<>> cast_;
+  //files the host is still receiving, they are streamed from it as they grow
+  std::set<std::string, std::less<>> partial_;
+  //requests and window updates are sent in the order they were encrypted
+  std::mutex write_mutex_;
+  std::deque<std::string> write_queue_;
+  bool writing_ = false;
 };
 
 class client_session : public client_session_base<boost::asio::ip::tcp::socket>
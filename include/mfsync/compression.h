@@ -0,0 +1,69 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace mfsync::filetransfer
+{
+
+enum class codec
+{
+  NONE,
+  ZSTD,
+  LZ4
+};
+
+// codecs this build supports, the preferred one first. the first one of the
+// receivers list that the sender supports is used
+std::vector<std::string> get_supported_codecs();
+std::optional<codec> get_codec(const std::string& name);
+
+// Compresses the chunks of a file before they are encrypted. A compressed
+// chunk starts with the size of the raw data as 4 byte little endian.
+// Chunks that dont shrink enough are sent as they are and the following ones
+// arent even tried, for twice as many chunks every time it happens, so
+// already compressed data costs next to no cpu. The level goes down while
+// compressing is slower than the link and up while it is much faster.
+class chunk_compressor
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+  static constexpr size_t SIZE_PREFIX = 4;
+  //a compressed chunk has to be at most this much of the raw one
+  static constexpr double MAX_RATIO = 0.9;
+  static constexpr size_t MAX_SKIPPED_CHUNKS = 64;
+  static constexpr int MIN_LEVEL = 1;
+  static constexpr int MAX_LEVEL = 9;
+  static constexpr int DEFAULT_LEVEL = 3;
+
+  chunk_compressor() = default;
+  explicit chunk_compressor(codec compression_codec);
+
+  //link_throughput is in bytes per second, 0 if it is unknown. returns false
+  //if the chunk should be sent uncompressed, out holds nothing useful then
+  bool compress(const unsigned char* data, size_t size, double link_throughput,
+                std::vector<unsigned char>& out);
+  int get_level() const;
+
+private:
+  bool compress_with_level(const unsigned char* data, size_t size,
+                           std::vector<unsigned char>& out) const;
+  void adapt_level(size_t size, clock::duration duration, double link_throughput);
+
+  codec codec_ = codec::NONE;
+  int level_ = DEFAULT_LEVEL;
+  //chunks left that are sent without trying
+  size_t skip_ = 0;
+  size_t next_skip_ = 1;
+};
+
+// restores a chunk compressed by chunk_compressor into out. fails on
+// malformed chunks and ones that would grow beyond max_size
+bool decompress_chunk(codec compression_codec, const unsigned char* data, size_t size,
+                      size_t max_size, std::vector<unsigned char>& out);
+
+} //closing namespace mfsync::filetransfer
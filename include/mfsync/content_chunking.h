@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mfsync/file_descriptor.h"
+
+namespace mfsync
+{
+
+// Content defined chunking the way FastCDC does it. A gear hash is rolled
+// over the data and a chunk ends where its top bits are zero, so boundaries
+// only depend on the bytes right in front of them. Data that is inserted or
+// removed shifts the following boundaries with it instead of changing every
+// chunk after it, identical content ends up in identical chunks no matter
+// which file or offset it is found at.
+
+constexpr size_t MIN_CONTENT_CHUNK_SIZE = 16 * 1024;
+constexpr size_t AVG_CONTENT_CHUNK_SIZE = 64 * 1024;
+constexpr size_t MAX_CONTENT_CHUNK_SIZE = 256 * 1024;
+constexpr size_t CONTENT_HASH_SIZE = 16;
+//smaller files are fetched without asking for their chunks first
+constexpr size_t MIN_DEDUP_FILE_SIZE = 4 * MAX_CONTENT_CHUNK_SIZE;
+
+//first 16 bytes of the sha256sum of a chunk
+using content_hash = std::array<unsigned char, CONTENT_HASH_SIZE>;
+content_hash get_content_hash(const unsigned char* data, size_t size);
+
+struct content_chunk
+{
+  content_hash hash;
+  size_t offset = 0;
+  size_t length = 0;
+};
+
+//length of the chunk data starts with. data has to hold at least
+//MAX_CONTENT_CHUNK_SIZE bytes unless the file ends within them
+size_t find_chunk_boundary(const unsigned char* data, size_t size);
+//appends the chunks of data, which starts at offset of its file, and returns
+//the bytes they cover. unless at_end is set, less than MAX_CONTENT_CHUNK_SIZE
+//bytes are left at the end since the next chunk might reach beyond them
+size_t cut_chunks(const unsigned char* data, size_t size, size_t offset, bool at_end,
+                  std::vector<content_chunk>& chunks);
+//chunks the first size bytes of a file
+std::optional<std::vector<content_chunk>> chunk_file(const file_descriptor& descriptor, size_t size);
+
+// finds chunks of stored files by their hash. entries arent checked when they
+// are added, whoever reads a chunk has to compare its hash since the file
+// might have changed in the meantime
+class chunk_index
+{
+public:
+  struct location
+  {
+    std::string file_name;
+    size_t offset = 0;
+    size_t length = 0;
+  };
+
+  void add_file(const std::string& file_name, const std::vector<content_chunk>& chunks);
+  void remove_file(const std::string& file_name);
+  bool contains_file(const std::string& file_name) const;
+  std::optional<location> find(const content_hash& hash) const;
+  //chunks of all files, the same content is counted for every file it is in
+  size_t size() const;
+
+private:
+  struct hash_hasher
+  {
+    //the hash is uniformly distributed already
+    size_t operator()(const content_hash& hash) const;
+  };
+
+  std::unordered_multimap<content_hash, location, hash_hasher> chunks_;
+  std::map<std::string, std::vector<content_hash>, std::less<>> files_;
+};
+
+} //closing namespace mfsync
@@ -8,9 +8,19 @@
 #include <cryptopp/osrng.h>
 #include <cryptopp/xed25519.h>
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <optional>
+#include <thread>
+#include <vector>
 
 #include "spdlog/spdlog.h"
 
@@ -62,9 +72,137 @@ struct encryption_wrapper {
   std::string aad;
 };
 
+// the two upper bits of a nonce count tell who used it. counts of the
+// lockstep handshake start at zero, afterwards each direction of a session
+// counts on its own and file streams use a range of their own
+constexpr size_t INITIATOR_NONCE_BASE = size_t{1} << 62;
+constexpr size_t RESPONDER_NONCE_BASE = size_t{2} << 62;
+constexpr size_t FILE_NONCE_BASE = size_t{3} << 62;
+
+// a file stream is sealed in records that are authenticated on their own.
+// the nonce of a record is made of the stream it is sent on and the offset
+// of the file it starts at, so both sides know it without sending it and
+// records can be opened in any order. the offset is counted from
+// FILE_NONCE_BASE, which keeps record nonces apart from those of messages
+constexpr size_t RECORD_NONCE_SIZE = 12;
+using record_nonce = std::array<byte, RECORD_NONCE_SIZE>;
+record_nonce get_record_nonce(uint32_t stream_id, size_t offset);
+
+// a chunk is cut into records of at most RECORD_SIZE bytes, which are laid
+// out one after another with their tags. the records of a chunk are sealed
+// and opened in parallel
+constexpr size_t RECORD_SIZE = 256 * 1024;
+constexpr size_t RECORD_TAG_SIZE = 16;
+// size of a sealed chunk, an empty chunk still carries a tag
+size_t get_sealed_size(size_t plain_size);
+// nullopt if sealed_size cant be the size of a sealed chunk
+std::optional<size_t> get_plain_size(size_t sealed_size);
+
+// seals the records of file bodies exchanged with one peer. it can be used
+// by several threads at a time, each of them gets a cipher of its own that
+// is keyed once and kept for the next record. every record carries its tag
+// at the end
+class chunk_cipher {
+ public:
+  static constexpr size_t TAG_SIZE = RECORD_TAG_SIZE;
+
+  explicit chunk_cipher(const SecByteBlock& key);
+  chunk_cipher(const chunk_cipher& other) = delete;
+  chunk_cipher& operator=(const chunk_cipher& other) = delete;
+
+  // writes size bytes of cipher text followed by the tag to out, out may be data
+  void encrypt(const record_nonce& nonce, const byte* data, size_t size, byte* out);
+  // data ends with the tag, writes size - TAG_SIZE bytes to out, which may be
+  // data. false if the record was altered or sealed under another nonce
+  bool decrypt(const record_nonce& nonce, const byte* data, size_t size, byte* out);
+
+ private:
+  struct context {
+    ChaCha20Poly1305::Encryption enc;
+    ChaCha20Poly1305::Decryption dec;
+  };
+
+  std::unique_ptr<context> acquire_context();
+  void release_context(std::unique_ptr<context> context);
+
+  SecByteBlock key_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<context>> contexts_;
+};
+
+// threads that seal and open the records of a chunk at the same time. the
+// thread that hands in the records works on them as well and only returns
+// once all of them are done, so the records stay in place and in order
+class crypto_pool {
+ public:
+  // threads besides the callers, with 0 records are handled one after another
+  explicit crypto_pool(size_t threads);
+  ~crypto_pool();
+  crypto_pool(const crypto_pool& other) = delete;
+  crypto_pool& operator=(const crypto_pool& other) = delete;
+
+  size_t get_threads() const;
+  // calls job for every index below count, the calls may run concurrently
+  void run(size_t count, const std::function<void(size_t)>& job);
+
+ private:
+  struct batch {
+    const std::function<void(size_t)>& job;
+    size_t count = 0;
+    std::atomic<size_t> next = 0;
+    // guarded by mutex_
+    size_t done = 0;
+  };
+
+  void work();
+
+  std::mutex mutex_;
+  std::condition_variable work_condition_;
+  std::condition_variable done_condition_;
+  std::deque<std::shared_ptr<batch>> batches_;
+  std::vector<std::thread> threads_;
+  bool stopped_ = false;
+};
+
 struct key_count_pair {
   SecByteBlock key;
   size_t count = 0;
+  bool directional = false;
+  size_t send_count = 0;
+  size_t receive_count = 0;
+  std::shared_ptr<chunk_cipher> cipher;
+};
+
+// key shared by all receivers of a multicast transfer, it is handed out over
+// their encrypted sessions. the cipher is keyed once, every packet brings its
+// own nonce. not thread safe
+class group_cipher {
+ public:
+  static constexpr size_t KEY_SIZE = 32;
+  static constexpr size_t NONCE_SIZE = 12;
+  static constexpr size_t TAG_SIZE = 16;
+
+  static std::unique_ptr<group_cipher> generate();
+  // nullptr if the key isnt hex encoded KEY_SIZE bytes
+  static std::unique_ptr<group_cipher> create(const std::string& encoded_key);
+
+  explicit group_cipher(SecByteBlock key);
+  group_cipher(const group_cipher& other) = delete;
+  group_cipher& operator=(const group_cipher& other) = delete;
+
+  std::string get_encoded_key() const;
+  // writes size bytes of cipher text followed by the tag to out
+  void encrypt(const byte* nonce, const byte* aad, size_t aad_size,
+               const byte* data, size_t size, byte* out);
+  // data ends with the tag, writes size - TAG_SIZE bytes to out. false if
+  // the packet wasnt sealed with this key or was altered
+  bool decrypt(const byte* nonce, const byte* aad, size_t aad_size,
+               const byte* data, size_t size, byte* out);
+
+ private:
+  SecByteBlock key_;
+  ChaCha20Poly1305::Encryption enc_;
+  ChaCha20Poly1305::Decryption dec_;
 };
 
 class crypto_handler {
@@ -85,24 +223,47 @@ class crypto_handler {
                                             std::string plain,
                                             std::string aad = "");
 
-  bool EndOfFile(const FileSource& file);
+  // records of large chunks are sealed and opened on the threads of pool
+  // from now on, handlers derived afterwards share it
+  void set_pool(std::shared_ptr<crypto_pool> pool);
 
-  void encrypt_file_to_buf(const std::string& pub_key, std::ifstream& ifstream,
+  // reads up to block_size bytes and seals them in out as the chunk that
+  // starts at offset of stream_id, out stays empty if nothing was left to read
+  void encrypt_file_to_buf(const std::string& pub_key, uint32_t stream_id,
+                           size_t offset, std::ifstream& ifstream,
                            size_t block_size, std::vector<unsigned char>& out);
 
-  void decrypt_file_to_buf(const std::string& pub_key, std::ofstream& ofstream,
-                           size_t block_size, std::vector<uint8_t>& in,
-                           bool pump_all);
+  // same as encrypt_file_to_buf but for data that was already read
+  void encrypt_buf(const std::string& pub_key, uint32_t stream_id, size_t offset,
+                   const unsigned char* data, size_t size,
+                   std::vector<unsigned char>& out);
+
+  // opens the chunk that starts at offset of stream_id, the plain chunk is
+  // stored in out. false if any of its records was altered or doesnt belong there
+  bool decrypt_buf(const std::string& pub_key, uint32_t stream_id, size_t offset,
+                   const unsigned char* data, size_t size,
+                   std::vector<unsigned char>& out);
 
   std::optional<encryption_wrapper> decrypt(const std::string& pub_key,
                                             const encryption_wrapper& wrapper);
 
   void set_count(const std::string& pub_key, size_t count);
 
+  // from now on messages to and from pub_key are counted separately, so both
+  // sides can send while messages of the other side are still in flight.
+  // initiator is the side that opened the connection
+  void use_directional_nonces(const std::string& pub_key, bool initiator);
+
  private:
-  size_t get_count(const std::string& pub_key);
+  size_t get_send_count(const std::string& pub_key);
+  size_t get_receive_count(const std::string& pub_key);
+  std::shared_ptr<chunk_cipher> get_chunk_cipher(const std::string& pub_key) const;
+
+  // calls job for every record of a chunk, on the pool if there is one
+  void run_records(size_t records, const std::function<void(size_t)>& job) const;
 
   mutable std::mutex mutex_;
+  std::shared_ptr<crypto_pool> pool_;
   key_pair key_pair_;
 
   bool trust_all_ = true;
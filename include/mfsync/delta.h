@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "mfsync/file_descriptor.h"
+#include "mfsync/file_information.h"
+
+namespace mfsync
+{
+
+// Delta transfers of files that changed in place, the way rsync does them.
+// The receiver sends a signature of the copy it already has: a weak rolling
+// checksum and a strong one for every block. The sender rolls the weak
+// checksum over its file byte by byte and only sends the data between blocks
+// the receiver has, the blocks themselves are referenced by their index.
+
+constexpr size_t MIN_SIGNATURE_BLOCK_SIZE = 4 * 1024;
+constexpr size_t MAX_SIGNATURE_BLOCK_SIZE = 4 * 1024 * 1024;
+//keeps the signature of huge files at a few MiB, their blocks get larger instead
+constexpr size_t MAX_SIGNATURE_BLOCKS = 256 * 1024;
+
+// weak checksum of a block that can be moved on by one byte in constant time
+class rolling_checksum
+{
+public:
+  void reset(const unsigned char* data, size_t size);
+  void roll(unsigned char out, unsigned char in);
+  uint32_t get() const;
+
+private:
+  uint32_t a_ = 0;
+  uint32_t b_ = 0;
+  size_t size_ = 0;
+};
+
+//first 8 bytes of the sha256sum of a block
+uint64_t get_strong_checksum(const unsigned char* data, size_t size);
+//about the square root of the file size, like rsync
+size_t get_signature_block_size(size_t file_size);
+//signs the full blocks of the first size bytes of basis, a shorter tail is left out
+std::optional<file_signature> create_signature(const file_descriptor& basis, size_t size);
+//signatures come from the receiver, the sender only uses sane ones
+bool is_valid_signature(const file_signature& signature);
+
+struct delta_step
+{
+  enum class type
+  {
+    LITERAL,
+    COPY
+  };
+
+  type step_type = type::LITERAL;
+  //bytes of the new file the step covers
+  size_t length = 0;
+  //first and amount of the receivers blocks a copy is made of
+  uint64_t block = 0;
+  uint32_t count = 0;
+};
+
+// finds the blocks of a signature in the data of the new file
+class delta_encoder
+{
+public:
+  explicit delta_encoder(file_signature signature);
+
+  size_t get_block_size() const;
+  //data starts at the first byte that isnt covered yet and holds the
+  //following max_literal + block size bytes, less only at the end of the
+  //file. the returned step covers a prefix of data
+  delta_step next(const unsigned char* data, size_t size, size_t max_literal);
+
+private:
+  std::optional<size_t> find(uint32_t weak, const unsigned char* data) const;
+  bool matches(size_t block, uint32_t weak, const unsigned char* data) const;
+
+  file_signature signature_;
+  std::unordered_multimap<uint32_t, size_t> blocks_;
+  //block after the last copy, files that changed in place mostly continue there
+  size_t expected_ = 0;
+};
+
+} //closing namespace mfsync
@@ -34,6 +34,25 @@ public:
     return result;
   }
 
+  //pops the first element that matches pred
+  template<typename Pred>
+  std::optional<T> try_pop_if(Pred pred)
+  {
+    std::scoped_lock lk{mutex_};
+
+    const auto it = std::find_if(deque_.begin(), deque_.end(), pred);
+
+    if(it == deque_.end())
+    {
+      return std::nullopt;
+    }
+
+    auto result = std::make_optional(std::move(*it));
+    deque_.erase(it);
+
+    return result;
+  }
+
   std::optional<T> wait_for_and_pop(int dur = 1)
   {
     std::scoped_lock lk(mutex_);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace mfsync
+{
+
+// Systematic Reed-Solomon erasure code over GF(2^8). A block is split into
+// data shards that are sent as they are and parity shards that are computed
+// with a Cauchy matrix. Every square submatrix of a Cauchy matrix can be
+// inverted, so any data_shards of the shards restore the block no matter
+// which ones got lost.
+
+constexpr size_t MAX_FEC_SHARDS = 256;
+
+class reed_solomon
+{
+public:
+  //at least one data shard, at most MAX_FEC_SHARDS shards together
+  static bool is_valid(size_t data_shards, size_t parity_shards);
+
+  //expects is_valid to hold for the shard counts
+  reed_solomon(size_t data_shards, size_t parity_shards);
+
+  size_t get_data_shards() const;
+  size_t get_parity_shards() const;
+  //shards holds the data shards followed by the parity shards, which are
+  //overwritten. all of them have the same size
+  void encode(std::vector<std::vector<unsigned char>>& shards) const;
+  //restores the data shards that arent present from the ones that are,
+  //false if less than data_shards are present. parity shards are left as they are
+  bool reconstruct(std::vector<std::vector<unsigned char>>& shards,
+                   const std::vector<bool>& present) const;
+
+private:
+  size_t data_shards_ = 0;
+  size_t parity_shards_ = 0;
+  //a row of data_shards coefficients for every parity shard
+  std::vector<unsigned char> parity_matrix_;
+};
+
+} //closing namespace mfsync
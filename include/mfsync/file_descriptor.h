@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+
+namespace mfsync
+{
+
+// owns a posix file descriptor and closes it on destruction
+class file_descriptor
+{
+public:
+  file_descriptor() = default;
+  explicit file_descriptor(int fd);
+  ~file_descriptor();
+
+  file_descriptor(file_descriptor&& other) noexcept;
+  file_descriptor(const file_descriptor& other) = delete;
+  file_descriptor& operator=(file_descriptor&& other) noexcept;
+  file_descriptor& operator=(const file_descriptor& other) = delete;
+
+  static std::optional<file_descriptor> open(const std::filesystem::path& path, int flags, int mode = 0644);
+
+  bool is_open() const;
+  int get() const;
+  void close();
+
+  //reads until size bytes at offset are read, interrupted and short reads are
+  //retried. returns less than size if the file ends first or reading fails
+  size_t read_at(void* data, size_t size, size_t offset) const;
+  //writes all size bytes at offset, false if writing fails with errno set
+  bool write_at(const void* data, size_t size, size_t offset) const;
+  //writes all size bytes to a descriptor that isnt owned, e.g. stdout
+  static bool write_all(int fd, const void* data, size_t size);
+
+private:
+  int fd_ = -1;
+};
+
+} //closing namespace mfsync
@@ -6,6 +6,7 @@
 #include "boost/lexical_cast.hpp"
 #include "mfsync/crypto.h"
 #include "mfsync/file_handler.h"
+#include "mfsync/socket_options.h"
 #include "spdlog/spdlog.h"
 
 namespace mfsync::multicast {
@@ -21,6 +22,9 @@ class file_fetcher {
   void handle_receive_from(const boost::system::error_code& error,
                            size_t bytes_recvd);
   void list_hosts(bool value) { list_host_infos_ = value; }
+  void set_socket_tuning(const mfsync::socket_tuning& tuning) {
+    mfsync::apply_socket_tuning(socket_.native_handle(), tuning, false);
+  }
 
  private:
   void print_host(const host_information& host_info);
@@ -1,12 +1,20 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
 #include <string>
+#include <map>
 #include <set>
+#include <vector>
 #include <mutex>
 #include <optional>
 #include <condition_variable>
+#include <deque>
 #include <filesystem>
+#include <thread>
 
+#include "mfsync/content_chunking.h"
+#include "mfsync/file_descriptor.h"
 #include "mfsync/ofstream_wrapper.h"
 #include "mfsync/file_information.h"
 #include "mfsync/progress_handler.h"
@@ -20,8 +28,9 @@ namespace mfsync
     using stored_files = std::set<file_information, std::less<>>;
     using available_files = std::set<available_file, std::less<>>;
     using locked_files = std::vector<std::pair<file_information, std::shared_ptr<std::atomic<bool>>>>;
+    using file_sources = std::map<std::string, std::vector<available_file>, std::less<>>;
     file_handler() = default;
-    ~file_handler() = default;
+    ~file_handler();
 
     void init_storage(std::string storage_path);
     bool can_be_stored(const file_information& file_info) const;
@@ -36,10 +45,58 @@ namespace mfsync
     available_files get_available_files();
     std::condition_variable& get_cv_new_available_files();
     bool in_progress(const available_file& file) const;
+    //every host that announced a file with the same name, size and sha256sum
+    std::vector<available_file> get_sources(const file_information& file_info) const;
 
     std::optional<mfsync::ofstream_wrapper> create_file(requested_file& requested);
     bool finalize_file(const mfsync::file_information& file);
+    //finalizes a file that was written through descriptors of its tmp file,
+    //output holds its lock and is closed afterwards. bar is set to done
+    bool finalize_file(const mfsync::file_information& file, ofstream_wrapper& output,
+                       filetransfer::progress::file_progress_information* bar);
+    void discard_file(const mfsync::file_information& file);
+    //ranges of a tmp file that were written by a segmented download, from the
+    //journal stored next to it. without one only the prefix of an earlier
+    //download can be trusted
+    byte_ranges get_written_ranges(const file_information& file_info, size_t prefix) const;
+    bool store_segment_journal(const file_information& file_info, const byte_ranges& written);
+    //same as above for ranges that were written through descriptor, which is synced first
+    bool store_segment_journal(const file_information& file_info, const byte_ranges& written,
+                               const file_descriptor& descriptor);
     std::optional<std::ifstream> read_file(const file_information& file_info);
+    std::optional<file_descriptor> open_file(const file_information& file_info);
+    //opens the tmp file of a file that was created and is still blocked for positional writes
+    std::optional<file_descriptor> open_tmp_file(const file_information& file_info);
+
+    //files that are received at the moment are offered to others before they
+    //are complete, the verified part at their start is sent on while they grow
+    void relay_partial_files(bool value);
+    //files that are received at the moment and have a verified part to send on
+    stored_files get_partial_files();
+    //opens the tmp file of a file that is received at the moment for reading
+    std::optional<file_descriptor> open_partial_file(const file_information& file_info);
+    //bytes from the start of the file that can be sent, the whole file once it
+    //is stored. nullopt if it was neither stored nor is received anymore
+    std::optional<size_t> get_relayable_size(const file_information& file_info) const;
+
+    //stored files whose name starts with one of file_names are fetched again
+    //once, the stored copy is the basis the new version is rebuilt from
+    void request_updates(std::vector<std::string> file_names);
+    //the stored file is still waiting for its update
+    bool is_update(const std::string& file_name) const;
+    //opens the stored copy of a file that is updated
+    std::optional<file_descriptor> open_basis(const file_information& file_info);
+
+    //stored files are chunked on a thread of their own to find the chunks of
+    //received files in them, the ones stored later are added as they show up
+    void index_chunks(bool value);
+
+    //copies the chunks of a file that are found in any stored file into its
+    //tmp file and returns written with their ranges added. the file has to be
+    //created and still blocked. stored files that arent indexed yet are skipped.
+    //it reads and writes up to the whole file, so it isnt called on io threads
+    byte_ranges copy_stored_chunks(const file_information& file_info,
+                                   const std::vector<content_chunk>& chunks, byte_ranges written);
 
     void print_availables(bool value);
 
@@ -49,14 +106,32 @@ namespace mfsync
     }
 
   private:
+    struct partial_file
+    {
+      file_information file_info;
+      //length of the verified prefix of the tmp file, kept by its resume journal
+      std::shared_ptr<std::atomic<size_t>> verified;
+    };
 
+    //expects mutex_ to be held
+    const partial_file* find_partial_file(const file_information& file_info) const;
     bool is_tmp_file(const std::filesystem::path& path) const;
     std::filesystem::path get_tmp_path(const file_information& file_info) const;
+    std::filesystem::path get_journal_path(const file_information& file_info) const;
+    std::filesystem::path get_resume_journal_path(const file_information& file_info) const;
+    std::optional<byte_ranges> load_segment_journal_internal(const file_information& file_info) const;
+    void remove_segment_journal(const file_information& file_info);
+    void remove_resume_journal(const file_information& file_info);
+    //received files are written back lazily, this waits until they are on disk
+    static bool sync_file(const std::filesystem::path& path);
     std::filesystem::path get_storage_path(const file_information& file_info) const;
     bool update_stored_files(bool init_call = false);
     void update_stored_files(const std::filesystem::path& path);
     void update_available_files();
     void add_stored_file(file_information file, bool block = false);
+    void add_source(const available_file& file);
+    //expects mutex_ to be held, true if the file wasnt available before or only partially
+    bool insert_available_file(available_file file);
     bool stored_file_exists(const file_information& file) const;
     bool stored_file_exists(const std::string& sha256sum) const;
     std::filesystem::path get_path_to_stored_file(const file_information& file_info) const;
@@ -65,6 +140,11 @@ namespace mfsync
     bool is_blocked_internal(const file_information& file_info) const;
     bool exists_internal(const std::string& name) const;
     bool exists_internal(const file_information& file_info) const;
+    bool is_update_internal(const std::string& file_name) const;
+    //queues a stored file for the chunk index if it is kept
+    void add_unindexed_file(file_information file);
+    //runs on chunk_indexer_ until the file_handler is destroyed
+    void update_chunk_index();
 
     filetransfer::progress_handler* progress_ = nullptr;
     filetransfer::progress::file_progress_information* bar_ = nullptr;
@@ -72,17 +152,33 @@ namespace mfsync
     std::filesystem::path storage_path_;
     stored_files stored_files_;
     available_files available_files_;
+    file_sources sources_;
     std::condition_variable cv_new_available_file_;
     locked_files locked_files_;
+    std::map<std::string, partial_file, std::less<>> partial_files_;
+    std::vector<std::string> update_prefixes_;
+    std::set<std::string, std::less<>> updated_files_;
+    chunk_index chunk_index_;
+    //guards the chunk index and the files waiting for it, neither this nor
+    //mutex_ is held while a file is chunked
+    std::mutex chunk_index_mutex_;
+    std::condition_variable cv_unindexed_files_;
+    std::deque<file_information> unindexed_files_;
+    bool index_chunks_ = false;
+    bool chunk_indexer_stopped_ = false;
 
     bool tmp_folder_initialized_ = false;
     bool storage_initialized_ = false;
     bool finalize_with_shasum = false;
     bool print_availables_ = false;
+    bool relay_partial_files_ = false;
     static constexpr const char* TMP_SUFFIX = ".mfsync";
+    static constexpr const char* JOURNAL_SUFFIX = ".mfsync-segments";
+    static constexpr const char* RESUME_JOURNAL_SUFFIX = ".mfsync-chunks";
 
     std::atomic<bool> storage_init_is_in_progress_ = false;
     mutable std::mutex mutex_;
+    std::thread chunk_indexer_;
   };
 
 } //closing namespace mfsync
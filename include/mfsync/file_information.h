@@ -1,14 +1,20 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <filesystem>
 #include <optional>
 #include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <nlohmann/json.hpp>
 
 namespace mfsync
 {
+  //sorted, non overlapping [begin, end) byte ranges of a file
+  using byte_ranges = std::vector<std::pair<size_t, size_t>>;
+
   struct file_information
   {
     static std::optional<file_information> create_file_information(const std::filesystem::path& path,
@@ -35,13 +41,113 @@ namespace mfsync
     boost::asio::ip::address source_address;
     unsigned short source_port = 0;
     std::string public_key;
+    //the host is still receiving the file, it sends it on while it grows
+    bool partial = false;
+  };
+
+  //checksums of the blocks of the copy of a file the receiver already has,
+  //the sender only transfers what isnt in it
+  struct file_signature
+  {
+    size_t block_size = 0;
+    std::vector<uint32_t> weak;
+    std::vector<uint64_t> strong;
   };
 
   struct requested_file
   {
+    //offset after the last byte that should be sent
+    size_t get_end() const
+    {
+      const auto end = length == 0 ? file_info.size : offset + length;
+      return std::min(end, file_info.size);
+    }
+
     file_information file_info;
     size_t offset = 0;
     unsigned chunksize = 0;
+    //stream of the connection the file is sent on
+    uint32_t stream_id = 0;
+    //bytes to send starting at offset, 0 means up to the end of the file
+    size_t length = 0;
+    //set if the receiver has an older copy the file can be rebuilt from. it
+    //isnt part of the request, it is sent ahead of it as a message of its own
+    std::optional<file_signature> signature = std::nullopt;
+    //only the content defined chunks of the file are listed, the receiver
+    //fetches the ones it has nowhere in its storage afterwards
+    bool manifest = false;
+    //the file is sent to a multicast group together with everybody else that
+    //asks for it meanwhile, the answer tells how to join it
+    bool cast = false;
+  };
+
+  struct capabilities
+  {
+    //largest chunk the peer is willing to send or receive, 0 if not announced
+    size_t max_chunksize = 0;
+    //file bodies are sent unencrypted, only granted between explicitly trusted peers
+    bool plaintext = false;
+    //files that can be sent concurrently over one connection, 0 if the peer cant multiplex them
+    size_t max_streams = 0;
+    //small files the peer sends in answer to one bundle request, 0 if it cant
+    size_t max_bundle_files = 0;
+    //the receiver replicates in the background, its transfers yield to interactive ones
+    bool background = false;
+    //codecs the peer can compress file bodies with, the preferred one first.
+    //after negotiating it holds the codec that is used, if any
+    std::vector<std::string> compression = {};
+    //the peer can list files as content defined chunks, so the receiver only
+    //fetches chunks that arent in any of its stored files
+    bool dedup = false;
+    //the peer can send files to a multicast group instead of every receiver on its own
+    bool multicast = false;
+  };
+
+  //grants the sender of a stream more bytes it may send
+  struct window_update
+  {
+    uint32_t stream_id = 0;
+    size_t bytes = 0;
+  };
+
+  //asks the sender to stop a stream, it answers with an error frame
+  struct stream_cancel
+  {
+    uint32_t stream_id = 0;
+  };
+
+  //announces the signature of the copy the receiver has of the file it
+  //requests on stream_id next, its blocks follow as a binary payload
+  struct signature_header
+  {
+    uint32_t stream_id = 0;
+    size_t block_size = 0;
+    size_t blocks = 0;
+  };
+
+  //many small files requested at once, the sender answers them one after
+  //another so they only take up a single stream slot
+  struct file_bundle
+  {
+    std::vector<requested_file> files;
+  };
+
+  //sent after a plaintext transfer so the receiver can verify what it got
+  struct transfer_checksum
+  {
+    std::string sha256sum;
+  };
+
+  //where and how a file is cast, the key is shared by all receivers of the cast
+  struct cast_offer
+  {
+    uint32_t transfer_id = 0;
+    std::string address;
+    unsigned short port = 0;
+    std::string key;
+    size_t symbol_size = 0;
+    size_t data_shards = 0;
+    size_t parity_shards = 0;
   };
 
   struct host_information
@@ -83,27 +189,134 @@ namespace mfsync
 
   inline void to_json(nlohmann::json& j, const requested_file& requested) {
     j = nlohmann::json{{"offset", requested.offset},
-             {"chunksize", requested.chunksize}};
+             {"length", requested.length},
+             {"chunksize", requested.chunksize},
+             {"stream_id", requested.stream_id}};
 
     j["file_info"] = requested.file_info;
+
+    if(requested.manifest)
+    {
+      j["manifest"] = true;
+    }
+
+    if(requested.cast)
+    {
+      j["cast"] = true;
+    }
   }
 
   inline void from_json(const nlohmann::json& j, requested_file& requested) {
     j.at("offset").get_to(requested.offset);
+    requested.length = j.value("length", size_t{0});
     j.at("chunksize").get_to(requested.chunksize);
+    requested.stream_id = j.value("stream_id", uint32_t{0});
     requested.file_info = j.at("file_info").get<file_information>();
+
+    requested.manifest = j.value("manifest", false);
+    requested.cast = j.value("cast", false);
+  }
+
+  inline void to_json(nlohmann::json& j, const capabilities& caps) {
+    j = nlohmann::json{{"max_chunksize", caps.max_chunksize},
+             {"plaintext", caps.plaintext},
+             {"max_streams", caps.max_streams},
+             {"max_bundle_files", caps.max_bundle_files},
+             {"background", caps.background},
+             {"compression", caps.compression},
+             {"dedup", caps.dedup},
+             {"multicast", caps.multicast}};
+  }
+
+  inline void from_json(const nlohmann::json& j, capabilities& caps) {
+    caps.max_chunksize = j.value("max_chunksize", size_t{0});
+    caps.plaintext = j.value("plaintext", false);
+    caps.max_streams = j.value("max_streams", size_t{0});
+    caps.max_bundle_files = j.value("max_bundle_files", size_t{0});
+    caps.background = j.value("background", false);
+    caps.compression = j.value("compression", std::vector<std::string>{});
+    caps.dedup = j.value("dedup", false);
+    caps.multicast = j.value("multicast", false);
+  }
+
+  inline void to_json(nlohmann::json& j, const window_update& update) {
+    j = nlohmann::json{{"stream_id", update.stream_id},
+             {"bytes", update.bytes}};
+  }
+
+  inline void from_json(const nlohmann::json& j, window_update& update) {
+    j.at("stream_id").get_to(update.stream_id);
+    j.at("bytes").get_to(update.bytes);
+  }
+
+  inline void to_json(nlohmann::json& j, const file_bundle& bundle) {
+    j = nlohmann::json{{"files", bundle.files}};
+  }
+
+  inline void from_json(const nlohmann::json& j, file_bundle& bundle) {
+    j.at("files").get_to(bundle.files);
+  }
+
+  inline void to_json(nlohmann::json& j, const stream_cancel& cancel) {
+    j = nlohmann::json{{"stream_id", cancel.stream_id}};
+  }
+
+  inline void from_json(const nlohmann::json& j, stream_cancel& cancel) {
+    j.at("stream_id").get_to(cancel.stream_id);
+  }
+
+  inline void to_json(nlohmann::json& j, const signature_header& header) {
+    j = nlohmann::json{{"stream_id", header.stream_id},
+             {"block_size", header.block_size},
+             {"blocks", header.blocks}};
+  }
+
+  inline void from_json(const nlohmann::json& j, signature_header& header) {
+    j.at("stream_id").get_to(header.stream_id);
+    j.at("block_size").get_to(header.block_size);
+    j.at("blocks").get_to(header.blocks);
+  }
+
+  inline void to_json(nlohmann::json& j, const transfer_checksum& checksum) {
+    j = nlohmann::json{{"sha256sum", checksum.sha256sum}};
+  }
+
+  inline void from_json(const nlohmann::json& j, transfer_checksum& checksum) {
+    j.at("sha256sum").get_to(checksum.sha256sum);
+  }
+
+  inline void to_json(nlohmann::json& j, const cast_offer& offer) {
+    j = nlohmann::json{{"transfer_id", offer.transfer_id},
+             {"address", offer.address},
+             {"port", offer.port},
+             {"key", offer.key},
+             {"symbol_size", offer.symbol_size},
+             {"data_shards", offer.data_shards},
+             {"parity_shards", offer.parity_shards}};
+  }
+
+  inline void from_json(const nlohmann::json& j, cast_offer& offer) {
+    j.at("transfer_id").get_to(offer.transfer_id);
+    j.at("address").get_to(offer.address);
+    j.at("port").get_to(offer.port);
+    j.at("key").get_to(offer.key);
+    j.at("symbol_size").get_to(offer.symbol_size);
+    j.at("data_shards").get_to(offer.data_shards);
+    j.at("parity_shards").get_to(offer.parity_shards);
   }
 
   inline void from_json(const nlohmann::json& j, available_file& available) {
     j.at("port").get_to(available.source_port);
     available.file_info = j.get<file_information>();
+    available.partial = j.value("partial", false);
   }
 
   inline bool operator==(const requested_file& lhs, const requested_file& rhs)
   {
     return lhs.file_info == rhs.file_info
         && lhs.chunksize == rhs.chunksize
-        && lhs.offset == rhs.offset;
+        && lhs.offset == rhs.offset
+        && lhs.length == rhs.length;
   }
 
   inline bool operator<(const file_information& file_info, const std::string& file_name)
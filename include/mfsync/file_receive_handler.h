@@ -14,6 +14,10 @@
 #include "mfsync/deque.h"
 #include "mfsync/client_session.h"
 #include "mfsync/crypto.h"
+#include "mfsync/rate_limiter.h"
+#include "mfsync/segmented_download.h"
+#include "mfsync/stream_output.h"
+#include "mfsync/uring_context.h"
 
 namespace mfsync
 {
@@ -38,6 +42,15 @@ public:
   std::future<void> get_future();
 
   void enable_tls(const std::string& cert_file);
+  void set_options(const mfsync::filetransfer::transfer_options& options);
+
+  void set_limiter(mfsync::filetransfer::rate_limiter* limiter)
+  {
+    limiter_ = limiter;
+  }
+
+  //streams the single requested file to output instead of storing it
+  void set_output(mfsync::stream_output* output);
 
 protected:
   void fill_request_queue();
@@ -46,6 +59,11 @@ private:
 
   void start_new_session();
   void add_to_request_queue(available_file file);
+  //queues every source of a large file that is offered by several hosts
+  //or should be fetched over several connections
+  bool add_segmented_download(const available_file& file);
+  //requests the file that is streamed to output_ once it is announced
+  void stream_file();
   void wait();
   void handle_timeout(const boost::system::error_code& error);
 
@@ -60,7 +78,14 @@ private:
   std::promise<void> promise_;
   mutable std::mutex mutex_;
   mfsync::filetransfer::progress_handler* progress_;
-
+  mfsync::filetransfer::transfer_options options_;
+  std::unique_ptr<mfsync::filetransfer::uring_context> uring_;
+  mfsync::filetransfer::rate_limiter* limiter_ = nullptr;
+  mfsync::filetransfer::download_registry downloads_;
+  mfsync::stream_output* output_ = nullptr;
+  bool output_requested_ = false;
+  //signs the stored copies of files that are updated
+  boost::asio::thread_pool workers_{2};
 };
 
 } //closing namespace mfsync
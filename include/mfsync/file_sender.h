@@ -10,6 +10,7 @@
 
 #include "mfsync/file_handler.h"
 #include "mfsync/protocol.h"
+#include "mfsync/socket_options.h"
 
 namespace mfsync::multicast
 {
@@ -26,6 +27,7 @@ namespace mfsync::multicast
 
     void init();
     void set_outbound_interface(const boost::asio::ip::address_v4& address);
+    void set_socket_tuning(const mfsync::socket_tuning& tuning);
     void handle_send_to(const boost::system::error_code& error);
     void handle_timeout(const boost::system::error_code& error);
 
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+
+#include "mfsync/file_descriptor.h"
+
+namespace mfsync
+{
+
+// read only memory mapping of a whole file, unmapped on destruction.
+// the file must not shrink while it is mapped, touching pages past its
+// end raises SIGBUS
+class mapped_file
+{
+public:
+  mapped_file() = default;
+  ~mapped_file();
+
+  mapped_file(mapped_file&& other) noexcept;
+  mapped_file(const mapped_file& other) = delete;
+  mapped_file& operator=(mapped_file&& other) noexcept;
+  mapped_file& operator=(const mapped_file& other) = delete;
+
+  //maps the file with its current size, pages are read ahead sequentially
+  static std::optional<mapped_file> map(const file_descriptor& descriptor);
+
+  bool is_mapped() const;
+  const unsigned char* data() const;
+  size_t size() const;
+  void unmap();
+
+private:
+  mapped_file(void* data, size_t size);
+
+  void* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+} //closing namespace mfsync
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "mfsync/crypto.h"
+#include "mfsync/fec.h"
+#include "mfsync/file_descriptor.h"
+#include "mfsync/file_handler.h"
+#include "mfsync/file_information.h"
+#include "mfsync/ofstream_wrapper.h"
+#include "mfsync/progress_handler.h"
+#include "mfsync/rate_limiter.h"
+#include "mfsync/segmented_download.h"
+#include "mfsync/socket_options.h"
+
+namespace mfsync::multicast
+{
+
+// Files that several hosts fetch at the same time are sent to the multicast
+// group once instead of once per host. The file is cut into blocks of
+// data_shards symbols, every block is followed by parity_shards symbols of a
+// Reed-Solomon code, so a receiver restores a block from any data_shards of
+// its packets. Blocks that lost more than that are fetched from the host
+// over unicast once the cast is over.
+
+//keeps a packet within an ethernet mtu, including ip and udp headers
+constexpr size_t CAST_SYMBOL_SIZE = 1200;
+constexpr size_t MAX_CAST_SYMBOL_SIZE = 8192;
+constexpr size_t CAST_DATA_SHARDS = 32;
+constexpr size_t CAST_PARITY_SHARDS = 8;
+//smaller files arent worth waiting for the cast to start
+constexpr size_t MIN_CAST_FILE_SIZE = 8 * 1024 * 1024;
+//the file is sent again for hosts that joined late, at most this often
+constexpr uint16_t MAX_CAST_ROUNDS = 3;
+//receivers that ask right after each other all get the first round in full
+constexpr auto CAST_START_DELAY = std::chrono::milliseconds(500);
+//a receiver gives up on a cast that went quiet
+constexpr auto CAST_IDLE_TIMEOUT = std::chrono::seconds(5);
+
+enum class packet_type : uint8_t
+{
+  SHARD = 0,  // a data or parity symbol of a block
+  END,        // the round is over, carries whether another one follows
+};
+
+// the header is sent in the clear and authenticated with the packet. the
+// round makes it unique for every packet of a cast, so it is the nonce too
+struct packet_header
+{
+  uint32_t transfer_id = 0;
+  uint16_t round = 0;
+  uint32_t block = 0;
+  uint8_t shard = 0;
+  packet_type type = packet_type::SHARD;
+};
+
+constexpr size_t PACKET_HEADER_SIZE = crypto::group_cipher::NONCE_SIZE;
+using packet_header_bytes = std::array<unsigned char, PACKET_HEADER_SIZE>;
+//fields in network byte order
+packet_header_bytes create_packet_header(const packet_header& header);
+std::optional<packet_header> get_packet_header(const unsigned char* data, size_t size);
+
+//symbol size and shard counts of an offer that came from the network are sane
+bool is_valid_cast_offer(const cast_offer& offer);
+
+// Casts the files receivers asked for. Every file is cast at most once at a
+// time, receivers that ask while it is cast join in and it is sent once more
+// if they missed the start of it. Packets are paced at the configured rate
+// and count against the upload limits.
+class file_caster
+{
+public:
+  file_caster(boost::asio::io_context& io_context,
+              const boost::asio::ip::address& multicast_address,
+              unsigned short port,
+              file_handler& handler);
+
+  void set_outbound_interface(const boost::asio::ip::address_v4& address);
+  void set_socket_tuning(const mfsync::socket_tuning& tuning);
+  //bytes per second of all casts together
+  void set_rate(size_t rate);
+
+  void set_limiter(filetransfer::rate_limiter* limiter)
+  {
+    limiter_ = limiter;
+  }
+
+  //starts casting the file unless it is cast already, nullopt if it cant be read
+  std::optional<cast_offer> join(const file_information& file_info);
+
+private:
+  struct cast
+  {
+    explicit cast(boost::asio::io_context& io_context)
+      : timer(io_context)
+    {}
+
+    cast_offer offer;
+    file_information file_info;
+    file_descriptor descriptor;
+    std::unique_ptr<crypto::group_cipher> cipher;
+    boost::asio::steady_timer timer;
+    uint32_t blocks = 0;
+    uint16_t round = 0;
+    uint32_t block = 0;
+    //somebody joined after the round started
+    bool rerun = false;
+  };
+
+  using cast_ptr = std::shared_ptr<cast>;
+
+  void schedule(const cast_ptr& current, std::chrono::steady_clock::duration delay);
+  void send_next(const cast_ptr& current, const boost::system::error_code& error);
+  //sends the next block and returns the bytes sent, 0 if it couldnt be read
+  size_t send_block(cast& current);
+  void send_end(cast& current, bool more);
+  size_t send_packet(cast& current, const packet_header& header,
+                     const unsigned char* data, size_t size);
+
+  boost::asio::io_context& io_context_;
+  boost::asio::ip::udp::endpoint endpoint_;
+  boost::asio::ip::udp::socket socket_;
+  file_handler& file_handler_;
+  filetransfer::rate_limiter* limiter_ = nullptr;
+  filetransfer::token_bucket pace_;
+  reed_solomon code_{CAST_DATA_SHARDS, CAST_PARITY_SHARDS};
+  //the socket and the buffers are shared by all casts
+  std::mutex mutex_;
+  std::map<std::string, cast_ptr, std::less<>> casts_;
+  uint32_t next_transfer_id_ = 0;
+  std::vector<std::vector<unsigned char>> shards_;
+  std::vector<unsigned char> read_buffer_;
+  std::vector<unsigned char> packet_;
+};
+
+// Receives a cast into the tmp file of a file that was created and is still
+// blocked. Once the cast is over the file is finalized if every block came
+// through, otherwise the written ranges are stored in its segment journal and
+// the gaps are left to a segmented download, which fetches them from the
+// hosts of the file.
+class cast_receiver : public std::enable_shared_from_this<cast_receiver>
+{
+public:
+  //nullptr if the offer is invalid or the group cant be joined, the file is unblocked then
+  static std::shared_ptr<cast_receiver> create(boost::asio::io_context& io_context,
+                                               file_handler& handler,
+                                               filetransfer::download_registry& downloads,
+                                               filetransfer::progress_handler* progress,
+                                               const cast_offer& offer,
+                                               const file_information& file_info,
+                                               ofstream_wrapper output,
+                                               const byte_ranges& written);
+
+  void start();
+
+private:
+  struct block_state
+  {
+    std::vector<std::vector<unsigned char>> shards;
+    std::vector<bool> present;
+    size_t count = 0;
+  };
+
+  cast_receiver(boost::asio::io_context& io_context, file_handler& handler,
+                filetransfer::download_registry& downloads,
+                filetransfer::progress_handler* progress, const cast_offer& offer,
+                const file_information& file_info, ofstream_wrapper output,
+                file_descriptor descriptor, std::unique_ptr<crypto::group_cipher> cipher);
+
+  void receive();
+  void handle_receive(const boost::system::error_code& error, size_t size);
+  void handle_packet(size_t size);
+  void add_shard(const packet_header& header, const unsigned char* data, size_t size);
+  bool write_block(uint32_t block, block_state& state);
+  void wait_idle();
+  void handle_idle(const boost::system::error_code& error);
+  //expects mutex_ to be held
+  void finish();
+  byte_ranges get_written() const;
+
+  file_handler& file_handler_;
+  filetransfer::download_registry& downloads_;
+  filetransfer::progress_handler* progress_;
+  cast_offer offer_;
+  file_information file_info_;
+  //holds the lock on the tmp file, the blocks are written through descriptor_
+  ofstream_wrapper output_;
+  file_descriptor descriptor_;
+  std::unique_ptr<crypto::group_cipher> cipher_;
+  reed_solomon code_;
+  boost::asio::ip::udp::socket socket_;
+  boost::asio::ip::udp::endpoint sender_endpoint_;
+  boost::asio::steady_timer idle_timer_;
+  std::chrono::steady_clock::time_point last_packet_;
+  //the receive handler and the idle timer may run concurrently
+  std::mutex mutex_;
+  //ranges that were written before the cast started
+  byte_ranges written_;
+  std::vector<bool> done_;
+  size_t blocks_done_ = 0;
+  std::map<uint32_t, block_state> pending_;
+  std::vector<unsigned char> packet_;
+  std::vector<unsigned char> plain_;
+  std::vector<unsigned char> block_buffer_;
+  filetransfer::progress::file_progress_information* bar_ = nullptr;
+  bool finished_ = false;
+};
+
+} //closing namespace mfsync::multicast
@@ -1,38 +1,66 @@
 #pragma once
 
+#include <atomic>
 #include <fstream>
+#include <memory>
+#include <vector>
 
+#include "mfsync/file_descriptor.h"
 #include "mfsync/file_information.h"
+#include "mfsync/resume_journal.h"
 
 namespace mfsync
 {
 
+// Writes a received file through a write-behind buffer. Writes that continue
+// where the previous one ended are collected and written with one pwrite once
+// WRITE_BEHIND_SIZE bytes are buffered, the kernel is asked to write them
+// back right away so dirty pages dont pile up. Nothing is synced to disk
+// here, file_handler::finalize_file does that once the file is complete.
 class ofstream_wrapper
 {
 public:
+  static constexpr size_t WRITE_BEHIND_SIZE = 8 * 1024 * 1024;
+
   ofstream_wrapper() = default;
   ofstream_wrapper(const requested_file& file);
  ~ofstream_wrapper();
 
   ofstream_wrapper(ofstream_wrapper &&other) = default;
   ofstream_wrapper(const ofstream_wrapper& other) = delete;
-  ofstream_wrapper& operator=(ofstream_wrapper&& other) = default;
+  ofstream_wrapper& operator=(ofstream_wrapper&& other);
   ofstream_wrapper& operator=(const ofstream_wrapper& other) = delete;
 
   bool operator!() const;
   void open(const std::string& filename, std::ios_base::openmode mode = std::ios_base::out);
   void open(const char *filename, std::ios_base::openmode mode = std::ios_base::out);
-  void write(const char* s, std::streamsize count, size_t offset = 0);
-  void write(const char* chunk);
-  std::ofstream::traits_type::pos_type tellp();
-  void flush();
+  //returns false if buffered data couldnt be written
+  bool write(const char* s, std::streamsize count, size_t offset = 0);
+  //hands the buffered data to the kernel without waiting for the disk
+  bool flush();
+  //reserves disk space for size bytes without changing the file size, fails
+  //if the space isnt available. filesystems that cant do it are skipped
+  bool preallocate(size_t size);
+  //flushes, closes the file and releases the lock on it
+  void close();
   void set_token(std::weak_ptr<std::atomic<bool>> token);
-  std::ofstream& get_ofstream();
+  //data handed to the kernel is hashed into journal, so it can be resumed
+  void set_journal(resume_journal journal);
 
 private:
+  bool write_buffer();
+  void start_writeback(size_t offset, size_t size);
 
-  std::ofstream ofstream_;
+  file_descriptor descriptor_;
+  std::vector<char> buffer_;
+  //file offset the first buffered byte belongs to
+  size_t buffer_offset_ = 0;
+  //range written last, its writeback is waited for before the next one starts
+  size_t writeback_offset_ = 0;
+  size_t writeback_size_ = 0;
+  bool failed_ = false;
   mfsync::requested_file requested_file_;
+  resume_journal journal_;
   std::weak_ptr<std::atomic<bool>> write_token_;
 };
 
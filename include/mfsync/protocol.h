@@ -1,11 +1,15 @@
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <optional>
 #include <string>
 #include <string_view>
 #include <tuple>
 #include <vector>
 
+#include "mfsync/content_chunking.h"
 #include "mfsync/crypto.h"
 #include "mfsync/file_handler.h"
 
@@ -13,16 +17,31 @@ namespace mfsync::protocol {
 
 constexpr auto TCP_PORT = 8000;
 constexpr auto MULTICAST_PORT = 30001;
+// files are cast to the multicast group on a port of their own
+constexpr auto MULTICAST_DATA_PORT = 30002;
 constexpr auto MULTICAST_LISTEN_ADDRESS = "0.0.0.0";
 constexpr auto MULTICAST_ADDRESS = "239.255.0.1";
 constexpr auto MAX_MESSAGE_SIZE = 1024;
-constexpr auto CHUNKSIZE = 1024;
+constexpr auto CHUNKSIZE = 64 * 1024;
+constexpr auto MIN_CHUNKSIZE = 4 * 1024;
+constexpr auto MAX_CHUNKSIZE = 4 * 1024 * 1024;
+constexpr auto FRAME_HEADER_SIZE = sizeof(uint8_t) + 2 * sizeof(uint32_t);
+// bytes a stream may send before the receiver has to grant more
+constexpr auto STREAM_WINDOW = 2 * MAX_CHUNKSIZE;
+// files up to this size are requested in bundles of at most MAX_BUNDLE_FILES
+constexpr auto MAX_BUNDLE_FILE_SIZE = CHUNKSIZE;
+constexpr auto MAX_BUNDLE_FILES = 64;
+// a file that is sent on while it is received waits this long for more of it
+constexpr auto RELAY_POLL_INTERVAL = std::chrono::milliseconds(200);
 constexpr std::string_view MFSYNC_HEADER_BEGIN = "<MFSYNC_HEADER_BEGIN>";
 constexpr std::string_view MFSYNC_HEADER_END = "<MFSYNC_HEADER_END>";
 constexpr auto MFSYNC_HEADER_SIZE =
     MFSYNC_HEADER_BEGIN.size() + MFSYNC_HEADER_END.size();
+// requests are read into a buffer of at most this size, the connection of a
+// receiver that sends a larger one is dropped
+constexpr size_t MAX_REQUEST_SIZE = 1024 * 1024;
 constexpr auto MFSYNC_LOG_PREFIX = "";
-constexpr auto VERSION = "0.2.0";
+constexpr auto VERSION = "0.4.0";
 
 constexpr std::string_view create_begin_transmission_message() {
   return "<MFSYNC_HEADER_BEGIN>BEGIN_TRANSMISSION<MFSYNC_HEADER_END>";
@@ -34,16 +53,92 @@ enum class type {
   HANDSHAKE,
   FILE_LIST,
   FILE,
+  WINDOW,
+  CANCEL,
+  BUNDLE,
+  SIGNATURE,
 };
 
 type get_message_type(const std::string& msg);
 std::optional<nlohmann::json> get_json_from_message(const std::string& msg);
 
 std::string wrap_with_header(const std::string& msg);
-std::string create_handshake_message(const std::string& public_key, const std::string& salt);
+std::string create_handshake_message(const std::string& public_key, const std::string& salt,
+                                     const capabilities& caps = {});
+std::optional<capabilities> get_capabilities_from_message(const std::string& msg);
+capabilities negotiate(const capabilities& local, const capabilities& remote);
+
+// everything the server sends after the handshake is framed, so the chunks of
+// several files can be interleaved on one connection. a frame header is the
+// frame type followed by stream id and payload size in network byte order
+enum class frame_type : uint8_t {
+  DATA = 0,   // a chunk of the file body
+  END,        // the file is complete, optionally carries an encrypted message
+  ERROR,      // the request was refused, carries the reason
+  COMPRESSED_DATA,  // a chunk compressed with the negotiated codec
+  COPY,       // blocks of the receivers old copy, carries block index and count
+  MANIFEST,   // hashes and lengths of the content defined chunks of the file
+};
+
+struct frame {
+  frame_type type = frame_type::DATA;
+  uint32_t stream_id = 0;
+  uint32_t length = 0;
+};
+
+// payload of a copy frame before it is encrypted, the first block as uint64
+// followed by the amount of blocks as uint32, both in network byte order
+constexpr auto COPY_PAYLOAD_SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+
+// entry of a manifest frame before it is encrypted, the hash of a chunk
+// followed by its length as uint32 in network byte order
+constexpr auto MANIFEST_ENTRY_SIZE = CONTENT_HASH_SIZE + sizeof(uint32_t);
+// bytes of a file one manifest frame lists the chunks of. even if all of
+// them are as short as possible, the frame fits into the smallest chunk size
+constexpr auto MANIFEST_READ_SIZE = 8 * MAX_CONTENT_CHUNK_SIZE;
+
+using frame_header = std::array<unsigned char, FRAME_HEADER_SIZE>;
+frame_header create_frame_header(frame_type type, uint32_t stream_id,
+                                 uint32_t length);
+std::optional<frame> get_frame_from_header(const frame_header& header);
+std::string create_frame(frame_type type, uint32_t stream_id,
+                         std::string_view payload = {});
+
+using copy_payload = std::array<unsigned char, COPY_PAYLOAD_SIZE>;
+copy_payload create_copy_payload(uint64_t block, uint32_t count);
+// first block and amount of blocks
+std::optional<std::pair<uint64_t, uint32_t>> get_copy_from_payload(
+    const unsigned char* data, size_t size);
+
+void append_manifest_entry(std::vector<unsigned char>& payload,
+                           const content_chunk& chunk);
+// chunks of a manifest frame, the first one starts at offset of the file
+std::optional<std::vector<content_chunk>> get_manifest_from_payload(
+    const unsigned char* data, size_t size, size_t offset);
+
+// the signature of the copy the receiver has follows its message in binary,
+// the weak checksum as uint32 and the strong one as uint64 per block in
+// network byte order. it is sealed as the records at SIGNATURE_OFFSET of its
+// stream, past the end of any file, so their nonces arent used otherwise
+constexpr auto SIGNATURE_ENTRY_SIZE = sizeof(uint32_t) + sizeof(uint64_t);
+constexpr size_t SIGNATURE_OFFSET = size_t{1} << 61;
+
+std::vector<unsigned char> create_signature_payload(
+    const file_signature& signature);
+std::optional<file_signature> get_signature_from_payload(
+    const unsigned char* data, size_t size, size_t block_size);
+
 std::string create_file_list_message(const std::string& public_key);
 std::string create_file_message(const std::string& public_key,
                                 const std::string& msg);
+std::string create_window_message(const std::string& public_key,
+                                  const std::string& msg);
+std::string create_cancel_message(const std::string& public_key,
+                                  const std::string& msg);
+std::string create_bundle_message(const std::string& public_key,
+                                  const std::string& msg);
+std::string create_signature_message(const std::string& public_key,
+                                     const std::string& msg);
 std::string create_error_message(const std::string& reason);
 
 std::string create_message_from_requested_file(const requested_file& file);
@@ -55,8 +150,11 @@ std::optional<host_information> get_host_info_from_message(
 std::string create_host_announcement_message(const std::string& pub_key,
                                              unsigned short port);
 
+// files that are still received are listed as partial, they are sent on
+// while they grow
 std::string create_message_from_file_info(
-    const file_handler::stored_files& file_infos, unsigned short port);
+    const file_handler::stored_files& file_infos, unsigned short port,
+    const file_handler::stored_files& partial_files = {});
 std::vector<std::string> create_messages_from_file_info(
     const file_handler::stored_files& file_infos, unsigned short port);
 
@@ -70,6 +168,17 @@ std::optional<std::string> get_decrypted_message(
 
 std::optional<size_t> get_count_from_message(const std::string& message);
 
+// END frames carry their payload as the record at the end of their stream
+// instead of as a counted message. a receiver may drop the END of a stream it
+// gave up on without opening it and still decrypts the messages after it
+std::string seal_end_payload(const std::string& plain, const requested_file& requested,
+                             const std::string& public_key,
+                             crypto::crypto_handler& handler);
+std::optional<std::string> open_end_payload(const std::string& payload,
+                                            const requested_file& requested,
+                                            const std::string& public_key,
+                                            crypto::crypto_handler& handler);
+
 std::optional<file_handler::available_files> get_available_files_from_message(
     const std::string& message, const boost::asio::ip::tcp::endpoint& endpoint,
     const std::string& pub_key = "");
@@ -167,6 +276,307 @@ class converter<bool> {
   }
 };
 
+template <>
+class converter<capabilities> {
+ public:
+  static std::optional<capabilities> from_message(
+      const std::string& buf, const std::string& pub_key,
+      mfsync::crypto::crypto_handler& handler) {
+    if (protocol::get_message_type(buf) == protocol::type::DENIED) {
+      return std::nullopt;
+    }
+
+    auto decrypted_message =
+        protocol::get_decrypted_message(buf, pub_key, handler);
+
+    if (!decrypted_message.has_value()) {
+      return std::nullopt;
+    }
+
+    try {
+      nlohmann::json j = nlohmann::json::parse(decrypted_message.value());
+      if (j.at("type") != "accepted") {
+        return std::nullopt;
+      }
+
+      return j.value("capabilities", nlohmann::json::object()).get<capabilities>();
+    } catch (std::exception& er) {
+      spdlog::debug("Json Error: {}", er.what());
+      return std::nullopt;
+    }
+  }
+
+  static std::string to_message(const capabilities& caps,
+                                const std::string& pub_key,
+                                mfsync::crypto::crypto_handler& handler) {
+    nlohmann::json j;
+    j["type"] = "accepted";
+    j["capabilities"] = caps;
+
+    auto wrapped = handler.encrypt(pub_key, j.dump());
+
+    if (!wrapped.has_value()) {
+      return protocol::create_denied_message();
+    }
+
+    j = nlohmann::json(wrapped.value());
+    return protocol::wrap_with_header(j.dump());
+  }
+};
+
+template <>
+class converter<transfer_checksum> {
+ public:
+  // sent as the payload of the END frame of requested
+  static std::optional<transfer_checksum> from_message(
+      const std::string& buf, const requested_file& requested,
+      const std::string& pub_key, mfsync::crypto::crypto_handler& handler) {
+    auto decrypted_message =
+        protocol::open_end_payload(buf, requested, pub_key, handler);
+
+    if (!decrypted_message.has_value()) {
+      return std::nullopt;
+    }
+
+    try {
+      nlohmann::json j = nlohmann::json::parse(decrypted_message.value());
+      if (j.at("type") != "checksum") {
+        return std::nullopt;
+      }
+
+      return j.at("checksum").get<transfer_checksum>();
+    } catch (std::exception& er) {
+      spdlog::debug("Json Error: {}", er.what());
+      return std::nullopt;
+    }
+  }
+
+  static std::string to_message(const transfer_checksum& checksum,
+                                const requested_file& requested,
+                                const std::string& pub_key,
+                                mfsync::crypto::crypto_handler& handler) {
+    nlohmann::json j;
+    j["type"] = "checksum";
+    j["checksum"] = checksum;
+    return protocol::seal_end_payload(j.dump(), requested, pub_key, handler);
+  }
+};
+
+template <>
+class converter<cast_offer> {
+ public:
+  // sent as the payload of the END frame of requested
+  static std::optional<cast_offer> from_message(
+      const std::string& buf, const requested_file& requested,
+      const std::string& pub_key, mfsync::crypto::crypto_handler& handler) {
+    auto decrypted_message =
+        protocol::open_end_payload(buf, requested, pub_key, handler);
+
+    if (!decrypted_message.has_value()) {
+      return std::nullopt;
+    }
+
+    try {
+      nlohmann::json j = nlohmann::json::parse(decrypted_message.value());
+      if (j.at("type") != "cast") {
+        return std::nullopt;
+      }
+
+      return j.at("cast").get<cast_offer>();
+    } catch (std::exception& er) {
+      spdlog::debug("Json Error: {}", er.what());
+      return std::nullopt;
+    }
+  }
+
+  static std::string to_message(const cast_offer& offer,
+                                const requested_file& requested,
+                                const std::string& pub_key,
+                                mfsync::crypto::crypto_handler& handler) {
+    nlohmann::json j;
+    j["type"] = "cast";
+    j["cast"] = offer;
+    return protocol::seal_end_payload(j.dump(), requested, pub_key, handler);
+  }
+};
+
+template <>
+class converter<window_update> {
+ public:
+  static std::string to_message(const window_update& update,
+                                const std::string& pub_key,
+                                mfsync::crypto::crypto_handler& handler) {
+    nlohmann::json j = update;
+    auto wrapper = handler.encrypt(pub_key, j.dump());
+
+    if (!wrapper.has_value()) {
+      spdlog::debug("encrypt failed for {}", pub_key);
+      return protocol::create_denied_message();
+    }
+
+    j = nlohmann::json(wrapper.value());
+    return protocol::create_window_message(handler.get_public_key(), j.dump());
+  }
+
+  static std::optional<window_update> from_message(
+      const std::string& buf, mfsync::crypto::crypto_handler& handler) {
+    const auto decrypted_message = protocol::get_decrypted_message(buf, handler);
+
+    if (!decrypted_message.has_value()) {
+      spdlog::debug("converter: could not decrypt message");
+      return std::nullopt;
+    }
+
+    try {
+      return nlohmann::json::parse(decrypted_message.value()).get<window_update>();
+    } catch (std::exception& er) {
+      spdlog::debug("Json Error: {}", er.what());
+      return std::nullopt;
+    }
+  }
+};
+
+template <>
+class converter<stream_cancel> {
+ public:
+  static std::string to_message(const stream_cancel& cancel,
+                                const std::string& pub_key,
+                                mfsync::crypto::crypto_handler& handler) {
+    nlohmann::json j = cancel;
+    auto wrapper = handler.encrypt(pub_key, j.dump());
+
+    if (!wrapper.has_value()) {
+      spdlog::debug("encrypt failed for {}", pub_key);
+      return protocol::create_denied_message();
+    }
+
+    j = nlohmann::json(wrapper.value());
+    return protocol::create_cancel_message(handler.get_public_key(), j.dump());
+  }
+
+  static std::optional<stream_cancel> from_message(
+      const std::string& buf, mfsync::crypto::crypto_handler& handler) {
+    const auto decrypted_message = protocol::get_decrypted_message(buf, handler);
+
+    if (!decrypted_message.has_value()) {
+      spdlog::debug("converter: could not decrypt message");
+      return std::nullopt;
+    }
+
+    try {
+      return nlohmann::json::parse(decrypted_message.value()).get<stream_cancel>();
+    } catch (std::exception& er) {
+      spdlog::debug("Json Error: {}", er.what());
+      return std::nullopt;
+    }
+  }
+};
+
+template <>
+class converter<file_signature> {
+ public:
+  // the header message followed by the sealed blocks of signature
+  static std::string to_message(const file_signature& signature,
+                                uint32_t stream_id, const std::string& pub_key,
+                                mfsync::crypto::crypto_handler& handler) {
+    const signature_header header{.stream_id = stream_id,
+                                  .block_size = signature.block_size,
+                                  .blocks = signature.weak.size()};
+    nlohmann::json j = header;
+    auto wrapper = handler.encrypt(pub_key, j.dump());
+
+    if (!wrapper.has_value()) {
+      spdlog::debug("encrypt failed for {}", pub_key);
+      return protocol::create_denied_message();
+    }
+
+    const auto payload = protocol::create_signature_payload(signature);
+    std::vector<unsigned char> sealed;
+    handler.encrypt_buf(pub_key, stream_id, SIGNATURE_OFFSET, payload.data(),
+                        payload.size(), sealed);
+
+    j = nlohmann::json(wrapper.value());
+    auto message =
+        protocol::create_signature_message(handler.get_public_key(), j.dump());
+    message.append(sealed.begin(), sealed.end());
+    return message;
+  }
+
+  // the header tells how many sealed bytes follow the message
+  static std::optional<signature_header> get_header(
+      const std::string& buf, mfsync::crypto::crypto_handler& handler) {
+    const auto decrypted_message = protocol::get_decrypted_message(buf, handler);
+
+    if (!decrypted_message.has_value()) {
+      spdlog::debug("converter: could not decrypt message");
+      return std::nullopt;
+    }
+
+    try {
+      return nlohmann::json::parse(decrypted_message.value())
+          .get<signature_header>();
+    } catch (std::exception& er) {
+      spdlog::debug("Json Error: {}", er.what());
+      return std::nullopt;
+    }
+  }
+
+  static size_t get_payload_size(const signature_header& header) {
+    return crypto::get_sealed_size(header.blocks * SIGNATURE_ENTRY_SIZE);
+  }
+
+  static std::optional<file_signature> from_payload(
+      const signature_header& header, const std::vector<unsigned char>& payload,
+      const std::string& pub_key, mfsync::crypto::crypto_handler& handler) {
+    std::vector<unsigned char> plain;
+
+    if (!handler.decrypt_buf(pub_key, header.stream_id, SIGNATURE_OFFSET,
+                             payload.data(), payload.size(), plain)) {
+      spdlog::debug("converter: could not decrypt signature");
+      return std::nullopt;
+    }
+
+    return protocol::get_signature_from_payload(plain.data(), plain.size(),
+                                                header.block_size);
+  }
+};
+
+template <>
+class converter<file_bundle> {
+ public:
+  static std::string to_message(const file_bundle& bundle,
+                                const std::string& pub_key,
+                                mfsync::crypto::crypto_handler& handler) {
+    nlohmann::json j = bundle;
+    auto wrapper = handler.encrypt(pub_key, j.dump());
+
+    if (!wrapper.has_value()) {
+      spdlog::debug("encrypt failed for {}", pub_key);
+      return protocol::create_denied_message();
+    }
+
+    j = nlohmann::json(wrapper.value());
+    return protocol::create_bundle_message(handler.get_public_key(), j.dump());
+  }
+
+  static std::optional<file_bundle> from_message(
+      const std::string& buf, mfsync::crypto::crypto_handler& handler) {
+    const auto decrypted_message = protocol::get_decrypted_message(buf, handler);
+
+    if (!decrypted_message.has_value()) {
+      spdlog::debug("converter: could not decrypt message");
+      return std::nullopt;
+    }
+
+    try {
+      return nlohmann::json::parse(decrypted_message.value()).get<file_bundle>();
+    } catch (std::exception& er) {
+      spdlog::debug("Json Error: {}", er.what());
+      return std::nullopt;
+    }
+  }
+};
+
 template <>
 class converter<mfsync::file_handler::available_files> {
  public:
@@ -179,7 +589,7 @@ class converter<mfsync::file_handler::available_files> {
     }
 
     auto msg = protocol::create_message_from_file_info(
-        file_handler.get_stored_files(), port);
+        file_handler.get_stored_files(), port, file_handler.get_partial_files());
 
     auto wrapper = handler.encrypt(pub_key, msg);
 
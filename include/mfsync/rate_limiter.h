@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace mfsync::filetransfer
+{
+
+enum class direction
+{
+  UPLOAD,
+  DOWNLOAD
+};
+
+// transfers started by get are interactive, replication done by sync runs
+// in the background and only gets what interactive transfers leave over
+enum class priority
+{
+  INTERACTIVE,
+  BACKGROUND
+};
+
+// bytes per second, 0 means unlimited
+struct rate_limits
+{
+  size_t upload = 0;
+  size_t download = 0;
+  //limits for every single peer on top of the global ones
+  size_t peer_upload = 0;
+  size_t peer_download = 0;
+};
+
+// Token bucket that keeps track of the time until all reserved bytes are
+// drained at the configured rate. Interactive reservations only queue up
+// behind other interactive ones, background reservations behind everything,
+// so interactive transfers pre-empt background ones.
+// Not thread safe, rate_limiter guards it.
+class token_bucket
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+  //idle time that can be made up for with a burst
+  static constexpr auto MAX_BURST = std::chrono::milliseconds(100);
+
+  token_bucket() = default;
+  explicit token_bucket(size_t rate);
+
+  void set_rate(size_t rate);
+  //time the caller has to wait before sending the bytes
+  clock::duration reserve(size_t bytes, priority prio, clock::time_point now);
+
+private:
+  size_t rate_ = 0;
+  clock::time_point interactive_until_{};
+  clock::time_point all_until_{};
+};
+
+// Shapes the traffic of all sessions, globally and per peer, separately for
+// both directions. Limits can be changed while transfers are running.
+class rate_limiter
+{
+public:
+  using clock = token_bucket::clock;
+
+  rate_limiter() = default;
+  explicit rate_limiter(const rate_limits& limits);
+
+  void set_limits(const rate_limits& limits);
+  rate_limits get_limits() const;
+  //reserves the bytes in the global and the peers bucket, returns how long
+  //the caller has to wait before sending them
+  clock::duration reserve(direction dir, const std::string& peer, size_t bytes,
+                          priority prio);
+
+private:
+  struct buckets
+  {
+    token_bucket upload;
+    token_bucket download;
+  };
+
+  buckets create_peer_buckets() const;
+
+  mutable std::mutex mutex_;
+  rate_limits limits_;
+  buckets global_;
+  std::map<std::string, buckets> peers_;
+};
+
+} //closing namespace mfsync::filetransfer
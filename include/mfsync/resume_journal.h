@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "mfsync/file_descriptor.h"
+#include "mfsync/file_information.h"
+#include "mfsync/sha256.h"
+
+namespace mfsync
+{
+
+// Hashes of the fixed size chunks of a tmp file, stored next to it while the
+// file is received. A download that was interrupted resumes after the last
+// chunk that still matches its hash instead of trusting the size of the tmp
+// file, so a torn tail left by a crash is fetched again.
+// The journal starts with a line naming the file, followed by one hex
+// sha256sum per chunk. Lines are only appended, a torn last line is ignored.
+class resume_journal
+{
+public:
+  static constexpr size_t CHUNK_SIZE = 4 * 1024 * 1024;
+
+  resume_journal() = default;
+
+  //checks the chunks of tmp_path against the journal at path and starts a
+  //journal that continues after the part that matched
+  static resume_journal open(const std::filesystem::path& path,
+                             const std::filesystem::path& tmp_path,
+                             const file_information& file_info);
+
+  bool is_open() const;
+  //length of the verified prefix of the tmp file, writing continues there
+  size_t get_verified() const;
+  //hashes data written at offset. only data that continues the hashed part
+  //is journaled, once a write skips ahead the journal stops
+  void update(size_t offset, const char* data, size_t size);
+  //verified is kept at the length of the verified prefix from now on
+  void set_progress(std::shared_ptr<std::atomic<size_t>> verified);
+
+private:
+  static std::string get_header(const file_information& file_info);
+  void append(const std::string& line);
+
+  file_descriptor descriptor_;
+  size_t file_size_ = 0;
+  size_t verified_ = 0;
+  //bytes of the chunk that is hashed at the moment
+  size_t current_size_ = 0;
+  std::optional<sha256> current_;
+  std::shared_ptr<std::atomic<size_t>> progress_;
+};
+
+} //closing namespace mfsync
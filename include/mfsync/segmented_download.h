@@ -0,0 +1,166 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "mfsync/file_descriptor.h"
+#include "mfsync/file_handler.h"
+#include "mfsync/file_information.h"
+#include "mfsync/ofstream_wrapper.h"
+#include "mfsync/progress_handler.h"
+#include "mfsync/protocol.h"
+
+namespace mfsync::filetransfer
+{
+
+// Splits the byte range of a file into segments that are handed out to
+// whoever asks next, so fast sources end up fetching more of them. Once all
+// segments are handed out, the unwritten part of the largest one is split
+// and its tail handed out again, which moves work away from slow sources.
+// Not thread safe, segmented_download guards it.
+class segment_map
+{
+public:
+  struct range
+  {
+    //identifies the segment, it is the offset it started at
+    size_t key = 0;
+    size_t begin = 0;
+    size_t end = 0;
+  };
+
+  segment_map() = default;
+  //bytes before begin are already written
+  segment_map(size_t begin, size_t end, size_t segment_size, size_t min_split_size);
+  //only the gaps between the written ranges are handed out
+  segment_map(size_t size, const byte_ranges& written, size_t segment_size, size_t min_split_size);
+
+  std::optional<range> acquire();
+  //amount of the size bytes at offset that still belong to the segment
+  size_t clip(size_t key, size_t offset, size_t size) const;
+  //marks everything of the segment before position as written
+  void advance(size_t key, size_t position);
+  //hands the unwritten rest of the segment out again
+  void release(size_t key);
+
+  bool is_done(size_t key) const;
+  bool is_complete() const;
+  bool has_unassigned() const;
+  //written bytes including the ones before begin
+  size_t get_bytes_done() const;
+  //all bytes before this offset are written
+  size_t get_contiguous_end() const;
+  byte_ranges get_written() const;
+
+private:
+  void add_gap(size_t begin, size_t end, size_t segment_size);
+
+  struct segment
+  {
+    size_t end = 0;
+    //first byte of the segment that wasnt written yet
+    size_t next = 0;
+    bool assigned = false;
+  };
+
+  size_t end_ = 0;
+  size_t min_split_size_ = 0;
+  size_t bytes_done_ = 0;
+  std::map<size_t, segment> segments_;
+};
+
+// A file that is fetched from several sources at once. Every source writes
+// the segments it got directly into the shared tmp file.
+class segmented_download : public std::enable_shared_from_this<segmented_download>
+{
+public:
+  static constexpr size_t SEGMENT_SIZE = 4 * protocol::MAX_CHUNKSIZE;
+  static constexpr size_t MIN_SPLIT_SIZE = 2 * protocol::MAX_CHUNKSIZE;
+  //smaller files are fetched over a single connection
+  static constexpr size_t MIN_FILE_SIZE = 2 * SEGMENT_SIZE;
+
+  // a segment handed out to one source, it is handed out again if the
+  // lease is destroyed before the segment was written completely
+  class lease
+  {
+  public:
+    lease(std::shared_ptr<segmented_download> download, segment_map::range range);
+    ~lease();
+
+    lease(lease&& other) = default;
+    lease(const lease& other) = delete;
+    lease& operator=(lease&& other) = delete;
+    lease& operator=(const lease& other) = delete;
+
+    //writes the part of data that still belongs to the segment and returns its size
+    size_t write(size_t offset, const unsigned char* data, size_t size);
+    bool is_done() const;
+    const segment_map::range& get_range() const;
+    std::shared_ptr<segmented_download> get_download() const;
+
+  private:
+    std::shared_ptr<segmented_download> download_;
+    segment_map::range range_;
+  };
+
+  ~segmented_download();
+
+  static std::shared_ptr<segmented_download> create(file_handler& handler,
+                                                    const file_information& file_info,
+                                                    progress_handler* progress);
+
+  std::optional<lease> acquire();
+
+  bool is_complete() const;
+  bool has_unassigned() const;
+  //moves the file to the storage once all segments are written. only the
+  //call that did it gets a value, false if finalizing failed and the file
+  //was discarded
+  std::optional<bool> try_finalize();
+  //throws away everything that was received, used if a source sent garbage
+  void discard();
+
+  const file_information& get_file_info() const;
+
+private:
+  segmented_download(file_handler& handler, const file_information& file_info,
+                     const byte_ranges& written, ofstream_wrapper output,
+                     file_descriptor descriptor);
+
+  size_t write(size_t key, size_t offset, const unsigned char* data, size_t size);
+  void release(size_t key);
+  bool is_done(size_t key) const;
+  //records the written ranges next to the tmp file, so a later download
+  //only fetches the gaps
+  void persist();
+
+  file_handler& file_handler_;
+  file_information file_info_;
+  //held while the journal is written, always taken before mutex_
+  std::mutex journal_mutex_;
+  mutable std::mutex mutex_;
+  segment_map segments_;
+  //holds the lock on the tmp file, the data is written through descriptor_
+  ofstream_wrapper output_;
+  file_descriptor descriptor_;
+  progress::file_progress_information* bar_ = nullptr;
+  bool finished_ = false;
+};
+
+// downloads that are split across sources, looked up by file name
+class download_registry
+{
+public:
+  void add(std::shared_ptr<segmented_download> download);
+  std::shared_ptr<segmented_download> find(const std::string& file_name) const;
+  void remove(const std::string& file_name);
+
+private:
+  mutable std::mutex mutex_;
+  std::map<std::string, std::shared_ptr<segmented_download>, std::less<>> downloads_;
+};
+
+} //closing namespace mfsync::filetransfer
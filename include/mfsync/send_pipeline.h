@@ -0,0 +1,62 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "mfsync/protocol.h"
+
+namespace mfsync::filetransfer
+{
+
+struct prepared_chunk
+{
+  protocol::frame_header header;
+  std::vector<unsigned char> payload;
+  //bytes of the file the chunk covers, without tags and before compression
+  size_t file_bytes = 0;
+};
+
+// Bounded queue between the stage that reads and encrypts chunks and the stage
+// that writes them to the socket. At most one chunk is prepared and at most one is
+// written at a time, but both can happen concurrently. The depth counts the chunk
+// that is currently on the wire, so a depth of 2 is classic double buffering.
+class send_pipeline
+{
+public:
+  send_pipeline() = default;
+  send_pipeline(size_t depth, size_t max_buffered_bytes);
+
+  //returns true if the caller should prepare the next chunk of the given size
+  bool try_start_prepare(size_t chunk_size);
+  void finish_prepare(prepared_chunk chunk);
+  //called by the preparing stage once the whole file was prepared
+  void finish_prepare();
+
+  //returns the chunk that should be written next, nullptr if none is ready
+  //or a write is still in flight
+  prepared_chunk* try_start_write();
+  void finish_write();
+
+  //returns true exactly once, after the last chunk was written
+  bool try_complete();
+
+  //returns a buffer of a previously written chunk to avoid reallocations
+  std::vector<unsigned char> acquire_buffer();
+
+  size_t get_buffered_bytes() const;
+
+private:
+  mutable std::mutex mutex_;
+  std::deque<prepared_chunk> chunks_;
+  std::vector<std::vector<unsigned char>> free_buffers_;
+  size_t depth_ = 1;
+  size_t max_buffered_bytes_ = 0;
+  size_t buffered_bytes_ = 0;
+  bool preparing_ = false;
+  bool writing_ = false;
+  bool prepared_all_ = false;
+  bool completed_ = false;
+};
+
+} //closing namespace mfsync::filetransfer
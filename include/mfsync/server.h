@@ -6,6 +6,10 @@
 #include "mfsync/server_session.h"
 #include "mfsync/client_session.h"
 #include "mfsync/crypto.h"
+#include "mfsync/multicast_transfer.h"
+#include "mfsync/rate_limiter.h"
+#include "mfsync/transfer_options.h"
+#include "mfsync/uring_context.h"
 
 namespace mfsync::filetransfer
 {
@@ -27,6 +31,19 @@ public:
     progress_ = progress;
   }
 
+  void set_options(const transfer_options& options);
+
+  void set_limiter(rate_limiter* limiter)
+  {
+    limiter_ = limiter;
+  }
+
+  //large files are cast to receivers that ask for it, without a caster they are refused
+  void set_caster(multicast::file_caster* caster)
+  {
+    caster_ = caster;
+  }
+
 private:
 
   bool start_listening(uint16_t port);
@@ -42,6 +59,10 @@ private:
   mfsync::file_handler& file_handler_;
   mfsync::crypto::crypto_handler& crypto_handler_;
   mfsync::filetransfer::progress_handler* progress_;
+  transfer_options options_;
+  std::unique_ptr<uring_context> uring_;
+  rate_limiter* limiter_ = nullptr;
+  multicast::file_caster* caster_ = nullptr;
 };
 
 } //closing namespace mfsync::filetransfer
@@ -1,17 +1,75 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <set>
 #include <utility>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 
+#include "mfsync/chunk_size_controller.h"
 #include "mfsync/client_session.h"
+#include "mfsync/compression.h"
 #include "mfsync/crypto.h"
+#include "mfsync/delta.h"
+#include "mfsync/file_descriptor.h"
 #include "mfsync/file_handler.h"
+#include "mfsync/mapped_file.h"
+#include "mfsync/multicast_transfer.h"
+#include "mfsync/protocol.h"
+#include "mfsync/rate_limiter.h"
+#include "mfsync/send_pipeline.h"
+#include "mfsync/sha256.h"
+#include "mfsync/transfer_options.h"
+#include "mfsync/uring_context.h"
 
 namespace mfsync::filetransfer {
 
 using SSLSocket = boost::asio::ssl::stream<boost::asio::ip::tcp::socket>;
 
+// a file that is sent as one of the streams of a connection
+struct outgoing_stream {
+  uint32_t id = 0;
+  // bundle the file was requested in, 0 if it was requested alone
+  uint32_t bundle = 0;
+  requested_file requested;
+  std::ifstream ifstream;
+  file_descriptor descriptor;
+  mapped_file mapping;
+  std::unique_ptr<send_pipeline> pipeline;
+  size_t bytes_prepared = 0;
+  // holds reads that dont go into registered io_uring buffers
+  std::vector<unsigned char> read_buffer;
+  // chunks are compressed before they are encrypted if a codec was negotiated
+  chunk_compressor compressor;
+  std::vector<unsigned char> compress_buffer;
+  // set if the receiver has an older copy, only what it is missing is sent.
+  // the checksum of the range is sent at the end to verify the rebuilt file
+  std::unique_ptr<delta_encoder> delta;
+  sha256 delta_checksum;
+  // only the content defined chunks of the file are listed
+  bool manifest = false;
+  // the file is still received, it is read from its tmp file as far as it is verified
+  bool relayed = false;
+  // bytes the receiver still accepts, the last chunk may overdraw it
+  int64_t window = protocol::STREAM_WINDOW;
+  size_t sendfile_offset = 0;
+  std::string checksum;
+  // the checksum of sendfile streams is hashed a slice per handler
+  sha256 plaintext_checksum;
+  std::atomic<int> pending_plaintext_jobs = 0;
+  // pages of streaming files are dropped from the page cache once the body
+  // and the checksum job are past them
+  bool streaming = false;
+  std::atomic<size_t> read_until = 0;
+  std::atomic<size_t> hashed_until = std::numeric_limits<size_t>::max();
+  std::atomic<size_t> dropped_until = 0;
+  progress::file_progress_information* bar = nullptr;
+};
+
 template <typename SocketType>
 class server_session_base
     : public std::enable_shared_from_this<server_session_base<SocketType>> {
@@ -27,19 +85,77 @@ class server_session_base
   void read_handshake();
 
   void set_progress(progress_handler* progress) { progress_ = progress; }
+  void set_options(const transfer_options& options) { options_ = options; }
+  void set_uring(uring_context* uring) { uring_ = uring; }
+  void set_limiter(rate_limiter* limiter) { limiter_ = limiter; }
+  void set_caster(multicast::file_caster* caster) { caster_ = caster; }
 
  protected:
+  using stream_ptr = std::shared_ptr<outgoing_stream>;
+
+  // sendfile and io_uring socket operations bypass the tls layer, so they
+  // are only used on unencrypted sockets
+  static constexpr bool RAW_SOCKET =
+      std::is_same_v<SocketType, boost::asio::ip::tcp::socket>;
+
   void handle_read_handshake(boost::system::error_code const& error,
                              std::size_t bytes_transferred);
   void handle_read_header(boost::system::error_code const& error,
                           std::size_t bytes_transferred);
-  void send_confirmation();
+  // the blocks of a signature are read in binary after its header
+  void read_signature(const std::string& message);
+  void handle_read_signature(const signature_header& header,
+                             const std::vector<unsigned char>& payload);
   void respond_encrypted(const std::string& pub_key, const std::string& salt);
-  void reply_with_error(const std::string& reason);
-  void read_confirmation();
-  void handle_read_confirmation(boost::system::error_code const& error,
-                                std::size_t bytes_transferred);
-  void write_file();
+  void reply_with_error(uint32_t stream_id, const std::string& reason);
+  bool open_stream(const requested_file& requested, uint32_t bundle = 0);
+  // answers the request with where the file is cast instead of a stream
+  bool offer_cast(const requested_file& requested);
+  void start_bundle(const file_bundle& bundle);
+  void open_next_bundled(uint32_t bundle);
+  size_t get_used_slots() const;
+  void grant_window(const window_update& update);
+  void write_file(const stream_ptr& stream);
+  void prepare_chunk(const stream_ptr& stream);
+  // prepares the chunk again once more of a relayed file was received
+  void wait_for_relay(const stream_ptr& stream);
+  void read_chunk(const stream_ptr& stream, size_t chunksize);
+  // reads into the read buffer of the stream, returns the bytes read
+  size_t read_at(const stream_ptr& stream, size_t offset, size_t size);
+  void prepare_delta_chunk(const stream_ptr& stream, size_t chunksize);
+  void prepare_manifest_chunk(const stream_ptr& stream);
+  void map_chunk(const stream_ptr& stream, size_t chunksize);
+  void read_chunk_uring(const stream_ptr& stream, size_t chunksize);
+  void encrypt_chunk(const stream_ptr& stream, const unsigned char* data,
+                     size_t size);
+  void drop_cache_behind(const stream_ptr& stream);
+  void handle_read_chunk_uring(const stream_ptr& stream,
+                               boost::system::error_code const& error,
+                               std::size_t bytes_transferred,
+                               std::span<unsigned char> buffer,
+                               bool registered);
+  void schedule_write();
+  // runs write once the limiter allows sending bytes more
+  void throttle(size_t bytes, std::function<void()> write);
+  void write_frame();
+  void write_chunk(const stream_ptr& stream, prepared_chunk* chunk);
+  void handle_write_file(const stream_ptr& stream, size_t file_bytes,
+                         boost::system::error_code const& error,
+                         std::size_t bytes_transferred);
+  void finish_file(const stream_ptr& stream);
+  bool send_file_plaintext(const stream_ptr& stream);
+  void write_plaintext_chunk(const stream_ptr& stream);
+  void sendfile_chunk(const stream_ptr& stream);
+  void hash_plaintext_range(const stream_ptr& stream);
+  void finish_plaintext_job(const stream_ptr& stream);
+  void abort_stream(const stream_ptr& stream, const std::string& reason);
+  void cancel_stream(uint32_t stream_id);
+  void finish_write();
+  // the connection cant be used anymore, its streams end with it and the
+  // receiver sees it closed
+  void close();
+  size_t get_next_chunksize();
+  std::chrono::microseconds get_rtt();
 
   SocketType socket_;
   mfsync::file_handler& file_handler_;
@@ -47,13 +163,38 @@ class server_session_base
   std::unique_ptr<mfsync::crypto::crypto_handler> derived_crypto_handler_;
   std::string message_;
   std::string public_key_;
-  requested_file requested_;
-  boost::asio::streambuf stream_buffer_;
-  std::vector<unsigned char> writebuf_;
-  std::ifstream ifstream_;
+  capabilities capabilities_;
+  transfer_options options_;
+  chunk_size_controller chunk_size_controller_;
+  std::mutex chunk_size_mutex_;
+  boost::asio::streambuf stream_buffer_{protocol::MAX_REQUEST_SIZE};
+  chunk_size_controller::clock::time_point write_started_;
+  uring_context* uring_ = nullptr;
+  rate_limiter* limiter_ = nullptr;
+  multicast::file_caster* caster_ = nullptr;
+
+  // all streams share one writer that takes turns between them. frames that
+  // end or refuse a stream are sent before any further file data
+  std::mutex streams_mutex_;
+  std::map<uint32_t, stream_ptr> streams_;
+  // files of a bundle that werent started yet, keyed by its first stream.
+  // a bundle sends one file at a time and only takes up one stream slot
+  std::map<uint32_t, std::deque<requested_file>> bundles_;
+  // records are sealed under a nonce made of their stream and offset, so a
+  // stream id is never taken twice within a session
+  std::set<uint32_t> used_stream_ids_;
+  // signatures that arrived ahead of the request of their stream, only
+  // touched by the read handlers
+  std::map<uint32_t, file_signature> pending_signatures_;
+  std::deque<std::string> control_frames_;
+  std::string current_frame_;
+  bool writing_ = false;
+  uint32_t last_written_stream_ = 0;
+
+  protocol::frame_header plaintext_header_;
+  size_t sendfile_chunk_left_ = 0;
   progress_handler* progress_;
   unsigned port_ = 0;
-  progress::file_progress_information* bar_ = nullptr;
 };
 
 class server_session
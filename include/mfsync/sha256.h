@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+
+#include <openssl/sha.h>
+
+namespace mfsync
+{
+
+// incremental sha256, used where data is only seen chunk by chunk
+class sha256
+{
+public:
+  sha256();
+
+  void update(const void* data, size_t size);
+  //returns the lowercase hex digest, the object must not be updated afterwards
+  std::string finalize();
+
+private:
+  SHA256_CTX context_;
+};
+
+} //closing namespace mfsync
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace mfsync
+{
+
+enum class socket_role
+{
+  //sockets the server sends files over, including the listening one
+  SERVER,
+  //sockets files are received over
+  CLIENT,
+  //multicast sockets host announcements are sent and received on
+  DISCOVERY
+};
+
+// options set on the sockets of one role, unset options keep the system
+// defaults. options that only exist for tcp are skipped on udp sockets
+struct socket_tuning
+{
+  //bytes, 0 keeps the default. setting them turns off the kernels autotuning
+  int send_buffer = 0;
+  int receive_buffer = 0;
+  bool no_delay = false;
+  //frame headers of plaintext transfers are held back until the body follows
+  bool cork = false;
+  //congestion control algorithm, e.g. bbr or cubic
+  std::string congestion;
+  bool keepalive = false;
+  //seconds, 0 keeps the default
+  int keepalive_idle = 0;
+  int keepalive_interval = 0;
+  int keepalive_count = 0;
+  //type of service byte, the dscp value shifted left by two. -1 keeps the default
+  int tos = -1;
+};
+
+struct socket_options
+{
+  socket_tuning server;
+  socket_tuning client;
+  socket_tuning discovery;
+
+  const socket_tuning& get(socket_role role) const;
+};
+
+// sets all options of tuning on the socket fd. failing options are logged and
+// skipped, the socket stays usable with the defaults
+void apply_socket_tuning(int fd, const socket_tuning& tuning, bool tcp = true);
+
+// while corked the kernel only sends full segments
+void set_cork(int fd, bool value);
+
+// adds an option given as role.key=value, e.g. server.send_buffer=4194304,
+// to j which holds the options of all roles. returns false if its malformed
+bool add_socket_option(nlohmann::json& j, const std::string& option);
+
+inline void to_json(nlohmann::json& j, const socket_tuning& tuning) {
+  j = nlohmann::json{{"send_buffer", tuning.send_buffer},
+                     {"receive_buffer", tuning.receive_buffer},
+                     {"no_delay", tuning.no_delay},
+                     {"cork", tuning.cork},
+                     {"congestion", tuning.congestion},
+                     {"keepalive", tuning.keepalive},
+                     {"keepalive_idle", tuning.keepalive_idle},
+                     {"keepalive_interval", tuning.keepalive_interval},
+                     {"keepalive_count", tuning.keepalive_count},
+                     {"tos", tuning.tos}};
+}
+
+inline void from_json(const nlohmann::json& j, socket_tuning& tuning) {
+  tuning.send_buffer = j.value("send_buffer", 0);
+  tuning.receive_buffer = j.value("receive_buffer", 0);
+  tuning.no_delay = j.value("no_delay", false);
+  tuning.cork = j.value("cork", false);
+  tuning.congestion = j.value("congestion", std::string{});
+  tuning.keepalive = j.value("keepalive", false);
+  tuning.keepalive_idle = j.value("keepalive_idle", 0);
+  tuning.keepalive_interval = j.value("keepalive_interval", 0);
+  tuning.keepalive_count = j.value("keepalive_count", 0);
+  tuning.tos = j.value("tos", -1);
+}
+
+inline void to_json(nlohmann::json& j, const socket_options& options) {
+  j = nlohmann::json{{"server", options.server},
+                     {"client", options.client},
+                     {"discovery", options.discovery}};
+}
+
+inline void from_json(const nlohmann::json& j, socket_options& options) {
+  options.server = j.value("server", socket_tuning{});
+  options.client = j.value("client", socket_tuning{});
+  options.discovery = j.value("discovery", socket_tuning{});
+}
+
+} //closing namespace mfsync
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+namespace mfsync
+{
+
+// Receives the body of a single file in order and writes it to a descriptor,
+// e.g. stdout piped into another program, instead of storing it. Nothing is
+// staged on disk, so bytes that were written cant be taken back: an aborted
+// transfer leaves the consumer with a truncated stream and failed() is set.
+class stream_output
+{
+public:
+  //offset and length select a range of the file, length 0 means up to its end
+  explicit stream_output(int fd, size_t offset = 0, size_t length = 0);
+
+  size_t get_offset() const;
+  size_t get_length() const;
+
+  //blocks until everything is written, a slow consumer slows down the sender
+  bool write(const unsigned char* data, size_t size);
+  void finish(bool success);
+
+  bool is_done() const;
+  bool failed() const;
+
+private:
+  int fd_ = -1;
+  size_t offset_ = 0;
+  size_t length_ = 0;
+  std::atomic<bool> done_ = false;
+  std::atomic<bool> failed_ = false;
+};
+
+} //closing namespace mfsync
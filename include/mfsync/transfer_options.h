@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "mfsync/compression.h"
+#include "mfsync/protocol.h"
+#include "mfsync/socket_options.h"
+
+namespace mfsync::filetransfer
+{
+
+enum class io_engine
+{
+  ASIO,
+  IO_URING,
+  //files are sent from a memory mapping, socket transfers use asio
+  MMAP
+};
+
+// settings shared by all file transfer sessions of a server or file_receive_handler
+struct transfer_options
+{
+  //largest chunk announced to peers during the handshake
+  size_t max_chunksize = protocol::MAX_CHUNKSIZE;
+  //chunk size a transfer starts with before it gets adapted
+  size_t initial_chunksize = protocol::CHUNKSIZE;
+  //amount of chunks the sender keeps in flight, including the one on the wire
+  size_t pipeline_depth = 4;
+  //upper bound for the bytes held by the send pipeline
+  size_t max_pipeline_bytes = 4 * protocol::MAX_CHUNKSIZE;
+  //files requested concurrently over one connection
+  size_t max_streams = 4;
+  //connections used to fetch segments of one large file from the same host
+  size_t connections_per_file = 1;
+  //files of at least this size are sent without keeping them in the page cache, 0 disables it
+  size_t streaming_threshold = size_t{1} << 30;
+  //files are replicated in the background, transfers of interactive receivers go first
+  bool background = false;
+  //encrypted file bodies are compressed if both sides share a codec
+  bool compression = true;
+  //large files are listed as content defined chunks first, only the chunks
+  //that arent in any stored file are fetched
+  bool dedup = false;
+  //large files are cast to the multicast group, hosts that fetch them at the
+  //same time share a single upload
+  bool multicast = false;
+  //bytes per second all casts of a server send together
+  size_t multicast_rate = 32 * 1024 * 1024;
+  //public keys of peers file bodies may be exchanged with unencrypted
+  std::vector<std::string> plaintext_peers;
+  //backend used for file reads and socket transfers of file bodies
+  io_engine engine = io_engine::ASIO;
+  //registered io_uring buffers, each one holds a chunk of max_chunksize bytes
+  size_t uring_buffers = 16;
+  //options set on the transfer sockets, depending on their role
+  socket_options sockets;
+
+  bool allows_plaintext(const std::string& public_key) const
+  {
+    return std::find(plaintext_peers.begin(), plaintext_peers.end(), public_key)
+        != plaintext_peers.end();
+  }
+
+  //codecs announced during the handshake
+  std::vector<std::string> get_compression() const
+  {
+    return compression ? get_supported_codecs() : std::vector<std::string>{};
+  }
+};
+
+inline std::optional<io_engine> get_io_engine(const std::string& input)
+{
+  const std::map<std::string, io_engine> engine_map
+  {
+    { "asio", io_engine::ASIO },
+    { "io_uring", io_engine::IO_URING },
+    { "mmap", io_engine::MMAP },
+  };
+
+  if(!engine_map.contains(input))
+  {
+    return std::nullopt;
+  }
+
+  return engine_map.at(input);
+}
+
+} //closing namespace mfsync::filetransfer
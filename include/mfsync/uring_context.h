@@ -0,0 +1,69 @@
+#pragma once
+
+#include <sys/uio.h>
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace mfsync::filetransfer
+{
+
+// Thin wrapper around an io_uring instance that is driven by an asio executor.
+// Completions are signaled through an eventfd that is waited on like any other
+// descriptor, so handlers run on the io_context threads just like asio handlers.
+// Submissions made while a handler runs are collected and submitted together.
+// Only available when built with USE_IO_URING, create() returns nullptr otherwise
+// or if the kernel refuses to set up a ring.
+class uring_context
+{
+public:
+  using handler = std::function<void(const boost::system::error_code&, std::size_t)>;
+
+  static constexpr unsigned DEFAULT_ENTRIES = 256;
+
+  ~uring_context();
+
+  static std::unique_ptr<uring_context> create(boost::asio::any_io_executor executor,
+                                               unsigned entries,
+                                               size_t buffer_count,
+                                               size_t buffer_size);
+  static bool is_compiled_in();
+
+  //reads up to size bytes at offset, uses the registered buffer if data points into one
+  void async_read(int fd, uint64_t offset, unsigned char* data, size_t size, handler callback);
+  //writes all buffers to a socket
+  void async_write(int fd, std::vector<iovec> buffers, handler callback);
+  //receives exactly size bytes from a socket
+  void async_receive(int fd, unsigned char* data, size_t size, handler callback);
+
+  //registered buffers of get_buffer_size() bytes, empty if all are in use
+  std::optional<std::span<unsigned char>> acquire_buffer();
+  void release_buffer(std::span<unsigned char> buffer);
+  size_t get_buffer_size() const;
+
+private:
+  struct impl;
+
+  explicit uring_context(std::unique_ptr<impl> impl);
+
+  std::unique_ptr<impl> impl_;
+};
+
+// callbacks run on the executor the ring was created with. sessions pass them
+// through this, so they run on the strand of their socket like asio handlers
+template <typename Executor, typename Callback>
+uring_context::handler on_executor(Executor executor, Callback callback)
+{
+  return [executor = std::move(executor), callback = std::move(callback)](
+             const boost::system::error_code& ec, std::size_t bytes)
+  {
+    boost::asio::post(executor, [callback, ec, bytes]() { callback(ec, bytes); });
+  };
+}
+
+} //closing namespace mfsync::filetransfer
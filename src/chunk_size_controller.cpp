@@ -0,0 +1,59 @@
+#include "mfsync/chunk_size_controller.h"
+
+#include <algorithm>
+
+namespace mfsync::filetransfer
+{
+
+chunk_size_controller::chunk_size_controller(size_t initial, size_t min, size_t max)
+  : chunksize_(std::clamp(initial, min, max))
+  , min_(min)
+  , max_(max)
+{
+}
+
+size_t chunk_size_controller::get_chunksize() const
+{
+  return chunksize_;
+}
+
+double chunk_size_controller::get_throughput() const
+{
+  return throughput_;
+}
+
+void chunk_size_controller::set_rtt(std::chrono::microseconds rtt)
+{
+  rtt_ = rtt;
+}
+
+void chunk_size_controller::update(size_t bytes_written, clock::duration duration)
+{
+  using seconds = std::chrono::duration<double>;
+
+  if(bytes_written == 0)
+  {
+    return;
+  }
+
+  //writes that complete instantly only went into the socket buffer, count them as 1us
+  const auto elapsed = std::max(std::chrono::duration_cast<seconds>(duration).count(), 1e-6);
+  const auto sample = static_cast<double>(bytes_written) / elapsed;
+
+  throughput_ = throughput_ == 0 ? sample : SMOOTHING * sample + (1 - SMOOTHING) * throughput_;
+
+  const auto target = std::chrono::duration_cast<seconds>(get_target_duration()).count();
+  const auto ideal = static_cast<size_t>(throughput_ * target);
+
+  //change at most by a factor of two per chunk to avoid oscillation
+  const auto next = std::clamp(ideal, chunksize_ / 2, chunksize_ * 2);
+  chunksize_ = std::clamp(next, min_, max_);
+}
+
+chunk_size_controller::clock::duration chunk_size_controller::get_target_duration() const
+{
+  const clock::duration two_rtts = rtt_ * 2;
+  return std::clamp<clock::duration>(two_rtts, MIN_TARGET_DURATION, MAX_TARGET_DURATION);
+}
+
+} //closing namespace mfsync::filetransfer
@@ -1,4 +1,9 @@
 #include "mfsync/client_session.h"
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <set>
 
 #include <boost/bind.hpp>
 
@@ -24,8 +29,9 @@ client_encrypted_file_list::client_encrypted_file_list(
     mfsync::crypto::crypto_handler& crypto_handler,
     mfsync::host_information host_info)
     : client_encrypted_session<boost::asio::ip::tcp::socket>(
-          context, boost::asio::ip::tcp::socket{context}, handler,
-          crypto_handler, std::move(host_info)) {}
+          context,
+          boost::asio::ip::tcp::socket{boost::asio::make_strand(context)},
+          handler, crypto_handler, std::move(host_info)) {}
 
 template <typename SocketType>
 void client_encrypted_session<SocketType>::initialize_communication() {
@@ -179,8 +185,9 @@ client_session::client_session(boost::asio::io_context& context,
                                mfsync::file_handler& handler,
                                mfsync::crypto::crypto_handler& crypto_handler)
     : client_session_base<boost::asio::ip::tcp::socket>(
-          context, boost::asio::ip::tcp::socket{context}, deque, handler,
-          crypto_handler) {}
+          context,
+          boost::asio::ip::tcp::socket{boost::asio::make_strand(context)},
+          deque, handler, crypto_handler) {}
 
 client_tls_session::client_tls_session(
     boost::asio::io_context& context, boost::asio::ssl::context& ssl_context,
@@ -190,8 +197,8 @@ client_tls_session::client_tls_session(
     : client_session_base<
           boost::asio::ssl::stream<boost::asio::ip::tcp::socket>>(
           context,
-          boost::asio::ssl::stream<boost::asio::ip::tcp::socket>(context,
-                                                                 ssl_context),
+          boost::asio::ssl::stream<boost::asio::ip::tcp::socket>(
+              boost::asio::make_strand(context), ssl_context),
           deque, handler, crypto_handler) {
   socket_.set_verify_mode(boost::asio::ssl::verify_peer);
   socket_.set_verify_callback(std::bind(&client_tls_session::verify_certificate,
@@ -227,7 +234,7 @@ void client_tls_session::handshake() {
       [this,
        me = base::shared_from_this()](const boost::system::error_code& error) {
         if (!error) {
-          me->request_file();
+          me->initialize_communication();
         } else {
           spdlog::error("Handshake failed: {}", error.message());
         }
@@ -246,11 +253,9 @@ void client_session::start_request() {
     return;
   }
 
-  // not setting offset here, it will be set by file_handler when file is
-  // created
-  requested_.file_info = std::move(available.value().file_info);
+  source_ = available.value();
   pub_key_ = available.value().public_key;
-  requested_.chunksize = mfsync::protocol::CHUNKSIZE;
+  next_requested_ = requested_file{.file_info = available.value().file_info};
 
   boost::asio::ip::tcp::resolver resolver{io_context_};
   auto endpoint =
@@ -265,6 +270,8 @@ void client_session::start_request() {
        available](boost::system::error_code ec,
                   boost::asio::ip::tcp::endpoint) {
         if (!ec) {
+          mfsync::apply_socket_tuning(socket_.native_handle(),
+                                      options_.sockets.client);
           me->initialize_communication();
         } else {
           spdlog::debug("Couldnt conntect. error: {}", ec.message());
@@ -282,10 +289,9 @@ void client_tls_session::start_request() {
     return;
   }
 
-  // not setting offset here, it will be set by file_handler when file is
-  // created
-  requested_.file_info = std::move(available.value().file_info);
-  requested_.chunksize = mfsync::protocol::CHUNKSIZE;
+  source_ = available.value();
+  pub_key_ = available.value().public_key;
+  next_requested_ = requested_file{.file_info = available.value().file_info};
 
   boost::asio::ip::tcp::resolver resolver{io_context_};
   auto endpoint =
@@ -297,6 +303,8 @@ void client_tls_session::start_request() {
       [this, me = this->shared_from_this(), available](
           boost::system::error_code ec, boost::asio::ip::tcp::endpoint) {
         if (!ec) {
+          mfsync::apply_socket_tuning(socket_.lowest_layer().native_handle(),
+                                      options_.sockets.client);
           std::dynamic_pointer_cast<client_tls_session>(me)->handshake();
         } else {
           spdlog::debug("Couldnt conntect. error: {}", ec.message());
@@ -318,7 +326,15 @@ void client_session_base<SocketType>::initialize_communication() {
   }
 
   message_ =
-      protocol::create_handshake_message(derived_crypto_handler_->get_public_key(), salt);
+      protocol::create_handshake_message(derived_crypto_handler_->get_public_key(), salt,
+                                         {.max_chunksize = options_.max_chunksize,
+                                          .plaintext = options_.allows_plaintext(pub_key_),
+                                          .max_streams = options_.max_streams,
+                                          .max_bundle_files = protocol::MAX_BUNDLE_FILES,
+                                          .background = options_.background,
+                                          .compression = options_.get_compression(),
+                                          .dedup = options_.dedup,
+                                          .multicast = options_.multicast});
   spdlog::trace("Sending message: {}", message_);
 
   async_write(socket_, boost::asio::buffer(message_.data(), message_.size()),
@@ -361,29 +377,49 @@ void client_session_base<SocketType>::handle_read_handshake(
 
   spdlog::trace("Received encrypted response: {}", response_message);
 
-  const auto got_accepted = protocol::converter<bool>::from_message(
+  const auto peer_capabilities = protocol::converter<capabilities>::from_message(
       response_message, pub_key_, *derived_crypto_handler_.get());
 
-  if (!got_accepted) {
+  if (!peer_capabilities.has_value()) {
     spdlog::debug("Handshake got denied");
     return;
   }
 
-  request_file();
-  //message_ =
-  //    protocol::create_file_list_message(derived_crypto_handler_->get_public_key(), salt);
-  //spdlog::trace("Sending message: {}", message_);
+  capabilities_ = protocol::negotiate({.max_chunksize = options_.max_chunksize,
+                                       .plaintext = options_.allows_plaintext(pub_key_),
+                                       .max_streams = options_.max_streams,
+                                       .max_bundle_files = protocol::MAX_BUNDLE_FILES,
+                                       .background = options_.background,
+                                       .compression = options_.get_compression(),
+                                       .dedup = options_.dedup,
+                                       .multicast = options_.multicast},
+                                      peer_capabilities.value());
+
+  if (capabilities_.max_streams == 0) {
+    spdlog::error("host {} does not support multiplexed file streams", pub_key_);
+    close();
+    return;
+  }
+
+  derived_crypto_handler_->use_directional_nonces(pub_key_, true);
+
+  if (capabilities_.plaintext) {
+    spdlog::debug("receiving unencrypted file bodies from {}", pub_key_);
+  }
 
-  //async_write(socket_, boost::asio::buffer(message_.data(), message_.size()),
-  //            [me = this->shared_from_this()](
-  //                boost::system::error_code const& ec, std::size_t) {
-  //              if (!ec) {
-  //                spdlog::debug("Done sending init message");
-  //                me->read_encrypted_response();
-  //              } else {
-  //                spdlog::debug("async write failed: {}", ec.message());
-  //              }
-  //            });
+  if (!capabilities_.compression.empty()) {
+    codec_ = get_codec(capabilities_.compression.front()).value_or(codec::NONE);
+    spdlog::debug("receiving {} compressed file bodies from {}",
+                  capabilities_.compression.front(), pub_key_);
+  }
+
+  fill_streams();
+
+  if (streams_.empty()) {
+    return;
+  }
+
+  read_frame_header();
 }
 
 template<typename SocketType>
@@ -426,185 +462,1163 @@ void client_session_base<SocketType>::handle_read_encrypted_response(boost::syst
 
 }
 
+template <typename SocketType>
+void client_session_base<SocketType>::fill_streams() {
+  if (!socket_.lowest_layer().is_open()) {
+    // the session ended after an error, the files are left to the next one
+    return;
+  }
+
+  // the connection and the derived keys are reused for all files this host
+  // offers, which saves the connect and key agreement per file. requests
+  // are sent back to back, the server answers them on separate streams
+  while (get_requests_in_flight() < capabilities_.max_streams) {
+    auto next = next_requested_.has_value() ? std::exchange(next_requested_, std::nullopt)
+                                            : get_next_file();
+
+    if (!next.has_value()) {
+      break;
+    }
+
+    if (capabilities_.max_bundle_files > 1 && output_ == nullptr &&
+        next.value().file_info.size <= protocol::MAX_BUNDLE_FILE_SIZE) {
+      request_bundle(std::move(next.value()));
+      continue;
+    }
+
+    request_file(std::move(next.value()));
+  }
+
+  if (streams_.empty()) {
+    spdlog::debug("no more files to request from {}, closing session", pub_key_);
+    close();
+  }
+}
+
+template <typename SocketType>
+size_t client_session_base<SocketType>::get_requests_in_flight() const {
+  std::set<uint32_t> bundles;
+  size_t count = 0;
+
+  for (const auto& [id, stream] : streams_) {
+    if (stream.bundle == 0) {
+      ++count;
+    } else {
+      bundles.insert(stream.bundle);
+    }
+  }
+
+  return count + bundles.size();
+}
+
+template <typename SocketType>
+std::optional<requested_file> client_session_base<SocketType>::get_next_file(
+    size_t max_size) {
+  auto next = deque_.try_pop_if([this, max_size](const available_file& file) {
+    if (file.file_info.size > max_size) {
+      return false;
+    }
+
+    // segments of one file are fetched by sessions of their own, so they
+    // end up on separate connections
+    if (downloads_ != nullptr &&
+        downloads_->find(file.file_info.file_name) != nullptr) {
+      return false;
+    }
+
+    return file.public_key == source_.public_key &&
+           file.source_address == source_.source_address &&
+           file.source_port == source_.source_port;
+  });
+
+  if (!next.has_value()) {
+    return std::nullopt;
+  }
+
+  if (next.value().partial) {
+    partial_.insert(next.value().file_info.file_name);
+  }
+
+  requested_file result;
+  result.file_info = std::move(next.value().file_info);
+  return result;
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::request_file(requested_file requested) {
+  if (downloads_ != nullptr) {
+    const auto download = downloads_->find(requested.file_info.file_name);
+
+    if (download != nullptr) {
+      request_segment(download, std::move(requested));
+      return;
+    }
+  }
+
+  if (wants_cast(requested)) {
+    request_cast(std::move(requested));
+    return;
+  }
+
+  if (wants_manifest(requested)) {
+    request_manifest(std::move(requested));
+    return;
+  }
+
+  if (!open_stream(requested)) {
+    return;
+  }
+
+  if (sign_basis(requested)) {
+    // the request follows the signature
+    return;
+  }
+
+  queue_message(protocol::converter<requested_file>::to_message(
+      requested, pub_key_, *derived_crypto_handler_.get()));
+}
+
+template <typename SocketType>
+bool client_session_base<SocketType>::sign_basis(const requested_file& requested) {
+  // an update only gets what its stored copy is missing, unencrypted
+  // transfers send whole files with sendfile
+  if (output_ != nullptr || capabilities_.plaintext) {
+    return false;
+  }
+
+  auto basis = file_handler_.open_basis(requested.file_info);
+  struct stat basis_stat;
+
+  if (!basis.has_value() || ::fstat(basis.value().get(), &basis_stat) != 0) {
+    return false;
+  }
+
+  // the whole copy is read and hashed, the handlers of the connection go on
+  // meanwhile and the request is sent once the signature is back on the strand
+  auto shared_basis = std::make_shared<file_descriptor>(std::move(basis.value()));
+  const auto size = static_cast<size_t>(basis_stat.st_size);
+  auto sign = [me = this->shared_from_this(), shared_basis, size, requested]() {
+    auto signature = create_signature(*shared_basis, size);
+    boost::asio::post(me->socket_.get_executor(),
+                      [me, shared_basis, signature = std::move(signature), requested]() {
+                        me->request_update(requested, std::move(*shared_basis), signature);
+                      });
+  };
+
+  if (workers_ != nullptr) {
+    boost::asio::post(*workers_, std::move(sign));
+  } else {
+    boost::asio::post(io_context_, std::move(sign));
+  }
+
+  return true;
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::request_update(
+    const requested_file& requested, file_descriptor basis,
+    const std::optional<file_signature>& signature) {
+  const auto it = streams_.find(requested.stream_id);
+
+  if (it == streams_.end()) {
+    // the session ended while the copy was signed
+    return;
+  }
+
+  auto& stream = it->second;
+
+  if (signature.has_value() && !signature.value().weak.empty()) {
+    spdlog::debug("updating {} from {} blocks of its stored copy",
+                  requested.file_info.file_name, signature.value().weak.size());
+    stream.basis = std::move(basis);
+    stream.basis_block_size = signature.value().block_size;
+    stream.basis_blocks = signature.value().weak.size();
+    queue_message(protocol::converter<file_signature>::to_message(
+        signature.value(), requested.stream_id, pub_key_,
+        *derived_crypto_handler_.get()));
+  }
+
+  queue_message(protocol::converter<requested_file>::to_message(
+      requested, pub_key_, *derived_crypto_handler_.get()));
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::request_bundle(requested_file first) {
+  // small files are named in one request and sent one after another, which
+  // saves a request round trip and a stream slot per file. they are sent
+  // whole, their stored copies arent signed
+  const auto bundle_id = next_stream_id_;
+  file_bundle bundle;
+  std::optional<requested_file> next = std::move(first);
+
+  while (next.has_value()) {
+    if (open_stream(next.value(), bundle_id)) {
+      bundle.files.push_back(std::move(next.value()));
+    }
+
+    if (bundle.files.size() >= capabilities_.max_bundle_files) {
+      break;
+    }
+
+    next = get_next_file(protocol::MAX_BUNDLE_FILE_SIZE);
+  }
+
+  if (bundle.files.empty()) {
+    return;
+  }
+
+  if (bundle.files.size() == 1) {
+    // nothing else to bundle it with
+    streams_[bundle_id].bundle = 0;
+    queue_message(protocol::converter<requested_file>::to_message(
+        bundle.files.front(), pub_key_, *derived_crypto_handler_.get()));
+    return;
+  }
+
+  spdlog::debug("requesting bundle of {} files from {}", bundle.files.size(), pub_key_);
+  queue_message(protocol::converter<file_bundle>::to_message(
+      bundle, pub_key_, *derived_crypto_handler_.get()));
+}
+
+template <typename SocketType>
+bool client_session_base<SocketType>::open_stream(requested_file& requested,
+                                                  uint32_t bundle) {
+  std::optional<mfsync::ofstream_wrapper> output_file_stream = mfsync::ofstream_wrapper{};
+
+  if (output_ != nullptr) {
+    // nothing is stored, the range is streamed to the output as it arrives
+    requested.offset = output_->get_offset();
+    requested.length = output_->get_length();
+  } else {
+    // not setting offset here, it will be set by file_handler when file is
+    // created
+    output_file_stream = file_handler_.create_file(requested);
+  }
+
+  if (!output_file_stream.has_value()) {
+    spdlog::debug("file creation failed, skipping it");
+    spdlog::debug("filename: {}", requested.file_info.file_name);
+    return false;
+  }
+
+  requested.chunksize = options_.initial_chunksize;
+  requested.stream_id = next_stream_id_++;
+
+  auto& stream = streams_[requested.stream_id];
+  stream.requested = requested;
+  stream.ofstream = std::move(output_file_stream.value());
+  stream.bytes_written = requested.offset;
+  stream.bundle = bundle;
+  stream.bar = progress_->create_file_progress(requested.file_info);
+  stream.bar->status = progress::STATUS::DOWNLOADING;
+  stream.bar->bytes_transferred = requested.offset;
+  return true;
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::request_segment(
+    const std::shared_ptr<segmented_download>& download, requested_file requested) {
+  if (!(download->get_file_info() == requested.file_info)) {
+    spdlog::debug("{} offers another version of {}, skipping it", pub_key_,
+                  requested.file_info.file_name);
+    return;
+  }
+
+  auto segment = download->acquire();
+
+  if (!segment.has_value()) {
+    spdlog::debug("no segment of {} left to fetch", requested.file_info.file_name);
+    return;
+  }
+
+  const auto& range = segment.value().get_range();
+  requested.offset = range.begin;
+  requested.length = range.end - range.begin;
+  requested.chunksize = options_.initial_chunksize;
+  requested.stream_id = next_stream_id_++;
+
+  spdlog::debug("requesting bytes {} to {} of {} from {}", range.begin, range.end,
+                requested.file_info.file_name, pub_key_);
+
+  auto& stream = streams_[requested.stream_id];
+  stream.requested = requested;
+  stream.bytes_written = requested.offset;
+  stream.segment.emplace(std::move(segment.value()));
+
+  queue_message(protocol::converter<requested_file>::to_message(
+      requested, pub_key_, *derived_crypto_handler_.get()));
+}
+
+template <typename SocketType>
+bool client_session_base<SocketType>::wants_manifest(
+    const requested_file& requested) const {
+  // small files arent worth the extra round trip, updates already reuse
+  // their stored copy
+  return capabilities_.dedup && output_ == nullptr && downloads_ != nullptr &&
+         requested.file_info.size >= MIN_DEDUP_FILE_SIZE &&
+         !deduplicated_.contains(requested.file_info.file_name) &&
+         !partial_.contains(requested.file_info.file_name) &&
+         !file_handler_.is_update(requested.file_info.file_name);
+}
 
 template <typename SocketType>
-void client_session_base<SocketType>::request_file() {
-  auto output_file_stream = file_handler_.create_file(requested_);
+void client_session_base<SocketType>::request_manifest(requested_file requested) {
+  deduplicated_.insert(requested.file_info.file_name);
+
+  // the file is created right away so nobody else fetches it meanwhile,
+  // create_file sets the offset to the part that was received before
+  auto output_file_stream = file_handler_.create_file(requested);
 
   if (!output_file_stream.has_value()) {
-    spdlog::debug("file creation failed. abort session");
-    spdlog::debug("filename: {}", requested_.file_info.file_name);
-    handle_error();
+    spdlog::debug("file creation failed, skipping it");
+    spdlog::debug("filename: {}", requested.file_info.file_name);
     return;
   }
 
-  ofstream_ = std::move(output_file_stream.value());
+  auto& stream = streams_[next_stream_id_];
+  stream.ofstream = std::move(output_file_stream.value());
+  stream.bytes_written = requested.offset;
+  stream.manifest = true;
+
+  requested.manifest = true;
+  requested.offset = 0;
+  requested.length = 0;
+  requested.chunksize = options_.initial_chunksize;
+  requested.stream_id = next_stream_id_++;
+  stream.requested = requested;
+
+  spdlog::debug("requesting chunk manifest of {} from {}", requested.file_info.file_name,
+                pub_key_);
+  queue_message(protocol::converter<requested_file>::to_message(
+      requested, pub_key_, *derived_crypto_handler_.get()));
+}
 
-  message_ = protocol::converter<requested_file>::to_message(
-      requested_, pub_key_, *derived_crypto_handler_.get());
+template <typename SocketType>
+bool client_session_base<SocketType>::wants_cast(const requested_file& requested) const {
+  // gaps of a cast are fetched as segments, so it needs the download registry
+  return capabilities_.multicast && output_ == nullptr && downloads_ != nullptr &&
+         requested.file_info.size >= multicast::MIN_CAST_FILE_SIZE &&
+         !cast_.contains(requested.file_info.file_name) &&
+         !partial_.contains(requested.file_info.file_name) &&
+         !file_handler_.is_update(requested.file_info.file_name);
+}
 
-  spdlog::debug("Sending message: {}", message_);
+template <typename SocketType>
+void client_session_base<SocketType>::request_cast(requested_file requested) {
+  cast_.insert(requested.file_info.file_name);
 
-  async_write(socket_, boost::asio::buffer(message_.data(), message_.size()),
+  // locked until the cast is over, create_file sets the offset to the part
+  // that was received before
+  auto output_file_stream = file_handler_.create_file(requested);
+
+  if (!output_file_stream.has_value()) {
+    spdlog::debug("file creation failed, skipping it");
+    spdlog::debug("filename: {}", requested.file_info.file_name);
+    return;
+  }
+
+  auto& stream = streams_[next_stream_id_];
+  stream.ofstream = std::move(output_file_stream.value());
+  stream.bytes_written = requested.offset;
+  stream.cast = true;
+
+  requested.cast = true;
+  requested.offset = 0;
+  requested.length = 0;
+  requested.chunksize = options_.initial_chunksize;
+  requested.stream_id = next_stream_id_++;
+  stream.requested = requested;
+
+  spdlog::debug("requesting cast of {} from {}", requested.file_info.file_name, pub_key_);
+  queue_message(protocol::converter<requested_file>::to_message(
+      requested, pub_key_, *derived_crypto_handler_.get()));
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::join_cast(incoming_stream& stream,
+                                                const std::string& payload) {
+  const auto file_info = stream.requested.file_info;
+  const auto offer = protocol::converter<cast_offer>::from_message(
+      payload, stream.requested, pub_key_, *derived_crypto_handler_.get());
+  std::shared_ptr<multicast::cast_receiver> receiver = nullptr;
+
+  if (offer.has_value()) {
+    const auto written = file_handler_.get_written_ranges(file_info, stream.bytes_written);
+    receiver = multicast::cast_receiver::create(io_context_, file_handler_, *downloads_,
+                                                progress_, offer.value(), file_info,
+                                                std::move(stream.ofstream), written);
+  } else {
+    spdlog::error("received invalid cast offer for {}", file_info.file_name);
+  }
+
+  close_stream(stream.requested.stream_id);
+
+  if (receiver != nullptr) {
+    receiver->start();
+    return;
+  }
+
+  // the file is fetched like the gaps of a cast, asking for another cast
+  // would start it for nobody
+  const auto download = segmented_download::create(file_handler_, file_info, progress_);
+
+  if (download == nullptr) {
+    return;
+  }
+
+  downloads_->add(download);
+
+  while (get_requests_in_flight() < capabilities_.max_streams &&
+         download->has_unassigned()) {
+    request_segment(download, requested_file{.file_info = file_info});
+  }
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::queue_message(std::string message) {
+  spdlog::debug("Sending message: {}", message);
+
+  {
+    std::scoped_lock lk{write_mutex_};
+    write_queue_.push_back(std::move(message));
+
+    if (writing_) {
+      return;
+    }
+
+    writing_ = true;
+  }
+
+  write_next_message();
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::write_next_message() {
+  const std::string* message = nullptr;
+
+  {
+    std::scoped_lock lk{write_mutex_};
+    message = &write_queue_.front();
+  }
+
+  async_write(socket_, boost::asio::buffer(message->data(), message->size()),
               [me = this->shared_from_this()](
                   boost::system::error_code const& ec, std::size_t) {
-                if (!ec) {
-                  spdlog::debug("Done requesting file!");
-                  me->read_file_request_response();
-                } else {
+                if (ec) {
                   spdlog::debug("async write failed: {}", ec.message());
+                  me->handle_error();
+                  return;
+                }
+
+                {
+                  std::scoped_lock lk{me->write_mutex_};
+                  me->write_queue_.pop_front();
+
+                  if (me->write_queue_.empty()) {
+                    me->writing_ = false;
+                    return;
+                  }
                 }
+
+                me->write_next_message();
               });
 }
 
 template <typename SocketType>
-void client_session_base<SocketType>::read_file_request_response() {
-  boost::asio::async_read_until(
-      socket_, stream_buffer_, mfsync::protocol::MFSYNC_HEADER_END,
+void client_session_base<SocketType>::read_frame_header() {
+  if constexpr (RAW_SOCKET) {
+    if (uring_ != nullptr) {
+      uring_->async_receive(
+          socket_.native_handle(), frame_header_.data(), frame_header_.size(),
+          on_executor(socket_.get_executor(),
+                      [me = this->shared_from_this()](
+                          boost::system::error_code const& error,
+                          std::size_t bytes_transferred) {
+                        me->handle_read_frame_header(error, bytes_transferred);
+                      }));
+      return;
+    }
+  }
+
+  boost::asio::async_read(
+      socket_, boost::asio::buffer(frame_header_),
       [me = this->shared_from_this()](boost::system::error_code const& error,
                                       std::size_t bytes_transferred) {
-        me->handle_read_file_request_response(error, bytes_transferred);
+        me->handle_read_frame_header(error, bytes_transferred);
       });
 }
 
 template <typename SocketType>
-void client_session_base<SocketType>::handle_read_file_request_response(
+void client_session_base<SocketType>::read_frame_header_after(size_t bytes) {
+  const auto delay =
+      limiter_ == nullptr
+          ? rate_limiter::clock::duration::zero()
+          : limiter_->reserve(direction::DOWNLOAD, pub_key_, bytes,
+                              options_.background ? priority::BACKGROUND
+                                                  : priority::INTERACTIVE);
+
+  if (delay <= rate_limiter::clock::duration::zero()) {
+    read_frame_header();
+    return;
+  }
+
+  // not reading lets the socket buffer fill up, the tcp window then slows
+  // down the sender
+  auto timer = std::make_shared<boost::asio::steady_timer>(socket_.get_executor(), delay);
+  timer->async_wait([me = this->shared_from_this(), timer](boost::system::error_code const&) {
+    me->read_frame_header();
+  });
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::handle_read_frame_header(
+    boost::system::error_code const& error, std::size_t) {
+  if (error) {
+    spdlog::debug("error during read_frame_header: {}", error.message());
+    handle_error();
+    return;
+  }
+
+  const auto frame = protocol::get_frame_from_header(frame_header_);
+
+  if (!frame.has_value()) {
+    handle_error();
+    return;
+  }
+
+  frame_ = frame.value();
+  // encrypted chunks carry the tags of their records on top of the data
+  const auto max_length = capabilities_.plaintext
+                              ? capabilities_.max_chunksize
+                              : crypto::get_sealed_size(capabilities_.max_chunksize);
+
+  if (frame_.length > max_length ||
+      ((frame_.type == protocol::frame_type::DATA ||
+        frame_.type == protocol::frame_type::COMPRESSED_DATA ||
+        frame_.type == protocol::frame_type::MANIFEST) &&
+       frame_.length == 0)) {
+    spdlog::debug("received frame with invalid size {}, negotiated maximum is {}",
+                  frame_.length, capabilities_.max_chunksize);
+    handle_error();
+    return;
+  }
+
+  read_frame_payload();
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::read_frame_payload() {
+  spdlog::debug("Trying read buffer with {} bytes", frame_.length);
+
+  if (readbuf_.size() < frame_.length) {
+    readbuf_.resize(frame_.length);
+  }
+
+  if constexpr (RAW_SOCKET) {
+    if (uring_ != nullptr && frame_.length > 0) {
+      uring_->async_receive(
+          socket_.native_handle(), readbuf_.data(), frame_.length,
+          on_executor(socket_.get_executor(),
+                      [me = this->shared_from_this()](
+                          boost::system::error_code const& error,
+                          std::size_t bytes_transferred) {
+                        me->handle_read_frame_payload(error, bytes_transferred);
+                      }));
+      return;
+    }
+  }
+
+  boost::asio::async_read(
+      socket_, boost::asio::buffer(readbuf_.data(), frame_.length),
+      [me = this->shared_from_this()](boost::system::error_code const& error,
+                                      std::size_t bytes_transferred) {
+        me->handle_read_frame_payload(error, bytes_transferred);
+      });
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::handle_read_frame_payload(
     boost::system::error_code const& error, std::size_t bytes_transferred) {
-  if (!error) {
-    boost::asio::streambuf::const_buffers_type bufs = stream_buffer_.data();
-    std::string response_message(
-        boost::asio::buffers_begin(bufs),
-        boost::asio::buffers_begin(bufs) + bytes_transferred);
+  if (error) {
+    spdlog::debug("error during read_frame_payload: {}", error.message());
+    handle_error();
+    return;
+  }
 
-    stream_buffer_.consume(bytes_transferred);
+  const auto it = streams_.find(frame_.stream_id);
 
-    spdlog::debug("Received encrypted response: {}", response_message);
+  if (it == streams_.end()) {
+    // happens if a stream failed on our side while the sender kept going
+    spdlog::debug("dropping frame of unknown stream {}", frame_.stream_id);
+    read_frame_header();
+    return;
+  }
 
-    const auto got_accepted = protocol::converter<bool>::from_message(
-        response_message, pub_key_, *derived_crypto_handler_.get());
+  auto& stream = it->second;
 
-    if (!got_accepted.has_value() || !got_accepted.value()) {
-      spdlog::debug("file list request got denied by host {}.", pub_key_);
+  switch (frame_.type) {
+    case protocol::frame_type::DATA:
+    case protocol::frame_type::COMPRESSED_DATA:
+      handle_data(stream, bytes_transferred);
+      read_frame_header_after(bytes_transferred + protocol::FRAME_HEADER_SIZE);
+      return;
+    case protocol::frame_type::COPY:
+      handle_copy(stream, bytes_transferred);
+      read_frame_header_after(bytes_transferred + protocol::FRAME_HEADER_SIZE);
+      return;
+    case protocol::frame_type::MANIFEST:
+      handle_manifest(stream, bytes_transferred);
+      read_frame_header_after(bytes_transferred + protocol::FRAME_HEADER_SIZE);
+      return;
+    case protocol::frame_type::END:
+      handle_end(stream, std::string(reinterpret_cast<const char*>(readbuf_.data()),
+                                     bytes_transferred));
+      break;
+    case protocol::frame_type::ERROR:
+      if (stream.cancelled) {
+        finish_segment(stream);
+        break;
+      }
+
+      spdlog::debug("file request got denied by host {}: {}", pub_key_,
+                    std::string(reinterpret_cast<const char*>(readbuf_.data()),
+                                bytes_transferred));
+      close_stream(frame_.stream_id);
+      break;
+  }
+
+  fill_streams();
+
+  if (streams_.empty()) {
+    return;
+  }
+
+  read_frame_header();
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::handle_data(incoming_stream& stream,
+                                                  size_t size) {
+  spdlog::debug("Received {} bytes on stream {}", size, stream.requested.stream_id);
+
+  if (stream.segment.has_value()) {
+    handle_segment_data(stream, size);
+    return;
+  }
+
+  const auto end = stream.requested.get_end();
+  const unsigned char* data = readbuf_.data();
+  // bytes of the file the chunk covers, the tag of a sealed chunk isnt part
+  // of them and compressed chunks are restored to their full length
+  auto plain_size = size;
+
+  if (capabilities_.plaintext) {
+    stream.checksum.update(readbuf_.data(), size);
+  } else {
+    const auto plain = decode_payload(stream, size);
+
+    if (!plain.has_value()) {
+      spdlog::error("chunk of {} cant be decoded, dropping the stream",
+                    stream.requested.file_info.file_name);
+      drop_stream(stream);
       return;
     }
 
-    message_ =
-        protocol::converter<bool>::to_message(true, pub_key_, *derived_crypto_handler_.get());
+    data = plain.value().data();
+    plain_size = plain.value().size();
 
-    spdlog::debug("Sending response: {}", message_);
+    if (output_ != nullptr || stream.basis.is_open()) {
+      // there is no file left to check the sha256sum of afterwards, updates
+      // are checked against the senders checksum
+      stream.checksum.update(data, plain_size);
+    }
+  }
 
-    bytes_written_to_requested_ = requested_.offset;
+  if (output_ != nullptr) {
+    if (!output_->write(data, plain_size)) {
+      spdlog::error("streaming {} failed, dropping the stream",
+                    stream.requested.file_info.file_name);
+      drop_stream(stream);
+      return;
+    }
+  } else if (!stream.ofstream.write(reinterpret_cast<const char*>(data), plain_size,
+                                    stream.bytes_written)) {
+    // the chunk is only buffered, it is written out together with the
+    // following ones
+    spdlog::error("writing {} failed, dropping the stream",
+                  stream.requested.file_info.file_name);
+    drop_stream(stream);
+    return;
+  }
+
+  stream.bytes_written += plain_size;
+  stream.bar->bytes_transferred = stream.bytes_written;
 
-    async_write(socket_, boost::asio::buffer(message_.data(), message_.size()),
-                [me = this->shared_from_this()](
-                    boost::system::error_code const& ec, std::size_t) {
-                  if (!ec) {
-                    spdlog::debug("Done sending response");
+  if (stream.bytes_written >= end) {
+    stream.bar->status = progress::STATUS::COMPARING;
+    return;
+  }
 
-                    if (me->bar_ == nullptr) {
-                      me->bar_ = me->progress_->create_file_progress(
-                          me->requested_.file_info);
-                      me->bar_->status = progress::STATUS::DOWNLOADING;
-                    }
+  acknowledge(stream, size);
+}
 
-                    me->readbuf_.resize(me->requested_.chunksize);
-                    me->read_file_chunk();
-                  } else {
-                    spdlog::debug("async write failed: {}", ec.message());
-                    me->handle_error();
-                  }
-                });
+template <typename SocketType>
+void client_session_base<SocketType>::handle_segment_data(incoming_stream& stream,
+                                                          size_t size) {
+  const unsigned char* data = readbuf_.data();
+  auto plain_size = size;
+  auto file_bytes = size;
+
+  if (capabilities_.plaintext) {
+    stream.checksum.update(readbuf_.data(), size);
   } else {
-    spdlog::debug("Error on handle_read_file_request_response: {}",
-                  error.message());
+    const auto plain = decode_payload(stream, size);
+    const auto compressed = frame_.type == protocol::frame_type::COMPRESSED_DATA;
+    file_bytes = crypto::get_plain_size(size).value_or(0);
+
+    if (compressed && plain.has_value()) {
+      file_bytes = plain.value().size();
+    }
+
+    // a chunk that cant be decoded counts as not written, the segment is
+    // left to the other sources then
+    if (plain.has_value()) {
+      data = plain.value().data();
+      plain_size = plain.value().size() == file_bytes ? file_bytes : 0;
+    } else {
+      plain_size = 0;
+    }
+  }
+
+  const auto offset = stream.bytes_written;
+  stream.bytes_written += file_bytes;
+
+  if (stream.cancelled) {
+    // frames that were on their way before the sender got the cancel
+    return;
   }
+
+  auto& segment = stream.segment.value();
+  const auto written = segment.write(offset, data, plain_size);
+
+  if (written < file_bytes ||
+      (segment.is_done() && stream.bytes_written < stream.requested.get_end())) {
+    // another source took over the rest of the segment
+    spdlog::debug("cancelling stream {}, its segment is fetched elsewhere",
+                  stream.requested.stream_id);
+    stream.cancelled = true;
+    queue_message(protocol::converter<stream_cancel>::to_message(
+        {.stream_id = stream.requested.stream_id}, pub_key_,
+        *derived_crypto_handler_.get()));
+    return;
+  }
+
+  if (stream.bytes_written >= stream.requested.get_end()) {
+    return;
+  }
+
+  acknowledge(stream, size);
 }
 
 template <typename SocketType>
-void client_session_base<SocketType>::read_file_chunk() {
-  spdlog::debug("READ FILE CHUNK");
-  auto bytes_left = requested_.file_info.size - bytes_written_to_requested_;
+std::optional<std::span<const unsigned char>>
+client_session_base<SocketType>::decode_payload(const incoming_stream& stream,
+                                                size_t size) {
+  if (!derived_crypto_handler_->decrypt_buf(pub_key_, stream.requested.stream_id,
+                                            stream.bytes_written, readbuf_.data(), size,
+                                            plain_buffer_)) {
+    spdlog::debug("received chunk that cant be decrypted");
+    return std::nullopt;
+  }
+
+  if (frame_.type != protocol::frame_type::COMPRESSED_DATA) {
+    return std::span<const unsigned char>{plain_buffer_};
+  }
+
+  if (codec_ == codec::NONE) {
+    spdlog::debug("received compressed chunk, but no codec was negotiated");
+    return std::nullopt;
+  }
+
+  if (!decompress_chunk(codec_, plain_buffer_.data(), plain_buffer_.size(),
+                        capabilities_.max_chunksize, decompress_buffer_)) {
+    spdlog::debug("received compressed chunk that cant be restored");
+    return std::nullopt;
+  }
+
+  return std::span<const unsigned char>{decompress_buffer_};
+}
 
-  if (bytes_left <= 0) {
-    spdlog::debug("complete file is written!");
+template <typename SocketType>
+void client_session_base<SocketType>::handle_copy(incoming_stream& stream,
+                                                  size_t size) {
+  const auto decrypted =
+      derived_crypto_handler_->decrypt_buf(pub_key_, stream.requested.stream_id,
+                                           stream.bytes_written, readbuf_.data(), size,
+                                           plain_buffer_);
+  const auto copy = decrypted ? protocol::get_copy_from_payload(plain_buffer_.data(),
+                                                                plain_buffer_.size())
+                              : std::nullopt;
+  const auto end = stream.requested.get_end();
+  const auto block_size = stream.basis_block_size;
+
+  if (!copy.has_value() || !stream.basis.is_open() || copy.value().second == 0 ||
+      copy.value().first >= stream.basis_blocks ||
+      copy.value().second > stream.basis_blocks - copy.value().first ||
+      copy.value().second * block_size > end - std::min(end, stream.bytes_written)) {
+    spdlog::error("received invalid copy for {}, dropping the stream",
+                  stream.requested.file_info.file_name);
+    drop_stream(stream);
     return;
   }
 
-  if (bytes_left > requested_.chunksize) {
-    bytes_left = requested_.chunksize;
+  const auto [first, count] = copy.value();
+  basis_buffer_.resize(block_size);
+
+  for (size_t block = first; block < first + count; ++block) {
+    if (stream.basis.read_at(basis_buffer_.data(), block_size, block * block_size) !=
+        block_size) {
+      spdlog::error("stored copy of {} cant be read, dropping the stream",
+                    stream.requested.file_info.file_name);
+      drop_stream(stream);
+      return;
+    }
+
+    stream.checksum.update(basis_buffer_.data(), block_size);
+
+    if (!stream.ofstream.write(reinterpret_cast<const char*>(basis_buffer_.data()),
+                               block_size, stream.bytes_written)) {
+      spdlog::error("writing {} failed, dropping the stream",
+                    stream.requested.file_info.file_name);
+      drop_stream(stream);
+      return;
+    }
+
+    stream.bytes_written += block_size;
   }
 
-  spdlog::debug("Trying read buffer with {} bytes", bytes_left);
-  boost::asio::mutable_buffers_1 buf =
-      boost::asio::buffer(&readbuf_[0], bytes_left /*+ 12 /* TAG_SIZE*/);
-  boost::asio::async_read(
-      socket_, buf,
-      [me = this->shared_from_this()](boost::system::error_code const& error,
-                                      std::size_t bytes_transferred) {
-        me->handle_read_file_chunk(error, bytes_transferred);
-      });
+  stream.bar->bytes_transferred = stream.bytes_written;
+
+  if (stream.bytes_written >= end) {
+    stream.bar->status = progress::STATUS::COMPARING;
+    return;
+  }
+
+  acknowledge(stream, size);
 }
 
 template <typename SocketType>
-void client_session_base<SocketType>::handle_read_file_chunk(
-    boost::system::error_code const& error, std::size_t bytes_transferred) {
-  if (error) {
-    spdlog::debug("error during read_file_chunk: {}", error.message());
-    handle_error();
+void client_session_base<SocketType>::handle_manifest(incoming_stream& stream,
+                                                      size_t size) {
+  const auto& chunks = stream.chunks;
+  const auto offset = chunks.empty() ? 0 : chunks.back().offset + chunks.back().length;
+  const auto decrypted = derived_crypto_handler_->decrypt_buf(
+      pub_key_, stream.requested.stream_id, offset, readbuf_.data(), size, plain_buffer_);
+  const auto manifest =
+      stream.manifest && decrypted ? protocol::get_manifest_from_payload(plain_buffer_.data(),
+                                                            plain_buffer_.size(), offset)
+                      : std::nullopt;
+
+  if (!manifest.has_value() ||
+      manifest.value().back().offset + manifest.value().back().length >
+          stream.requested.file_info.size) {
+    spdlog::error("received invalid manifest for {}, dropping the stream",
+                  stream.requested.file_info.file_name);
+    drop_stream(stream);
     return;
   }
 
-  spdlog::debug("Received {} bytes", bytes_transferred);
-  auto pump_all = (bytes_written_to_requested_ + bytes_transferred) >
-                  requested_.file_info.size;
+  stream.chunks.insert(stream.chunks.end(), manifest.value().begin(),
+                       manifest.value().end());
+  acknowledge(stream, size);
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::rebuild_from_chunks(incoming_stream& stream) {
+  const auto file_info = stream.requested.file_info;
+  const auto& chunks = stream.chunks;
+  const auto covered = chunks.empty() ? 0 : chunks.back().offset + chunks.back().length;
+
+  if (covered != file_info.size) {
+    // fetched in full on the next try
+    spdlog::debug("manifest of {} ends after {} bytes", file_info.file_name, covered);
+    close_stream(stream.requested.stream_id);
+    return;
+  }
+
+  auto written = file_handler_.get_written_ranges(file_info, stream.bytes_written);
+
+  // the stored chunks may make up most of a large file, they are copied while
+  // the other streams of the connection go on. the stream keeps its slot
+  // until the rest of the file is requested
+  auto copy = [me = this->shared_from_this(), stream_id = stream.requested.stream_id,
+               file_info, chunks = std::move(stream.chunks),
+               written = std::move(written)]() mutable {
+    written = me->file_handler_.copy_stored_chunks(file_info, chunks, std::move(written));
+    boost::asio::post(me->socket_.get_executor(),
+                      [me, stream_id, written = std::move(written)]() mutable {
+                        me->handle_copied_chunks(stream_id, std::move(written));
+                      });
+  };
+
+  if (workers_ != nullptr) {
+    boost::asio::post(*workers_, std::move(copy));
+  } else {
+    boost::asio::post(io_context_, std::move(copy));
+  }
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::handle_copied_chunks(uint32_t stream_id,
+                                                           byte_ranges written) {
+  const auto it = streams_.find(stream_id);
+
+  if (it == streams_.end()) {
+    // the session ended while the chunks were copied
+    return;
+  }
+
+  auto& stream = it->second;
+  const auto file_info = stream.requested.file_info;
+
+  if (written.size() == 1 && written.front().first == 0 &&
+      written.front().second >= file_info.size) {
+    spdlog::debug("rebuilt {} from stored chunks only", file_info.file_name);
+    stream.bar = progress_->create_file_progress(file_info);
+    stream.bar->status = progress::STATUS::DOWNLOADING;
+    // the frame read that is still pending ends once no streams are left
+    finish_file(stream);
+    fill_streams();
+    return;
+  }
+
+  // the chunks that are missing are fetched like segments of a download
+  // that was interrupted, so a restart continues with the same gaps
+  file_handler_.store_segment_journal(file_info, written);
+  close_stream(stream.requested.stream_id);
+
+  const auto download = segmented_download::create(file_handler_, file_info, progress_);
+
+  if (download == nullptr) {
+    fill_streams();
+    return;
+  }
+
+  downloads_->add(download);
+
+  while (get_requests_in_flight() < capabilities_.max_streams &&
+         download->has_unassigned()) {
+    request_segment(download, requested_file{.file_info = file_info});
+  }
+
+  fill_streams();
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::acknowledge(incoming_stream& stream,
+                                                  size_t size) {
+  // granting in halves of the window keeps the sender busy without an
+  // update for every chunk
+  stream.unacknowledged += size;
+
+  if (stream.unacknowledged >= protocol::STREAM_WINDOW / 2) {
+    queue_message(protocol::converter<window_update>::to_message(
+        {.stream_id = stream.requested.stream_id, .bytes = stream.unacknowledged},
+        pub_key_, *derived_crypto_handler_.get()));
+    stream.unacknowledged = 0;
+  }
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::handle_end(incoming_stream& stream,
+                                                 const std::string& payload) {
+  if (stream.manifest) {
+    rebuild_from_chunks(stream);
+    return;
+  }
+
+  if (stream.cast) {
+    join_cast(stream, payload);
+    return;
+  }
 
-  ofstream_.get_ofstream().seekp(bytes_written_to_requested_);
-  derived_crypto_handler_->decrypt_file_to_buf(pub_key_, ofstream_.get_ofstream(),
-                                      bytes_transferred, readbuf_, pump_all);
-  ofstream_.get_ofstream().flush();
-  // ofstream_.write(reinterpret_cast<char*>(readbuf_.data()),
-  // bytes_transferred,
-  //                 bytes_written_to_requested_);
-  bytes_written_to_requested_ += bytes_transferred;
+  const auto& requested = stream.requested;
 
-  if (ofstream_.tellp() <
-      static_cast<std::streamsize>(requested_.file_info.size)) {
-    bar_->bytes_transferred = bytes_written_to_requested_;
-    read_file_chunk();
+  if (stream.bytes_written < requested.get_end()) {
+    spdlog::debug("stream {} ended before {} was received completely",
+                  requested.stream_id, requested.file_info.file_name);
+    close_stream(requested.stream_id);
     return;
   }
 
-  bar_->status = progress::STATUS::COMPARING;
-  spdlog::debug("received file {}", requested_.file_info.file_name);
+  spdlog::debug("received file {}", requested.file_info.file_name);
   spdlog::debug("with size in mb: {}",
-                static_cast<double>(requested_.file_info.size / 1048576.0));
+                static_cast<double>(requested.file_info.size / 1048576.0));
+
+  // a sender that doesnt know updates sends the whole file without a checksum
+  if (capabilities_.plaintext || (stream.basis.is_open() && !payload.empty())) {
+    const auto expected = protocol::converter<transfer_checksum>::from_message(
+        payload, requested, pub_key_, *derived_crypto_handler_.get());
+    const auto received = stream.checksum.finalize();
+
+    if (!expected.has_value() || expected.value().sha256sum != received) {
+      spdlog::error("checksum mismatch on unencrypted transfer of {}, discarding it",
+                    requested.file_info.file_name);
+      const auto file_info = requested.file_info;
+      const auto download = stream.segment.has_value()
+                                ? stream.segment.value().get_download()
+                                : nullptr;
+      close_stream(requested.stream_id);
+
+      if (download != nullptr) {
+        // the bad bytes cant be told apart from the ones of other sources
+        download->discard();
+        downloads_->remove(file_info.file_name);
+      } else {
+        file_handler_.discard_file(file_info);
+      }
+      return;
+    }
+  }
 
-  ofstream_.flush();
+  if (stream.segment.has_value()) {
+    finish_segment(stream);
+    return;
+  }
+
+  finish_file(stream);
+}
 
-  if (!file_handler_.finalize_file(requested_.file_info)) {
+template <typename SocketType>
+void client_session_base<SocketType>::finish_file(incoming_stream& stream) {
+  if (output_ != nullptr) {
+    finish_output(stream);
+    return;
+  }
+
+  if (!stream.ofstream.flush()) {
+    spdlog::debug("writing the rest of {} failed", stream.requested.file_info.file_name);
+    close_stream(stream.requested.stream_id);
+    return;
+  }
+
+  const bool finalized = file_handler_.finalize_file(stream.requested.file_info);
+
+  if (!finalized) {
     spdlog::debug("finalizing failed!!!");
     handle_error();
     return;
   }
 
-  bar_->bytes_transferred = requested_.file_info.size;
-  bar_->status = progress::STATUS::DONE;
-  bar_ = nullptr;
+  stream.bar->bytes_transferred = stream.requested.file_info.size;
+  stream.bar->status = progress::STATUS::DONE;
 
   // spdlog::info("received file: {} - {} - {}",
   // requested_.file_info.file_name,
   //                                             requested_.file_info.sha256sum,
   //                                             requested_.file_info.size);
 
-  readbuf_.clear();
-  // TODO: start_request currently does handshake again which leads to failing
-  // tls connection foo so it is neccessary only do the deque handling setting
-  // "requested_" properly and not doing handshake anymore start_request();
+  close_stream(stream.requested.stream_id);
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::finish_output(incoming_stream& stream) {
+  const auto& requested = stream.requested;
+  const auto& sha256sum = requested.file_info.sha256sum;
+  bool verified = true;
+
+  // plaintext transfers were verified against the senders checksum already,
+  // encrypted chunks are authenticated one by one. a whole file can be
+  // checked against the announced sha256sum on top of that
+  if (!capabilities_.plaintext && requested.offset == 0 &&
+      requested.get_end() == requested.file_info.size && sha256sum.has_value()) {
+    verified = stream.checksum.finalize() == sha256sum.value();
+  }
+
+  if (!verified) {
+    spdlog::error("sha256sum of streamed {} doesnt match", requested.file_info.file_name);
+  }
+
+  output_->finish(verified);
+  stream.bar->status = progress::STATUS::DONE;
+  close_stream(requested.stream_id);
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::finish_segment(incoming_stream& stream) {
+  const auto download = stream.segment.value().get_download();
+  const auto file_info = download->get_file_info();
+  close_stream(stream.requested.stream_id);
+
+  const auto finalized = download->try_finalize();
+
+  if (finalized.has_value()) {
+    if (finalized.value()) {
+      spdlog::debug("received all segments of {}", file_info.file_name);
+    } else {
+      spdlog::error("finalizing {} failed, it is fetched again from scratch",
+                    file_info.file_name);
+    }
+
+    downloads_->remove(file_info.file_name);
+    return;
+  }
+
+  if (!download->is_complete() && !next_requested_.has_value()) {
+    // this source keeps fetching segments until none are left, so fast
+    // sources end up with more of the file
+    next_requested_ = requested_file{.file_info = file_info};
+  }
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::close_stream(uint32_t stream_id) {
+  const auto it = streams_.find(stream_id);
+
+  if (it == streams_.end()) {
+    return;
+  }
+
+  if (output_ != nullptr && !output_->is_done()) {
+    // bytes that reached the output cant be fetched again
+    output_->finish(false);
+  }
+
+  it->second.ofstream.close();
+  streams_.erase(it);
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::drop_stream(incoming_stream& stream) {
+  if (!stream.cancelled) {
+    // frames the sender has on their way are dropped as frames of an unknown
+    // stream, its END as well
+    queue_message(protocol::converter<stream_cancel>::to_message(
+        {.stream_id = stream.requested.stream_id}, pub_key_,
+        *derived_crypto_handler_.get()));
+  }
+
+  close_stream(stream.requested.stream_id);
+}
+
+template <typename SocketType>
+void client_session_base<SocketType>::close() {
+  boost::system::error_code ec;
+  socket_.lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+  socket_.lowest_layer().close(ec);
 }
 
 template <typename SocketType>
 void client_session_base<SocketType>::handle_error() {
-  spdlog::debug("handle_error not implemented yet!!!");
+  // the frames of all streams share the connection, once one cant be read
+  // none of the others can either. their tmp files are kept for a resume
+  spdlog::debug("ending session with {} after an error, dropping {} streams", pub_key_,
+                streams_.size());
+  close();
+
+  while (!streams_.empty()) {
+    close_stream(streams_.begin()->first);
+  }
 }
 
 }  // namespace mfsync::filetransfer
@@ -0,0 +1,239 @@
+#include "mfsync/compression.h"
+
+#include <algorithm>
+#include <map>
+
+#ifdef MFSYNC_USE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef MFSYNC_USE_LZ4
+#include <lz4.h>
+#endif
+
+#include "spdlog/spdlog.h"
+
+namespace mfsync::filetransfer
+{
+
+namespace
+{
+  void write_size(unsigned char* out, size_t size)
+  {
+    for(size_t i = 0; i < chunk_compressor::SIZE_PREFIX; ++i)
+    {
+      out[i] = static_cast<unsigned char>(size >> (8 * i));
+    }
+  }
+
+  size_t read_size(const unsigned char* data)
+  {
+    size_t size = 0;
+    for(size_t i = 0; i < chunk_compressor::SIZE_PREFIX; ++i)
+    {
+      size |= static_cast<size_t>(data[i]) << (8 * i);
+    }
+
+    return size;
+  }
+} //closing anonymous namespace
+
+std::vector<std::string> get_supported_codecs()
+{
+  std::vector<std::string> result;
+
+#ifdef MFSYNC_USE_ZSTD
+  result.emplace_back("zstd");
+#endif
+
+#ifdef MFSYNC_USE_LZ4
+  result.emplace_back("lz4");
+#endif
+
+  return result;
+}
+
+std::optional<codec> get_codec(const std::string& name)
+{
+  const std::map<std::string, codec> codec_map
+  {
+    { "zstd", codec::ZSTD },
+    { "lz4", codec::LZ4 },
+  };
+
+  const auto supported = get_supported_codecs();
+
+  if(!codec_map.contains(name) || std::find(supported.begin(), supported.end(), name) == supported.end())
+  {
+    return std::nullopt;
+  }
+
+  return codec_map.at(name);
+}
+
+chunk_compressor::chunk_compressor(codec compression_codec)
+  : codec_(compression_codec)
+{
+}
+
+bool chunk_compressor::compress(const unsigned char* data, size_t size, double link_throughput,
+                                std::vector<unsigned char>& out)
+{
+  if(codec_ == codec::NONE || size == 0)
+  {
+    return false;
+  }
+
+  if(skip_ > 0)
+  {
+    --skip_;
+    return false;
+  }
+
+  const auto started = clock::now();
+
+  if(!compress_with_level(data, size, out) || out.size() > size * MAX_RATIO)
+  {
+    //most likely media or archives, probing them again gets rarer
+    skip_ = next_skip_;
+    next_skip_ = std::min(next_skip_ * 2, MAX_SKIPPED_CHUNKS);
+    return false;
+  }
+
+  next_skip_ = 1;
+  adapt_level(size, clock::now() - started, link_throughput);
+  return true;
+}
+
+int chunk_compressor::get_level() const
+{
+  return level_;
+}
+
+bool chunk_compressor::compress_with_level([[maybe_unused]] const unsigned char* data, size_t size,
+                                           std::vector<unsigned char>& out) const
+{
+  [[maybe_unused]] size_t compressed = 0;
+
+  switch(codec_)
+  {
+    case codec::ZSTD:
+#ifdef MFSYNC_USE_ZSTD
+      out.resize(SIZE_PREFIX + ZSTD_compressBound(size));
+      compressed = ZSTD_compress(out.data() + SIZE_PREFIX, out.size() - SIZE_PREFIX, data, size, level_);
+
+      if(ZSTD_isError(compressed))
+      {
+        spdlog::debug("zstd compression failed: {}", ZSTD_getErrorName(compressed));
+        return false;
+      }
+      break;
+#else
+      return false;
+#endif
+    case codec::LZ4:
+#ifdef MFSYNC_USE_LZ4
+    {
+      //lz4 is tuned by its acceleration, higher is faster
+      out.resize(SIZE_PREFIX + LZ4_compressBound(static_cast<int>(size)));
+      const auto result = LZ4_compress_fast(reinterpret_cast<const char*>(data),
+                                            reinterpret_cast<char*>(out.data() + SIZE_PREFIX),
+                                            static_cast<int>(size),
+                                            static_cast<int>(out.size() - SIZE_PREFIX),
+                                            MAX_LEVEL + 1 - level_);
+
+      if(result <= 0)
+      {
+        return false;
+      }
+
+      compressed = result;
+      break;
+    }
+#else
+      return false;
+#endif
+    case codec::NONE:
+      return false;
+  }
+
+  write_size(out.data(), size);
+  out.resize(SIZE_PREFIX + compressed);
+  return true;
+}
+
+void chunk_compressor::adapt_level(size_t size, clock::duration duration, double link_throughput)
+{
+  const auto seconds = std::chrono::duration<double>(duration).count();
+
+  if(link_throughput <= 0 || seconds <= 0)
+  {
+    return;
+  }
+
+  //compressing should keep well ahead of the link, otherwise it is the bottleneck
+  const auto speed = size / seconds;
+
+  if(speed < 2 * link_throughput && level_ > MIN_LEVEL)
+  {
+    --level_;
+    spdlog::trace("lowering compression level to {}", level_);
+  }
+  else if(speed > 8 * link_throughput && level_ < MAX_LEVEL)
+  {
+    ++level_;
+    spdlog::trace("raising compression level to {}", level_);
+  }
+}
+
+bool decompress_chunk(codec compression_codec, const unsigned char* data, size_t size,
+                      size_t max_size, std::vector<unsigned char>& out)
+{
+  if(size < chunk_compressor::SIZE_PREFIX)
+  {
+    return false;
+  }
+
+  const auto raw_size = read_size(data);
+
+  if(raw_size > max_size)
+  {
+    spdlog::debug("compressed chunk claims {} bytes, at most {} are allowed", raw_size, max_size);
+    return false;
+  }
+
+  out.resize(raw_size);
+  data += chunk_compressor::SIZE_PREFIX;
+  size -= chunk_compressor::SIZE_PREFIX;
+
+  switch(compression_codec)
+  {
+    case codec::ZSTD:
+#ifdef MFSYNC_USE_ZSTD
+    {
+      const auto result = ZSTD_decompress(out.data(), out.size(), data, size);
+      return !ZSTD_isError(result) && result == raw_size;
+    }
+#else
+      return false;
+#endif
+    case codec::LZ4:
+#ifdef MFSYNC_USE_LZ4
+    {
+      const auto result = LZ4_decompress_safe(reinterpret_cast<const char*>(data),
+                                              reinterpret_cast<char*>(out.data()),
+                                              static_cast<int>(size),
+                                              static_cast<int>(out.size()));
+      return result >= 0 && static_cast<size_t>(result) == raw_size;
+    }
+#else
+      return false;
+#endif
+    case codec::NONE:
+      break;
+  }
+
+  return false;
+}
+
+} //closing namespace mfsync::filetransfer
@@ -0,0 +1,220 @@
+#include "mfsync/content_chunking.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+#include "mfsync/sha256.h"
+
+namespace mfsync
+{
+
+namespace
+{
+  //chunks are read in batches of this size
+  constexpr size_t CHUNK_READ_SIZE = 16 * MAX_CONTENT_CHUNK_SIZE;
+
+  //both sides of a transfer have to cut the same boundaries, so the table is
+  //generated from a fixed seed at compile time
+  constexpr auto GEAR = []()
+  {
+    std::array<uint64_t, 256> table{};
+    uint64_t state = 0x6d6673796e63ull;
+
+    for(auto& entry : table)
+    {
+      //splitmix64
+      state += 0x9e3779b97f4a7c15ull;
+      auto value = state;
+      value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+      value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+      entry = value ^ (value >> 31);
+    }
+
+    return table;
+  }();
+
+  //the top bits of the gear hash depend on the most bytes. chunks shorter
+  //than the average need two more zero bits, longer ones two less, which
+  //keeps most chunks close to the average
+  constexpr uint64_t MASK_SMALL = ~uint64_t{0} << (64 - 18);
+  constexpr uint64_t MASK_LARGE = ~uint64_t{0} << (64 - 14);
+
+  unsigned char from_hex(char c)
+  {
+    return c <= '9' ? c - '0' : c - 'a' + 10;
+  }
+} //closing anonymous namespace
+
+content_hash get_content_hash(const unsigned char* data, size_t size)
+{
+  sha256 hasher;
+  hasher.update(data, size);
+  const auto digest = hasher.finalize();
+
+  content_hash result;
+  for(size_t i = 0; i < result.size(); ++i)
+  {
+    result[i] = from_hex(digest[2 * i]) << 4 | from_hex(digest[2 * i + 1]);
+  }
+
+  return result;
+}
+
+size_t find_chunk_boundary(const unsigned char* data, size_t size)
+{
+  if(size <= MIN_CONTENT_CHUNK_SIZE)
+  {
+    return size;
+  }
+
+  const auto limit = std::min(size, MAX_CONTENT_CHUNK_SIZE);
+  const auto normal = std::min(limit, AVG_CONTENT_CHUNK_SIZE);
+  uint64_t hash = 0;
+  size_t i = MIN_CONTENT_CHUNK_SIZE;
+
+  //no chunk is cut before the minimum, so its bytes arent even hashed
+  for(; i < normal; ++i)
+  {
+    hash = (hash << 1) + GEAR[data[i]];
+
+    if((hash & MASK_SMALL) == 0)
+    {
+      return i + 1;
+    }
+  }
+
+  for(; i < limit; ++i)
+  {
+    hash = (hash << 1) + GEAR[data[i]];
+
+    if((hash & MASK_LARGE) == 0)
+    {
+      return i + 1;
+    }
+  }
+
+  return limit;
+}
+
+size_t cut_chunks(const unsigned char* data, size_t size, size_t offset, bool at_end,
+                  std::vector<content_chunk>& chunks)
+{
+  size_t pos = 0;
+
+  while(pos < size && (at_end || size - pos >= MAX_CONTENT_CHUNK_SIZE))
+  {
+    const auto length = find_chunk_boundary(data + pos, size - pos);
+    chunks.push_back({ .hash = get_content_hash(data + pos, length),
+                       .offset = offset + pos,
+                       .length = length });
+    pos += length;
+  }
+
+  return pos;
+}
+
+std::optional<std::vector<content_chunk>> chunk_file(const file_descriptor& descriptor, size_t size)
+{
+  std::vector<content_chunk> chunks;
+  std::vector<unsigned char> buffer(std::min(size, CHUNK_READ_SIZE));
+  //file offset of the start of the buffer
+  size_t offset = 0;
+  size_t buffered = 0;
+
+  while(offset < size)
+  {
+    const auto count = std::min(buffer.size() - buffered, size - offset - buffered);
+    const auto read = descriptor.read_at(buffer.data() + buffered, count, offset + buffered);
+    buffered += read;
+
+    if(read != count)
+    {
+      spdlog::debug("file ended after {} bytes while chunking it", offset + buffered);
+      return std::nullopt;
+    }
+
+    const auto at_end = offset + buffered == size;
+    const auto covered = cut_chunks(buffer.data(), buffered, offset, at_end, chunks);
+
+    //the tail that might belong to a longer chunk moves to the front
+    std::memmove(buffer.data(), buffer.data() + covered, buffered - covered);
+    buffered -= covered;
+    offset += covered;
+  }
+
+  return chunks;
+}
+
+void chunk_index::add_file(const std::string& file_name, const std::vector<content_chunk>& chunks)
+{
+  remove_file(file_name);
+  auto& hashes = files_[file_name];
+  hashes.reserve(chunks.size());
+
+  for(const auto& chunk : chunks)
+  {
+    chunks_.emplace(chunk.hash, location{ .file_name = file_name,
+                                          .offset = chunk.offset,
+                                          .length = chunk.length });
+    hashes.push_back(chunk.hash);
+  }
+}
+
+void chunk_index::remove_file(const std::string& file_name)
+{
+  const auto it = files_.find(file_name);
+
+  if(it == files_.end())
+  {
+    return;
+  }
+
+  for(const auto& hash : it->second)
+  {
+    const auto [begin, end] = chunks_.equal_range(hash);
+    const auto entry = std::find_if(begin, end, [&file_name](const auto& entry)
+    {
+      return entry.second.file_name == file_name;
+    });
+
+    if(entry != end)
+    {
+      chunks_.erase(entry);
+    }
+  }
+
+  files_.erase(it);
+}
+
+bool chunk_index::contains_file(const std::string& file_name) const
+{
+  return files_.contains(file_name);
+}
+
+std::optional<chunk_index::location> chunk_index::find(const content_hash& hash) const
+{
+  const auto it = chunks_.find(hash);
+
+  if(it == chunks_.end())
+  {
+    return std::nullopt;
+  }
+
+  return it->second;
+}
+
+size_t chunk_index::size() const
+{
+  return chunks_.size();
+}
+
+size_t chunk_index::hash_hasher::operator()(const content_hash& hash) const
+{
+  size_t result = 0;
+  std::memcpy(&result, hash.data(), sizeof(result));
+  return result;
+}
+
+} //closing namespace mfsync
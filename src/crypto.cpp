@@ -1,5 +1,8 @@
 #include "mfsync/crypto.h"
 
+#include <algorithm>
+#include <cstring>
+
 #include <cryptopp/chachapoly.h>
 #include <cryptopp/cryptlib.h>
 #include <cryptopp/files.h>
@@ -141,6 +144,221 @@ std::optional<encryption_wrapper> encryption_wrapper::decrypt(
   return std::nullopt;
 }
 
+std::unique_ptr<group_cipher> group_cipher::generate() {
+  SecByteBlock key(KEY_SIZE);
+  AutoSeededRandomPool rng;
+  rng.GenerateBlock(key, key.size());
+  return std::make_unique<group_cipher>(std::move(key));
+}
+
+std::unique_ptr<group_cipher> group_cipher::create(const std::string& encoded_key) {
+  SecByteBlock key;
+  HexDecoder decoder;
+  decoder.Put(reinterpret_cast<const byte*>(encoded_key.data()), encoded_key.size());
+  decoder.MessageEnd();
+
+  if (encoded_key.size() != 2 * KEY_SIZE || decoder.MaxRetrievable() != KEY_SIZE) {
+    return nullptr;
+  }
+
+  key.resize(KEY_SIZE);
+  decoder.Get(key, key.size());
+  return std::make_unique<group_cipher>(std::move(key));
+}
+
+group_cipher::group_cipher(SecByteBlock key) : key_(std::move(key)) {
+  // the nonce is replaced by the one of every packet
+  const SecByteBlock IV(NONCE_SIZE);
+  enc_.SetKeyWithIV(key_, key_.size(), IV, IV.size());
+  dec_.SetKeyWithIV(key_, key_.size(), IV, IV.size());
+}
+
+std::string group_cipher::get_encoded_key() const {
+  std::string result;
+  HexEncoder encoder(new StringSink(result));
+  encoder.Put(key_, key_.size());
+  encoder.MessageEnd();
+  return result;
+}
+
+void group_cipher::encrypt(const byte* nonce, const byte* aad, size_t aad_size,
+                           const byte* data, size_t size, byte* out) {
+  enc_.EncryptAndAuthenticate(out, out + size, TAG_SIZE, nonce, NONCE_SIZE, aad,
+                              aad_size, data, size);
+}
+
+bool group_cipher::decrypt(const byte* nonce, const byte* aad, size_t aad_size,
+                           const byte* data, size_t size, byte* out) {
+  if (size < TAG_SIZE) {
+    return false;
+  }
+
+  const auto text_size = size - TAG_SIZE;
+  return dec_.DecryptAndVerify(out, data + text_size, TAG_SIZE, nonce, NONCE_SIZE,
+                               aad, aad_size, data, text_size);
+}
+
+record_nonce get_record_nonce(uint32_t stream_id, size_t offset) {
+  record_nonce result{};
+  const auto count = FILE_NONCE_BASE | offset;
+  std::memcpy(result.data(), &count, sizeof(count));
+  std::memcpy(result.data() + sizeof(count), &stream_id, sizeof(stream_id));
+  return result;
+}
+
+size_t get_sealed_size(size_t plain_size) {
+  const auto records = std::max<size_t>((plain_size + RECORD_SIZE - 1) / RECORD_SIZE, 1);
+  return plain_size + records * RECORD_TAG_SIZE;
+}
+
+std::optional<size_t> get_plain_size(size_t sealed_size) {
+  const auto full_records = sealed_size / (RECORD_SIZE + RECORD_TAG_SIZE);
+  const auto rest = sealed_size % (RECORD_SIZE + RECORD_TAG_SIZE);
+
+  if (rest == 0 && full_records > 0) {
+    return full_records * RECORD_SIZE;
+  }
+
+  // only the last record is shorter, and only an empty chunk has an empty record
+  if (rest < RECORD_TAG_SIZE || (rest == RECORD_TAG_SIZE && full_records > 0)) {
+    return std::nullopt;
+  }
+
+  return full_records * RECORD_SIZE + rest - RECORD_TAG_SIZE;
+}
+
+chunk_cipher::chunk_cipher(const SecByteBlock& key) : key_(key) {}
+
+std::unique_ptr<chunk_cipher::context> chunk_cipher::acquire_context() {
+  {
+    std::scoped_lock lk{mutex_};
+
+    if (!contexts_.empty()) {
+      auto result = std::move(contexts_.back());
+      contexts_.pop_back();
+      return result;
+    }
+  }
+
+  // the nonce is replaced by the one of every record
+  auto result = std::make_unique<context>();
+  const SecByteBlock IV(RECORD_NONCE_SIZE);
+  result->enc.SetKeyWithIV(key_, key_.size(), IV, IV.size());
+  result->dec.SetKeyWithIV(key_, key_.size(), IV, IV.size());
+  return result;
+}
+
+void chunk_cipher::release_context(std::unique_ptr<context> context) {
+  std::scoped_lock lk{mutex_};
+  contexts_.push_back(std::move(context));
+}
+
+void chunk_cipher::encrypt(const record_nonce& nonce, const byte* data, size_t size,
+                           byte* out) {
+  auto context = acquire_context();
+  context->enc.EncryptAndAuthenticate(out, out + size, TAG_SIZE, nonce.data(),
+                                      nonce.size(), nullptr, 0, data, size);
+  release_context(std::move(context));
+}
+
+bool chunk_cipher::decrypt(const record_nonce& nonce, const byte* data, size_t size,
+                           byte* out) {
+  if (size < TAG_SIZE) {
+    return false;
+  }
+
+  const auto text_size = size - TAG_SIZE;
+  auto context = acquire_context();
+  const auto result = context->dec.DecryptAndVerify(
+      out, data + text_size, TAG_SIZE, nonce.data(), nonce.size(), nullptr, 0, data,
+      text_size);
+  release_context(std::move(context));
+  return result;
+}
+
+crypto_pool::crypto_pool(size_t threads) {
+  for (size_t i = 0; i < threads; ++i) {
+    threads_.emplace_back([this]() { work(); });
+  }
+}
+
+crypto_pool::~crypto_pool() {
+  {
+    std::scoped_lock lk{mutex_};
+    stopped_ = true;
+  }
+
+  work_condition_.notify_all();
+
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+size_t crypto_pool::get_threads() const {
+  return threads_.size();
+}
+
+void crypto_pool::run(size_t count, const std::function<void(size_t)>& job) {
+  if (threads_.empty() || count < 2) {
+    for (size_t i = 0; i < count; ++i) {
+      job(i);
+    }
+    return;
+  }
+
+  auto current = std::make_shared<batch>(job, count);
+
+  {
+    std::scoped_lock lk{mutex_};
+    batches_.push_back(current);
+  }
+
+  work_condition_.notify_all();
+
+  // the records are taken one by one, by the workers as well as by the caller
+  size_t done = 0;
+
+  for (auto i = current->next++; i < count; i = current->next++) {
+    job(i);
+    ++done;
+  }
+
+  std::unique_lock lk{mutex_};
+  current->done += done;
+  std::erase(batches_, current);
+  done_condition_.wait(lk, [&current, count]() { return current->done == count; });
+}
+
+void crypto_pool::work() {
+  std::unique_lock lk{mutex_};
+
+  while (true) {
+    work_condition_.wait(lk, [this]() { return stopped_ || !batches_.empty(); });
+
+    if (stopped_) {
+      return;
+    }
+
+    const auto current = batches_.front();
+    const auto i = current->next++;
+
+    if (i >= current->count) {
+      // every record is taken, the ones still in work are waited for by the caller
+      batches_.pop_front();
+      continue;
+    }
+
+    lk.unlock();
+    current->job(i);
+    lk.lock();
+
+    if (++current->done == current->count) {
+      done_condition_.notify_all();
+    }
+  }
+}
+
 bool crypto_handler::init(const std::filesystem::path& path) {
   std::unique_lock lk{mutex_};
   key_pair_ = key_pair::create(path);
@@ -217,8 +435,9 @@ bool crypto_handler::trust_key(std::string pub_key, std::optional<std::string> s
     return false;
   }
 
-  trusted_keys_[pub_key] =
-      key_count_pair{.key = std::move(shared_secret.value())};
+  auto cipher = std::make_shared<chunk_cipher>(shared_secret.value());
+  trusted_keys_[pub_key] = key_count_pair{.key = std::move(shared_secret.value()),
+                                          .cipher = std::move(cipher)};
   return true;
 }
 
@@ -227,6 +446,7 @@ std::unique_ptr<crypto_handler> crypto_handler::derive(const std::string& pub_ke
   result->key_pair_ = key_pair_;
   result->trust_all_ = trust_all_;
   result->allowed_keys_ = allowed_keys_;
+  result->pool_ = pool_;
 
   spdlog::trace("Derive key: {}, salt: {}", pub_key, salt);
   result->trust_key(pub_key, salt);
@@ -249,88 +469,125 @@ std::optional<encryption_wrapper> crypto_handler::encrypt(
   }
 
   return encryption_wrapper::create(trusted_keys_.at(pub_key).key,
-                                    std::move(plain), get_count(pub_key),
+                                    std::move(plain), get_send_count(pub_key),
                                     std::move(aad));
 }
 
-bool crypto_handler::EndOfFile(const FileSource& file) {
-  std::istream* stream = const_cast<FileSource&>(file).GetStream();
-  return stream->eof();
+void crypto_handler::set_pool(std::shared_ptr<crypto_pool> pool) {
+  std::unique_lock lk{mutex_};
+  pool_ = std::move(pool);
+}
+
+void crypto_handler::run_records(size_t records,
+                                 const std::function<void(size_t)>& job) const {
+  std::shared_ptr<crypto_pool> pool;
+  {
+    std::unique_lock lk{mutex_};
+    pool = pool_;
+  }
+
+  if (pool == nullptr) {
+    for (size_t i = 0; i < records; ++i) {
+      job(i);
+    }
+    return;
+  }
+
+  pool->run(records, job);
 }
 
 void crypto_handler::encrypt_file_to_buf(const std::string& pub_key,
+                                         uint32_t stream_id, size_t offset,
                                          std::ifstream& ifstream,
                                          size_t block_size,
                                          std::vector<unsigned char>& out) {
-  if (!trusted_keys_.contains(pub_key)) {
+  const auto cipher = get_chunk_cipher(pub_key);
+  out.clear();
+
+  if (cipher == nullptr) {
     spdlog::debug("Tried encrypting file to buf with non trusted pub key");
     return;
   }
 
-  const int TAG_SIZE = -1;
-  static auto IV = encryption_wrapper::get_nonce_from_count(get_count(pub_key));
-
-  auto shared = trusted_keys_.at(pub_key);
-  ChaCha20Poly1305::Encryption enc;
-  enc.SetKeyWithIV(shared.key, shared.key.size(), IV, IV.size());
-
-  std::vector<unsigned char> v;
-  CryptoPP::FileSource source(ifstream, false);
-  CryptoPP::MeterFilter meter;
-  CryptoPP::AuthenticatedEncryptionFilter filter(enc, nullptr, false, TAG_SIZE);
-  CryptoPP::VectorSink sink(out);
-
-  source.Attach(new Redirector(filter));
-  filter.Attach(new Redirector(meter));
-  meter.Attach(new Redirector(sink));
+  // every record is read straight to its place in out and sealed where it is
+  out.resize(get_sealed_size(block_size));
+  size_t size = 0;
 
-  source.Pump(block_size);
+  while (size < block_size && ifstream) {
+    const auto record = size / RECORD_SIZE;
+    const auto length = std::min(RECORD_SIZE, block_size - size);
+    ifstream.read(reinterpret_cast<char*>(out.data() + size + record * RECORD_TAG_SIZE),
+                  length);
+    size += static_cast<size_t>(ifstream.gcount());
+  }
 
-  if (out.size() < block_size) {
-    filter.Flush(true);
-  } else {
-    filter.Flush(false);
+  if (size == 0) {
+    out.clear();
+    return;
   }
-  // todo;: maybe needed on eof
-  // filter.MessageEnd();
-  filter.Flush((out.size() < block_size));
+
+  // a short read can only happen at the end of the file, so the last record
+  // is the only one that isnt full
+  out.resize(get_sealed_size(size));
+  run_records((out.size() - size) / RECORD_TAG_SIZE, [&](size_t record) {
+    const auto begin = record * RECORD_SIZE;
+    auto* data = out.data() + begin + record * RECORD_TAG_SIZE;
+    cipher->encrypt(get_record_nonce(stream_id, offset + begin), data,
+                    std::min(RECORD_SIZE, size - begin), data);
+  });
 }
 
-void crypto_handler::decrypt_file_to_buf(const std::string& pub_key,
-                                         std::ofstream& ofstream,
-                                         size_t block_size,
-                                         std::vector<uint8_t>& in,
-                                         bool pump_all) {
-  if (!trusted_keys_.contains(pub_key)) {
-    spdlog::debug("Tried decrypting file to buf with non trusted pub key");
+void crypto_handler::encrypt_buf(const std::string& pub_key, uint32_t stream_id,
+                                 size_t offset, const unsigned char* data,
+                                 size_t size, std::vector<unsigned char>& out) {
+  const auto cipher = get_chunk_cipher(pub_key);
+  out.clear();
+
+  if (cipher == nullptr) {
+    spdlog::debug("Tried encrypting buf with non trusted pub key");
     return;
   }
 
-  static auto IV = encryption_wrapper::get_nonce_from_count(get_count(pub_key));
-
-  auto shared = trusted_keys_.at(pub_key);
+  out.resize(get_sealed_size(size));
+  run_records((out.size() - size) / RECORD_TAG_SIZE, [&](size_t record) {
+    const auto begin = record * RECORD_SIZE;
+    cipher->encrypt(get_record_nonce(stream_id, offset + begin), data + begin,
+                    std::min(RECORD_SIZE, size - begin),
+                    out.data() + begin + record * RECORD_TAG_SIZE);
+  });
+}
 
-  ChaCha20Poly1305::Decryption dec;
-  dec.SetKeyWithIV(shared.key, shared.key.size(), IV, IV.size());
+bool crypto_handler::decrypt_buf(const std::string& pub_key, uint32_t stream_id,
+                                 size_t offset, const unsigned char* data,
+                                 size_t size, std::vector<unsigned char>& out) {
+  const auto cipher = get_chunk_cipher(pub_key);
+  out.clear();
 
-  in.resize(block_size);
-  CryptoPP::VectorSource source(in, false);
-  CryptoPP::MeterFilter meter;
-  CryptoPP::AuthenticatedDecryptionFilter filter(
-      dec, nullptr, AuthenticatedDecryptionFilter::DEFAULT_FLAGS);
-  CryptoPP::FileSink sink(ofstream);
+  if (cipher == nullptr) {
+    spdlog::debug("Tried decrypting buf with non trusted pub key");
+    return false;
+  }
 
-  source.Attach(new Redirector(filter));
-  filter.Attach(new Redirector(meter));
-  meter.Attach(new Redirector(sink));
+  const auto plain_size = get_plain_size(size);
 
-  if (pump_all) {
-    source.PumpAll();
-  } else {
-    source.Pump(block_size);
+  if (!plain_size.has_value()) {
+    return false;
   }
 
-  filter.Flush(true);
+  out.resize(plain_size.value());
+  std::atomic<bool> authentic = true;
+  run_records((size - out.size()) / RECORD_TAG_SIZE, [&](size_t record) {
+    const auto begin = record * RECORD_SIZE;
+    const auto length = std::min(RECORD_SIZE, out.size() - begin);
+
+    if (!cipher->decrypt(get_record_nonce(stream_id, offset + begin),
+                         data + begin + record * RECORD_TAG_SIZE,
+                         length + RECORD_TAG_SIZE, out.data() + begin)) {
+      authentic = false;
+    }
+  });
+
+  return authentic;
 }
 
 std::optional<encryption_wrapper> crypto_handler::decrypt(
@@ -340,7 +597,7 @@ std::optional<encryption_wrapper> crypto_handler::decrypt(
   }
 
   return encryption_wrapper::decrypt(trusted_keys_.at(pub_key).key, wrapper,
-                                     get_count(pub_key));
+                                     get_receive_count(pub_key));
 }
 
 void crypto_handler::set_count(const std::string& pub_key, size_t count) {
@@ -354,13 +611,51 @@ void crypto_handler::set_count(const std::string& pub_key, size_t count) {
 }
 
 
-size_t crypto_handler::get_count(const std::string& pub_key) {
+void crypto_handler::use_directional_nonces(const std::string& pub_key,
+                                            bool initiator) {
+  std::unique_lock lk{mutex_};
+  if (!trusted_keys_.contains(pub_key)) {
+    spdlog::error("use_directional_nonces of non trusted key.");
+    return;
+  }
+
+  auto& pair = trusted_keys_.at(pub_key);
+  pair.directional = true;
+  pair.send_count = initiator ? INITIATOR_NONCE_BASE : RESPONDER_NONCE_BASE;
+  pair.receive_count = initiator ? RESPONDER_NONCE_BASE : INITIATOR_NONCE_BASE;
+}
+
+std::shared_ptr<chunk_cipher> crypto_handler::get_chunk_cipher(
+    const std::string& pub_key) const {
+  std::unique_lock lk{mutex_};
+  const auto it = trusted_keys_.find(pub_key);
+
+  if (it == trusted_keys_.end()) {
+    return nullptr;
+  }
+
+  return it->second.cipher;
+}
+
+size_t crypto_handler::get_send_count(const std::string& pub_key) {
+  std::unique_lock lk{mutex_};
+  if (!trusted_keys_.contains(pub_key)) {
+    spdlog::error("get_send_count of non trusted key.");
+    return 0;
+  }
+
+  auto& pair = trusted_keys_.at(pub_key);
+  return pair.directional ? pair.send_count++ : pair.count++;
+}
+
+size_t crypto_handler::get_receive_count(const std::string& pub_key) {
   std::unique_lock lk{mutex_};
   if (!trusted_keys_.contains(pub_key)) {
-    spdlog::error("get_count of non trusted key.");
+    spdlog::error("get_receive_count of non trusted key.");
     return 0;
   }
 
-  return trusted_keys_.at(pub_key).count++;
+  auto& pair = trusted_keys_.at(pub_key);
+  return pair.directional ? pair.receive_count++ : pair.count++;
 }
 }  // namespace mfsync::crypto
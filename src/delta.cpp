@@ -0,0 +1,206 @@
+#include "mfsync/delta.h"
+
+#include <algorithm>
+#include <string>
+
+#include "spdlog/spdlog.h"
+
+#include "mfsync/sha256.h"
+
+namespace mfsync
+{
+
+void rolling_checksum::reset(const unsigned char* data, size_t size)
+{
+  a_ = 0;
+  b_ = 0;
+  size_ = size;
+
+  for(size_t i = 0; i < size; ++i)
+  {
+    a_ += data[i];
+    b_ += static_cast<uint32_t>(size - i) * data[i];
+  }
+}
+
+void rolling_checksum::roll(unsigned char out, unsigned char in)
+{
+  a_ += in - out;
+  b_ += a_ - static_cast<uint32_t>(size_) * out;
+}
+
+uint32_t rolling_checksum::get() const
+{
+  return (a_ & 0xffff) | (b_ << 16);
+}
+
+uint64_t get_strong_checksum(const unsigned char* data, size_t size)
+{
+  sha256 hasher;
+  hasher.update(data, size);
+  return std::stoull(hasher.finalize().substr(0, 16), nullptr, 16);
+}
+
+size_t get_signature_block_size(size_t file_size)
+{
+  size_t block_size = MIN_SIGNATURE_BLOCK_SIZE;
+
+  while(block_size < MAX_SIGNATURE_BLOCK_SIZE
+        && (block_size * block_size < file_size || file_size / block_size > MAX_SIGNATURE_BLOCKS))
+  {
+    block_size *= 2;
+  }
+
+  return block_size;
+}
+
+std::optional<file_signature> create_signature(const file_descriptor& basis, size_t size)
+{
+  file_signature signature;
+  signature.block_size = get_signature_block_size(size);
+
+  const auto blocks = size / signature.block_size;
+  signature.weak.reserve(blocks);
+  signature.strong.reserve(blocks);
+
+  std::vector<unsigned char> buffer(signature.block_size);
+  rolling_checksum weak;
+
+  for(size_t block = 0; block < blocks; ++block)
+  {
+    const auto offset = block * signature.block_size;
+    const auto read = basis.read_at(buffer.data(), buffer.size(), offset);
+
+    if(read != buffer.size())
+    {
+      spdlog::debug("basis ended after {} bytes while signing it", offset + read);
+      return std::nullopt;
+    }
+
+    weak.reset(buffer.data(), buffer.size());
+    signature.weak.push_back(weak.get());
+    signature.strong.push_back(get_strong_checksum(buffer.data(), buffer.size()));
+  }
+
+  return signature;
+}
+
+bool is_valid_signature(const file_signature& signature)
+{
+  return signature.block_size >= MIN_SIGNATURE_BLOCK_SIZE
+      && signature.block_size <= MAX_SIGNATURE_BLOCK_SIZE
+      && signature.weak.size() == signature.strong.size();
+}
+
+delta_encoder::delta_encoder(file_signature signature)
+  : signature_(std::move(signature))
+{
+  blocks_.reserve(signature_.weak.size());
+
+  for(size_t i = 0; i < signature_.weak.size(); ++i)
+  {
+    blocks_.emplace(signature_.weak[i], i);
+  }
+}
+
+size_t delta_encoder::get_block_size() const
+{
+  return signature_.block_size;
+}
+
+delta_step delta_encoder::next(const unsigned char* data, size_t size, size_t max_literal)
+{
+  const auto block_size = signature_.block_size;
+  max_literal = std::max<size_t>(max_literal, 1);
+
+  if(size < block_size || blocks_.empty())
+  {
+    //the tail cant hold a block of the receiver anymore
+    return { .length = std::min(size, max_literal) };
+  }
+
+  rolling_checksum weak;
+  weak.reset(data, block_size);
+
+  for(size_t pos = 0; ; ++pos)
+  {
+    const auto block = find(weak.get(), data + pos);
+
+    if(block.has_value())
+    {
+      if(pos > 0)
+      {
+        //the data in front of the match goes first, the match is found again next time
+        return { .length = pos };
+      }
+
+      //blocks that follow each other in both files become a single copy
+      uint32_t count = 1;
+      while((count + 1) * block_size <= size
+            && block.value() + count < signature_.weak.size())
+      {
+        const auto* next_data = data + count * block_size;
+        weak.reset(next_data, block_size);
+
+        if(!matches(block.value() + count, weak.get(), next_data))
+        {
+          break;
+        }
+
+        ++count;
+      }
+
+      expected_ = block.value() + count;
+      return { .step_type = delta_step::type::COPY,
+               .length = count * block_size,
+               .block = block.value(),
+               .count = count };
+    }
+
+    if(pos + 1 == max_literal || pos + block_size == size)
+    {
+      break;
+    }
+
+    weak.roll(data[pos], data[pos + block_size]);
+  }
+
+  return { .length = std::min(size, max_literal) };
+}
+
+std::optional<size_t> delta_encoder::find(uint32_t weak, const unsigned char* data) const
+{
+  if(expected_ < signature_.weak.size() && matches(expected_, weak, data))
+  {
+    return expected_;
+  }
+
+  const auto [begin, end] = blocks_.equal_range(weak);
+
+  if(begin == end)
+  {
+    return std::nullopt;
+  }
+
+  //the strong checksum is only calculated once the weak one matched
+  const auto strong = get_strong_checksum(data, signature_.block_size);
+  const auto it = std::find_if(begin, end, [this, strong](const auto& entry)
+  {
+    return signature_.strong[entry.second] == strong;
+  });
+
+  if(it == end)
+  {
+    return std::nullopt;
+  }
+
+  return it->second;
+}
+
+bool delta_encoder::matches(size_t block, uint32_t weak, const unsigned char* data) const
+{
+  return signature_.weak[block] == weak
+      && signature_.strong[block] == get_strong_checksum(data, signature_.block_size);
+}
+
+} //closing namespace mfsync
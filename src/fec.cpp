@@ -0,0 +1,244 @@
+#include "mfsync/fec.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <utility>
+
+namespace mfsync
+{
+
+namespace
+{
+  //x^8 + x^4 + x^3 + x^2 + 1, 2 generates the multiplicative group
+  constexpr unsigned POLYNOMIAL = 0x11d;
+
+  struct gf_tables
+  {
+    //exp is doubled, so the sum of two logs never has to be reduced
+    std::array<unsigned char, 512> exp{};
+    std::array<unsigned, 256> log{};
+  };
+
+  constexpr auto GF = []()
+  {
+    gf_tables tables;
+    unsigned value = 1;
+
+    for(unsigned i = 0; i < 255; ++i)
+    {
+      tables.exp[i] = static_cast<unsigned char>(value);
+      tables.exp[i + 255] = static_cast<unsigned char>(value);
+      tables.log[value] = i;
+      value <<= 1;
+
+      if(value & 0x100)
+      {
+        value ^= POLYNOMIAL;
+      }
+    }
+
+    return tables;
+  }();
+
+  unsigned char multiply(unsigned char a, unsigned char b)
+  {
+    if(a == 0 || b == 0)
+    {
+      return 0;
+    }
+
+    return GF.exp[GF.log[a] + GF.log[b]];
+  }
+
+  unsigned char invert(unsigned char a)
+  {
+    return GF.exp[255 - GF.log[a]];
+  }
+
+  //dst += coefficient * src, addition is xor
+  void multiply_add(unsigned char* dst, const unsigned char* src, unsigned char coefficient,
+                    size_t size)
+  {
+    if(coefficient == 0)
+    {
+      return;
+    }
+
+    const auto log = GF.log[coefficient];
+
+    for(size_t i = 0; i < size; ++i)
+    {
+      if(src[i] != 0)
+      {
+        dst[i] ^= GF.exp[GF.log[src[i]] + log];
+      }
+    }
+  }
+
+  //inverts the size x size matrix in place, it has to be invertible
+  void invert_matrix(std::vector<unsigned char>& matrix, size_t size)
+  {
+    std::vector<unsigned char> inverse(size * size, 0);
+
+    for(size_t i = 0; i < size; ++i)
+    {
+      inverse[i * size + i] = 1;
+    }
+
+    for(size_t col = 0; col < size; ++col)
+    {
+      auto pivot = col;
+
+      while(matrix[pivot * size + col] == 0)
+      {
+        ++pivot;
+      }
+
+      if(pivot != col)
+      {
+        std::swap_ranges(matrix.begin() + pivot * size, matrix.begin() + (pivot + 1) * size,
+                         matrix.begin() + col * size);
+        std::swap_ranges(inverse.begin() + pivot * size, inverse.begin() + (pivot + 1) * size,
+                         inverse.begin() + col * size);
+      }
+
+      const auto scale = invert(matrix[col * size + col]);
+
+      for(size_t i = 0; i < size; ++i)
+      {
+        matrix[col * size + i] = multiply(matrix[col * size + i], scale);
+        inverse[col * size + i] = multiply(inverse[col * size + i], scale);
+      }
+
+      for(size_t row = 0; row < size; ++row)
+      {
+        const auto factor = matrix[row * size + col];
+
+        if(row == col || factor == 0)
+        {
+          continue;
+        }
+
+        multiply_add(matrix.data() + row * size, matrix.data() + col * size, factor, size);
+        multiply_add(inverse.data() + row * size, inverse.data() + col * size, factor, size);
+      }
+    }
+
+    matrix = std::move(inverse);
+  }
+} //closing anonymous namespace
+
+bool reed_solomon::is_valid(size_t data_shards, size_t parity_shards)
+{
+  return data_shards > 0 && data_shards + parity_shards <= MAX_FEC_SHARDS;
+}
+
+reed_solomon::reed_solomon(size_t data_shards, size_t parity_shards)
+  : data_shards_(data_shards)
+  , parity_shards_(parity_shards)
+  , parity_matrix_(data_shards * parity_shards)
+{
+  //1 / (x_i + y_j) with distinct x_i = data_shards + i and y_j = j
+  for(size_t i = 0; i < parity_shards_; ++i)
+  {
+    for(size_t j = 0; j < data_shards_; ++j)
+    {
+      const auto sum = static_cast<unsigned char>((data_shards_ + i) ^ j);
+      parity_matrix_[i * data_shards_ + j] = invert(sum);
+    }
+  }
+}
+
+size_t reed_solomon::get_data_shards() const
+{
+  return data_shards_;
+}
+
+size_t reed_solomon::get_parity_shards() const
+{
+  return parity_shards_;
+}
+
+void reed_solomon::encode(std::vector<std::vector<unsigned char>>& shards) const
+{
+  const auto size = shards.front().size();
+
+  for(size_t i = 0; i < parity_shards_; ++i)
+  {
+    auto& parity = shards[data_shards_ + i];
+    parity.assign(size, 0);
+
+    for(size_t j = 0; j < data_shards_; ++j)
+    {
+      multiply_add(parity.data(), shards[j].data(), parity_matrix_[i * data_shards_ + j], size);
+    }
+  }
+}
+
+bool reed_solomon::reconstruct(std::vector<std::vector<unsigned char>>& shards,
+                               const std::vector<bool>& present) const
+{
+  //data shards first, every one of them saves restoring it
+  std::vector<size_t> used;
+  std::vector<size_t> missing;
+
+  for(size_t i = 0; i < data_shards_ + parity_shards_ && used.size() < data_shards_; ++i)
+  {
+    if(present[i])
+    {
+      used.push_back(i);
+    }
+    else if(i < data_shards_)
+    {
+      missing.push_back(i);
+    }
+  }
+
+  if(used.size() < data_shards_)
+  {
+    return false;
+  }
+
+  if(missing.empty())
+  {
+    return true;
+  }
+
+  //rows of the encoding matrix that produced the used shards, inverted
+  //they turn the used shards back into the data shards
+  std::vector<unsigned char> matrix(data_shards_ * data_shards_, 0);
+
+  for(size_t row = 0; row < data_shards_; ++row)
+  {
+    const auto shard = used[row];
+
+    if(shard < data_shards_)
+    {
+      matrix[row * data_shards_ + shard] = 1;
+      continue;
+    }
+
+    std::copy_n(parity_matrix_.begin() + (shard - data_shards_) * data_shards_, data_shards_,
+                matrix.begin() + row * data_shards_);
+  }
+
+  invert_matrix(matrix, data_shards_);
+
+  const auto size = shards[used.front()].size();
+
+  for(const auto shard : missing)
+  {
+    auto& data = shards[shard];
+    data.assign(size, 0);
+
+    for(size_t i = 0; i < data_shards_; ++i)
+    {
+      multiply_add(data.data(), shards[used[i]].data(), matrix[shard * data_shards_ + i], size);
+    }
+  }
+
+  return true;
+}
+
+} //closing namespace mfsync
@@ -0,0 +1,149 @@
+#include "mfsync/file_descriptor.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "spdlog/spdlog.h"
+
+namespace mfsync
+{
+
+file_descriptor::file_descriptor(int fd)
+  : fd_(fd)
+{
+}
+
+file_descriptor::~file_descriptor()
+{
+  close();
+}
+
+file_descriptor::file_descriptor(file_descriptor&& other) noexcept
+  : fd_(other.fd_)
+{
+  other.fd_ = -1;
+}
+
+file_descriptor& file_descriptor::operator=(file_descriptor&& other) noexcept
+{
+  if(this != &other)
+  {
+    close();
+    fd_ = other.fd_;
+    other.fd_ = -1;
+  }
+
+  return *this;
+}
+
+std::optional<file_descriptor> file_descriptor::open(const std::filesystem::path& path, int flags, int mode /* = 0644 */)
+{
+  const int fd = ::open(path.c_str(), flags | O_CLOEXEC, mode);
+
+  if(fd < 0)
+  {
+    spdlog::debug("failed to open {}: {}", path.c_str(), std::strerror(errno));
+    return std::nullopt;
+  }
+
+  return file_descriptor{fd};
+}
+
+bool file_descriptor::is_open() const
+{
+  return fd_ >= 0;
+}
+
+int file_descriptor::get() const
+{
+  return fd_;
+}
+
+void file_descriptor::close()
+{
+  if(fd_ >= 0)
+  {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+size_t file_descriptor::read_at(void* data, size_t size, size_t offset) const
+{
+  auto* bytes = static_cast<unsigned char*>(data);
+  size_t read = 0;
+
+  while(read < size)
+  {
+    const auto result = ::pread(fd_, bytes + read, size - read, static_cast<off_t>(offset + read));
+
+    if(result < 0 && errno == EINTR)
+    {
+      continue;
+    }
+
+    if(result <= 0)
+    {
+      break;
+    }
+
+    read += result;
+  }
+
+  return read;
+}
+
+bool file_descriptor::write_at(const void* data, size_t size, size_t offset) const
+{
+  const auto* bytes = static_cast<const unsigned char*>(data);
+  size_t written = 0;
+
+  while(written < size)
+  {
+    const auto result = ::pwrite(fd_, bytes + written, size - written,
+                                 static_cast<off_t>(offset + written));
+
+    if(result < 0 && errno == EINTR)
+    {
+      continue;
+    }
+
+    if(result <= 0)
+    {
+      return false;
+    }
+
+    written += result;
+  }
+
+  return true;
+}
+
+bool file_descriptor::write_all(int fd, const void* data, size_t size)
+{
+  const auto* bytes = static_cast<const unsigned char*>(data);
+  size_t written = 0;
+
+  while(written < size)
+  {
+    const auto result = ::write(fd, bytes + written, size - written);
+
+    if(result < 0 && errno == EINTR)
+    {
+      continue;
+    }
+
+    if(result <= 0)
+    {
+      return false;
+    }
+
+    written += result;
+  }
+
+  return true;
+}
+
+} //closing namespace mfsync
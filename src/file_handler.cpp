@@ -1,6 +1,10 @@
 #include "mfsync/file_handler.h"
 
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "boost/lexical_cast.hpp"
 
@@ -8,6 +12,52 @@
 
 namespace mfsync
 {
+  namespace
+  {
+    bool is_written(const byte_ranges& written, size_t begin, size_t end)
+    {
+      return std::any_of(written.begin(), written.end(), [begin, end](const auto& range)
+      {
+        return range.first <= begin && end <= range.second;
+      });
+    }
+
+    //inserts [begin, end) and merges it with the ranges it touches
+    void add_written(byte_ranges& written, size_t begin, size_t end)
+    {
+      auto it = std::lower_bound(written.begin(), written.end(), std::make_pair(begin, end));
+      it = written.insert(it, {begin, end});
+
+      if(it != written.begin() && std::prev(it)->second >= it->first)
+      {
+        --it;
+        it->second = std::max(it->second, std::next(it)->second);
+        written.erase(std::next(it));
+      }
+
+      while(std::next(it) != written.end() && std::next(it)->first <= it->second)
+      {
+        it->second = std::max(it->second, std::next(it)->second);
+        written.erase(std::next(it));
+      }
+    }
+  } //closing anonymous namespace
+
+  file_handler::~file_handler()
+  {
+    {
+      std::scoped_lock lk{chunk_index_mutex_};
+      chunk_indexer_stopped_ = true;
+    }
+
+    cv_unindexed_files_.notify_all();
+
+    if(chunk_indexer_.joinable())
+    {
+      chunk_indexer_.join();
+    }
+  }
+
   void file_handler::init_storage(std::string storage_path)
   {
     if(!storage_path_.empty())
@@ -78,15 +128,16 @@ namespace mfsync
   {
     std::unique_lock lk{mutex_};
 
-    if(stored_files_.contains(file.file_info))
+    if(stored_files_.contains(file.file_info) && !is_update_internal(file.file_info.file_name))
     {
       return;
     }
 
-    const auto it_bool_pair = available_files_.insert(std::move(file));
+    add_source(file);
+    const auto inserted = insert_available_file(std::move(file));
     lk.unlock();
 
-    if(std::get<1>(it_bool_pair))
+    if(inserted)
     {
       cv_new_available_file_.notify_all();
     }
@@ -101,17 +152,16 @@ namespace mfsync
 
     for(const auto& avail : available)
     {
-      if(stored_files_.contains(avail.file_info))
+      if(stored_files_.contains(avail.file_info) && !is_update_internal(avail.file_info.file_name))
       {
         continue;
       }
 
-      const auto it_bool_pair = available_files_.insert(std::move(avail));
+      add_source(avail);
 
-      if(std::get<1>(it_bool_pair) && print_availables_)
+      if(insert_available_file(avail) && print_availables_)
       {
-        const auto& file_info = (*std::get<0>(it_bool_pair)).file_info;
-        spdlog::info("{}", file_info.file_name);
+        spdlog::info("{}", avail.file_info.file_name);
         changed = true;
       }
     }
@@ -145,7 +195,8 @@ namespace mfsync
 
   bool file_handler::in_progress(const available_file& file) const
   {
-    if(exists_internal(file.file_info) || is_blocked_internal(file.file_info))
+    if((exists_internal(file.file_info) && !is_update_internal(file.file_info.file_name))
+       || is_blocked_internal(file.file_info))
     {
       return true;
     }
@@ -153,10 +204,38 @@ namespace mfsync
     return false;
   }
 
+  std::vector<available_file> file_handler::get_sources(const file_information& file_info) const
+  {
+    std::scoped_lock lk{mutex_};
+    const auto it = sources_.find(file_info.file_name);
+
+    if(it == sources_.end())
+    {
+      return {};
+    }
+
+    std::vector<available_file> result;
+    std::copy_if(it->second.begin(), it->second.end(), std::back_inserter(result),
+                 [&file_info](const auto& source)
+                 {
+                   //a missing sha256sum doesnt rule a source out, the size has to match though.
+                   //hosts that are still receiving the file couldnt serve segments past their prefix
+                   const auto& sha256sum = source.file_info.sha256sum;
+                   return !source.partial && source.file_info == file_info
+                       && (!sha256sum.has_value() || !file_info.sha256sum.has_value()
+                           || sha256sum == file_info.sha256sum);
+                 });
+
+    return result;
+  }
+
   std::optional<mfsync::ofstream_wrapper> file_handler::create_file(requested_file& requested)
   {
     std::scoped_lock lk{mutex_};
-    if(exists_internal(requested.file_info) || is_blocked_internal(requested.file_info))
+    //an update is received next to the stored copy and replaces it once it is complete
+    const auto update = is_update_internal(requested.file_info.file_name);
+
+    if((exists_internal(requested.file_info) && !update) || is_blocked_internal(requested.file_info))
     {
       spdlog::debug("Tried creating existing or locked file");
       return std::nullopt;
@@ -168,7 +247,7 @@ namespace mfsync
       return std::nullopt;
     }
 
-    if(std::filesystem::exists(get_storage_path(requested.file_info)))
+    if(!update && std::filesystem::exists(get_storage_path(requested.file_info)))
     {
       spdlog::debug("Tried creating existing file that was not initialized yet");
       return std::nullopt;
@@ -177,10 +256,11 @@ namespace mfsync
     const auto tmp_path = get_tmp_path(requested.file_info);
     const auto file_exists = std::filesystem::exists(tmp_path);
 
-    if(file_exists)
+    if(!file_exists)
     {
-      requested.offset = std::filesystem::file_size(tmp_path);
-      spdlog::debug("setting offset to: {}", requested.offset);
+      //left over from a tmp file that was removed by someone else
+      remove_segment_journal(requested.file_info);
+      remove_resume_journal(requested.file_info);
     }
 
     auto tmp_path_without_filename = tmp_path;
@@ -194,6 +274,40 @@ namespace mfsync
       }
     }
 
+    //hashes the chunks of the received data, on a restart only the chunks that still match are kept
+    auto resume = resume_journal::open(get_resume_journal_path(requested.file_info), tmp_path,
+                                       requested.file_info);
+    const auto segments = file_exists ? load_segment_journal_internal(requested.file_info)
+                                      : std::nullopt;
+
+    if(segments.has_value())
+    {
+      //segmented downloads leave gaps, only the part before the first one is complete
+      const auto& written = segments.value();
+      const auto prefix = !written.empty() && written.front().first == 0 ? written.front().second : 0;
+      requested.offset = std::min(std::filesystem::file_size(tmp_path), prefix);
+      spdlog::debug("setting offset to: {}", requested.offset);
+    }
+    else if(file_exists)
+    {
+      //the tail after the verified chunks may be torn, it is fetched again
+      requested.offset = resume.get_verified();
+      std::error_code ec;
+      std::filesystem::resize_file(tmp_path, requested.offset, ec);
+
+      if(ec)
+      {
+        spdlog::error("Could not truncate {}: {}", tmp_path.c_str(), ec.message());
+        return std::nullopt;
+      }
+
+      spdlog::debug("setting offset to verified: {}", requested.offset);
+    }
+
+    //whoever the file is sent on to while it is received reads how far it got
+    auto verified = std::make_shared<std::atomic<size_t>>(0);
+    resume.set_progress(verified);
+
     ofstream_wrapper output(requested);
 
     if(file_exists)
@@ -211,34 +325,59 @@ namespace mfsync
       return std::nullopt;
     }
 
-    output.get_ofstream().seekp(requested.offset, output.get_ofstream().beg);
+    //large files get contiguous extents and a full disk is noticed before
+    //anything is transferred
+    if(!output.preallocate(requested.file_info.size))
+    {
+      output.close();
+
+      if(!file_exists)
+      {
+        std::error_code ec;
+        std::filesystem::remove(tmp_path, ec);
+        remove_resume_journal(requested.file_info);
+      }
+
+      return std::nullopt;
+    }
 
     auto token = std::make_shared<std::atomic<bool>>(true);
     output.set_token(token);
+    output.set_journal(std::move(resume));
     locked_files_.emplace_back(requested.file_info, std::move(token));
 
+    if(!update)
+    {
+      partial_files_[requested.file_info.file_name] = {requested.file_info, std::move(verified)};
+    }
+
     return output;
   }
 
   bool file_handler::finalize_file(const mfsync::file_information& file)
   {
-    std::scoped_lock lk{mutex_};
+    std::filesystem::path tmp_path;
 
-    if(exists_internal(file))
     {
-      spdlog::debug("tried finalizing file that already exists");
-      return false;
-    }
+      std::scoped_lock lk{mutex_};
 
-    if(!is_blocked_internal(file))
-    {
-      spdlog::debug("tried finalizing file that was not blocked");
-      return false;
-    }
+      if(exists_internal(file) && !is_update_internal(file.file_name))
+      {
+        spdlog::debug("tried finalizing file that already exists");
+        return false;
+      }
 
-    const auto tmp_path = get_tmp_path(file);
+      if(!is_blocked_internal(file))
+      {
+        spdlog::debug("tried finalizing file that was not blocked");
+        return false;
+      }
 
+      tmp_path = get_tmp_path(file);
+    }
 
+    //the tmp file is blocked, so it only changes through its own session. it
+    //is hashed and synced without mutex_, which other sessions need meanwhile
     if(finalize_with_shasum)
     {
       if(!file_information::compare_sha256sum(file, tmp_path))
@@ -249,17 +388,149 @@ namespace mfsync
       spdlog::debug("shasum256 of {} is correct.", file.file_name);
     }
 
+    //the file must not show up in the storage before its content is on disk
+    if(!sync_file(tmp_path))
+    {
+      return false;
+    }
+
+    std::scoped_lock lk{mutex_};
+
+    //the file may have been discarded while it was synced
+    if(!is_blocked_internal(file))
+    {
+      spdlog::debug("{} was discarded while it was finalized", file.file_name);
+      return false;
+    }
+
+    const auto update = is_update_internal(file.file_name);
+
     spdlog::debug("adding file to storage: {}", file.file_name);
+    sources_.erase(file.file_name);
+    partial_files_.erase(file.file_name);
     locked_files_.erase(std::remove_if(locked_files_.begin(), locked_files_.end(),
                         [&file](const auto& locked_file){ return file == locked_file.first; }),
                         locked_files_.end());
 
+    //replaces the stored copy of an update in one step
     std::filesystem::rename(tmp_path, get_storage_path(file));
+    remove_segment_journal(file);
+    remove_resume_journal(file);
+
+    if(update)
+    {
+      stored_files_.erase(file);
+      updated_files_.insert(file.file_name);
+    }
+
     add_stored_file(file, false);
     update_stored_files();
     return true;
   }
 
+  bool file_handler::finalize_file(const mfsync::file_information& file, ofstream_wrapper& output,
+                                   filetransfer::progress::file_progress_information* bar)
+  {
+    //finalizing needs the file to be still locked, so output is closed afterwards
+    const auto finalized = finalize_file(file);
+
+    if(!finalized)
+    {
+      spdlog::debug("finalizing {} failed", file.file_name);
+    }
+    else if(bar != nullptr)
+    {
+      bar->bytes_transferred = file.size;
+      bar->status = filetransfer::progress::STATUS::DONE;
+    }
+
+    output.close();
+    return finalized;
+  }
+
+  void file_handler::discard_file(const mfsync::file_information& file)
+  {
+    std::scoped_lock lk{mutex_};
+
+    spdlog::debug("discarding partially received file: {}", file.file_name);
+    partial_files_.erase(file.file_name);
+    locked_files_.erase(std::remove_if(locked_files_.begin(), locked_files_.end(),
+                        [&file](const auto& locked_file){ return file == locked_file.first; }),
+                        locked_files_.end());
+
+    std::error_code ec;
+    std::filesystem::remove(get_tmp_path(file), ec);
+
+    if(ec)
+    {
+      spdlog::error("Could not remove {}: {}", get_tmp_path(file).c_str(), ec.message());
+    }
+
+    remove_segment_journal(file);
+    remove_resume_journal(file);
+  }
+
+  byte_ranges file_handler::get_written_ranges(const file_information& file_info, size_t prefix) const
+  {
+    std::scoped_lock lk{mutex_};
+    return load_segment_journal_internal(file_info).value_or(byte_ranges{{0, prefix}});
+  }
+
+  bool file_handler::store_segment_journal(const file_information& file_info, const byte_ranges& written)
+  {
+    std::scoped_lock lk{mutex_};
+
+    if(!is_blocked_internal(file_info))
+    {
+      spdlog::debug("Tried storing segment journal of a file that was not created");
+      return false;
+    }
+
+    nlohmann::json j;
+    j["size"] = file_info.size;
+    j["written"] = written;
+
+    //the journal is replaced atomically, a crash leaves either the old or the new one
+    const auto journal_path = get_journal_path(file_info);
+    auto tmp_journal_path = journal_path;
+    tmp_journal_path += TMP_SUFFIX;
+
+    {
+      std::ofstream output{tmp_journal_path, std::ios::out | std::ios::trunc};
+      output << j.dump();
+
+      if(!output.flush())
+      {
+        spdlog::error("Could not write segment journal {}", tmp_journal_path.c_str());
+        return false;
+      }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_journal_path, journal_path, ec);
+
+    if(ec)
+    {
+      spdlog::error("Could not write segment journal {}: {}", journal_path.c_str(), ec.message());
+      return false;
+    }
+
+    return true;
+  }
+
+  bool file_handler::store_segment_journal(const file_information& file_info, const byte_ranges& written,
+                                           const file_descriptor& descriptor)
+  {
+    //the journal must not claim bytes that are not on disk yet
+    if(::fdatasync(descriptor.get()) != 0)
+    {
+      spdlog::error("Could not sync {}: {}", file_info.file_name, std::strerror(errno));
+      return false;
+    }
+
+    return store_segment_journal(file_info, written);
+  }
+
   std::optional<std::ifstream> file_handler::read_file(const file_information& file_info)
   {
     std::scoped_lock lk{mutex_};
@@ -284,6 +555,343 @@ namespace mfsync
     return Input;
   }
 
+  std::optional<file_descriptor> file_handler::open_file(const file_information& file_info)
+  {
+    std::scoped_lock lk{mutex_};
+
+    update_stored_files();
+    if(!exists_internal(file_info))
+    {
+      spdlog::debug("Tried opening nonexisting file");
+      return std::nullopt;
+    }
+
+    auto result = file_descriptor::open(get_storage_path(file_info), O_RDONLY);
+
+    if(!result.has_value())
+    {
+      spdlog::error("Failed to open file");
+      spdlog::error("{}",get_storage_path(file_info).c_str());
+    }
+
+    return result;
+  }
+
+  std::optional<file_descriptor> file_handler::open_tmp_file(const file_information& file_info)
+  {
+    std::scoped_lock lk{mutex_};
+
+    if(!is_blocked_internal(file_info))
+    {
+      spdlog::debug("Tried opening tmp file of a file that was not created");
+      return std::nullopt;
+    }
+
+    auto result = file_descriptor::open(get_tmp_path(file_info), O_WRONLY);
+
+    if(!result.has_value())
+    {
+      spdlog::error("Failed to open tmp file");
+      spdlog::error("{}",get_tmp_path(file_info).c_str());
+    }
+
+    return result;
+  }
+
+  void file_handler::relay_partial_files(bool value)
+  {
+    std::scoped_lock lk{mutex_};
+    relay_partial_files_ = value;
+  }
+
+  file_handler::stored_files file_handler::get_partial_files()
+  {
+    std::scoped_lock lk{mutex_};
+    stored_files result;
+
+    if(!relay_partial_files_)
+    {
+      return result;
+    }
+
+    //the lock of a file is also given up by closing it without finalizing or discarding it
+    std::erase_if(partial_files_, [this](const auto& partial)
+    {
+      return !is_blocked_internal(partial.second.file_info);
+    });
+
+    for(const auto& [file_name, partial] : partial_files_)
+    {
+      if(partial.verified->load() > 0)
+      {
+        result.insert(partial.file_info);
+      }
+    }
+
+    return result;
+  }
+
+  std::optional<file_descriptor> file_handler::open_partial_file(const file_information& file_info)
+  {
+    std::scoped_lock lk{mutex_};
+
+    if(find_partial_file(file_info) == nullptr)
+    {
+      spdlog::debug("Tried opening {} which isnt received at the moment", file_info.file_name);
+      return std::nullopt;
+    }
+
+    auto result = file_descriptor::open(get_tmp_path(file_info), O_RDONLY);
+
+    if(!result.has_value())
+    {
+      spdlog::error("Failed to open tmp file");
+      spdlog::error("{}",get_tmp_path(file_info).c_str());
+    }
+
+    return result;
+  }
+
+  std::optional<size_t> file_handler::get_relayable_size(const file_information& file_info) const
+  {
+    std::scoped_lock lk{mutex_};
+
+    //the tmp file was renamed into the storage, descriptors of it see the whole file
+    if(exists_internal(file_info) && !is_update_internal(file_info.file_name))
+    {
+      return file_info.size;
+    }
+
+    const auto* partial = find_partial_file(file_info);
+
+    if(partial == nullptr)
+    {
+      return std::nullopt;
+    }
+
+    return partial->verified->load();
+  }
+
+  const file_handler::partial_file* file_handler::find_partial_file(const file_information& file_info) const
+  {
+    const auto it = partial_files_.find(file_info.file_name);
+
+    if(!relay_partial_files_ || it == partial_files_.end() || !(it->second.file_info == file_info)
+       || !is_blocked_internal(file_info))
+    {
+      return nullptr;
+    }
+
+    return &it->second;
+  }
+
+  void file_handler::request_updates(std::vector<std::string> file_names)
+  {
+    std::scoped_lock lk{mutex_};
+    update_prefixes_ = std::move(file_names);
+  }
+
+  bool file_handler::is_update(const std::string& file_name) const
+  {
+    std::scoped_lock lk{mutex_};
+    return is_update_internal(file_name);
+  }
+
+  std::optional<file_descriptor> file_handler::open_basis(const file_information& file_info)
+  {
+    std::scoped_lock lk{mutex_};
+
+    if(!is_update_internal(file_info.file_name))
+    {
+      return std::nullopt;
+    }
+
+    auto result = file_descriptor::open(get_storage_path(file_info), O_RDONLY);
+
+    if(!result.has_value())
+    {
+      spdlog::debug("Could not open stored copy of {}, fetching it in full", file_info.file_name);
+    }
+
+    return result;
+  }
+
+  byte_ranges file_handler::copy_stored_chunks(const file_information& file_info,
+                                               const std::vector<content_chunk>& chunks,
+                                               byte_ranges written)
+  {
+    auto tmp_file = open_tmp_file(file_info);
+
+    if(!tmp_file.has_value())
+    {
+      return written;
+    }
+
+    //the locations are looked up first, the index isnt locked while the
+    //chunks are read and written
+    std::vector<std::pair<const content_chunk*, chunk_index::location>> found;
+
+    {
+      std::scoped_lock lk{chunk_index_mutex_};
+
+      for(const auto& chunk : chunks)
+      {
+        if(chunk.offset + chunk.length > file_info.size
+           || is_written(written, chunk.offset, chunk.offset + chunk.length))
+        {
+          continue;
+        }
+
+        auto location = chunk_index_.find(chunk.hash);
+
+        if(location.has_value() && location.value().length == chunk.length)
+        {
+          found.emplace_back(&chunk, std::move(location.value()));
+        }
+      }
+    }
+
+    std::map<std::string, file_descriptor, std::less<>> sources;
+    //stored files that are gone and the ones that changed since they were chunked
+    std::set<std::string, std::less<>> missing;
+    std::set<std::string, std::less<>> outdated;
+    std::vector<unsigned char> buffer(MAX_CONTENT_CHUNK_SIZE);
+    size_t copied = 0;
+
+    for(const auto& [chunk, location] : found)
+    {
+      const auto& source_name = location.file_name;
+
+      if(missing.contains(source_name) || outdated.contains(source_name))
+      {
+        continue;
+      }
+
+      auto source = sources.find(source_name);
+
+      if(source == sources.end())
+      {
+        auto descriptor = file_descriptor::open(get_storage_path({.file_name = source_name}), O_RDONLY);
+
+        if(!descriptor.has_value())
+        {
+          missing.insert(source_name);
+          continue;
+        }
+
+        source = sources.emplace(source_name, std::move(descriptor.value())).first;
+      }
+
+      const auto read = source->second.read_at(buffer.data(), chunk->length, location.offset);
+
+      if(read != chunk->length
+         || get_content_hash(buffer.data(), chunk->length) != chunk->hash)
+      {
+        spdlog::debug("chunk index of {} is outdated", source_name);
+        outdated.insert(source_name);
+        sources.erase(source);
+        continue;
+      }
+
+      if(!tmp_file.value().write_at(buffer.data(), chunk->length, chunk->offset))
+      {
+        spdlog::error("Could not write to tmp file of {}: {}", file_info.file_name, std::strerror(errno));
+        break;
+      }
+
+      add_written(written, chunk->offset, chunk->offset + chunk->length);
+      copied += chunk->length;
+    }
+
+    if(!missing.empty() || !outdated.empty())
+    {
+      std::scoped_lock lk{chunk_index_mutex_};
+
+      for(const auto& source_name : missing)
+      {
+        chunk_index_.remove_file(source_name);
+      }
+
+      //the stored files that changed are chunked again
+      for(const auto& source_name : outdated)
+      {
+        chunk_index_.remove_file(source_name);
+        unindexed_files_.push_back({.file_name = source_name});
+      }
+
+      cv_unindexed_files_.notify_one();
+    }
+
+    spdlog::debug("copied {} bytes of {} from stored files", copied, file_info.file_name);
+    return written;
+  }
+
+  void file_handler::index_chunks(bool value)
+  {
+    std::scoped_lock lk{chunk_index_mutex_};
+    index_chunks_ = value;
+
+    if(index_chunks_ && !chunk_indexer_.joinable())
+    {
+      chunk_indexer_ = std::thread{[this]() { update_chunk_index(); }};
+    }
+  }
+
+  void file_handler::add_unindexed_file(file_information file)
+  {
+    {
+      std::scoped_lock lk{chunk_index_mutex_};
+
+      if(!index_chunks_)
+      {
+        return;
+      }
+
+      unindexed_files_.push_back(std::move(file));
+    }
+
+    cv_unindexed_files_.notify_one();
+  }
+
+  void file_handler::update_chunk_index()
+  {
+    std::unique_lock lk{chunk_index_mutex_};
+
+    while(true)
+    {
+      cv_unindexed_files_.wait(lk, [this]() { return chunk_indexer_stopped_ || !unindexed_files_.empty(); });
+
+      if(chunk_indexer_stopped_)
+      {
+        return;
+      }
+
+      const auto file_info = std::move(unindexed_files_.front());
+      unindexed_files_.pop_front();
+      lk.unlock();
+
+      //the size of a file that is queued again after it changed is unknown
+      const auto path = get_storage_path(file_info);
+      std::error_code ec;
+      const auto size = std::filesystem::file_size(path, ec);
+      auto descriptor = file_descriptor::open(path, O_RDONLY);
+      std::optional<std::vector<content_chunk>> chunks;
+
+      if(!ec && descriptor.has_value())
+      {
+        chunks = chunk_file(descriptor.value(), size);
+      }
+
+      lk.lock();
+
+      if(chunks.has_value())
+      {
+        chunk_index_.add_file(file_info.file_name, chunks.value());
+        spdlog::debug("chunk index holds {} chunks", chunk_index_.size());
+      }
+    }
+  }
+
   void file_handler::print_availables(bool value)
   {
       print_availables_ = value;
@@ -296,6 +904,82 @@ namespace mfsync
     return tmp_path;
   }
 
+  std::filesystem::path file_handler::get_journal_path(const file_information& file_info) const
+  {
+    auto journal_path = storage_path_;
+    journal_path /= std::string{file_info.file_name + JOURNAL_SUFFIX}.c_str();
+    return journal_path;
+  }
+
+  std::optional<byte_ranges> file_handler::load_segment_journal_internal(const file_information& file_info) const
+  {
+    const auto journal_path = get_journal_path(file_info);
+
+    if(!std::filesystem::exists(journal_path))
+    {
+      return std::nullopt;
+    }
+
+    try
+    {
+      std::ifstream input{journal_path};
+      const auto j = nlohmann::json::parse(input);
+
+      if(j.at("size").get<size_t>() != file_info.size)
+      {
+        spdlog::debug("segment journal of {} belongs to another version", file_info.file_name);
+        return std::nullopt;
+      }
+
+      auto written = j.at("written").get<byte_ranges>();
+      std::sort(written.begin(), written.end());
+      return written;
+    }
+    catch(std::exception& er)
+    {
+      spdlog::debug("Could not read segment journal of {}: {}", file_info.file_name, er.what());
+    }
+
+    return std::nullopt;
+  }
+
+  void file_handler::remove_segment_journal(const file_information& file_info)
+  {
+    std::error_code ec;
+    std::filesystem::remove(get_journal_path(file_info), ec);
+  }
+
+  std::filesystem::path file_handler::get_resume_journal_path(const file_information& file_info) const
+  {
+    auto journal_path = storage_path_;
+    journal_path /= std::string{file_info.file_name + RESUME_JOURNAL_SUFFIX}.c_str();
+    return journal_path;
+  }
+
+  void file_handler::remove_resume_journal(const file_information& file_info)
+  {
+    std::error_code ec;
+    std::filesystem::remove(get_resume_journal_path(file_info), ec);
+  }
+
+  bool file_handler::sync_file(const std::filesystem::path& path)
+  {
+    auto descriptor = file_descriptor::open(path, O_RDONLY);
+
+    if(!descriptor.has_value())
+    {
+      return false;
+    }
+
+    if(::fdatasync(descriptor.value().get()) != 0)
+    {
+      spdlog::error("Could not sync {}: {}", path.c_str(), std::strerror(errno));
+      return false;
+    }
+
+    return true;
+  }
+
   std::filesystem::path file_handler::get_storage_path(const file_information& file_info) const
   {
     auto tmp_path = storage_path_;
@@ -412,7 +1096,8 @@ namespace mfsync
   bool file_handler::is_tmp_file(const std::filesystem::path& path) const
   {
     const auto file_name = path.string();
-    return file_name.ends_with(TMP_SUFFIX);
+    return file_name.ends_with(TMP_SUFFIX) || file_name.ends_with(JOURNAL_SUFFIX)
+        || file_name.ends_with(RESUME_JOURNAL_SUFFIX);
   }
 
   void file_handler::update_available_files()
@@ -446,9 +1131,53 @@ namespace mfsync
     {
       spdlog::debug("adding file to storage: {} - size: {}", (*std::get<0>(result)).file_name,
                                                              (*std::get<0>(result)).size);
+      add_unindexed_file(*std::get<0>(result));
     }
   }
 
+  void file_handler::add_source(const available_file& file)
+  {
+    auto& sources = sources_[file.file_info.file_name];
+    const auto known = std::find_if(sources.begin(), sources.end(), [&file](const auto& source)
+    {
+      return source.public_key == file.public_key
+          && source.source_address == file.source_address
+          && source.source_port == file.source_port
+          && source.file_info == file.file_info;
+    });
+
+    if(known == sources.end())
+    {
+      sources.push_back(file);
+    }
+    else if(known->partial && !file.partial)
+    {
+      //the host finished receiving the file meanwhile
+      known->partial = false;
+    }
+  }
+
+  bool file_handler::insert_available_file(available_file file)
+  {
+    const auto it = available_files_.find(file.file_info.file_name);
+
+    if(it == available_files_.end())
+    {
+      available_files_.insert(std::move(file));
+      return true;
+    }
+
+    //a host that has the whole file is preferred over one that is still receiving it
+    if(it->partial && !file.partial)
+    {
+      available_files_.erase(it);
+      available_files_.insert(std::move(file));
+      return true;
+    }
+
+    return false;
+  }
+
   bool file_handler::stored_file_exists(const file_information& file) const
   {
     std::scoped_lock lk{mutex_};
@@ -498,4 +1227,15 @@ namespace mfsync
     return stored_files_.contains(file_info);
   }
 
+  bool file_handler::is_update_internal(const std::string& file_name) const
+  {
+    if(updated_files_.contains(file_name) || !exists_internal(file_name))
+    {
+      return false;
+    }
+
+    return std::any_of(update_prefixes_.begin(), update_prefixes_.end(),
+                       [&file_name](const auto& prefix){ return file_name.starts_with(prefix); });
+  }
+
 } //closing namespace mfsync
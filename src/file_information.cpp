@@ -3,7 +3,7 @@
 #include <fstream>
 
 #include "spdlog/spdlog.h"
-#include "openssl/sha.h"
+#include "mfsync/sha256.h"
 
 namespace mfsync
 {
@@ -62,27 +62,16 @@ std::optional<std::string> file_information::get_sha256sum(const std::filesystem
     return std::nullopt;
   }
 
-  SHA256_CTX sha256;
-  SHA256_Init(&sha256);
+  mfsync::sha256 hasher;
 
   std::array<char, 0x8012> input_buffer;
   while(file.peek() != EOF)
   {
     const auto bytes_read = file.readsome(input_buffer.data(), input_buffer.size());
-    SHA256_Update(&sha256, input_buffer.data(), bytes_read);
+    hasher.update(input_buffer.data(), bytes_read);
   }
 
-  std::array<uint8_t, SHA256_DIGEST_LENGTH> hash;
-  SHA256_Final(hash.data(), &sha256);
-
-  std::array<char, 65> output_buffer;
-  for(int i = 0; i < SHA256_DIGEST_LENGTH; ++i)
-  {
-      std::sprintf(output_buffer.data() + (i * 2), "%02x", hash[i]);
-  }
-  output_buffer[64] = 0;
-
-  return std::string{output_buffer.data(), 64};
+  return hasher.finalize();
 }
 
 bool file_information::compare_sha256sum(const file_information& file, const std::filesystem::path& path)
@@ -111,5 +100,4 @@ bool file_information::compare_sha256sum(const file_information& file, const std
   return true;
 }
 
-
 } //closing namespace mfsync
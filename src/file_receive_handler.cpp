@@ -53,6 +53,12 @@ void file_receive_handler::get_files()
 {
   std::scoped_lock lk{mutex_};
 
+  if(output_ != nullptr)
+  {
+    stream_file();
+    return;
+  }
+
   if(std::none_of(sessions_.begin(), sessions_.end(), [](const auto& session_ptr)
     { return session_ptr.expired();}))
   {
@@ -84,7 +90,8 @@ void file_receive_handler::get_files()
 
   //clean files_to_request
   files_to_request_.erase(std::remove_if(files_to_request_.begin(), files_to_request_.end(),
-                      [this](const auto& sha256sum){ return file_handler_.is_stored(sha256sum); }),
+                      [this](const auto& sha256sum)
+                      { return file_handler_.is_stored(sha256sum) && !file_handler_.is_update(sha256sum); }),
                       files_to_request_.end());
 
   static bool promise_is_set = false;
@@ -98,6 +105,51 @@ void file_receive_handler::get_files()
   wait();
 }
 
+void file_receive_handler::set_output(mfsync::stream_output* output)
+{
+  output_ = output;
+  //the file is received in order over a single connection
+  sessions_.resize(1);
+}
+
+void file_receive_handler::stream_file()
+{
+  if(output_->is_done())
+  {
+    promise_.set_value();
+    return;
+  }
+
+  if(!request_queue_.empty() || !sessions_.front().expired())
+  {
+    wait();
+    return;
+  }
+
+  if(output_requested_)
+  {
+    //the session ended without receiving the whole file
+    spdlog::error("streaming {} was aborted", files_to_request_.front());
+    output_->finish(false);
+    promise_.set_value();
+    return;
+  }
+
+  const auto& availables = file_handler_.get_available_files();
+  const auto it = std::find_if(availables.begin(), availables.end(), [this](const auto& available)
+    { return available.file_info.file_name == files_to_request_.front(); });
+
+  if(it != availables.end())
+  {
+    spdlog::debug("streaming {} from {}", it->file_info.file_name, it->public_key);
+    output_requested_ = true;
+    request_queue_.push_back(*it);
+    start_new_session();
+  }
+
+  wait();
+}
+
 void file_receive_handler::fill_request_queue()
 {
   const auto& availables = file_handler_.get_available_files();
@@ -125,6 +177,23 @@ void file_receive_handler::enable_tls(const std::string& cert_file)
   ctx_.value().load_verify_file(cert_file);
 }
 
+void file_receive_handler::set_options(const mfsync::filetransfer::transfer_options& options)
+{
+  options_ = options;
+
+  using mfsync::filetransfer::uring_context;
+  if(options_.engine == mfsync::filetransfer::io_engine::IO_URING && uring_ == nullptr)
+  {
+    //received chunks go to the session buffers, no registered buffers needed
+    uring_ = uring_context::create(io_context_.get_executor(), uring_context::DEFAULT_ENTRIES, 0, 0);
+
+    if(uring_ == nullptr)
+    {
+      spdlog::info("io_uring is not available, falling back to asio");
+    }
+  }
+}
+
 void file_receive_handler::start_new_session()
 {
   std::for_each(sessions_.begin(), sessions_.end(), [this](auto& session_ptr)
@@ -155,6 +224,12 @@ void file_receive_handler::start_new_session()
 
     session_ptr = session;
     session->set_progress(progress_);
+    session->set_options(options_);
+    session->set_uring(uring_.get());
+    session->set_limiter(limiter_);
+    session->set_downloads(&downloads_);
+    session->set_output(output_);
+    session->set_workers(&workers_);
     session->start_request();
   });
 }
@@ -169,6 +244,12 @@ void file_receive_handler::add_to_request_queue(available_file file)
     return;
   }
 
+  //updates are rebuilt from the stored copy over a single stream
+  if(!file_handler_.is_update(file.file_info.file_name) && add_segmented_download(file))
+  {
+    return;
+  }
+
   if(file_handler_.in_progress(file))
   {
     return;
@@ -178,6 +259,53 @@ void file_receive_handler::add_to_request_queue(available_file file)
   request_queue_.push_back(std::move(file));
 }
 
+bool file_receive_handler::add_segmented_download(const available_file& file)
+{
+  using mfsync::filetransfer::segmented_download;
+  auto download = downloads_.find(file.file_info.file_name);
+
+  const auto connections = std::max<size_t>(options_.connections_per_file, 1);
+
+  if(download == nullptr)
+  {
+    if(file.file_info.size < segmented_download::MIN_FILE_SIZE
+       || file_handler_.in_progress(file)
+       || file_handler_.get_sources(file.file_info).size() * connections < 2)
+    {
+      return false;
+    }
+
+    download = segmented_download::create(file_handler_, file.file_info, progress_);
+
+    if(download == nullptr)
+    {
+      return false;
+    }
+
+    downloads_.add(download);
+  }
+  else if(!download->has_unassigned())
+  {
+    //all segments are being fetched, sessions continue with the file on their own
+    return true;
+  }
+
+  //every entry becomes a session of its own that fetches segments until
+  //none are left, so a host gets one connection per entry
+  for(const auto& source : file_handler_.get_sources(download->get_file_info()))
+  {
+    spdlog::debug("adding source {} of {} to request queue", source.public_key,
+                  source.file_info.file_name);
+
+    for(size_t i = 0; i < connections; ++i)
+    {
+      request_queue_.push_back(source);
+    }
+  }
+
+  return true;
+}
+
 void file_receive_handler::wait()
 {
   timer_.expires_from_now(boost::posix_time::milliseconds(50));
@@ -42,6 +42,11 @@ namespace mfsync::multicast
     socket_.set_option(option);
   }
 
+  void file_sender::set_socket_tuning(const mfsync::socket_tuning& tuning)
+  {
+    mfsync::apply_socket_tuning(socket_.native_handle(), tuning, false);
+  }
+
   void file_sender::handle_send_to(const boost::system::error_code& error)
   {
     if(!error)
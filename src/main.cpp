@@ -1,8 +1,11 @@
 #include <ifaddrs.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <boost/bind.hpp>
 #include <boost/program_options.hpp>
+#include <csignal>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <thread>
@@ -16,8 +19,13 @@
 #include "mfsync/file_sender.h"
 #include "mfsync/help_messages.h"
 #include "mfsync/misc.h"
+#include "mfsync/multicast_transfer.h"
 #include "mfsync/protocol.h"
+#include "mfsync/rate_limiter.h"
 #include "mfsync/server.h"
+#include "mfsync/stream_output.h"
+#include "mfsync/transfer_options.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/spdlog.h"
 
 namespace po = boost::program_options;
@@ -49,6 +57,46 @@ inline std::vector<boost::asio::ip::address> get_ip_addresses_by_interface_name(
   return result;
 }
 
+// reads the bandwidth limits from the config file, limits given on the command
+// line take precedence. called again on SIGHUP so limits can be changed while
+// transfers are running
+inline mfsync::filetransfer::rate_limits load_rate_limits(
+    const std::filesystem::path& config_file, const po::variables_map& vm) {
+  mfsync::filetransfer::rate_limits limits;
+
+  if (std::filesystem::exists(config_file)) {
+    try {
+      std::ifstream ifs(config_file);
+      const auto j = nlohmann::json::parse(ifs);
+      limits.upload = j.value("uploadRate", size_t{0});
+      limits.download = j.value("downloadRate", size_t{0});
+      limits.peer_upload = j.value("peerUploadRate", size_t{0});
+      limits.peer_download = j.value("peerDownloadRate", size_t{0});
+    } catch (std::exception& er) {
+      spdlog::error("Json Error while reading rate limits from {}: {}",
+                    config_file.string(), er.what());
+    }
+  }
+
+  if (vm.count("max-upload-rate")) {
+    limits.upload = vm["max-upload-rate"].as<size_t>();
+  }
+
+  if (vm.count("max-download-rate")) {
+    limits.download = vm["max-download-rate"].as<size_t>();
+  }
+
+  if (vm.count("peer-upload-rate")) {
+    limits.peer_upload = vm["peer-upload-rate"].as<size_t>();
+  }
+
+  if (vm.count("peer-download-rate")) {
+    limits.peer_download = vm["peer-download-rate"].as<size_t>();
+  }
+
+  return limits;
+}
+
 int main(int argc, char** argv) {
   po::options_description description("");
 
@@ -86,6 +134,78 @@ int main(int argc, char** argv) {
       "paths to file containing all trusted certificates")(
       "wait-until,w", po::value<int>(),
       "stop program execution after the given amount of seconds.")(
+      "stdout", "get only: write the single requested file to stdout as it "
+      "is received instead of storing it. logs go to stderr")(
+      "offset", po::value<size_t>(),
+      "with --stdout: first byte of the file that is written. default is 0")(
+      "length", po::value<size_t>(),
+      "with --stdout: amount of bytes that are written. 0 writes up to the "
+      "end of the file, default is 0")(
+      "delta", "get only: fetch the given files again even if they are "
+      "stored already. only the blocks that changed are transferred, the "
+      "stored copy is replaced once the new version is complete")(
+      "no-compression", "dont compress file bodies before encrypting them. "
+      "by default zstd or lz4 is used if both hosts support it")(
+      "dedup", "ask for the content defined chunks of large files first and "
+      "only fetch the ones that arent in any stored file. the stored files "
+      "are indexed in the background when mfsync starts")(
+      "multicast", "send files of at least 8 MiB to the multicast group "
+      "once for all hosts that fetch them at the same time, and ask for "
+      "files to be sent that way. lost packets are restored from parity "
+      "packets, what is still missing is fetched from the host")(
+      "multicast-rate", po::value<size_t>(),
+      "bytes per second all files sent to the multicast group take "
+      "together. default is 33554432")(
+      "max-chunksize", po::value<size_t>(),
+      "largest chunk in bytes used for file transfers. chunks grow up to "
+      "this size on fast links. default is 4194304")(
+      "pipeline-depth", po::value<size_t>(),
+      "amount of chunks that are read and encrypted ahead while sending a "
+      "file, including the one on the wire. default is 4")(
+      "pipeline-max-bytes", po::value<size_t>(),
+      "upper bound for the bytes buffered by the read ahead while sending a "
+      "file. default is 16777216")(
+      "max-streams", po::value<size_t>(),
+      "amount of files requested concurrently over one connection to a "
+      "host. default is 4")(
+      "connections", po::value<size_t>(),
+      "amount of parallel connections used to fetch disjoint segments of a "
+      "large file from one host. default is 1")(
+      "streaming-threshold", po::value<size_t>(),
+      "files of at least this many bytes are sent without keeping them in "
+      "the page cache, so they dont evict the files other hosts fetch. 0 "
+      "disables it. default is 1073741824")(
+      "io-engine", po::value<std::string>(),
+      "backend for file reads and socket transfers: asio, io_uring or mmap. "
+      "io_uring falls back to asio if it is unavailable. mmap encrypts "
+      "files straight from a memory mapping. default is asio")(
+      "io-uring-buffers", po::value<size_t>(),
+      "amount of registered io_uring buffers of --max-chunksize bytes each "
+      "used for file reads. default is 16")(
+      "crypto-threads", po::value<size_t>(),
+      "threads that encrypt and decrypt the records of large chunks in "
+      "parallel, besides the one that sends or receives the chunk. 0 handles "
+      "them one after another. default is the amount of cores minus one")(
+      "max-upload-rate", po::value<size_t>(),
+      "bytes per second sent to all hosts together. 0 is unlimited, "
+      "default is 0")(
+      "max-download-rate", po::value<size_t>(),
+      "bytes per second received from all hosts together. 0 is unlimited, "
+      "default is 0")(
+      "peer-upload-rate", po::value<size_t>(),
+      "bytes per second sent to a single host. 0 is unlimited, default is "
+      "0")(
+      "peer-download-rate", po::value<size_t>(),
+      "bytes per second received from a single host. 0 is unlimited, "
+      "default is 0")(
+      "socket-option", po::value<std::vector<std::string>>()->multitoken(),
+      "socket options as role.option=value. roles are server, client and "
+      "discovery, options are send_buffer, receive_buffer, no_delay, cork, "
+      "congestion, keepalive, keepalive_idle, keepalive_interval, "
+      "keepalive_count and tos. e.g. server.send_buffer=8388608")(
+      "plaintext-peers", po::value<std::vector<std::string>>()->multitoken(),
+      "public keys of peers that exchange file bodies unencrypted. only use "
+      "this on trusted networks, both sides have to list each other")(
       "trusted-keys", po::value<std::vector<std::string>>()->multitoken(),
       "Manual specify trusted keys")(
       "outbound-addresses,a",
@@ -119,6 +239,13 @@ int main(int argc, char** argv) {
 
     po::notify(vm);
 
+    const bool to_stdout = vm.count("stdout");
+
+    if (to_stdout) {
+      // stdout carries the file, nothing else may end up there
+      spdlog::set_default_logger(spdlog::stderr_color_mt("mfsync"));
+    }
+
     if (vm.count("version")) {
       std::cout << "mfsync v" << mfsync::protocol::VERSION << '\n';
       return 0;
@@ -182,6 +309,9 @@ int main(int argc, char** argv) {
       }
     }
 
+    std::vector<std::string> plaintext_peers;
+    nlohmann::json socket_config = nlohmann::json::object();
+
     if(std::filesystem::exists(config_file)) {
       try
       {
@@ -194,6 +324,14 @@ int main(int argc, char** argv) {
             crypto_handler->add_allowed_key(key);
           }
         }
+
+        if(j.contains("plaintextPeers")) {
+          plaintext_peers = j.at("plaintextPeers").get<std::vector<std::string>>();
+        }
+
+        if(j.contains("sockets")) {
+          socket_config = j.at("sockets");
+        }
       }
       catch(std::exception& er)
       {
@@ -221,7 +359,10 @@ int main(int argc, char** argv) {
     } else if (vm.count("verbose")) {
       spdlog::set_level(spdlog::level::debug);
     } else {
-      progress_handler->start();
+      if (!to_stdout) {
+        progress_handler->start();
+      }
+
       spdlog::set_pattern(std::string{mfsync::protocol::MFSYNC_LOG_PREFIX} +
                           "%v");
     }
@@ -345,8 +486,37 @@ int main(int argc, char** argv) {
     std::vector<std::string> target_files{};
     if (vm.count("destination")) {
       target_files = vm["destination"].as<std::vector<std::string>>();
-      destination_path = target_files.back();
-      target_files.pop_back();
+
+      // streamed files arent stored, so there is no destination folder
+      if (!to_stdout) {
+        destination_path = target_files.back();
+        target_files.pop_back();
+      }
+    }
+
+    std::unique_ptr<mfsync::stream_output> output = nullptr;
+
+    if (to_stdout) {
+      if (mode != operation_mode::GET || target_files.size() != 1) {
+        spdlog::error("--stdout needs mode get and exactly one file. aborting.");
+        return -1;
+      }
+
+      // a consumer that exits early makes writes fail instead of killing us
+      std::signal(SIGPIPE, SIG_IGN);
+      output = std::make_unique<mfsync::stream_output>(
+          STDOUT_FILENO, vm.count("offset") ? vm["offset"].as<size_t>() : 0,
+          vm.count("length") ? vm["length"].as<size_t>() : 0);
+    } else if (vm.count("offset") || vm.count("length")) {
+      spdlog::error("--offset and --length need --stdout. aborting.");
+      return -1;
+    }
+
+    const bool update = vm.count("delta");
+
+    if (update && (mode != operation_mode::GET || to_stdout || target_files.empty())) {
+      spdlog::error("--delta needs mode get and the files to update. aborting.");
+      return -1;
     }
 
     std::string client_tls_path;
@@ -368,18 +538,158 @@ int main(int argc, char** argv) {
       server_tls_paths = std::make_pair(file_paths.at(0), file_paths.at(1));
     }
 
+    mfsync::filetransfer::transfer_options transfer_options;
+
+    if (vm.count("max-chunksize")) {
+      const auto max_chunksize = vm["max-chunksize"].as<size_t>();
+
+      if (max_chunksize < mfsync::protocol::MIN_CHUNKSIZE ||
+          max_chunksize > mfsync::protocol::MAX_CHUNKSIZE) {
+        spdlog::error("--max-chunksize has to be between {} and {}. aborting.",
+                      mfsync::protocol::MIN_CHUNKSIZE,
+                      mfsync::protocol::MAX_CHUNKSIZE);
+        return -1;
+      }
+
+      transfer_options.max_chunksize = max_chunksize;
+      transfer_options.initial_chunksize =
+          std::min(transfer_options.initial_chunksize, max_chunksize);
+    }
+
+    if (vm.count("pipeline-depth")) {
+      transfer_options.pipeline_depth = vm["pipeline-depth"].as<size_t>();
+
+      if (transfer_options.pipeline_depth == 0) {
+        spdlog::error("--pipeline-depth has to be at least 1. aborting.");
+        return -1;
+      }
+    }
+
+    if (vm.count("pipeline-max-bytes")) {
+      transfer_options.max_pipeline_bytes = vm["pipeline-max-bytes"].as<size_t>();
+    }
+
+    if (vm.count("max-streams")) {
+      transfer_options.max_streams = vm["max-streams"].as<size_t>();
+
+      if (transfer_options.max_streams == 0) {
+        spdlog::error("--max-streams has to be at least 1. aborting.");
+        return -1;
+      }
+    }
+
+    if (vm.count("connections")) {
+      transfer_options.connections_per_file = vm["connections"].as<size_t>();
+
+      if (transfer_options.connections_per_file == 0) {
+        spdlog::error("--connections has to be at least 1. aborting.");
+        return -1;
+      }
+    }
+
+    if (vm.count("streaming-threshold")) {
+      transfer_options.streaming_threshold = vm["streaming-threshold"].as<size_t>();
+    }
+
+    if (vm.count("plaintext-peers")) {
+      const auto& peers = vm["plaintext-peers"].as<std::vector<std::string>>();
+      plaintext_peers.insert(plaintext_peers.end(), peers.begin(), peers.end());
+    }
+
+    transfer_options.plaintext_peers = std::move(plaintext_peers);
+
+    if (vm.count("io-engine")) {
+      const auto engine =
+          mfsync::filetransfer::get_io_engine(vm["io-engine"].as<std::string>());
+
+      if (!engine.has_value()) {
+        spdlog::error("--io-engine has to be asio, io_uring or mmap. aborting.");
+        return -1;
+      }
+
+      transfer_options.engine = engine.value();
+    }
+
+    if (vm.count("io-uring-buffers")) {
+      transfer_options.uring_buffers = vm["io-uring-buffers"].as<size_t>();
+    }
+
+    // the pool is handed down to the handlers of every session
+    auto crypto_threads =
+        static_cast<size_t>(std::max(std::thread::hardware_concurrency(), 1u) - 1);
+
+    if (vm.count("crypto-threads")) {
+      crypto_threads = vm["crypto-threads"].as<size_t>();
+    }
+
+    crypto_handler->set_pool(std::make_shared<mfsync::crypto::crypto_pool>(crypto_threads));
+
+    if (vm.count("socket-option")) {
+      for (const auto& option : vm["socket-option"].as<std::vector<std::string>>()) {
+        if (!mfsync::add_socket_option(socket_config, option)) {
+          spdlog::error("invalid --socket-option {}. aborting.", option);
+          return -1;
+        }
+      }
+    }
+
+    try {
+      transfer_options.sockets = socket_config.get<mfsync::socket_options>();
+    } catch (std::exception& er) {
+      spdlog::error("invalid socket options: {}", er.what());
+      return -1;
+    }
+
+    // replication done by sync yields to hosts that are waiting for a get
+    transfer_options.background = mode == operation_mode::SYNC;
+    transfer_options.compression = !vm.count("no-compression");
+    transfer_options.dedup = vm.count("dedup");
+    transfer_options.multicast = vm.count("multicast");
+
+    if (vm.count("multicast-rate")) {
+      transfer_options.multicast_rate = vm["multicast-rate"].as<size_t>();
+
+      if (transfer_options.multicast_rate == 0) {
+        spdlog::error("--multicast-rate has to be at least 1. aborting.");
+        return -1;
+      }
+    }
+
     boost::asio::io_context io_service;
+
+    mfsync::filetransfer::rate_limiter limiter{load_rate_limits(config_file, vm)};
+    boost::asio::signal_set reload_signals{io_service, SIGHUP};
+    std::function<void()> wait_for_reload = [&]() {
+      reload_signals.async_wait(
+          [&](boost::system::error_code const& ec, int) {
+            if (ec) {
+              return;
+            }
+
+            spdlog::info("reloading rate limits from {}", config_file.string());
+            limiter.set_limits(load_rate_limits(config_file, vm));
+            wait_for_reload();
+          });
+    };
+    wait_for_reload();
+
     std::unique_ptr<mfsync::multicast::file_fetcher> fetcher = nullptr;
     std::vector<std::unique_ptr<mfsync::multicast::file_sender>> sender_vec;
     std::unique_ptr<mfsync::file_receive_handler> receiver = nullptr;
     std::unique_ptr<mfsync::filetransfer::server> file_server = nullptr;
+    std::unique_ptr<mfsync::multicast::file_caster> caster = nullptr;
 
     auto file_handler = mfsync::file_handler{};
     file_handler.set_progress(progress_handler.get());
+    // replicas pass files on while they still receive them, so a file moves
+    // through a chain of hosts without waiting for it to complete at every hop
+    file_handler.relay_partial_files(mode == operation_mode::SYNC);
+    // the chunks of the storage are indexed before manifests are asked for
+    file_handler.index_chunks(transfer_options.dedup && output == nullptr);
 
     std::thread storage_initialization_thread;
 
-    if (mode != operation_mode::FETCH) {
+    if (mode != operation_mode::FETCH && output == nullptr) {
       storage_initialization_thread =
           std::thread{[&file_handler, &destination_path]() {
             file_handler.init_storage(destination_path);
@@ -406,6 +716,7 @@ int main(int argc, char** argv) {
           }
         }
 
+        sender->set_socket_tuning(transfer_options.sockets.discovery);
         sender->init();
         sender_vec.push_back(std::move(sender));
       }
@@ -419,6 +730,26 @@ int main(int argc, char** argv) {
       }
 
       file_server->set_progress(progress_handler.get());
+      file_server->set_options(transfer_options);
+      file_server->set_limiter(&limiter);
+
+      if (transfer_options.multicast) {
+        caster = std::make_unique<mfsync::multicast::file_caster>(
+            io_service, multicast_address, mfsync::protocol::MULTICAST_DATA_PORT,
+            file_handler);
+
+        // casts leave through the first interface announcements are sent on
+        if (!outbound_addresses.empty() && outbound_addresses.front().is_v4() &&
+            !outbound_addresses.front().is_unspecified()) {
+          caster->set_outbound_interface(outbound_addresses.front().to_v4());
+        }
+
+        caster->set_socket_tuning(transfer_options.sockets.discovery);
+        caster->set_rate(transfer_options.multicast_rate);
+        caster->set_limiter(&limiter);
+        file_server->set_caster(caster.get());
+      }
+
       file_server->run();
     }
 
@@ -426,6 +757,7 @@ int main(int argc, char** argv) {
       fetcher = std::make_unique<mfsync::multicast::file_fetcher>(
           io_service, multicast_listen_address, multicast_address,
           multicast_port, &file_handler, *crypto_handler.get());
+      fetcher->set_socket_tuning(transfer_options.sockets.discovery);
     }
 
     if (mode != operation_mode::SHARE && mode != operation_mode::FETCH) {
@@ -438,6 +770,10 @@ int main(int argc, char** argv) {
           io_service, file_handler, concurrent_downloads, *crypto_handler.get(),
           progress_handler.get());
 
+      if (update) {
+        file_handler.request_updates(target_files);
+      }
+
       if (!target_files.empty()) {
         receiver->set_files(std::move(target_files));
       }
@@ -446,6 +782,13 @@ int main(int argc, char** argv) {
         receiver->enable_tls(client_tls_path);
       }
 
+      receiver->set_options(transfer_options);
+      receiver->set_limiter(&limiter);
+
+      if (output != nullptr) {
+        receiver->set_output(output.get());
+      }
+
       receiver->get_files();
     }
 
@@ -495,6 +838,10 @@ int main(int argc, char** argv) {
 
     spdlog::debug("stopped...");
 
+    if (output != nullptr && (!output->is_done() || output->failed())) {
+      return 1;
+    }
+
   } catch (std::exception& e) {
     std::cout << e.what() << "\n";
   }
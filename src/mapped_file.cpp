@@ -0,0 +1,100 @@
+#include "mfsync/mapped_file.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spdlog/spdlog.h"
+
+namespace mfsync
+{
+
+mapped_file::mapped_file(void* data, size_t size)
+  : data_(data)
+  , size_(size)
+{
+}
+
+mapped_file::~mapped_file()
+{
+  unmap();
+}
+
+mapped_file::mapped_file(mapped_file&& other) noexcept
+  : data_(other.data_)
+  , size_(other.size_)
+{
+  other.data_ = nullptr;
+  other.size_ = 0;
+}
+
+mapped_file& mapped_file::operator=(mapped_file&& other) noexcept
+{
+  if(this != &other)
+  {
+    unmap();
+    data_ = other.data_;
+    size_ = other.size_;
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+
+  return *this;
+}
+
+std::optional<mapped_file> mapped_file::map(const file_descriptor& descriptor)
+{
+  struct stat file_stat{};
+
+  if(::fstat(descriptor.get(), &file_stat) != 0)
+  {
+    spdlog::debug("failed to stat file for mapping: {}", std::strerror(errno));
+    return std::nullopt;
+  }
+
+  //empty files cant be mapped, there is nothing to read from them anyway
+  if(file_stat.st_size == 0)
+  {
+    return mapped_file{};
+  }
+
+  const auto size = static_cast<size_t>(file_stat.st_size);
+  void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, descriptor.get(), 0);
+
+  if(data == MAP_FAILED)
+  {
+    spdlog::debug("failed to map file: {}", std::strerror(errno));
+    return std::nullopt;
+  }
+
+  ::madvise(data, size, MADV_SEQUENTIAL);
+  return mapped_file{data, size};
+}
+
+bool mapped_file::is_mapped() const
+{
+  return data_ != nullptr;
+}
+
+const unsigned char* mapped_file::data() const
+{
+  return static_cast<const unsigned char*>(data_);
+}
+
+size_t mapped_file::size() const
+{
+  return size_;
+}
+
+void mapped_file::unmap()
+{
+  if(data_ != nullptr)
+  {
+    ::munmap(data_, size_);
+    data_ = nullptr;
+    size_ = 0;
+  }
+}
+
+} //closing namespace mfsync
@@ -0,0 +1,690 @@
+#include "mfsync/multicast_transfer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <random>
+
+#include "spdlog/spdlog.h"
+
+#include "mfsync/protocol.h"
+
+namespace mfsync::multicast
+{
+
+namespace
+{
+  //end packets are sent several times, a lost one would leave the receivers
+  //waiting for the idle timeout
+  constexpr int END_PACKET_COPIES = 3;
+  //blocks that still wait for shards, older ones are left to the next round
+  constexpr size_t MAX_PENDING_BLOCKS = 64;
+
+  void write_be(unsigned char* out, uint64_t value, size_t size)
+  {
+    for(size_t i = 0; i < size; ++i)
+    {
+      out[i] = static_cast<unsigned char>(value >> (8 * (size - 1 - i)));
+    }
+  }
+
+  uint64_t read_be(const unsigned char* data, size_t size)
+  {
+    uint64_t value = 0;
+    for(size_t i = 0; i < size; ++i)
+    {
+      value = value << 8 | data[i];
+    }
+
+    return value;
+  }
+
+  size_t get_block_size(const cast_offer& offer)
+  {
+    return offer.symbol_size * offer.data_shards;
+  }
+
+  uint32_t get_block_count(const cast_offer& offer, size_t file_size)
+  {
+    const auto block_size = get_block_size(offer);
+    return static_cast<uint32_t>((file_size + block_size - 1) / block_size);
+  }
+} //closing anonymous namespace
+
+packet_header_bytes create_packet_header(const packet_header& header)
+{
+  packet_header_bytes result;
+  write_be(result.data(), header.transfer_id, sizeof(uint32_t));
+  write_be(result.data() + 4, header.round, sizeof(uint16_t));
+  write_be(result.data() + 6, header.block, sizeof(uint32_t));
+  result[10] = header.shard;
+  result[11] = static_cast<unsigned char>(header.type);
+  return result;
+}
+
+std::optional<packet_header> get_packet_header(const unsigned char* data, size_t size)
+{
+  if(size < PACKET_HEADER_SIZE || data[11] > static_cast<unsigned char>(packet_type::END))
+  {
+    return std::nullopt;
+  }
+
+  return packet_header{ .transfer_id = static_cast<uint32_t>(read_be(data, sizeof(uint32_t))),
+                        .round = static_cast<uint16_t>(read_be(data + 4, sizeof(uint16_t))),
+                        .block = static_cast<uint32_t>(read_be(data + 6, sizeof(uint32_t))),
+                        .shard = data[10],
+                        .type = static_cast<packet_type>(data[11]) };
+}
+
+bool is_valid_cast_offer(const cast_offer& offer)
+{
+  boost::system::error_code ec;
+  const auto address = boost::asio::ip::make_address(offer.address, ec);
+
+  return !ec && address.is_multicast() && offer.port != 0
+      && offer.symbol_size > 0 && offer.symbol_size <= MAX_CAST_SYMBOL_SIZE
+      && reed_solomon::is_valid(offer.data_shards, offer.parity_shards);
+}
+
+file_caster::file_caster(boost::asio::io_context& io_context,
+                         const boost::asio::ip::address& multicast_address,
+                         unsigned short port,
+                         file_handler& handler)
+  : io_context_(io_context)
+  , endpoint_(multicast_address, port)
+  , socket_(io_context, endpoint_.protocol())
+  , file_handler_(handler)
+  , shards_(CAST_DATA_SHARDS + CAST_PARITY_SHARDS)
+  , read_buffer_(CAST_DATA_SHARDS * CAST_SYMBOL_SIZE)
+  , packet_(PACKET_HEADER_SIZE + CAST_SYMBOL_SIZE + crypto::group_cipher::TAG_SIZE)
+{
+  //receivers tell casts apart by their id, it shouldnt repeat after a restart
+  next_transfer_id_ = std::random_device{}();
+}
+
+void file_caster::set_outbound_interface(const boost::asio::ip::address_v4& address)
+{
+  boost::asio::ip::multicast::outbound_interface option(address);
+  socket_.set_option(option);
+}
+
+void file_caster::set_socket_tuning(const mfsync::socket_tuning& tuning)
+{
+  mfsync::apply_socket_tuning(socket_.native_handle(), tuning, false);
+}
+
+void file_caster::set_rate(size_t rate)
+{
+  std::scoped_lock lk{mutex_};
+  pace_.set_rate(rate);
+}
+
+std::optional<cast_offer> file_caster::join(const file_information& file_info)
+{
+  std::scoped_lock lk{mutex_};
+  const auto it = casts_.find(file_info.file_name);
+
+  if(it != casts_.end() && it->second->file_info == file_info)
+  {
+    auto& current = *it->second;
+
+    //whoever joins after the first block missed part of the round
+    if(current.block > 0)
+    {
+      current.rerun = true;
+    }
+
+    return current.offer;
+  }
+
+  if(it != casts_.end())
+  {
+    spdlog::debug("another version of {} is cast already", file_info.file_name);
+    return std::nullopt;
+  }
+
+  auto descriptor = file_handler_.open_file(file_info);
+
+  if(!descriptor.has_value())
+  {
+    return std::nullopt;
+  }
+
+  auto current = std::make_shared<cast>(io_context_);
+  current->file_info = file_info;
+  current->descriptor = std::move(descriptor.value());
+  current->cipher = crypto::group_cipher::generate();
+  current->offer = { .transfer_id = next_transfer_id_++,
+                     .address = endpoint_.address().to_string(),
+                     .port = endpoint_.port(),
+                     .key = current->cipher->get_encoded_key(),
+                     .symbol_size = CAST_SYMBOL_SIZE,
+                     .data_shards = CAST_DATA_SHARDS,
+                     .parity_shards = CAST_PARITY_SHARDS };
+  current->blocks = get_block_count(current->offer, file_info.size);
+
+  spdlog::debug("casting {} as transfer {}", file_info.file_name, current->offer.transfer_id);
+  casts_.emplace(file_info.file_name, current);
+  schedule(current, CAST_START_DELAY);
+  return current->offer;
+}
+
+void file_caster::schedule(const cast_ptr& current, std::chrono::steady_clock::duration delay)
+{
+  current->timer.expires_after(delay);
+  current->timer.async_wait([this, current](const boost::system::error_code& error)
+  {
+    send_next(current, error);
+  });
+}
+
+void file_caster::send_next(const cast_ptr& current, const boost::system::error_code& error)
+{
+  if(error)
+  {
+    spdlog::debug("cast of {} was aborted: {}", current->file_info.file_name, error.message());
+    return;
+  }
+
+  size_t sent = 0;
+  auto delay = filetransfer::token_bucket::clock::duration::zero();
+
+  {
+    std::scoped_lock lk{mutex_};
+
+    if(current->block < current->blocks)
+    {
+      sent = send_block(*current);
+
+      if(sent == 0)
+      {
+        spdlog::error("Could not read {} while casting it", current->file_info.file_name);
+        send_end(*current, false);
+        casts_.erase(current->file_info.file_name);
+        return;
+      }
+    }
+    else
+    {
+      const bool more = current->rerun && current->round + 1 < MAX_CAST_ROUNDS;
+      send_end(*current, more);
+
+      if(!more)
+      {
+        spdlog::debug("done casting {}", current->file_info.file_name);
+        casts_.erase(current->file_info.file_name);
+        return;
+      }
+
+      ++current->round;
+      current->block = 0;
+      current->rerun = false;
+    }
+
+    delay = pace_.reserve(sent, filetransfer::priority::INTERACTIVE,
+                          filetransfer::token_bucket::clock::now());
+  }
+
+  if(limiter_ != nullptr)
+  {
+    delay = std::max(delay, limiter_->reserve(filetransfer::direction::UPLOAD, "multicast", sent,
+                                              filetransfer::priority::INTERACTIVE));
+  }
+
+  schedule(current, delay);
+}
+
+size_t file_caster::send_block(cast& current)
+{
+  const auto block_size = get_block_size(current.offer);
+  const auto offset = static_cast<size_t>(current.block) * block_size;
+  const auto size = std::min(block_size, current.file_info.size - offset);
+
+  if(current.descriptor.read_at(read_buffer_.data(), size, offset) != size)
+  {
+    return 0;
+  }
+
+  //the tail of the last block is padded, receivers know where the file ends
+  std::fill(read_buffer_.begin() + size, read_buffer_.end(), 0);
+
+  for(size_t i = 0; i < CAST_DATA_SHARDS; ++i)
+  {
+    const auto* symbol = read_buffer_.data() + i * CAST_SYMBOL_SIZE;
+    shards_[i].assign(symbol, symbol + CAST_SYMBOL_SIZE);
+  }
+
+  code_.encode(shards_);
+  size_t sent = 0;
+
+  for(size_t i = 0; i < shards_.size(); ++i)
+  {
+    sent += send_packet(current, { .transfer_id = current.offer.transfer_id,
+                                   .round = current.round,
+                                   .block = current.block,
+                                   .shard = static_cast<uint8_t>(i) },
+                        shards_[i].data(), shards_[i].size());
+  }
+
+  ++current.block;
+  //a packet the socket couldnt take is a lost packet, the block still counts
+  return std::max<size_t>(sent, 1);
+}
+
+void file_caster::send_end(cast& current, bool more)
+{
+  const unsigned char payload = more ? 1 : 0;
+
+  for(int i = 0; i < END_PACKET_COPIES; ++i)
+  {
+    send_packet(current, { .transfer_id = current.offer.transfer_id,
+                           .round = current.round,
+                           .block = current.blocks,
+                           .shard = static_cast<uint8_t>(i),
+                           .type = packet_type::END },
+                &payload, sizeof(payload));
+  }
+}
+
+size_t file_caster::send_packet(cast& current, const packet_header& header,
+                                const unsigned char* data, size_t size)
+{
+  const auto header_bytes = create_packet_header(header);
+  std::copy(header_bytes.begin(), header_bytes.end(), packet_.begin());
+  current.cipher->encrypt(header_bytes.data(), header_bytes.data(), header_bytes.size(),
+                          data, size, packet_.data() + PACKET_HEADER_SIZE);
+
+  const auto packet_size = PACKET_HEADER_SIZE + size + crypto::group_cipher::TAG_SIZE;
+  boost::system::error_code ec;
+  socket_.send_to(boost::asio::buffer(packet_.data(), packet_size), endpoint_, 0, ec);
+
+  if(ec)
+  {
+    spdlog::trace("sending cast packet failed: {}", ec.message());
+    return 0;
+  }
+
+  return packet_size;
+}
+
+std::shared_ptr<cast_receiver> cast_receiver::create(boost::asio::io_context& io_context,
+                                                     file_handler& handler,
+                                                     filetransfer::download_registry& downloads,
+                                                     filetransfer::progress_handler* progress,
+                                                     const cast_offer& offer,
+                                                     const file_information& file_info,
+                                                     ofstream_wrapper output,
+                                                     const byte_ranges& written)
+{
+  if(!is_valid_cast_offer(offer))
+  {
+    spdlog::debug("received invalid cast offer for {}", file_info.file_name);
+    return nullptr;
+  }
+
+  auto cipher = crypto::group_cipher::create(offer.key);
+  auto descriptor = handler.open_tmp_file(file_info);
+
+  if(cipher == nullptr || !descriptor.has_value())
+  {
+    return nullptr;
+  }
+
+  std::shared_ptr<cast_receiver> result{
+      new cast_receiver(io_context, handler, downloads, progress, offer, file_info,
+                        std::move(output), std::move(descriptor.value()), std::move(cipher))};
+
+  //several casts are received on the same port, each socket gets every packet
+  const boost::asio::ip::udp::endpoint listen_endpoint(
+      boost::asio::ip::make_address(protocol::MULTICAST_LISTEN_ADDRESS), offer.port);
+  auto& socket = result->socket_;
+
+  try
+  {
+    socket.open(listen_endpoint.protocol());
+    socket.set_option(boost::asio::ip::udp::socket::reuse_address(true));
+    socket.bind(listen_endpoint);
+    socket.set_option(
+        boost::asio::ip::multicast::join_group(boost::asio::ip::make_address(offer.address)));
+  }
+  catch (std::exception& e)
+  {
+    spdlog::error("Could not join cast of {}: {}", file_info.file_name, e.what());
+    return nullptr;
+  }
+
+  const auto block_size = get_block_size(offer);
+
+  //blocks that were received before dont have to be restored again
+  for(const auto& [begin, end] : written)
+  {
+    if(begin >= end)
+    {
+      continue;
+    }
+
+    const auto first = (begin + block_size - 1) / block_size;
+    for(auto block = first; block < result->done_.size(); ++block)
+    {
+      const auto block_end = std::min((block + 1) * block_size, file_info.size);
+
+      if(block_end > end)
+      {
+        break;
+      }
+
+      result->done_[block] = true;
+      ++result->blocks_done_;
+    }
+
+    result->written_.emplace_back(begin, end);
+  }
+
+  if(progress != nullptr)
+  {
+    result->bar_ = progress->create_file_progress(file_info);
+    result->bar_->status = filetransfer::progress::STATUS::DOWNLOADING;
+  }
+
+  return result;
+}
+
+cast_receiver::cast_receiver(boost::asio::io_context& io_context, file_handler& handler,
+                             filetransfer::download_registry& downloads,
+                             filetransfer::progress_handler* progress, const cast_offer& offer,
+                             const file_information& file_info, ofstream_wrapper output,
+                             file_descriptor descriptor,
+                             std::unique_ptr<crypto::group_cipher> cipher)
+  : file_handler_(handler)
+  , downloads_(downloads)
+  , progress_(progress)
+  , offer_(offer)
+  , file_info_(file_info)
+  , output_(std::move(output))
+  , descriptor_(std::move(descriptor))
+  , cipher_(std::move(cipher))
+  , code_(offer.data_shards, offer.parity_shards)
+  , socket_(io_context)
+  , idle_timer_(io_context)
+  , last_packet_(std::chrono::steady_clock::now())
+  , done_(get_block_count(offer, file_info.size), false)
+  , packet_(PACKET_HEADER_SIZE + offer.symbol_size + crypto::group_cipher::TAG_SIZE)
+  , plain_(offer.symbol_size)
+  , block_buffer_(get_block_size(offer))
+{
+}
+
+void cast_receiver::start()
+{
+  std::scoped_lock lk{mutex_};
+
+  if(blocks_done_ == done_.size())
+  {
+    finish();
+    return;
+  }
+
+  spdlog::debug("receiving cast {} of {}", offer_.transfer_id, file_info_.file_name);
+  //the cast starts after a delay, nothing may arrive until then
+  last_packet_ = std::chrono::steady_clock::now() + CAST_START_DELAY;
+  receive();
+  wait_idle();
+}
+
+void cast_receiver::receive()
+{
+  socket_.async_receive_from(
+      boost::asio::buffer(packet_), sender_endpoint_,
+      [me = shared_from_this()](const boost::system::error_code& error, size_t size)
+      {
+        me->handle_receive(error, size);
+      });
+}
+
+void cast_receiver::handle_receive(const boost::system::error_code& error, size_t size)
+{
+  std::scoped_lock lk{mutex_};
+
+  if(finished_)
+  {
+    return;
+  }
+
+  if(error)
+  {
+    spdlog::debug("receiving cast of {} failed: {}", file_info_.file_name, error.message());
+    finish();
+    return;
+  }
+
+  handle_packet(size);
+
+  if(!finished_)
+  {
+    receive();
+  }
+}
+
+void cast_receiver::handle_packet(size_t size)
+{
+  const auto header = get_packet_header(packet_.data(), size);
+
+  //other casts share the group and the port
+  if(!header.has_value() || header.value().transfer_id != offer_.transfer_id
+     || size < PACKET_HEADER_SIZE + crypto::group_cipher::TAG_SIZE)
+  {
+    return;
+  }
+
+  const auto text_size = size - PACKET_HEADER_SIZE - crypto::group_cipher::TAG_SIZE;
+
+  if(text_size > plain_.size()
+     || !cipher_->decrypt(packet_.data(), packet_.data(), PACKET_HEADER_SIZE,
+                          packet_.data() + PACKET_HEADER_SIZE, size - PACKET_HEADER_SIZE,
+                          plain_.data()))
+  {
+    spdlog::debug("dropping cast packet of {} that failed authentication", file_info_.file_name);
+    return;
+  }
+
+  last_packet_ = std::chrono::steady_clock::now();
+
+  if(header.value().type == packet_type::END)
+  {
+    if(text_size == 1 && plain_.front() == 0)
+    {
+      finish();
+    }
+    return;
+  }
+
+  add_shard(header.value(), plain_.data(), text_size);
+}
+
+void cast_receiver::add_shard(const packet_header& header, const unsigned char* data, size_t size)
+{
+  const auto shards = offer_.data_shards + offer_.parity_shards;
+
+  if(header.block >= done_.size() || header.shard >= shards || size != offer_.symbol_size
+     || done_[header.block])
+  {
+    return;
+  }
+
+  auto it = pending_.find(header.block);
+
+  if(it == pending_.end())
+  {
+    if(pending_.size() >= MAX_PENDING_BLOCKS)
+    {
+      pending_.erase(pending_.begin());
+    }
+
+    it = pending_.emplace(header.block, block_state{}).first;
+    it->second.shards.resize(shards);
+    it->second.present.resize(shards, false);
+  }
+
+  auto& state = it->second;
+
+  if(state.present[header.shard])
+  {
+    //the same shard of another round
+    return;
+  }
+
+  state.shards[header.shard].assign(data, data + size);
+  state.present[header.shard] = true;
+
+  if(++state.count < offer_.data_shards)
+  {
+    return;
+  }
+
+  if(!write_block(header.block, state))
+  {
+    finish();
+    return;
+  }
+
+  pending_.erase(it);
+
+  if(blocks_done_ == done_.size())
+  {
+    finish();
+  }
+}
+
+bool cast_receiver::write_block(uint32_t block, block_state& state)
+{
+  //can only fail with less than data_shards shards
+  code_.reconstruct(state.shards, state.present);
+
+  const auto block_size = get_block_size(offer_);
+  const auto offset = static_cast<size_t>(block) * block_size;
+  const auto size = std::min(block_size, file_info_.size - offset);
+
+  for(size_t i = 0; i < offer_.data_shards; ++i)
+  {
+    std::copy(state.shards[i].begin(), state.shards[i].end(),
+              block_buffer_.begin() + i * offer_.symbol_size);
+  }
+
+  if(!descriptor_.write_at(block_buffer_.data(), size, offset))
+  {
+    spdlog::error("Could not write to {}: {}", file_info_.file_name, std::strerror(errno));
+    return false;
+  }
+
+  done_[block] = true;
+  ++blocks_done_;
+
+  if(bar_ != nullptr)
+  {
+    bar_->bytes_transferred = std::min(blocks_done_ * block_size, file_info_.size);
+  }
+
+  return true;
+}
+
+void cast_receiver::wait_idle()
+{
+  idle_timer_.expires_at(last_packet_ + CAST_IDLE_TIMEOUT);
+  idle_timer_.async_wait([me = shared_from_this()](const boost::system::error_code& error)
+  {
+    me->handle_idle(error);
+  });
+}
+
+void cast_receiver::handle_idle(const boost::system::error_code& error)
+{
+  std::scoped_lock lk{mutex_};
+
+  if(error || finished_)
+  {
+    return;
+  }
+
+  if(std::chrono::steady_clock::now() < last_packet_ + CAST_IDLE_TIMEOUT)
+  {
+    wait_idle();
+    return;
+  }
+
+  spdlog::debug("cast of {} went quiet", file_info_.file_name);
+  finish();
+}
+
+void cast_receiver::finish()
+{
+  finished_ = true;
+  pending_.clear();
+
+  boost::system::error_code ec;
+  socket_.close(ec);
+  idle_timer_.cancel();
+
+  if(blocks_done_ == done_.size())
+  {
+    spdlog::debug("received cast of {}", file_info_.file_name);
+
+    descriptor_.close();
+    file_handler_.finalize_file(file_info_, output_, bar_);
+    return;
+  }
+
+  spdlog::debug("cast of {} ended with {} of {} blocks, fetching the rest from its hosts",
+                file_info_.file_name, blocks_done_, done_.size());
+
+  file_handler_.store_segment_journal(file_info_, get_written(), descriptor_);
+  descriptor_.close();
+  output_.close();
+
+  //the segmented download shows the progress from here on
+  if(bar_ != nullptr)
+  {
+    bar_->status = filetransfer::progress::STATUS::DONE;
+  }
+
+  //the receive handler queues the hosts of the file for the segments that are left
+  const auto download = filetransfer::segmented_download::create(file_handler_, file_info_,
+                                                                 progress_);
+
+  if(download != nullptr)
+  {
+    downloads_.add(download);
+  }
+}
+
+byte_ranges cast_receiver::get_written() const
+{
+  auto ranges = written_;
+  const auto block_size = get_block_size(offer_);
+
+  for(size_t block = 0; block < done_.size(); ++block)
+  {
+    if(done_[block])
+    {
+      ranges.emplace_back(block * block_size,
+                          std::min((block + 1) * block_size, file_info_.size));
+    }
+  }
+
+  std::sort(ranges.begin(), ranges.end());
+  byte_ranges result;
+
+  for(const auto& range : ranges)
+  {
+    if(!result.empty() && range.first <= result.back().second)
+    {
+      result.back().second = std::max(result.back().second, range.second);
+      continue;
+    }
+
+    result.push_back(range);
+  }
+
+  return result;
+}
+
+} //closing namespace mfsync::multicast
@@ -1,5 +1,12 @@
 #include "mfsync/ofstream_wrapper.h"
 
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "spdlog/spdlog.h"
+
 namespace mfsync
 {
 
@@ -10,49 +17,131 @@ ofstream_wrapper::ofstream_wrapper(const requested_file& file)
 
 ofstream_wrapper::~ofstream_wrapper()
 {
+  close();
+}
+
+ofstream_wrapper& ofstream_wrapper::operator=(ofstream_wrapper&& other)
+{
+  if(this != &other)
+  {
+    //release the file this wrapper held so far
+    close();
+    descriptor_ = std::move(other.descriptor_);
+    buffer_ = std::move(other.buffer_);
+    buffer_offset_ = other.buffer_offset_;
+    writeback_offset_ = other.writeback_offset_;
+    writeback_size_ = other.writeback_size_;
+    failed_ = other.failed_;
+    requested_file_ = std::move(other.requested_file_);
+    journal_ = std::move(other.journal_);
+    write_token_ = std::move(other.write_token_);
+  }
+
+  return *this;
+}
+
+void ofstream_wrapper::close()
+{
+  //the buffer has to reach the file before others may use it
+  flush();
+
   if(auto shared_token = write_token_.lock())
   {
     *shared_token.get() = false;
   }
 
-  ofstream_.close();
+  write_token_.reset();
+  descriptor_.close();
 }
 
 bool ofstream_wrapper::operator!() const
 {
-  return !ofstream_;
+  return !descriptor_.is_open() || failed_;
 }
 
 void ofstream_wrapper::open(const std::string& filename, std::ios_base::openmode mode /* = ios_base::out */)
 {
-  ofstream_.open(filename.c_str(), mode);
+  open(filename.c_str(), mode);
 }
 
 void ofstream_wrapper::open(const char *filename, std::ios_base::openmode mode /* = ios_base::out */)
 {
-  ofstream_.open(filename, mode);
-}
+  //same semantics as std::ofstream, without in the file gets truncated
+  int flags = O_WRONLY;
 
-void ofstream_wrapper::write(const char* s, std::streamsize count, size_t offset /* = 0 */)
-{
-  ofstream_.seekp(offset);
-  ofstream_.write(s, count);
-  ofstream_.flush();
+  if(!(mode & std::ios_base::in) || (mode & std::ios_base::trunc))
+  {
+    flags |= O_CREAT | O_TRUNC;
+  }
+
+  auto descriptor = file_descriptor::open(filename, flags);
+  descriptor_ = descriptor.has_value() ? std::move(descriptor.value()) : file_descriptor{};
+  buffer_.clear();
+  failed_ = false;
 }
 
-void ofstream_wrapper::write(const char* chunk)
+bool ofstream_wrapper::write(const char* s, std::streamsize count, size_t offset /* = 0 */)
 {
-  write(chunk, requested_file_.chunksize, 0);
+  if(!buffer_.empty() && offset != buffer_offset_ + buffer_.size())
+  {
+    //not continuing the buffered data, so it cant be merged
+    if(!write_buffer())
+    {
+      return false;
+    }
+  }
+
+  if(buffer_.empty())
+  {
+    buffer_.reserve(WRITE_BEHIND_SIZE);
+    buffer_offset_ = offset;
+  }
+
+  buffer_.insert(buffer_.end(), s, s + count);
+
+  if(buffer_.size() >= WRITE_BEHIND_SIZE)
+  {
+    return write_buffer();
+  }
+
+  return !failed_;
 }
 
-std::ofstream::traits_type::pos_type ofstream_wrapper::tellp()
+bool ofstream_wrapper::flush()
 {
-  return ofstream_.tellp();
+  return write_buffer();
 }
 
-void ofstream_wrapper::flush()
+bool ofstream_wrapper::preallocate(size_t size)
 {
-  ofstream_.flush();
+#ifdef FALLOC_FL_KEEP_SIZE
+  if(size == 0)
+  {
+    return true;
+  }
+
+  //the file size is left alone, it still tells how much of a file was received
+  while(::fallocate(descriptor_.get(), FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) != 0)
+  {
+    if(errno == EINTR)
+    {
+      continue;
+    }
+
+    if(errno == EOPNOTSUPP || errno == ENOSYS)
+    {
+      spdlog::debug("Cant preallocate {}, it grows while being received",
+                    requested_file_.file_info.file_name);
+      return true;
+    }
+
+    spdlog::error("Could not preallocate {} bytes for {}: {}", size,
+                  requested_file_.file_info.file_name, std::strerror(errno));
+    return false;
+  }
+#endif
+
+  return true;
 }
 
 void ofstream_wrapper::set_token(std::weak_ptr<std::atomic<bool>> token)
@@ -60,9 +149,55 @@ void ofstream_wrapper::set_token(std::weak_ptr<std::atomic<bool>> token)
   write_token_ = token;
 }
 
-std::ofstream& ofstream_wrapper::get_ofstream()
+void ofstream_wrapper::set_journal(resume_journal journal)
+{
+  journal_ = std::move(journal);
+}
+
+bool ofstream_wrapper::write_buffer()
+{
+  if(buffer_.empty() || !descriptor_.is_open())
+  {
+    return !failed_;
+  }
+
+  if(!descriptor_.write_at(buffer_.data(), buffer_.size(), buffer_offset_))
+  {
+    spdlog::error("Could not write to {}: {}", requested_file_.file_info.file_name,
+                  std::strerror(errno));
+    failed_ = true;
+    buffer_.clear();
+    return false;
+  }
+
+  start_writeback(buffer_offset_, buffer_.size());
+  //the hashes may get ahead of the disk, resuming checks them against it
+  journal_.update(buffer_offset_, buffer_.data(), buffer_.size());
+  buffer_.clear();
+  return !failed_;
+}
+
+void ofstream_wrapper::start_writeback(size_t offset, size_t size)
 {
-  return ofstream_;
+#ifdef SYNC_FILE_RANGE_WRITE
+  //only full buffers are worth it, small files are left to the kernel
+  if(size < WRITE_BEHIND_SIZE)
+  {
+    return;
+  }
+
+  //waiting for the previous range keeps at most two buffers of dirty pages
+  //per file, instead of stalling in large bursts once the kernel throttles
+  if(writeback_size_ > 0)
+  {
+    ::sync_file_range(descriptor_.get(), writeback_offset_, writeback_size_,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+  }
+
+  ::sync_file_range(descriptor_.get(), offset, size, SYNC_FILE_RANGE_WRITE);
+  writeback_offset_ = offset;
+  writeback_size_ = size;
+#endif
 }
 
 } //closing namespace mfsync
@@ -1,5 +1,6 @@
 #include "mfsync/protocol.h"
 
+#include <algorithm>
 #include <functional>
 #include <sstream>
 #include <nlohmann/json.hpp>
@@ -48,6 +49,23 @@ type get_message_type(const std::string& msg)
     {
       return type::FILE;
     }
+    if(type_string == "window")
+    {
+      return type::WINDOW;
+    }
+    if(type_string == "cancel")
+    {
+      return type::CANCEL;
+    }
+    if(type_string == "bundle")
+    {
+      return type::BUNDLE;
+    }
+
+    if(type_string == "signature")
+    {
+      return type::SIGNATURE;
+    }
   }
   catch(std::exception& er)
   {
@@ -101,17 +119,317 @@ std::string create_file_message(const std::string& public_key, const std::string
   return wrap_with_header(j.dump());
 }
 
-std::string create_handshake_message(const std::string& public_key, const std::string& salt)
+std::string create_window_message(const std::string& public_key, const std::string& msg)
+{
+  nlohmann::json j;
+  j["type"] = "window";
+  j["version"] = protocol::VERSION;
+  j["public_key"] = public_key;
+  j["message"] = msg;
+
+  return wrap_with_header(j.dump());
+}
+
+std::string create_cancel_message(const std::string& public_key, const std::string& msg)
+{
+  nlohmann::json j;
+  j["type"] = "cancel";
+  j["version"] = protocol::VERSION;
+  j["public_key"] = public_key;
+  j["message"] = msg;
+
+  return wrap_with_header(j.dump());
+}
+
+std::string create_bundle_message(const std::string& public_key, const std::string& msg)
+{
+  nlohmann::json j;
+  j["type"] = "bundle";
+  j["version"] = protocol::VERSION;
+  j["public_key"] = public_key;
+  j["message"] = msg;
+
+  return wrap_with_header(j.dump());
+}
+
+std::string create_signature_message(const std::string& public_key, const std::string& msg)
+{
+  nlohmann::json j;
+  j["type"] = "signature";
+  j["version"] = protocol::VERSION;
+  j["public_key"] = public_key;
+  j["message"] = msg;
+
+  return wrap_with_header(j.dump());
+}
+
+std::string create_handshake_message(const std::string& public_key, const std::string& salt,
+                                     const capabilities& caps)
 {
   nlohmann::json j;
   j["type"] = "handshake";
   j["version"] = protocol::VERSION;
   j["public_key"] = public_key;
   j["salt"] = salt;
+  j["capabilities"] = caps;
 
   return wrap_with_header(j.dump());
 }
 
+std::optional<capabilities> get_capabilities_from_message(const std::string& msg)
+{
+  const auto j = get_json_from_message(msg);
+
+  if(!j.has_value())
+  {
+    return std::nullopt;
+  }
+
+  try
+  {
+    return j.value().value("capabilities", nlohmann::json::object()).get<capabilities>();
+  }
+  catch(std::exception& er)
+  {
+    spdlog::debug("Json Error: {}", er.what());
+    return std::nullopt;
+  }
+}
+
+capabilities negotiate(const capabilities& local, const capabilities& remote)
+{
+  capabilities result;
+
+  //a peer that doesnt announce a limit only gets the smallest chunks
+  const size_t local_max = local.max_chunksize == 0 ? MIN_CHUNKSIZE : local.max_chunksize;
+  const size_t remote_max = remote.max_chunksize == 0 ? MIN_CHUNKSIZE : remote.max_chunksize;
+  result.max_chunksize = std::clamp<size_t>(std::min(local_max, remote_max),
+                                            MIN_CHUNKSIZE, MAX_CHUNKSIZE);
+
+  //both sides have to trust each other to skip encryption
+  result.plaintext = local.plaintext && remote.plaintext;
+
+  //streams are only used if both sides can multiplex them
+  result.max_streams = local.max_streams == 0 || remote.max_streams == 0
+                     ? 0
+                     : std::min(local.max_streams, remote.max_streams);
+
+  //bundles are sent on streams, so they need both
+  result.max_bundle_files = result.max_streams == 0
+                          ? 0
+                          : std::min(local.max_bundle_files, remote.max_bundle_files);
+
+  //only the receiving side announces it
+  result.background = local.background || remote.background;
+
+  //compressing bodies that are sent unencrypted isnt worth it on trusted links
+  if(!result.plaintext)
+  {
+    const auto codec = std::find_first_of(local.compression.begin(), local.compression.end(),
+                                          remote.compression.begin(), remote.compression.end());
+
+    if(codec != local.compression.end())
+    {
+      result.compression = { *codec };
+    }
+  }
+
+  //manifests are only read from the encrypted streams
+  result.dedup = local.dedup && remote.dedup && !result.plaintext;
+
+  //casts are encrypted with a key of their own, even for plaintext peers
+  result.multicast = local.multicast && remote.multicast;
+
+  return result;
+}
+
+frame_header create_frame_header(frame_type type, uint32_t stream_id, uint32_t length)
+{
+  return frame_header{ static_cast<unsigned char>(type),
+                       static_cast<unsigned char>(stream_id >> 24),
+                       static_cast<unsigned char>(stream_id >> 16),
+                       static_cast<unsigned char>(stream_id >> 8),
+                       static_cast<unsigned char>(stream_id),
+                       static_cast<unsigned char>(length >> 24),
+                       static_cast<unsigned char>(length >> 16),
+                       static_cast<unsigned char>(length >> 8),
+                       static_cast<unsigned char>(length) };
+}
+
+std::optional<frame> get_frame_from_header(const frame_header& header)
+{
+  if(header[0] > static_cast<unsigned char>(frame_type::MANIFEST))
+  {
+    spdlog::debug("received frame with unknown type {}", header[0]);
+    return std::nullopt;
+  }
+
+  const auto read_uint32 = [&header](size_t pos)
+  {
+    return static_cast<uint32_t>(header[pos]) << 24
+         | static_cast<uint32_t>(header[pos + 1]) << 16
+         | static_cast<uint32_t>(header[pos + 2]) << 8
+         | static_cast<uint32_t>(header[pos + 3]);
+  };
+
+  return frame{ .type = static_cast<frame_type>(header[0]),
+                .stream_id = read_uint32(1),
+                .length = read_uint32(5) };
+}
+
+std::string create_frame(frame_type type, uint32_t stream_id, std::string_view payload)
+{
+  const auto header = create_frame_header(type, stream_id, payload.size());
+
+  std::string result;
+  result.reserve(header.size() + payload.size());
+  result.append(reinterpret_cast<const char*>(header.data()), header.size());
+  result.append(payload);
+  return result;
+}
+
+copy_payload create_copy_payload(uint64_t block, uint32_t count)
+{
+  copy_payload payload;
+
+  for(size_t i = 0; i < sizeof(uint64_t); ++i)
+  {
+    payload[i] = static_cast<unsigned char>(block >> (8 * (sizeof(uint64_t) - 1 - i)));
+  }
+
+  for(size_t i = 0; i < sizeof(uint32_t); ++i)
+  {
+    payload[sizeof(uint64_t) + i] = static_cast<unsigned char>(count >> (8 * (sizeof(uint32_t) - 1 - i)));
+  }
+
+  return payload;
+}
+
+std::optional<std::pair<uint64_t, uint32_t>> get_copy_from_payload(const unsigned char* data, size_t size)
+{
+  if(size != COPY_PAYLOAD_SIZE)
+  {
+    spdlog::debug("received copy frame with invalid size {}", size);
+    return std::nullopt;
+  }
+
+  uint64_t block = 0;
+  uint32_t count = 0;
+
+  for(size_t i = 0; i < sizeof(uint64_t); ++i)
+  {
+    block = block << 8 | data[i];
+  }
+
+  for(size_t i = 0; i < sizeof(uint32_t); ++i)
+  {
+    count = count << 8 | data[sizeof(uint64_t) + i];
+  }
+
+  return std::make_pair(block, count);
+}
+
+void append_manifest_entry(std::vector<unsigned char>& payload, const content_chunk& chunk)
+{
+  payload.insert(payload.end(), chunk.hash.begin(), chunk.hash.end());
+
+  for(size_t i = 0; i < sizeof(uint32_t); ++i)
+  {
+    payload.push_back(static_cast<unsigned char>(chunk.length >> (8 * (sizeof(uint32_t) - 1 - i))));
+  }
+}
+
+std::vector<unsigned char> create_signature_payload(const file_signature& signature)
+{
+  std::vector<unsigned char> payload;
+  payload.reserve(signature.weak.size() * SIGNATURE_ENTRY_SIZE);
+
+  for(size_t block = 0; block < signature.weak.size() && block < signature.strong.size(); ++block)
+  {
+    for(size_t i = 0; i < sizeof(uint32_t); ++i)
+    {
+      payload.push_back(static_cast<unsigned char>(signature.weak[block] >> (8 * (sizeof(uint32_t) - 1 - i))));
+    }
+
+    for(size_t i = 0; i < sizeof(uint64_t); ++i)
+    {
+      payload.push_back(static_cast<unsigned char>(signature.strong[block] >> (8 * (sizeof(uint64_t) - 1 - i))));
+    }
+  }
+
+  return payload;
+}
+
+std::optional<file_signature> get_signature_from_payload(const unsigned char* data, size_t size,
+                                                         size_t block_size)
+{
+  if(size == 0 || size % SIGNATURE_ENTRY_SIZE != 0)
+  {
+    spdlog::debug("received signature with invalid size {}", size);
+    return std::nullopt;
+  }
+
+  file_signature signature;
+  signature.block_size = block_size;
+  signature.weak.resize(size / SIGNATURE_ENTRY_SIZE);
+  signature.strong.resize(size / SIGNATURE_ENTRY_SIZE);
+
+  for(size_t block = 0; block < signature.weak.size(); ++block)
+  {
+    for(size_t i = 0; i < sizeof(uint32_t); ++i)
+    {
+      signature.weak[block] = signature.weak[block] << 8 | data[i];
+    }
+
+    data += sizeof(uint32_t);
+
+    for(size_t i = 0; i < sizeof(uint64_t); ++i)
+    {
+      signature.strong[block] = signature.strong[block] << 8 | data[i];
+    }
+
+    data += sizeof(uint64_t);
+  }
+
+  return signature;
+}
+
+std::optional<std::vector<content_chunk>> get_manifest_from_payload(const unsigned char* data, size_t size,
+                                                                    size_t offset)
+{
+  if(size == 0 || size % MANIFEST_ENTRY_SIZE != 0)
+  {
+    spdlog::debug("received manifest frame with invalid size {}", size);
+    return std::nullopt;
+  }
+
+  std::vector<content_chunk> chunks(size / MANIFEST_ENTRY_SIZE);
+
+  for(auto& chunk : chunks)
+  {
+    std::copy(data, data + CONTENT_HASH_SIZE, chunk.hash.begin());
+    data += CONTENT_HASH_SIZE;
+
+    for(size_t i = 0; i < sizeof(uint32_t); ++i)
+    {
+      chunk.length = chunk.length << 8 | data[i];
+    }
+
+    data += sizeof(uint32_t);
+
+    if(chunk.length == 0 || chunk.length > MAX_CONTENT_CHUNK_SIZE)
+    {
+      spdlog::debug("received manifest with invalid chunk length {}", chunk.length);
+      return std::nullopt;
+    }
+
+    chunk.offset = offset;
+    offset += chunk.length;
+  }
+
+  return chunks;
+}
+
 std::string create_file_list_message(const std::string& public_key)
 {
   nlohmann::json j;
@@ -127,7 +445,7 @@ std::string create_error_message(const std::string& reason)
   std::stringstream message_sstring;
   message_sstring << MFSYNC_HEADER_BEGIN;
   message_sstring << reason;
-  message_sstring << MFSYNC_HEADER_BEGIN;
+  message_sstring << MFSYNC_HEADER_END;
   return message_sstring.str();
 }
 
@@ -209,7 +527,8 @@ std::optional<host_information> get_host_info_from_message(const std::string& me
 }
 
 std::string create_message_from_file_info(const file_handler::stored_files& file_infos,
-                                          unsigned short port)
+                                          unsigned short port,
+                                          const file_handler::stored_files& partial_files)
 {
   nlohmann::json json_array = nlohmann::json::array();
   nlohmann::json element;
@@ -221,6 +540,15 @@ std::string create_message_from_file_info(const file_handler::stored_files& file
     element.clear();
   }
 
+  for(const auto& file_info : partial_files)
+  {
+    element = file_info;
+    element["port"] = port;
+    element["partial"] = true;
+    json_array.push_back(element);
+    element.clear();
+  }
+
   return json_array.dump();
 }
 
@@ -376,6 +704,34 @@ std::optional<size_t> get_count_from_message(const std::string& message)
   }
 }
 
+std::string seal_end_payload(const std::string& plain, const requested_file& requested,
+                             const std::string& public_key, crypto::crypto_handler& handler)
+{
+  //no record of the stream starts at its end, so the nonce is still unused
+  std::vector<unsigned char> sealed;
+  handler.encrypt_buf(public_key, requested.stream_id, requested.get_end(),
+                      reinterpret_cast<const unsigned char*>(plain.data()), plain.size(),
+                      sealed);
+  return std::string(reinterpret_cast<const char*>(sealed.data()), sealed.size());
+}
+
+std::optional<std::string> open_end_payload(const std::string& payload,
+                                            const requested_file& requested,
+                                            const std::string& public_key,
+                                            crypto::crypto_handler& handler)
+{
+  std::vector<unsigned char> plain;
+
+  if(!handler.decrypt_buf(public_key, requested.stream_id, requested.get_end(),
+                          reinterpret_cast<const unsigned char*>(payload.data()),
+                          payload.size(), plain))
+  {
+    return std::nullopt;
+  }
+
+  return std::string(reinterpret_cast<const char*>(plain.data()), plain.size());
+}
+
 std::optional<file_handler::available_files>
 get_available_files_from_message(const std::string& message,
                                  const boost::asio::ip::address& address,
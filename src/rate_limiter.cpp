@@ -0,0 +1,93 @@
+#include "mfsync/rate_limiter.h"
+
+#include <algorithm>
+
+namespace mfsync::filetransfer
+{
+
+token_bucket::token_bucket(size_t rate)
+  : rate_(rate)
+{
+}
+
+void token_bucket::set_rate(size_t rate)
+{
+  rate_ = rate;
+}
+
+token_bucket::clock::duration token_bucket::reserve(size_t bytes, priority prio,
+                                                    clock::time_point now)
+{
+  if(rate_ == 0)
+  {
+    return clock::duration::zero();
+  }
+
+  const auto drain_time = std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(static_cast<double>(bytes) / rate_));
+  //a bucket that was idle for a while lets a short burst through
+  const auto earliest = now - std::chrono::duration_cast<clock::duration>(MAX_BURST);
+
+  //interactive bytes delay background ones, but not the other way around
+  all_until_ = std::max(all_until_, earliest) + drain_time;
+  auto until = all_until_;
+
+  if(prio == priority::INTERACTIVE)
+  {
+    interactive_until_ = std::max(interactive_until_, earliest) + drain_time;
+    until = interactive_until_;
+  }
+
+  return std::max(until - now, clock::duration::zero());
+}
+
+rate_limiter::rate_limiter(const rate_limits& limits)
+{
+  set_limits(limits);
+}
+
+void rate_limiter::set_limits(const rate_limits& limits)
+{
+  std::scoped_lock lk{mutex_};
+  limits_ = limits;
+  global_.upload.set_rate(limits.upload);
+  global_.download.set_rate(limits.download);
+
+  //bytes that were reserved already keep the time they were granted
+  for(auto& [peer, peer_buckets] : peers_)
+  {
+    peer_buckets.upload.set_rate(limits.peer_upload);
+    peer_buckets.download.set_rate(limits.peer_download);
+  }
+}
+
+rate_limits rate_limiter::get_limits() const
+{
+  std::scoped_lock lk{mutex_};
+  return limits_;
+}
+
+rate_limiter::clock::duration rate_limiter::reserve(direction dir, const std::string& peer,
+                                                    size_t bytes, priority prio)
+{
+  const auto now = clock::now();
+  std::scoped_lock lk{mutex_};
+
+  auto it = peers_.find(peer);
+  if(it == peers_.end())
+  {
+    it = peers_.emplace(peer, create_peer_buckets()).first;
+  }
+
+  auto& global = dir == direction::UPLOAD ? global_.upload : global_.download;
+  auto& peer_bucket = dir == direction::UPLOAD ? it->second.upload : it->second.download;
+
+  return std::max(global.reserve(bytes, prio, now), peer_bucket.reserve(bytes, prio, now));
+}
+
+rate_limiter::buckets rate_limiter::create_peer_buckets() const
+{
+  return buckets{token_bucket{limits_.peer_upload}, token_bucket{limits_.peer_download}};
+}
+
+} //closing namespace mfsync::filetransfer
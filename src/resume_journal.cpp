@@ -0,0 +1,187 @@
+#include "mfsync/resume_journal.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+namespace mfsync
+{
+
+namespace
+{
+  //hashes the chunk of the tmp file starting at offset, nullopt if it is cut short
+  std::optional<std::string> hash_chunk(const file_descriptor& descriptor, size_t offset,
+                                        size_t size, std::vector<char>& buffer)
+  {
+    if(descriptor.read_at(buffer.data(), size, offset) != size)
+    {
+      return std::nullopt;
+    }
+
+    sha256 hasher;
+    hasher.update(buffer.data(), size);
+    return hasher.finalize();
+  }
+} //closing anonymous namespace
+
+resume_journal resume_journal::open(const std::filesystem::path& path,
+                                    const std::filesystem::path& tmp_path,
+                                    const file_information& file_info)
+{
+  resume_journal journal;
+  journal.file_size_ = file_info.size;
+
+  const auto header = get_header(file_info);
+  std::string content = header + '\n';
+
+  std::ifstream input{path};
+  std::string line;
+  auto tmp_file = file_descriptor::open(tmp_path, O_RDONLY);
+
+  if(input && tmp_file.has_value() && std::getline(input, line) && line == header)
+  {
+    std::vector<char> buffer(CHUNK_SIZE);
+
+    while(journal.verified_ < journal.file_size_ && std::getline(input, line))
+    {
+      const auto size = std::min(CHUNK_SIZE, journal.file_size_ - journal.verified_);
+
+      if(hash_chunk(tmp_file.value(), journal.verified_, size, buffer) != line)
+      {
+        spdlog::debug("{} differs from its journal after {} bytes", tmp_path.c_str(),
+                      journal.verified_);
+        break;
+      }
+
+      content += line + '\n';
+      journal.verified_ += size;
+    }
+  }
+
+  //the verified part is written to a new journal which replaces the old one,
+  //a crash leaves either of them
+  //ends like a tmp file, so a left over one isnt taken for a stored file
+  auto tmp_journal_path = path;
+  tmp_journal_path += ".mfsync";
+
+  {
+    std::ofstream output{tmp_journal_path, std::ios::out | std::ios::trunc};
+    output << content;
+
+    if(!output.flush())
+    {
+      spdlog::error("Could not write resume journal {}", tmp_journal_path.c_str());
+      return journal;
+    }
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp_journal_path, path, ec);
+
+  if(ec)
+  {
+    spdlog::error("Could not write resume journal {}: {}", path.c_str(), ec.message());
+    return journal;
+  }
+
+  auto descriptor = file_descriptor::open(path, O_WRONLY | O_APPEND);
+
+  if(descriptor.has_value())
+  {
+    journal.descriptor_ = std::move(descriptor.value());
+  }
+
+  return journal;
+}
+
+bool resume_journal::is_open() const
+{
+  return descriptor_.is_open();
+}
+
+size_t resume_journal::get_verified() const
+{
+  return verified_;
+}
+
+void resume_journal::update(size_t offset, const char* data, size_t size)
+{
+  if(!is_open())
+  {
+    return;
+  }
+
+  if(offset != verified_ + current_size_)
+  {
+    //what follows cant be hashed in order anymore
+    spdlog::debug("write at {} skips ahead of the resume journal, closing it", offset);
+    descriptor_.close();
+    return;
+  }
+
+  while(size > 0 && verified_ < file_size_)
+  {
+    if(!current_.has_value())
+    {
+      current_.emplace();
+      current_size_ = 0;
+    }
+
+    const auto chunk_size = std::min(CHUNK_SIZE, file_size_ - verified_);
+    const auto count = std::min(size, chunk_size - current_size_);
+
+    current_.value().update(data, count);
+    current_size_ += count;
+    data += count;
+    size -= count;
+
+    if(current_size_ == chunk_size)
+    {
+      append(current_.value().finalize() + '\n');
+      verified_ += chunk_size;
+      current_size_ = 0;
+      current_.reset();
+
+      if(progress_ != nullptr)
+      {
+        *progress_ = verified_;
+      }
+    }
+  }
+}
+
+void resume_journal::set_progress(std::shared_ptr<std::atomic<size_t>> verified)
+{
+  progress_ = std::move(verified);
+
+  if(progress_ != nullptr)
+  {
+    *progress_ = verified_;
+  }
+}
+
+std::string resume_journal::get_header(const file_information& file_info)
+{
+  //a journal of another version of the file doesnt match
+  return file_info.file_name + ' ' + std::to_string(file_info.size) + ' '
+       + file_info.sha256sum.value_or("-") + ' ' + std::to_string(CHUNK_SIZE);
+}
+
+void resume_journal::append(const std::string& line)
+{
+  //a single write with O_APPEND, the line is either complete or torn at the end
+  if(::write(descriptor_.get(), line.data(), line.size()) != static_cast<ssize_t>(line.size()))
+  {
+    spdlog::error("Could not append to resume journal: {}", std::strerror(errno));
+    descriptor_.close();
+  }
+}
+
+} //closing namespace mfsync
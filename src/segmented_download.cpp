@@ -0,0 +1,479 @@
+#include "mfsync/segmented_download.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+
+#include "spdlog/spdlog.h"
+
+namespace mfsync::filetransfer
+{
+
+segment_map::segment_map(size_t begin, size_t end, size_t segment_size, size_t min_split_size)
+  : segment_map(end, byte_ranges{{0, begin}}, segment_size, min_split_size)
+{
+}
+
+segment_map::segment_map(size_t size, const byte_ranges& written, size_t segment_size,
+                         size_t min_split_size)
+  : end_(size)
+  , min_split_size_(min_split_size)
+{
+  segment_size = std::max<size_t>(segment_size, 1);
+  size_t offset = 0;
+
+  for(const auto& [begin, end] : written)
+  {
+    //ranges overlapping the previous one or the end of the file are cut
+    const auto written_begin = std::clamp(begin, offset, size);
+    const auto written_end = std::min(end, size);
+
+    if(written_end <= written_begin)
+    {
+      continue;
+    }
+
+    add_gap(offset, written_begin, segment_size);
+    segments_.emplace(written_begin, segment{written_end, written_end, false});
+    bytes_done_ += written_end - written_begin;
+    offset = written_end;
+  }
+
+  add_gap(offset, size, segment_size);
+}
+
+void segment_map::add_gap(size_t begin, size_t end, size_t segment_size)
+{
+  for(size_t offset = begin; offset < end; offset += segment_size)
+  {
+    const auto segment_end = std::min(end, offset + segment_size);
+    segments_.emplace(offset, segment{segment_end, offset, false});
+  }
+}
+
+std::optional<segment_map::range> segment_map::acquire()
+{
+  for(auto& [key, segment] : segments_)
+  {
+    if(!segment.assigned && segment.next < segment.end)
+    {
+      segment.assigned = true;
+      return range{key, segment.next, segment.end};
+    }
+  }
+
+  //everything is handed out, take over the back half of the largest rest
+  auto largest = segments_.end();
+  for(auto it = segments_.begin(); it != segments_.end(); ++it)
+  {
+    const auto left = it->second.end - it->second.next;
+    if(left >= min_split_size_
+       && (largest == segments_.end() || left > largest->second.end - largest->second.next))
+    {
+      largest = it;
+    }
+  }
+
+  if(largest == segments_.end())
+  {
+    return std::nullopt;
+  }
+
+  auto& cut = largest->second;
+  const auto middle = cut.next + (cut.end - cut.next) / 2;
+  segments_.emplace(middle, segment{cut.end, middle, true});
+  cut.end = middle;
+
+  return range{middle, middle, segments_.at(middle).end};
+}
+
+size_t segment_map::clip(size_t key, size_t offset, size_t size) const
+{
+  const auto it = segments_.find(key);
+
+  if(it == segments_.end() || offset >= it->second.end)
+  {
+    return 0;
+  }
+
+  return std::min(size, it->second.end - offset);
+}
+
+void segment_map::advance(size_t key, size_t position)
+{
+  const auto it = segments_.find(key);
+
+  if(it == segments_.end())
+  {
+    return;
+  }
+
+  //the segment might have been cut while its data was written
+  auto& segment = it->second;
+  position = std::min(position, segment.end);
+
+  if(position > segment.next)
+  {
+    bytes_done_ += position - segment.next;
+    segment.next = position;
+  }
+}
+
+void segment_map::release(size_t key)
+{
+  const auto it = segments_.find(key);
+
+  if(it != segments_.end())
+  {
+    it->second.assigned = false;
+  }
+}
+
+bool segment_map::is_done(size_t key) const
+{
+  const auto it = segments_.find(key);
+  return it == segments_.end() || it->second.next >= it->second.end;
+}
+
+bool segment_map::is_complete() const
+{
+  return bytes_done_ >= end_;
+}
+
+bool segment_map::has_unassigned() const
+{
+  return std::any_of(segments_.begin(), segments_.end(), [](const auto& key_segment)
+  {
+    return !key_segment.second.assigned && key_segment.second.next < key_segment.second.end;
+  });
+}
+
+size_t segment_map::get_bytes_done() const
+{
+  return bytes_done_;
+}
+
+size_t segment_map::get_contiguous_end() const
+{
+  //segments cover the range without gaps, so the first unfinished one ends it
+  for(const auto& [key, segment] : segments_)
+  {
+    if(segment.next < segment.end)
+    {
+      return segment.next;
+    }
+  }
+
+  return end_;
+}
+
+byte_ranges segment_map::get_written() const
+{
+  byte_ranges result;
+
+  for(const auto& [key, segment] : segments_)
+  {
+    if(segment.next == key)
+    {
+      continue;
+    }
+
+    if(!result.empty() && result.back().second == key)
+    {
+      result.back().second = segment.next;
+      continue;
+    }
+
+    result.emplace_back(key, segment.next);
+  }
+
+  return result;
+}
+
+segmented_download::lease::lease(std::shared_ptr<segmented_download> download,
+                                 segment_map::range range)
+  : download_(std::move(download))
+  , range_(range)
+{
+}
+
+segmented_download::lease::~lease()
+{
+  if(download_ != nullptr)
+  {
+    download_->release(range_.key);
+  }
+}
+
+size_t segmented_download::lease::write(size_t offset, const unsigned char* data, size_t size)
+{
+  return download_->write(range_.key, offset, data, size);
+}
+
+bool segmented_download::lease::is_done() const
+{
+  return download_->is_done(range_.key);
+}
+
+const segment_map::range& segmented_download::lease::get_range() const
+{
+  return range_;
+}
+
+std::shared_ptr<segmented_download> segmented_download::lease::get_download() const
+{
+  return download_;
+}
+
+segmented_download::segmented_download(file_handler& handler, const file_information& file_info,
+                                       const byte_ranges& written, ofstream_wrapper output,
+                                       file_descriptor descriptor)
+  : file_handler_(handler)
+  , file_info_(file_info)
+  , segments_(file_info.size, written, SEGMENT_SIZE, MIN_SPLIT_SIZE)
+  , output_(std::move(output))
+  , descriptor_(std::move(descriptor))
+{
+}
+
+segmented_download::~segmented_download()
+{
+  persist();
+}
+
+std::shared_ptr<segmented_download> segmented_download::create(file_handler& handler,
+                                                               const file_information& file_info,
+                                                               progress_handler* progress)
+{
+  //create_file locks the file and sets the offset to the already received part
+  requested_file requested{.file_info = file_info};
+  auto output = handler.create_file(requested);
+
+  if(!output.has_value())
+  {
+    spdlog::debug("file creation failed for segmented download of {}", file_info.file_name);
+    return nullptr;
+  }
+
+  auto descriptor = handler.open_tmp_file(file_info);
+
+  if(!descriptor.has_value())
+  {
+    return nullptr;
+  }
+
+  const auto written = handler.get_written_ranges(file_info, requested.offset);
+
+  std::shared_ptr<segmented_download> result{
+      new segmented_download(handler, file_info, written, std::move(output.value()),
+                             std::move(descriptor.value()))};
+
+  if(progress != nullptr)
+  {
+    result->bar_ = progress->create_file_progress(file_info);
+    result->bar_->status = progress::STATUS::DOWNLOADING;
+    result->bar_->bytes_transferred = result->segments_.get_bytes_done();
+  }
+
+  return result;
+}
+
+std::optional<segmented_download::lease> segmented_download::acquire()
+{
+  std::optional<segment_map::range> range;
+
+  {
+    std::scoped_lock lk{mutex_};
+
+    if(finished_)
+    {
+      return std::nullopt;
+    }
+
+    range = segments_.acquire();
+  }
+
+  if(!range.has_value())
+  {
+    return std::nullopt;
+  }
+
+  return std::make_optional<lease>(shared_from_this(), range.value());
+}
+
+bool segmented_download::is_complete() const
+{
+  std::scoped_lock lk{mutex_};
+  return segments_.is_complete();
+}
+
+bool segmented_download::has_unassigned() const
+{
+  std::scoped_lock lk{mutex_};
+  return !finished_ && segments_.has_unassigned();
+}
+
+std::optional<bool> segmented_download::try_finalize()
+{
+  std::scoped_lock journal_lk{journal_mutex_};
+
+  {
+    std::scoped_lock lk{mutex_};
+
+    if(finished_ || !segments_.is_complete())
+    {
+      return std::nullopt;
+    }
+
+    finished_ = true;
+  }
+
+  if(!file_handler_.finalize_file(file_info_, output_, bar_))
+  {
+    //the journal would only ask for the last segment again, which fails the
+    //same way, so the file is fetched from scratch next time
+    file_handler_.discard_file(file_info_);
+    return false;
+  }
+
+  return true;
+}
+
+void segmented_download::discard()
+{
+  std::scoped_lock journal_lk{journal_mutex_};
+
+  {
+    std::scoped_lock lk{mutex_};
+
+    if(finished_)
+    {
+      return;
+    }
+
+    finished_ = true;
+  }
+
+  file_handler_.discard_file(file_info_);
+  output_.close();
+}
+
+const file_information& segmented_download::get_file_info() const
+{
+  return file_info_;
+}
+
+size_t segmented_download::write(size_t key, size_t offset, const unsigned char* data, size_t size)
+{
+  size_t count = 0;
+
+  {
+    std::scoped_lock lk{mutex_};
+
+    if(finished_)
+    {
+      return 0;
+    }
+
+    count = segments_.clip(key, offset, size);
+  }
+
+  //descriptor_ stays open until the last lease is gone, so it is used without
+  //the lock and sources dont wait for each other. if the segment gets cut
+  //meanwhile, its new owner writes the same bytes again
+  if(!descriptor_.write_at(data, count, offset))
+  {
+    spdlog::error("Could not write to {}: {}", file_info_.file_name, std::strerror(errno));
+    return 0;
+  }
+
+  bool segment_done = false;
+
+  {
+    std::scoped_lock lk{mutex_};
+    segments_.advance(key, offset + count);
+    segment_done = segments_.is_done(key);
+
+    if(bar_ != nullptr)
+    {
+      bar_->bytes_transferred = segments_.get_bytes_done();
+
+      if(segments_.is_complete())
+      {
+        bar_->status = progress::STATUS::COMPARING;
+      }
+    }
+  }
+
+  if(segment_done)
+  {
+    persist();
+  }
+
+  return count;
+}
+
+void segmented_download::release(size_t key)
+{
+  bool segment_done = false;
+
+  {
+    std::scoped_lock lk{mutex_};
+    segments_.release(key);
+    segment_done = segments_.is_done(key);
+  }
+
+  //keeps the part of an interrupted segment that was received
+  if(!segment_done)
+  {
+    persist();
+  }
+}
+
+void segmented_download::persist()
+{
+  std::scoped_lock journal_lk{journal_mutex_};
+  byte_ranges written;
+
+  {
+    std::scoped_lock lk{mutex_};
+
+    if(finished_ || segments_.is_complete())
+    {
+      return;
+    }
+
+    written = segments_.get_written();
+  }
+
+  file_handler_.store_segment_journal(file_info_, written, descriptor_);
+}
+
+bool segmented_download::is_done(size_t key) const
+{
+  std::scoped_lock lk{mutex_};
+  return segments_.is_done(key);
+}
+
+void download_registry::add(std::shared_ptr<segmented_download> download)
+{
+  auto file_name = download->get_file_info().file_name;
+  std::scoped_lock lk{mutex_};
+  downloads_.insert_or_assign(std::move(file_name), std::move(download));
+}
+
+std::shared_ptr<segmented_download> download_registry::find(const std::string& file_name) const
+{
+  std::scoped_lock lk{mutex_};
+  const auto it = downloads_.find(file_name);
+  return it != downloads_.end() ? it->second : nullptr;
+}
+
+void download_registry::remove(const std::string& file_name)
+{
+  std::scoped_lock lk{mutex_};
+  downloads_.erase(file_name);
+}
+
+} //closing namespace mfsync::filetransfer
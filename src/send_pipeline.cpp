@@ -0,0 +1,116 @@
+#include "mfsync/send_pipeline.h"
+
+#include <algorithm>
+
+namespace mfsync::filetransfer
+{
+
+send_pipeline::send_pipeline(size_t depth, size_t max_buffered_bytes)
+  : depth_(std::max<size_t>(depth, 1))
+  , max_buffered_bytes_(max_buffered_bytes)
+{
+}
+
+bool send_pipeline::try_start_prepare(size_t chunk_size)
+{
+  std::scoped_lock lk{mutex_};
+
+  if(preparing_ || prepared_all_ || chunks_.size() >= depth_)
+  {
+    return false;
+  }
+
+  //an empty pipeline always accepts one chunk, otherwise it could never make progress
+  if(!chunks_.empty() && buffered_bytes_ + chunk_size > max_buffered_bytes_)
+  {
+    return false;
+  }
+
+  preparing_ = true;
+  return true;
+}
+
+void send_pipeline::finish_prepare(prepared_chunk chunk)
+{
+  std::scoped_lock lk{mutex_};
+  buffered_bytes_ += chunk.payload.size();
+  chunks_.push_back(std::move(chunk));
+  preparing_ = false;
+}
+
+void send_pipeline::finish_prepare()
+{
+  std::scoped_lock lk{mutex_};
+  prepared_all_ = true;
+  preparing_ = false;
+}
+
+prepared_chunk* send_pipeline::try_start_write()
+{
+  std::scoped_lock lk{mutex_};
+
+  if(writing_ || chunks_.empty())
+  {
+    return nullptr;
+  }
+
+  writing_ = true;
+  return &chunks_.front();
+}
+
+void send_pipeline::finish_write()
+{
+  std::scoped_lock lk{mutex_};
+
+  if(chunks_.empty())
+  {
+    return;
+  }
+
+  auto& chunk = chunks_.front();
+  buffered_bytes_ -= chunk.payload.size();
+  chunk.payload.clear();
+
+  if(free_buffers_.size() < depth_)
+  {
+    free_buffers_.push_back(std::move(chunk.payload));
+  }
+
+  chunks_.pop_front();
+  writing_ = false;
+}
+
+bool send_pipeline::try_complete()
+{
+  std::scoped_lock lk{mutex_};
+
+  if(completed_ || !prepared_all_ || preparing_ || writing_ || !chunks_.empty())
+  {
+    return false;
+  }
+
+  completed_ = true;
+  return true;
+}
+
+std::vector<unsigned char> send_pipeline::acquire_buffer()
+{
+  std::scoped_lock lk{mutex_};
+
+  if(free_buffers_.empty())
+  {
+    return {};
+  }
+
+  auto result = std::move(free_buffers_.back());
+  free_buffers_.pop_back();
+  return result;
+}
+
+size_t send_pipeline::get_buffered_bytes() const
+{
+  std::scoped_lock lk{mutex_};
+  return buffered_bytes_;
+}
+
+} //closing namespace mfsync::filetransfer
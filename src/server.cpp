@@ -18,6 +18,22 @@ server::server(boost::asio::io_context &io_context,
   , crypto_handler_(crypto_handler)
 {}
 
+void server::set_options(const transfer_options& options)
+{
+  options_ = options;
+
+  if(options_.engine == io_engine::IO_URING && uring_ == nullptr)
+  {
+    uring_ = uring_context::create(acceptor_.get_executor(), uring_context::DEFAULT_ENTRIES,
+                                   options_.uring_buffers, options_.max_chunksize);
+
+    if(uring_ == nullptr)
+    {
+      spdlog::info("io_uring is not available, falling back to asio");
+    }
+  }
+}
+
 void server::run()
 {
   if(start_listening(port_))
@@ -62,6 +78,9 @@ bool server::start_listening(uint16_t port)
   spdlog::debug("setting port to {}", port);
   acceptor_.open(endpoint.protocol());
   acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+  //buffer sizes have to be set before listening, they decide the window
+  //scaling negotiated with the accepted connections
+  apply_socket_tuning(acceptor_.native_handle(), options_.sockets.server);
   try
   {
     acceptor_.bind(endpoint);
@@ -79,7 +98,8 @@ bool server::start_listening(uint16_t port)
 
 void server::accept_connections()
 {
-  acceptor_.async_accept([this](auto ec, auto socket) { handle_new_connection(std::move(socket), ec); });
+  acceptor_.async_accept(boost::asio::make_strand(acceptor_.get_executor()),
+                         [this](auto ec, auto socket) { handle_new_connection(std::move(socket), ec); });
 }
 
 void server::handle_new_connection(boost::asio::ip::tcp::socket socket,
@@ -97,6 +117,8 @@ void server::handle_new_connection(boost::asio::ip::tcp::socket socket,
     return;
   }
 
+  apply_socket_tuning(socket.native_handle(), options_.sockets.server);
+
   if(ssl_context_.has_value())
   {
     auto handler = std::make_shared<mfsync::filetransfer::server_tls_session>(
@@ -106,6 +128,10 @@ void server::handle_new_connection(boost::asio::ip::tcp::socket socket,
       file_handler_, crypto_handler_);
 
     handler->set_progress(progress_);
+    handler->set_options(options_);
+    handler->set_uring(uring_.get());
+    handler->set_limiter(limiter_);
+    handler->set_caster(caster_);
     handler->start();
   }
   else
@@ -115,10 +141,15 @@ void server::handle_new_connection(boost::asio::ip::tcp::socket socket,
           file_handler_,
           crypto_handler_);
     handler->set_progress(progress_);
+    handler->set_options(options_);
+    handler->set_uring(uring_.get());
+    handler->set_limiter(limiter_);
+    handler->set_caster(caster_);
     handler->start();
   }
 
-  acceptor_.async_accept([this](auto ec, auto socket) { handle_new_connection(std::move(socket), ec); });
+  acceptor_.async_accept(boost::asio::make_strand(acceptor_.get_executor()),
+                         [this](auto ec, auto socket) { handle_new_connection(std::move(socket), ec); });
 }
 
 } //closing namespace mfsync::filetransfer
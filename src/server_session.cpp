@@ -1,8 +1,18 @@
 #include "mfsync/server_session.h"
 
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
 #include <boost/bind.hpp>
 
 #include "mfsync/protocol.h"
+#include "mfsync/sha256.h"
 #include "spdlog/spdlog.h"
 
 namespace mfsync::filetransfer {
@@ -47,7 +57,7 @@ void server_tls_session::do_handshake() {
       boost::asio::ssl::stream_base::server,
       [this, me = shared_from_this()](const boost::system::error_code& error) {
         if (!error) {
-          me->read();
+          me->read_handshake();
         } else {
           spdlog::error("server_tls_session error on handshake: {}",
                         error.message());
@@ -83,9 +93,10 @@ void server_session_base<SocketType>::handle_read_handshake(
     return;
   }
 
-  stream_buffer_.commit(bytes_transferred);
-  std::istream is(&stream_buffer_);
-  std::string message(std::istreambuf_iterator<char>(is), {});
+  boost::asio::streambuf::const_buffers_type bufs = stream_buffer_.data();
+  std::string message(boost::asio::buffers_begin(bufs),
+                      boost::asio::buffers_begin(bufs) + bytes_transferred);
+  stream_buffer_.consume(bytes_transferred);
   spdlog::debug("Received header: {}", message);
 
   const auto type = protocol::get_message_type(message);
@@ -105,6 +116,18 @@ void server_session_base<SocketType>::handle_read_handshake(
   const auto& j = optional_j.value();
   const auto pub_key = j.at("public_key").get<std::string>();
   const auto salt = j.at("salt").get<std::string>();
+  const auto peer_capabilities = protocol::get_capabilities_from_message(message);
+  capabilities_ = protocol::negotiate(
+      {.max_chunksize = options_.max_chunksize,
+       .plaintext = RAW_SOCKET && options_.allows_plaintext(pub_key),
+       .max_streams = options_.max_streams,
+       .max_bundle_files = protocol::MAX_BUNDLE_FILES,
+       .compression = options_.get_compression(),
+       // manifests are only sent on request, whether to ask is up to the receiver
+       .dedup = true,
+       .multicast = caster_ != nullptr},
+      peer_capabilities.value_or(capabilities{}));
+  public_key_ = pub_key;
   spdlog::debug("received init message: {}", pub_key);
   respond_encrypted(pub_key, salt);
   return;
@@ -118,17 +141,23 @@ void server_session_base<SocketType>::handle_read_header(
     return;
   }
 
-  stream_buffer_.commit(bytes_transferred);
-  std::istream is(&stream_buffer_);
-  std::string message(std::istreambuf_iterator<char>(is), {});
+  boost::asio::streambuf::const_buffers_type bufs = stream_buffer_.data();
+  std::string message(boost::asio::buffers_begin(bufs),
+                      boost::asio::buffers_begin(bufs) + bytes_transferred);
+  stream_buffer_.consume(bytes_transferred);
   spdlog::debug("Received header: {}", message);
 
   const auto type = protocol::get_message_type(message);
 
+  // a message that cant be read leaves the session without a next read, the
+  // connection is closed so the receiver sees EOF instead of waiting on its
+  // streams forever
+
   if (type == protocol::type::FILE_LIST) {
     auto optional_j = protocol::get_json_from_message(message);
 
     if (!optional_j.has_value()) {
+      close();
       return;
     }
 
@@ -150,9 +179,60 @@ void server_session_base<SocketType>::handle_read_header(
     return;
   }
 
+  if (type == protocol::type::WINDOW) {
+    const auto update = protocol::converter<window_update>::from_message(
+        message, *derived_crypto_handler_.get());
+
+    if (!update.has_value()) {
+      spdlog::debug("Couldnt create window_update from message: {}", message);
+      close();
+      return;
+    }
+
+    grant_window(update.value());
+    read();
+    return;
+  }
+
+  if (type == protocol::type::CANCEL) {
+    const auto cancel = protocol::converter<stream_cancel>::from_message(
+        message, *derived_crypto_handler_.get());
+
+    if (!cancel.has_value()) {
+      spdlog::debug("Couldnt create stream_cancel from message: {}", message);
+      close();
+      return;
+    }
+
+    cancel_stream(cancel.value().stream_id);
+    read();
+    return;
+  }
+
+  if (type == protocol::type::BUNDLE) {
+    const auto bundle = protocol::converter<file_bundle>::from_message(
+        message, *derived_crypto_handler_.get());
+
+    if (!bundle.has_value() || bundle.value().files.empty()) {
+      spdlog::debug("Couldnt create file_bundle from message: {}", message);
+      close();
+      return;
+    }
+
+    start_bundle(bundle.value());
+    read();
+    return;
+  }
+
+  if (type == protocol::type::SIGNATURE) {
+    read_signature(message);
+    return;
+  }
+
   if (type != protocol::type::FILE) {
     spdlog::debug("received request with wrong type: {}",
                   static_cast<int>(type));
+    close();
     return;
   }
 
@@ -160,18 +240,95 @@ void server_session_base<SocketType>::handle_read_header(
       message, *derived_crypto_handler_.get());
   if (!result.has_value()) {
     spdlog::debug("Couldnt create requested_file from message: {}", message);
+    close();
     return;
   }
 
-  const auto& [file, pub_key] = result.value();
-  public_key_ = pub_key;
+  auto requested = std::move(result.value().first);
+  const auto signature = pending_signatures_.find(requested.stream_id);
 
-  if (file_handler_.is_stored(file.file_info)) {
-    requested_ = file;
-    send_confirmation();
-  } else {
-    reply_with_error("file doesnt exists");
+  if (signature != pending_signatures_.end()) {
+    requested.signature = std::move(signature->second);
+    pending_signatures_.erase(signature);
+  }
+
+  // files that dont exist here are refused by open_stream, unless they are
+  // still received and can be relayed
+  open_stream(requested);
+
+  // further requests and window updates arrive while files are sent
+  read();
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::read_signature(const std::string& message) {
+  // the payload of a signature that is refused isnt read, the messages
+  // after it cant be found anymore and the connection is closed
+  const auto header = protocol::converter<file_signature>::get_header(
+      message, *derived_crypto_handler_.get());
+
+  if (!header.has_value()) {
+    spdlog::debug("Couldnt create signature_header from message: {}", message);
+    close();
+    return;
+  }
+
+  if (header.value().blocks == 0 || header.value().blocks > MAX_SIGNATURE_BLOCKS ||
+      header.value().block_size < MIN_SIGNATURE_BLOCK_SIZE ||
+      header.value().block_size > MAX_SIGNATURE_BLOCK_SIZE) {
+    spdlog::debug("received signature of {} blocks of {} bytes",
+                  header.value().blocks, header.value().block_size);
+    close();
+    return;
+  }
+
+  // a receiver only signs the copies of files it is about to request
+  if (pending_signatures_.size() >= std::max<size_t>(capabilities_.max_streams, 1) ||
+      pending_signatures_.contains(header.value().stream_id)) {
+    spdlog::debug("received signature for stream {} that wasnt requested",
+                  header.value().stream_id);
+    close();
+    return;
+  }
+
+  auto payload = std::make_shared<std::vector<unsigned char>>(
+      protocol::converter<file_signature>::get_payload_size(header.value()));
+
+  // the start of the payload may have been read together with the header
+  const auto buffered = std::min(stream_buffer_.size(), payload->size());
+  boost::asio::buffer_copy(boost::asio::buffer(payload->data(), buffered),
+                           stream_buffer_.data());
+  stream_buffer_.consume(buffered);
+
+  boost::asio::async_read(
+      socket_,
+      boost::asio::buffer(payload->data() + buffered, payload->size() - buffered),
+      [me = this->shared_from_this(), header = header.value(), payload](
+          boost::system::error_code const& error, std::size_t) {
+        if (error) {
+          spdlog::debug("Error on read_signature: {}", error.message());
+          me->close();
+          return;
+        }
+
+        me->handle_read_signature(header, *payload);
+      });
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::handle_read_signature(
+    const signature_header& header, const std::vector<unsigned char>& payload) {
+  auto signature = protocol::converter<file_signature>::from_payload(
+      header, payload, public_key_, *derived_crypto_handler_.get());
+
+  if (!signature.has_value()) {
+    spdlog::debug("Couldnt read signature of stream {}", header.stream_id);
+    close();
+    return;
   }
+
+  pending_signatures_[header.stream_id] = std::move(signature.value());
+  read();
 }
 
 template <typename SocketType>
@@ -184,8 +341,12 @@ void server_session_base<SocketType>::respond_encrypted(
       return;
   }
 
-  message_ = protocol::converter<bool>::to_message(
-      true, pub_key, *derived_crypto_handler_.get());
+  message_ = protocol::converter<capabilities>::to_message(
+      capabilities_, pub_key, *derived_crypto_handler_.get());
+
+  if (capabilities_.max_streams > 0) {
+    derived_crypto_handler_->use_directional_nonces(pub_key, false);
+  }
 
   spdlog::debug("Sending response: {}", message_);
   async_write(socket_, boost::asio::buffer(message_.data(), message_.size()),
@@ -201,130 +362,1149 @@ void server_session_base<SocketType>::respond_encrypted(
 }
 
 template <typename SocketType>
-void server_session_base<SocketType>::send_confirmation() {
-  message_ =
-      protocol::converter<bool>::to_message(true, public_key_, *derived_crypto_handler_.get());
+void server_session_base<SocketType>::reply_with_error(
+    uint32_t stream_id, const std::string& reason) {
+  spdlog::debug("Refusing stream {}: {}", stream_id, reason);
 
-  spdlog::debug("Sending response: {}", message_);
-  async_write(socket_, boost::asio::buffer(message_.data(), message_.size()),
-              [me = this->shared_from_this()](
-                  boost::system::error_code const& ec, std::size_t) {
-                if (!ec) {
-                  spdlog::debug("Done sending response");
-                  me->read_confirmation();
-                } else {
-                  spdlog::debug("async write failed: {}", ec.message());
-                }
-              });
+  {
+    std::scoped_lock lk{streams_mutex_};
+    control_frames_.push_back(
+        protocol::create_frame(protocol::frame_type::ERROR, stream_id, reason));
+  }
+
+  schedule_write();
 }
 
 template <typename SocketType>
-void server_session_base<SocketType>::reply_with_error(
-    const std::string& reason) {
-  message_ = protocol::create_error_message(reason);
-  spdlog::debug("Sending response: {}", message_);
-  async_write(socket_, boost::asio::buffer(message_.data(), message_.size()),
+void server_session_base<SocketType>::abort_stream(const stream_ptr& stream,
+                                                   const std::string& reason) {
+  {
+    std::scoped_lock lk{streams_mutex_};
+
+    if (streams_.erase(stream->id) == 0) {
+      // the stream already ended or was aborted before
+      return;
+    }
+  }
+
+  reply_with_error(stream->id, reason);
+
+  if (stream->bundle != 0) {
+    open_next_bundled(stream->bundle);
+  }
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::cancel_stream(uint32_t stream_id) {
+  stream_ptr stream;
+
+  {
+    std::scoped_lock lk{streams_mutex_};
+    const auto it = streams_.find(stream_id);
+
+    if (it == streams_.end()) {
+      // the stream might have ended while the cancel was on its way
+      return;
+    }
+
+    stream = it->second;
+  }
+
+  spdlog::debug("Receiver cancelled stream {}", stream_id);
+  abort_stream(stream, "cancelled");
+}
+
+template <typename SocketType>
+size_t server_session_base<SocketType>::get_used_slots() const {
+  // expects streams_mutex_ to be held
+  size_t used = bundles_.size();
+
+  for (const auto& [id, stream] : streams_) {
+    if (stream->bundle == 0) {
+      ++used;
+    }
+  }
+
+  return used;
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::start_bundle(const file_bundle& bundle) {
+  const auto bundle_id = bundle.files.front().stream_id;
+  std::string refusal;
+
+  {
+    std::scoped_lock lk{streams_mutex_};
+
+    if (bundle.files.size() > capabilities_.max_bundle_files) {
+      refusal = "bundle is too large";
+    } else if (bundles_.contains(bundle_id) || streams_.contains(bundle_id)) {
+      refusal = "stream is already in use";
+    } else if (get_used_slots() >= std::max<size_t>(capabilities_.max_streams, 1)) {
+      refusal = "too many streams";
+    } else {
+      bundles_.emplace(bundle_id, std::deque<requested_file>(bundle.files.begin(),
+                                                             bundle.files.end()));
+    }
+  }
+
+  if (!refusal.empty()) {
+    for (const auto& requested : bundle.files) {
+      reply_with_error(requested.stream_id, refusal);
+    }
+    return;
+  }
+
+  spdlog::debug("Start sending bundle of {} files on stream {}",
+                bundle.files.size(), bundle_id);
+  open_next_bundled(bundle_id);
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::open_next_bundled(uint32_t bundle) {
+  // runs whenever a file of the bundle ended, files that cant be sent are
+  // refused and the next one is tried right away
+  while (true) {
+    requested_file next;
+
+    {
+      std::scoped_lock lk{streams_mutex_};
+      const auto it = bundles_.find(bundle);
+
+      if (it == bundles_.end()) {
+        return;
+      }
+
+      if (it->second.empty()) {
+        bundles_.erase(it);
+        return;
+      }
+
+      next = std::move(it->second.front());
+      it->second.pop_front();
+    }
+
+    if (open_stream(next, bundle)) {
+      return;
+    }
+  }
+}
+
+template <typename SocketType>
+bool server_session_base<SocketType>::open_stream(
+    const requested_file& requested, uint32_t bundle) {
+  bool first_stream = false;
+  std::string refusal;
+
+  // single streams are only added by the read handler, so nothing can sneak
+  // in between this check and inserting the stream below. the next file of a
+  // bundle replaces the one that ended and is not counted again
+  {
+    std::scoped_lock lk{streams_mutex_};
+    first_stream = streams_.empty();
+
+    if (streams_.contains(requested.stream_id)) {
+      refusal = "stream is already in use";
+    } else if (bundle == 0 &&
+               get_used_slots() >= std::max<size_t>(capabilities_.max_streams, 1)) {
+      refusal = "too many streams";
+    } else if (!used_stream_ids_.insert(requested.stream_id).second) {
+      refusal = "stream was used before";
+    }
+  }
+
+  if (!refusal.empty()) {
+    reply_with_error(requested.stream_id, refusal);
+    return false;
+  }
+
+  // files that are received here at the moment are sent on while they grow
+  std::optional<file_descriptor> partial_file;
+
+  if (!file_handler_.is_stored(requested.file_info)) {
+    partial_file = file_handler_.open_partial_file(requested.file_info);
+
+    if (!partial_file.has_value()) {
+      reply_with_error(requested.stream_id, "file doesnt exists");
+      return false;
+    }
+
+    // sendfile, manifests and casts would read past the verified part
+    if (capabilities_.plaintext || requested.manifest || requested.cast) {
+      reply_with_error(requested.stream_id, "file is not complete yet");
+      return false;
+    }
+  }
+
+  if (requested.cast) {
+    return offer_cast(requested);
+  }
+
+  auto stream = std::make_shared<outgoing_stream>();
+  stream->id = requested.stream_id;
+  stream->bundle = bundle;
+  stream->requested = requested;
+
+  if (partial_file.has_value()) {
+    spdlog::debug("relaying {} while it is received", requested.file_info.file_name);
+    stream->relayed = true;
+    stream->descriptor = std::move(partial_file.value());
+    stream->requested.signature.reset();
+  }
+
+  // the pages of a relayed file are still written back, they arent dropped
+  stream->streaming = !stream->relayed && options_.streaming_threshold > 0 &&
+                      requested.file_info.size >= options_.streaming_threshold;
+
+  if (stream->requested.signature.has_value() && !capabilities_.plaintext) {
+    if (is_valid_signature(stream->requested.signature.value())) {
+      stream->delta =
+          std::make_unique<delta_encoder>(std::move(stream->requested.signature.value()));
+    } else {
+      spdlog::debug("ignoring invalid signature of {}", requested.file_info.file_name);
+    }
+
+    stream->requested.signature.reset();
+  }
+
+  if (requested.manifest) {
+    if (!capabilities_.dedup) {
+      reply_with_error(stream->id, "manifests are not supported");
+      return false;
+    }
+
+    stream->manifest = true;
+  }
+
+  // streaming files are read with pread, their pages couldnt be dropped
+  // while they are mapped. deltas and manifests read ahead of the data they send
+  const bool mapped = options_.engine == io_engine::MMAP && !capabilities_.plaintext &&
+                      !stream->streaming && stream->delta == nullptr &&
+                      !stream->manifest && !stream->relayed;
+
+  // compressing needs the raw chunk, the ifstream path encrypts while reading
+  const bool compressed = !capabilities_.compression.empty();
+
+  if (compressed) {
+    stream->compressor =
+        chunk_compressor{get_codec(capabilities_.compression.front()).value_or(codec::NONE)};
+  }
+
+  if (stream->relayed) {
+    // opened above
+  } else if (capabilities_.plaintext || uring_ != nullptr || stream->streaming || mapped ||
+             compressed || stream->delta != nullptr || stream->manifest) {
+    auto source_file = file_handler_.open_file(requested.file_info);
+
+    if (!source_file.has_value()) {
+      spdlog::error("Cant read file");
+      reply_with_error(stream->id, "file cant be read");
+      return false;
+    }
+
+    stream->descriptor = std::move(source_file.value());
+
+    if (mapped) {
+      auto mapping = mapped_file::map(stream->descriptor);
+
+      if (mapping.has_value()) {
+        stream->mapping = std::move(mapping.value());
+      } else {
+        spdlog::debug("Cant map {}, reading it instead", requested.file_info.file_name);
+      }
+    }
+
+    if (stream->streaming) {
+      // huge files are read once from front to back, keeping them cached
+      // would only evict the files other hosts fetch
+      ::posix_fadvise(stream->descriptor.get(), requested.offset, 0,
+                      POSIX_FADV_SEQUENTIAL);
+      stream->read_until = requested.offset;
+      stream->dropped_until = requested.offset;
+    }
+  } else {
+    auto source_file = file_handler_.read_file(requested.file_info);
+
+    if (!source_file.has_value()) {
+      spdlog::error("Cant read file");
+      reply_with_error(stream->id, "file cant be read");
+      return false;
+    }
+
+    stream->ifstream = std::move(source_file.value());
+    stream->ifstream.seekg(requested.offset, stream->ifstream.beg);
+  }
+
+  stream->bar = progress_->create_file_progress(requested.file_info);
+  stream->bar->status = progress::STATUS::UPLOADING;
+  stream->bar->bytes_transferred = requested.offset;
+
+  if (first_stream) {
+    // the client proposes the initial chunk size, the negotiated maximum
+    // bounds how far it can grow. it is kept while files follow each other
+    std::scoped_lock lk{chunk_size_mutex_};
+    chunk_size_controller_ = chunk_size_controller{
+        requested.chunksize, protocol::MIN_CHUNKSIZE, capabilities_.max_chunksize};
+  }
+
+  if (capabilities_.plaintext) {
+    return send_file_plaintext(stream);
+  }
+
+  spdlog::debug("Start sending file: {} with size: {} on stream {}",
+                requested.file_info.file_name, requested.file_info.size,
+                stream->id);
+
+  stream->pipeline = std::make_unique<send_pipeline>(options_.pipeline_depth,
+                                                     options_.max_pipeline_bytes);
+
+  {
+    std::scoped_lock lk{streams_mutex_};
+    streams_.emplace(stream->id, stream);
+  }
+
+  write_file(stream);
+  return true;
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::grant_window(const window_update& update) {
+  {
+    std::scoped_lock lk{streams_mutex_};
+    const auto it = streams_.find(update.stream_id);
+
+    if (it == streams_.end()) {
+      // the stream might have ended while the update was on its way
+      return;
+    }
+
+    it->second->window += update.bytes;
+  }
+
+  schedule_write();
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::write_file(const stream_ptr& stream) {
+  if (stream->pipeline->try_start_prepare(get_next_chunksize())) {
+    // preparing runs as its own handler on the strand of the socket, the
+    // current chunk is on the wire meanwhile and the crypto pool seals the
+    // records of the next one
+    boost::asio::post(socket_.get_executor(),
+                      [me = this->shared_from_this(), stream]() {
+                        me->prepare_chunk(stream);
+                      });
+  }
+
+  schedule_write();
+
+  if (stream->pipeline->try_complete()) {
+    finish_file(stream);
+  }
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::close() {
+  {
+    std::scoped_lock lk{streams_mutex_};
+    writing_ = false;
+    streams_.clear();
+    bundles_.clear();
+    control_frames_.clear();
+  }
+
+  boost::system::error_code ec;
+  socket_.lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+  socket_.lowest_layer().close(ec);
+}
+
+template <typename SocketType>
+size_t server_session_base<SocketType>::get_next_chunksize() {
+  std::scoped_lock lk{chunk_size_mutex_};
+  return chunk_size_controller_.get_chunksize();
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::prepare_chunk(const stream_ptr& stream) {
+  const auto& requested = stream->requested;
+  const auto end = requested.get_end();
+  const auto bytes_left =
+      end - std::min(end, requested.offset + stream->bytes_prepared);
+
+  if (bytes_left == 0 || (!stream->descriptor.is_open() && !stream->ifstream)) {
+    stream->pipeline->finish_prepare();
+    write_file(stream);
+    return;
+  }
+
+  if (stream->manifest) {
+    prepare_manifest_chunk(stream);
+    return;
+  }
+
+  auto chunksize = std::min(get_next_chunksize(), bytes_left);
+
+  if (stream->relayed) {
+    const auto offset = requested.offset + stream->bytes_prepared;
+    const auto relayable = file_handler_.get_relayable_size(requested.file_info);
+
+    if (!relayable.has_value()) {
+      spdlog::debug("{} is not received anymore", requested.file_info.file_name);
+      abort_stream(stream, "file was discarded before it was complete");
+      return;
+    }
+
+    if (relayable.value() <= offset) {
+      wait_for_relay(stream);
+      return;
+    }
+
+    chunksize = std::min(chunksize, relayable.value() - offset);
+  }
+
+  if (stream->delta != nullptr) {
+    prepare_delta_chunk(stream, chunksize);
+    return;
+  }
+
+  if (uring_ != nullptr) {
+    read_chunk_uring(stream, chunksize);
+    return;
+  }
+
+  if (stream->mapping.is_mapped()) {
+    map_chunk(stream, chunksize);
+    return;
+  }
+
+  if (stream->descriptor.is_open()) {
+    read_chunk(stream, chunksize);
+    return;
+  }
+
+  prepared_chunk chunk;
+  chunk.payload = stream->pipeline->acquire_buffer();
+  derived_crypto_handler_->encrypt_file_to_buf(public_key_, stream->id,
+                                               requested.offset + stream->bytes_prepared,
+                                               stream->ifstream, chunksize, chunk.payload);
+
+  if (stream->ifstream.fail() && !stream->ifstream.eof()) {
+    spdlog::debug("Failed reading file");
+    abort_stream(stream, "file cant be read");
+    return;
+  }
+
+  if (chunk.payload.empty()) {
+    spdlog::debug("File ended before the expected size was sent");
+    abort_stream(stream, "file ended before the expected size was sent");
+    return;
+  }
+
+  stream->bytes_prepared += chunksize;
+  chunk.file_bytes = chunksize;
+  chunk.header = protocol::create_frame_header(protocol::frame_type::DATA,
+                                               stream->id, chunk.payload.size());
+  stream->pipeline->finish_prepare(std::move(chunk));
+  write_file(stream);
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::wait_for_relay(const stream_ptr& stream) {
+  auto timer = std::make_shared<boost::asio::steady_timer>(socket_.get_executor(),
+                                                           protocol::RELAY_POLL_INTERVAL);
+  timer->async_wait([me = this->shared_from_this(), stream, timer](boost::system::error_code const&) {
+    {
+      std::scoped_lock lk{me->streams_mutex_};
+
+      if (!me->streams_.contains(stream->id)) {
+        // cancelled by the receiver meanwhile
+        return;
+      }
+    }
+
+    me->prepare_chunk(stream);
+  });
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::read_chunk(const stream_ptr& stream,
+                                                 size_t chunksize) {
+  const auto bytes_read =
+      read_at(stream, stream->requested.offset + stream->bytes_prepared, chunksize);
+
+  if (bytes_read == 0) {
+    spdlog::debug("Failed reading file");
+    abort_stream(stream, "file cant be read");
+    return;
+  }
+
+  encrypt_chunk(stream, stream->read_buffer.data(), bytes_read);
+  write_file(stream);
+}
+
+template <typename SocketType>
+size_t server_session_base<SocketType>::read_at(const stream_ptr& stream,
+                                                size_t offset, size_t size) {
+  stream->read_buffer.resize(size);
+  return stream->descriptor.read_at(stream->read_buffer.data(), size, offset);
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::prepare_delta_chunk(const stream_ptr& stream,
+                                                          size_t chunksize) {
+  const auto end = stream->requested.get_end();
+  const auto offset = stream->requested.offset + stream->bytes_prepared;
+  // a block that starts within the chunk has to be seen as a whole
+  const auto bytes_read = read_at(
+      stream, offset, std::min(chunksize + stream->delta->get_block_size(), end - offset));
+
+  if (bytes_read == 0) {
+    spdlog::debug("Failed reading file");
+    abort_stream(stream, "file cant be read");
+    return;
+  }
+
+  const auto* data = stream->read_buffer.data();
+  const auto step = stream->delta->next(data, bytes_read, chunksize);
+  stream->delta_checksum.update(data, step.length);
+
+  if (step.step_type == delta_step::type::LITERAL) {
+    encrypt_chunk(stream, data, step.length);
+    write_file(stream);
+    return;
+  }
+
+  const auto payload = protocol::create_copy_payload(step.block, step.count);
+  prepared_chunk chunk;
+  chunk.payload = stream->pipeline->acquire_buffer();
+  derived_crypto_handler_->encrypt_buf(public_key_, stream->id, offset,
+                                       payload.data(), payload.size(), chunk.payload);
+
+  stream->bytes_prepared += step.length;
+  chunk.file_bytes = step.length;
+  stream->read_until = stream->requested.offset + stream->bytes_prepared;
+  drop_cache_behind(stream);
+
+  chunk.header = protocol::create_frame_header(protocol::frame_type::COPY, stream->id,
+                                               chunk.payload.size());
+  stream->pipeline->finish_prepare(std::move(chunk));
+  write_file(stream);
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::prepare_manifest_chunk(const stream_ptr& stream) {
+  const auto end = stream->requested.get_end();
+  const auto offset = stream->requested.offset + stream->bytes_prepared;
+  const auto bytes_read =
+      read_at(stream, offset, std::min<size_t>(protocol::MANIFEST_READ_SIZE, end - offset));
+
+  // a chunk that reaches past the data read is cut in the next frame
+  std::vector<content_chunk> chunks;
+  const auto covered = cut_chunks(stream->read_buffer.data(), bytes_read, offset,
+                                  offset + bytes_read == end, chunks);
+
+  if (covered == 0) {
+    spdlog::debug("Failed reading file");
+    abort_stream(stream, "file cant be read");
+    return;
+  }
+
+  std::vector<unsigned char> manifest;
+  manifest.reserve(chunks.size() * protocol::MANIFEST_ENTRY_SIZE);
+
+  for (const auto& content : chunks) {
+    protocol::append_manifest_entry(manifest, content);
+  }
+
+  prepared_chunk chunk;
+  chunk.payload = stream->pipeline->acquire_buffer();
+  derived_crypto_handler_->encrypt_buf(public_key_, stream->id, offset,
+                                       manifest.data(), manifest.size(), chunk.payload);
+
+  stream->bytes_prepared += covered;
+  chunk.file_bytes = covered;
+  stream->read_until = stream->requested.offset + stream->bytes_prepared;
+  drop_cache_behind(stream);
+
+  chunk.header = protocol::create_frame_header(protocol::frame_type::MANIFEST,
+                                               stream->id, chunk.payload.size());
+  stream->pipeline->finish_prepare(std::move(chunk));
+  write_file(stream);
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::map_chunk(const stream_ptr& stream,
+                                                size_t chunksize) {
+  const auto& mapping = stream->mapping;
+  const auto offset = stream->requested.offset + stream->bytes_prepared;
+
+  if (offset >= mapping.size()) {
+    spdlog::debug("File ended before the expected size was sent");
+    abort_stream(stream, "file ended before the expected size was sent");
+    return;
+  }
+
+  // the cipher reads straight from the mapped pages, no copy is made before
+  encrypt_chunk(stream, mapping.data() + offset,
+                std::min(chunksize, mapping.size() - offset));
+  write_file(stream);
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::read_chunk_uring(const stream_ptr& stream,
+                                                       size_t chunksize) {
+  auto registered = uring_->acquire_buffer();
+  std::span<unsigned char> buffer;
+
+  if (registered.has_value() && registered.value().size() >= chunksize) {
+    buffer = registered.value().first(chunksize);
+  } else {
+    // all registered buffers are in use, read into our own memory instead
+    if (registered.has_value()) {
+      uring_->release_buffer(registered.value());
+      registered.reset();
+    }
+
+    stream->read_buffer.resize(chunksize);
+    buffer = std::span<unsigned char>{stream->read_buffer};
+  }
+
+  uring_->async_read(
+      stream->descriptor.get(), stream->requested.offset + stream->bytes_prepared,
+      buffer.data(), buffer.size(),
+      on_executor(socket_.get_executor(),
+                  [me = this->shared_from_this(), stream, buffer,
+                   is_registered = registered.has_value()](
+                      boost::system::error_code const& ec, std::size_t bytes) {
+                    me->handle_read_chunk_uring(stream, ec, bytes, buffer,
+                                                is_registered);
+                  }));
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::handle_read_chunk_uring(
+    const stream_ptr& stream, boost::system::error_code const& error,
+    std::size_t bytes_transferred, std::span<unsigned char> buffer,
+    bool registered) {
+  if (error || bytes_transferred == 0) {
+    spdlog::debug("Failed reading file: {}",
+                  error ? error.message() : "file ended before the expected size was sent");
+
+    if (registered) {
+      uring_->release_buffer(buffer);
+    }
+
+    abort_stream(stream, "file cant be read");
+    return;
+  }
+
+  encrypt_chunk(stream, buffer.data(), bytes_transferred);
+
+  if (registered) {
+    uring_->release_buffer(buffer);
+  }
+
+  write_file(stream);
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::encrypt_chunk(const stream_ptr& stream,
+                                                    const unsigned char* data,
+                                                    size_t size) {
+  prepared_chunk chunk;
+  chunk.payload = stream->pipeline->acquire_buffer();
+  auto type = protocol::frame_type::DATA;
+
+  double link_throughput = 0;
+  {
+    std::scoped_lock lk{chunk_size_mutex_};
+    link_throughput = chunk_size_controller_.get_throughput();
+  }
+
+  // compressed or not, the chunk is sealed under the offset of the file it starts at
+  const auto offset = stream->requested.offset + stream->bytes_prepared;
+
+  if (stream->compressor.compress(data, size, link_throughput, stream->compress_buffer)) {
+    // encrypted as a full block, the payload keeps the size of the compressed chunk
+    type = protocol::frame_type::COMPRESSED_DATA;
+    derived_crypto_handler_->encrypt_buf(public_key_, stream->id, offset,
+                                         stream->compress_buffer.data(),
+                                         stream->compress_buffer.size(), chunk.payload);
+  } else {
+    derived_crypto_handler_->encrypt_buf(public_key_, stream->id, offset, data, size,
+                                         chunk.payload);
+  }
+
+  stream->bytes_prepared += size;
+  chunk.file_bytes = size;
+  stream->read_until = stream->requested.offset + stream->bytes_prepared;
+  drop_cache_behind(stream);
+
+  chunk.header = protocol::create_frame_header(type, stream->id, chunk.payload.size());
+  stream->pipeline->finish_prepare(std::move(chunk));
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::drop_cache_behind(const stream_ptr& stream) {
+  if (!stream->streaming) {
+    return;
+  }
+
+  // the body and the checksum job both advance it, whoever moves it past
+  // the other one drops the pages in between
+  const auto limit = std::min(stream->read_until.load(), stream->hashed_until.load());
+  auto dropped = stream->dropped_until.load();
+
+  do {
+    if (dropped >= limit) {
+      return;
+    }
+  } while (!stream->dropped_until.compare_exchange_weak(dropped, limit));
+
+  ::posix_fadvise(stream->descriptor.get(), dropped, limit - dropped,
+                  POSIX_FADV_DONTNEED);
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::schedule_write() {
+  std::unique_lock lk{streams_mutex_};
+
+  if (writing_) {
+    return;
+  }
+
+  if (!control_frames_.empty()) {
+    writing_ = true;
+    current_frame_ = std::move(control_frames_.front());
+    control_frames_.pop_front();
+    lk.unlock();
+    write_frame();
+    return;
+  }
+
+  // streams take turns, starting with the one after the stream written last
+  auto it = streams_.upper_bound(last_written_stream_);
+  for (size_t i = 0; i < streams_.size(); ++i, ++it) {
+    if (it == streams_.end()) {
+      it = streams_.begin();
+    }
+
+    auto stream = it->second;
+
+    if (stream->window <= 0) {
+      continue;
+    }
+
+    if (capabilities_.plaintext) {
+      const auto end = stream->requested.get_end();
+
+      if (stream->sendfile_offset >= end) {
+        continue;
+      }
+
+      writing_ = true;
+      last_written_stream_ = stream->id;
+      sendfile_chunk_left_ =
+          std::min(capabilities_.max_chunksize, end - stream->sendfile_offset);
+      stream->window -= sendfile_chunk_left_;
+      lk.unlock();
+      throttle(sendfile_chunk_left_ + protocol::FRAME_HEADER_SIZE,
+               [me = this->shared_from_this(), stream] { me->write_plaintext_chunk(stream); });
+      return;
+    }
+
+    auto* chunk = stream->pipeline->try_start_write();
+
+    if (chunk == nullptr) {
+      continue;
+    }
+
+    writing_ = true;
+    last_written_stream_ = stream->id;
+    stream->window -= chunk->payload.size();
+    lk.unlock();
+    throttle(chunk->header.size() + chunk->payload.size(),
+             [me = this->shared_from_this(), stream, chunk] { me->write_chunk(stream, chunk); });
+    return;
+  }
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::throttle(size_t bytes, std::function<void()> write) {
+  const auto delay =
+      limiter_ == nullptr
+          ? rate_limiter::clock::duration::zero()
+          : limiter_->reserve(direction::UPLOAD, public_key_, bytes,
+                              capabilities_.background ? priority::BACKGROUND
+                                                       : priority::INTERACTIVE);
+
+  if (delay <= rate_limiter::clock::duration::zero()) {
+    write();
+    return;
+  }
+
+  // writing_ stays set while waiting, so no other stream jumps in
+  auto timer = std::make_shared<boost::asio::steady_timer>(socket_.get_executor(), delay);
+  timer->async_wait([timer, write = std::move(write)](boost::system::error_code const&) {
+    write();
+  });
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::finish_write() {
+  {
+    std::scoped_lock lk{streams_mutex_};
+    writing_ = false;
+  }
+
+  schedule_write();
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::write_frame() {
+  async_write(socket_, boost::asio::buffer(current_frame_),
               [me = this->shared_from_this()](
                   boost::system::error_code const& ec, std::size_t) {
-                if (!ec) {
-                  spdlog::debug("Done sending response");
-                } else {
+                if (ec) {
                   spdlog::debug("async write failed: {}", ec.message());
+                  me->close();
+                  return;
                 }
+
+                me->finish_write();
               });
 }
 
 template <typename SocketType>
-void server_session_base<SocketType>::read_confirmation() {
-  boost::asio::async_read_until(
-      socket_, stream_buffer_, mfsync::protocol::MFSYNC_HEADER_END,
-      [me = this->shared_from_this()](boost::system::error_code const& error,
-                                      std::size_t bytes_transferred) {
-        me->handle_read_confirmation(error, bytes_transferred);
-      });
+void server_session_base<SocketType>::write_chunk(const stream_ptr& stream,
+                                                  prepared_chunk* chunk) {
+  const std::array<boost::asio::const_buffer, 2> buffers{
+      boost::asio::buffer(chunk->header),
+      boost::asio::buffer(chunk->payload.data(), chunk->payload.size())};
+
+  spdlog::debug("Writing {} bytes on stream {}.", chunk->payload.size(), stream->id);
+  write_started_ = chunk_size_controller::clock::now();
+
+  if constexpr (RAW_SOCKET) {
+    if (uring_ != nullptr) {
+      std::vector<iovec> iovecs{
+          iovec{chunk->header.data(), chunk->header.size()},
+          iovec{chunk->payload.data(), chunk->payload.size()}};
+
+      uring_->async_write(socket_.native_handle(), std::move(iovecs),
+                          on_executor(socket_.get_executor(),
+                                      [me = this->shared_from_this(), stream,
+                                       file_bytes = chunk->file_bytes](
+                                          boost::system::error_code const& ec,
+                                          std::size_t bytes) {
+                                        me->handle_write_file(stream, file_bytes, ec,
+                                                              bytes);
+                                      }));
+      return;
+    }
+  }
+
+  async_write(socket_, buffers,
+              [me = this->shared_from_this(), stream, file_bytes = chunk->file_bytes](
+                  boost::system::error_code const& ec, std::size_t bytes) {
+                me->handle_write_file(stream, file_bytes, ec, bytes);
+              });
 }
 
 template <typename SocketType>
-void server_session_base<SocketType>::handle_read_confirmation(
+void server_session_base<SocketType>::handle_write_file(
+    const stream_ptr& stream, size_t file_bytes,
     boost::system::error_code const& error, std::size_t bytes_transferred) {
   if (error) {
-    spdlog::debug("Error during read_confirmation: {}", error.message());
+    // a frame may have been written partly, nothing can follow it
+    spdlog::debug("async write failed: {}", error.message());
+    close();
     return;
   }
 
-  boost::asio::streambuf::const_buffers_type bufs = stream_buffer_.data();
-  std::string message(boost::asio::buffers_begin(bufs),
-                      boost::asio::buffers_begin(bufs) + bytes_transferred);
+  {
+    std::scoped_lock lk{chunk_size_mutex_};
+    chunk_size_controller_.set_rtt(get_rtt());
+    chunk_size_controller_.update(
+        bytes_transferred, chunk_size_controller::clock::now() - write_started_);
+    spdlog::trace("next chunk size: {}", chunk_size_controller_.get_chunksize());
+  }
 
-  const auto got_accepted = protocol::converter<bool>::from_message(
-      message, public_key_, *derived_crypto_handler_.get());
+  // the frame carries tags and may be compressed, the bar counts file bytes
+  stream->bar->bytes_transferred += file_bytes;
+  stream->pipeline->finish_write();
 
-  if (!got_accepted.has_value() || !got_accepted.value()) {
-    spdlog::debug("begin transmission wasnt confirmed. aborting");
-    spdlog::debug("message was: {}", message);
-    return;
+  {
+    std::scoped_lock lk{streams_mutex_};
+    writing_ = false;
   }
 
-  auto source_file = file_handler_.read_file(requested_.file_info);
+  write_file(stream);
+}
 
-  if (!source_file.has_value()) {
-    spdlog::error("Cant read file");
-    // handle_error();
-    return;
+template <typename SocketType>
+void server_session_base<SocketType>::finish_file(const stream_ptr& stream) {
+  stream->bar->bytes_transferred = stream->requested.get_end();
+  stream->bar->status = progress::STATUS::DONE;
+  spdlog::debug("Done sending file on stream {}.", stream->id);
+
+  {
+    std::scoped_lock lk{streams_mutex_};
+
+    if (!streams_.contains(stream->id)) {
+      // the stream was aborted, the receiver already got an error frame
+      return;
+    }
+
+    std::string message;
+
+    if (stream->delta != nullptr) {
+      stream->checksum = stream->delta_checksum.finalize();
+    }
+
+    if (capabilities_.plaintext || stream->delta != nullptr) {
+      // sealed as the last record of the stream, the receiver may drop it
+      // without throwing off the nonces of the messages that follow
+      message = protocol::converter<transfer_checksum>::to_message(
+          {.sha256sum = stream->checksum}, stream->requested, public_key_,
+          *derived_crypto_handler_.get());
+    }
+
+    streams_.erase(stream->id);
+    control_frames_.push_back(
+        protocol::create_frame(protocol::frame_type::END, stream->id, message));
   }
 
-  ifstream_ = std::move(source_file.value());
+  schedule_write();
 
-  ifstream_.seekg(0, ifstream_.end);
-  const auto file_size = ifstream_.tellg();
-  ifstream_.seekg(requested_.offset, ifstream_.beg);
+  if (stream->bundle != 0) {
+    open_next_bundled(stream->bundle);
+  }
+}
 
-  //spdlog::debug("Start sending file: {} with size: {}",
-                //requested_.file_info.file_name, file_size);
+template <typename SocketType>
+bool server_session_base<SocketType>::offer_cast(const requested_file& requested) {
+  const auto offer = capabilities_.multicast && caster_ != nullptr
+                         ? caster_->join(requested.file_info)
+                         : std::nullopt;
 
-  if (bar_ == nullptr) {
-    bar_ = progress_->create_file_progress(requested_.file_info);
-    bar_->status = progress::STATUS::UPLOADING;
+  if (!offer.has_value()) {
+    reply_with_error(requested.stream_id, "file cant be cast");
+    return false;
   }
 
-  writebuf_.resize(requested_.chunksize);
-  write_file();
+  spdlog::debug("casting {} to {} as transfer {}", requested.file_info.file_name,
+                public_key_, offer.value().transfer_id);
+
+  const auto message = protocol::converter<cast_offer>::to_message(
+      offer.value(), requested, public_key_, *derived_crypto_handler_.get());
+
+  {
+    std::scoped_lock lk{streams_mutex_};
+    control_frames_.push_back(
+        protocol::create_frame(protocol::frame_type::END, requested.stream_id, message));
+  }
+
+  schedule_write();
+  return true;
 }
 
 template <typename SocketType>
-void server_session_base<SocketType>::write_file() {
-  if (!ifstream_) {
-    bar_->bytes_transferred = requested_.file_info.size;
-    bar_->status = progress::STATUS::DONE;
-    bar_ = nullptr;
-    spdlog::debug("Done sending file.");
-    return;
+bool server_session_base<SocketType>::send_file_plaintext(
+    const stream_ptr& stream) {
+  if constexpr (!RAW_SOCKET) {
+    spdlog::error("plaintext transfers are not supported on tls sessions");
+    reply_with_error(stream->id, "plaintext transfers are not supported on tls sessions");
+    return false;
   }
 
-  // ifstream_.read(reinterpret_cast<char*>(writebuf_.data()),
-  // writebuf_.size());
-  writebuf_.clear();
-  derived_crypto_handler_->encrypt_file_to_buf(public_key_, ifstream_,
-                                      requested_.chunksize, writebuf_);
+  const auto& requested = stream->requested;
+  stream->sendfile_offset = std::min(requested.offset, requested.get_end());
 
-  bar_->bytes_transferred = ifstream_.tellg();
+  boost::system::error_code ec;
+  socket_.lowest_layer().native_non_blocking(true, ec);
 
-  if (ifstream_.fail() && !ifstream_.eof()) {
-    spdlog::debug("Failed reading file");
-    // handle_error();
-    return;
+  if (ec) {
+    spdlog::debug("Could not make socket non blocking: {}", ec.message());
+    reply_with_error(stream->id, "file cant be sent");
+    return false;
   }
 
-  spdlog::debug("Writing {} bytes.", writebuf_.size());
-  async_write(socket_, boost::asio::buffer(writebuf_.data(), writebuf_.size()),
-              [me = this->shared_from_this()](
+  spdlog::debug("Start sending file: {} unencrypted with size: {} on stream {}",
+                requested.file_info.file_name, requested.file_info.size,
+                stream->id);
+
+  {
+    std::scoped_lock lk{streams_mutex_};
+    streams_.emplace(stream->id, stream);
+  }
+
+  // the checksum is calculated from the page cache while the body is
+  // streamed, whichever job finishes last ends the stream. both run on the
+  // strand of the socket, the checksum a slice at a time
+  stream->hashed_until = stream->sendfile_offset;
+  stream->pending_plaintext_jobs = 2;
+  boost::asio::post(socket_.get_executor(),
+                    [me = this->shared_from_this(), stream]() {
+                      me->hash_plaintext_range(stream);
+                    });
+
+  if (stream->sendfile_offset >= requested.get_end()) {
+    finish_plaintext_job(stream);
+    return true;
+  }
+
+  schedule_write();
+  return true;
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::write_plaintext_chunk(
+    const stream_ptr& stream) {
+  plaintext_header_ = protocol::create_frame_header(
+      protocol::frame_type::DATA, stream->id, sendfile_chunk_left_);
+
+  if (options_.sockets.server.cork) {
+    // the header leaves together with the start of the body
+    set_cork(socket_.lowest_layer().native_handle(), true);
+  }
+
+  async_write(socket_, boost::asio::buffer(plaintext_header_),
+              [me = this->shared_from_this(), stream](
                   boost::system::error_code const& ec, std::size_t) {
-                if (!ec) {
-                  me->write_file();
-                } else {
+                if (ec) {
                   spdlog::debug("async write failed: {}", ec.message());
+                  me->close();
+                  return;
                 }
+
+                me->sendfile_chunk(stream);
               });
 }
 
+template <typename SocketType>
+void server_session_base<SocketType>::sendfile_chunk(const stream_ptr& stream) {
+  auto& socket = socket_.lowest_layer();
+
+  while (sendfile_chunk_left_ > 0) {
+    auto offset = static_cast<off_t>(stream->sendfile_offset);
+    const auto sent = ::sendfile(socket.native_handle(), stream->descriptor.get(),
+                                 &offset, sendfile_chunk_left_);
+
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      socket.async_wait(boost::asio::socket_base::wait_write,
+                        [me = this->shared_from_this(), stream](
+                            boost::system::error_code const& ec) {
+                          if (ec) {
+                            spdlog::debug("async wait failed: {}", ec.message());
+                            me->close();
+                            return;
+                          }
+
+                          me->sendfile_chunk(stream);
+                        });
+      return;
+    }
+
+    if (sent <= 0) {
+      // the frame header announced more bytes than were sent, the
+      // connection cant be used anymore
+      spdlog::debug("sendfile failed: {}",
+                    sent < 0 ? std::strerror(errno)
+                             : "file ended before the expected size was sent");
+      close();
+      return;
+    }
+
+    stream->sendfile_offset += sent;
+    sendfile_chunk_left_ -= sent;
+    stream->bar->bytes_transferred += sent;
+    stream->read_until = stream->sendfile_offset;
+    drop_cache_behind(stream);
+  }
+
+  const bool sent_all =
+      stream->sendfile_offset >= stream->requested.get_end();
+
+  if (options_.sockets.server.cork) {
+    set_cork(socket.native_handle(), false);
+  }
+
+  finish_write();
+
+  if (sent_all) {
+    finish_plaintext_job(stream);
+  }
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::hash_plaintext_range(
+    const stream_ptr& stream) {
+  const auto end = stream->requested.get_end();
+  const auto offset = stream->hashed_until.load();
+
+  if (offset < end) {
+    // sendfile streams dont read into read_buffer, it holds the slice
+    auto& buffer = stream->read_buffer;
+    buffer.resize(protocol::MAX_CHUNKSIZE);
+    const auto count = std::min(buffer.size(), end - offset);
+    const auto bytes_read = stream->descriptor.read_at(buffer.data(), count, offset);
+
+    if (bytes_read == 0) {
+      spdlog::debug("Failed reading file for checksum");
+      finish_plaintext_job(stream);
+      return;
+    }
+
+    stream->plaintext_checksum.update(buffer.data(), bytes_read);
+    stream->hashed_until = offset + bytes_read;
+    drop_cache_behind(stream);
+
+    // the next slice waits behind the handlers that were queued meanwhile
+    boost::asio::post(socket_.get_executor(),
+                      [me = this->shared_from_this(), stream]() {
+                        me->hash_plaintext_range(stream);
+                      });
+    return;
+  }
+
+  stream->checksum = stream->plaintext_checksum.finalize();
+  finish_plaintext_job(stream);
+}
+
+template <typename SocketType>
+void server_session_base<SocketType>::finish_plaintext_job(
+    const stream_ptr& stream) {
+  if (--stream->pending_plaintext_jobs != 0) {
+    return;
+  }
+
+  if (stream->checksum.empty()) {
+    spdlog::error("Could not calculate checksum of {}",
+                  stream->requested.file_info.file_name);
+    abort_stream(stream, "checksum cant be calculated");
+    return;
+  }
+
+  finish_file(stream);
+}
+
+template <typename SocketType>
+std::chrono::microseconds server_session_base<SocketType>::get_rtt() {
+#ifdef TCP_INFO
+  tcp_info info{};
+  socklen_t length = sizeof(info);
+  if (getsockopt(socket_.lowest_layer().native_handle(), IPPROTO_TCP,
+                 TCP_INFO, &info, &length) == 0) {
+    return std::chrono::microseconds(info.tcpi_rtt);
+  }
+#endif
+
+  return std::chrono::microseconds(0);
+}
+
 }  // namespace mfsync::filetransfer
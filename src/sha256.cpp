@@ -0,0 +1,34 @@
+#include "mfsync/sha256.h"
+
+#include <array>
+#include <cstdio>
+
+namespace mfsync
+{
+
+sha256::sha256()
+{
+  SHA256_Init(&context_);
+}
+
+void sha256::update(const void* data, size_t size)
+{
+  SHA256_Update(&context_, data, size);
+}
+
+std::string sha256::finalize()
+{
+  std::array<uint8_t, SHA256_DIGEST_LENGTH> hash;
+  SHA256_Final(hash.data(), &context_);
+
+  std::array<char, 65> output_buffer;
+  for(int i = 0; i < SHA256_DIGEST_LENGTH; ++i)
+  {
+      std::sprintf(output_buffer.data() + (i * 2), "%02x", hash[i]);
+  }
+  output_buffer[64] = 0;
+
+  return std::string{output_buffer.data(), 64};
+}
+
+} //closing namespace mfsync
@@ -0,0 +1,173 @@
+#include "mfsync/socket_options.h"
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <string_view>
+
+#include "spdlog/spdlog.h"
+
+namespace mfsync
+{
+
+namespace
+{
+  void set_int_option(int fd, int level, int name, int value, const char* description)
+  {
+    if(::setsockopt(fd, level, name, &value, sizeof(value)) != 0)
+    {
+      spdlog::error("Could not set {} to {}: {}", description, value, std::strerror(errno));
+    }
+  }
+
+  int get_family(int fd)
+  {
+    sockaddr_storage address{};
+    socklen_t length = sizeof(address);
+
+    if(::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+    {
+      return AF_UNSPEC;
+    }
+
+    return address.ss_family;
+  }
+} //closing anonymous namespace
+
+const socket_tuning& socket_options::get(socket_role role) const
+{
+  switch(role)
+  {
+    case socket_role::SERVER:
+      return server;
+    case socket_role::CLIENT:
+      return client;
+    case socket_role::DISCOVERY:
+      break;
+  }
+
+  return discovery;
+}
+
+void apply_socket_tuning(int fd, const socket_tuning& tuning, bool tcp /* = true */)
+{
+  if(tuning.send_buffer > 0)
+  {
+    set_int_option(fd, SOL_SOCKET, SO_SNDBUF, tuning.send_buffer, "SO_SNDBUF");
+  }
+
+  if(tuning.receive_buffer > 0)
+  {
+    set_int_option(fd, SOL_SOCKET, SO_RCVBUF, tuning.receive_buffer, "SO_RCVBUF");
+  }
+
+  if(tuning.tos >= 0)
+  {
+    if(get_family(fd) == AF_INET6)
+    {
+      set_int_option(fd, IPPROTO_IPV6, IPV6_TCLASS, tuning.tos, "IPV6_TCLASS");
+    }
+    else
+    {
+      set_int_option(fd, IPPROTO_IP, IP_TOS, tuning.tos, "IP_TOS");
+    }
+  }
+
+  if(!tcp)
+  {
+    return;
+  }
+
+  if(tuning.no_delay)
+  {
+    set_int_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  }
+
+  if(tuning.keepalive)
+  {
+    set_int_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+
+    if(tuning.keepalive_idle > 0)
+    {
+      set_int_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, tuning.keepalive_idle, "TCP_KEEPIDLE");
+    }
+
+    if(tuning.keepalive_interval > 0)
+    {
+      set_int_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, tuning.keepalive_interval, "TCP_KEEPINTVL");
+    }
+
+    if(tuning.keepalive_count > 0)
+    {
+      set_int_option(fd, IPPROTO_TCP, TCP_KEEPCNT, tuning.keepalive_count, "TCP_KEEPCNT");
+    }
+  }
+
+#ifdef TCP_CONGESTION
+  if(!tuning.congestion.empty()
+     && ::setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, tuning.congestion.data(),
+                     tuning.congestion.size()) != 0)
+  {
+    //the module may not be loaded or not be allowed for unprivileged users
+    spdlog::error("Could not set congestion control to {}: {}", tuning.congestion,
+                  std::strerror(errno));
+  }
+#endif
+}
+
+void set_cork(int fd, bool value)
+{
+#ifdef TCP_CORK
+  set_int_option(fd, IPPROTO_TCP, TCP_CORK, value ? 1 : 0, "TCP_CORK");
+#endif
+}
+
+bool add_socket_option(nlohmann::json& j, const std::string& option)
+{
+  static constexpr std::array<std::string_view, 3> roles{ "server", "client", "discovery" };
+  static const auto keys = nlohmann::json(socket_tuning{});
+
+  const auto dot = option.find('.');
+  const auto equals = option.find('=');
+
+  if(dot == std::string::npos || equals == std::string::npos || equals < dot)
+  {
+    return false;
+  }
+
+  const auto role = option.substr(0, dot);
+  const auto key = option.substr(dot + 1, equals - dot - 1);
+  const auto value = option.substr(equals + 1);
+
+  if(std::find(roles.begin(), roles.end(), role) == roles.end() || !keys.contains(key))
+  {
+    return false;
+  }
+
+  const auto& expected = keys.at(key);
+
+  if(expected.is_string())
+  {
+    j[role][key] = value;
+    return true;
+  }
+
+  const auto parsed = nlohmann::json::parse(value, nullptr, false);
+  if(parsed.is_discarded()
+     || (expected.is_number() && !parsed.is_number_integer())
+     || (expected.is_boolean() && !parsed.is_boolean()))
+  {
+    return false;
+  }
+
+  j[role][key] = parsed;
+  return true;
+}
+
+} //closing namespace mfsync
@@ -0,0 +1,68 @@
+#include "mfsync/stream_output.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+#include "mfsync/file_descriptor.h"
+
+namespace mfsync
+{
+
+stream_output::stream_output(int fd, size_t offset /* = 0 */, size_t length /* = 0 */)
+  : fd_(fd)
+  , offset_(offset)
+  , length_(length)
+{
+}
+
+size_t stream_output::get_offset() const
+{
+  return offset_;
+}
+
+size_t stream_output::get_length() const
+{
+  return length_;
+}
+
+bool stream_output::write(const unsigned char* data, size_t size)
+{
+  if(failed_)
+  {
+    return false;
+  }
+
+  if(!file_descriptor::write_all(fd_, data, size))
+  {
+    //usually the consumer exited, EPIPE
+    spdlog::error("Could not write to output: {}", std::strerror(errno));
+    finish(false);
+    return false;
+  }
+
+  return true;
+}
+
+void stream_output::finish(bool success)
+{
+  if(!success)
+  {
+    failed_ = true;
+  }
+
+  done_ = true;
+}
+
+bool stream_output::is_done() const
+{
+  return done_;
+}
+
+bool stream_output::failed() const
+{
+  return failed_;
+}
+
+} //closing namespace mfsync
@@ -0,0 +1,457 @@
+#include "mfsync/uring_context.h"
+
+#include "spdlog/spdlog.h"
+
+#ifdef MFSYNC_USE_IO_URING
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <cstring>
+#include <mutex>
+
+#include <liburing.h>
+
+namespace mfsync::filetransfer
+{
+
+namespace
+{
+
+struct operation
+{
+  enum class kind
+  {
+    READ,
+    WRITE,
+    RECEIVE
+  };
+
+  kind type = kind::READ;
+  int fd = -1;
+  uint64_t offset = 0;
+  std::vector<iovec> buffers;
+  msghdr message{};
+  std::optional<int> buffer_index;
+  size_t transferred = 0;
+  size_t total = 0;
+  uring_context::handler callback;
+};
+
+} //closing anonymous namespace
+
+struct uring_context::impl
+{
+  impl(boost::asio::any_io_executor executor_, int eventfd)
+    : executor(executor_)
+    , eventfd_descriptor(executor_, eventfd)
+  {
+  }
+
+  ~impl()
+  {
+    boost::system::error_code ec;
+    eventfd_descriptor.close(ec);
+
+    if(ring_initialized)
+    {
+      io_uring_queue_exit(&ring);
+    }
+  }
+
+  void enqueue(std::unique_ptr<operation> op)
+  {
+    std::scoped_lock lk{mutex};
+
+    auto* sqe = io_uring_get_sqe(&ring);
+
+    if(sqe == nullptr)
+    {
+      //submission queue is full, flush it early
+      io_uring_submit(&ring);
+      sqe = io_uring_get_sqe(&ring);
+    }
+
+    if(sqe == nullptr)
+    {
+      spdlog::debug("io_uring submission queue is full");
+      boost::asio::post(executor, [callback = std::move(op->callback)]()
+      {
+        callback(boost::asio::error::no_buffer_space, 0);
+      });
+      return;
+    }
+
+    prepare(sqe, *op);
+    io_uring_sqe_set_data(sqe, op.release());
+
+    if(!flush_pending)
+    {
+      flush_pending = true;
+      boost::asio::post(executor, [this]() { flush(); });
+    }
+  }
+
+  void prepare(io_uring_sqe* sqe, operation& op)
+  {
+    switch(op.type)
+    {
+      case operation::kind::READ:
+      {
+        auto& buffer = op.buffers.front();
+        if(op.buffer_index.has_value())
+        {
+          io_uring_prep_read_fixed(sqe, op.fd, buffer.iov_base, buffer.iov_len,
+                                   op.offset, op.buffer_index.value());
+        }
+        else
+        {
+          io_uring_prep_read(sqe, op.fd, buffer.iov_base, buffer.iov_len, op.offset);
+        }
+        break;
+      }
+      case operation::kind::WRITE:
+        op.message = msghdr{};
+        op.message.msg_iov = op.buffers.data();
+        op.message.msg_iovlen = op.buffers.size();
+        io_uring_prep_sendmsg(sqe, op.fd, &op.message, MSG_NOSIGNAL);
+        break;
+      case operation::kind::RECEIVE:
+      {
+        auto& buffer = op.buffers.front();
+        io_uring_prep_recv(sqe, op.fd, buffer.iov_base, buffer.iov_len, MSG_WAITALL);
+        break;
+      }
+    }
+  }
+
+  void flush()
+  {
+    std::scoped_lock lk{mutex};
+    flush_pending = false;
+    io_uring_submit(&ring);
+  }
+
+  void wait_for_completions()
+  {
+    eventfd_descriptor.async_read_some(boost::asio::buffer(&eventfd_value, sizeof(eventfd_value)),
+      [this](const boost::system::error_code& ec, std::size_t)
+      {
+        if(ec)
+        {
+          if(ec != boost::asio::error::operation_aborted)
+          {
+            spdlog::error("waiting for io_uring completions failed: {}", ec.message());
+          }
+          return;
+        }
+
+        reap();
+        wait_for_completions();
+      });
+  }
+
+  void reap()
+  {
+    std::vector<std::pair<std::unique_ptr<operation>, int>> completed;
+
+    {
+      std::scoped_lock lk{mutex};
+      io_uring_cqe* cqe = nullptr;
+      while(io_uring_peek_cqe(&ring, &cqe) == 0)
+      {
+        completed.emplace_back(static_cast<operation*>(io_uring_cqe_get_data(cqe)), cqe->res);
+        io_uring_cqe_seen(&ring, cqe);
+      }
+    }
+
+    for(auto& [op, result] : completed)
+    {
+      complete(std::move(op), result);
+    }
+  }
+
+  void complete(std::unique_ptr<operation> op, int result)
+  {
+    if(result < 0)
+    {
+      op->callback(boost::system::error_code(-result, boost::system::system_category()),
+                   op->transferred);
+      return;
+    }
+
+    if(op->type == operation::kind::READ)
+    {
+      op->callback({}, static_cast<size_t>(result));
+      return;
+    }
+
+    if(result == 0)
+    {
+      op->callback(boost::asio::error::eof, op->transferred);
+      return;
+    }
+
+    op->transferred += result;
+
+    if(op->transferred >= op->total)
+    {
+      op->callback({}, op->transferred);
+      return;
+    }
+
+    //socket operations are short sometimes, continue with the rest
+    consume(op->buffers, result);
+    enqueue(std::move(op));
+  }
+
+  static void consume(std::vector<iovec>& buffers, size_t bytes)
+  {
+    auto it = buffers.begin();
+    while(it != buffers.end() && bytes >= it->iov_len)
+    {
+      bytes -= it->iov_len;
+      ++it;
+    }
+
+    buffers.erase(buffers.begin(), it);
+
+    if(!buffers.empty())
+    {
+      buffers.front().iov_base = static_cast<unsigned char*>(buffers.front().iov_base) + bytes;
+      buffers.front().iov_len -= bytes;
+    }
+  }
+
+  std::optional<int> find_buffer_index(const unsigned char* data, size_t size) const
+  {
+    for(size_t i = 0; i < registered.size(); ++i)
+    {
+      const auto* begin = registered[i].data();
+      if(data >= begin && data + size <= begin + registered[i].size())
+      {
+        return static_cast<int>(i);
+      }
+    }
+
+    return std::nullopt;
+  }
+
+  boost::asio::any_io_executor executor;
+  boost::asio::posix::stream_descriptor eventfd_descriptor;
+  uint64_t eventfd_value = 0;
+  io_uring ring{};
+  bool ring_initialized = false;
+  std::mutex mutex;
+  bool flush_pending = false;
+
+  std::vector<std::vector<unsigned char>> registered;
+  std::vector<size_t> free_buffers;
+  std::mutex buffer_mutex;
+  size_t buffer_size = 0;
+};
+
+uring_context::uring_context(std::unique_ptr<impl> impl)
+  : impl_(std::move(impl))
+{
+}
+
+uring_context::~uring_context() = default;
+
+std::unique_ptr<uring_context> uring_context::create(boost::asio::any_io_executor executor,
+                                                     unsigned entries,
+                                                     size_t buffer_count,
+                                                     size_t buffer_size)
+{
+  const int eventfd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+  if(eventfd < 0)
+  {
+    spdlog::error("could not create eventfd for io_uring");
+    return nullptr;
+  }
+
+  auto result = std::make_unique<impl>(executor, eventfd);
+
+  if(const int ec = io_uring_queue_init(entries, &result->ring, 0); ec < 0)
+  {
+    spdlog::error("io_uring setup failed: {}", std::strerror(-ec));
+    return nullptr;
+  }
+
+  result->ring_initialized = true;
+
+  if(const int ec = io_uring_register_eventfd(&result->ring, eventfd); ec < 0)
+  {
+    spdlog::error("io_uring eventfd registration failed: {}", std::strerror(-ec));
+    return nullptr;
+  }
+
+  result->buffer_size = buffer_size;
+  result->registered.resize(buffer_count);
+  std::vector<iovec> iovecs;
+  for(size_t i = 0; i < buffer_count; ++i)
+  {
+    result->registered[i].resize(buffer_size);
+    iovecs.push_back(iovec{result->registered[i].data(), buffer_size});
+    result->free_buffers.push_back(i);
+  }
+
+  if(!iovecs.empty())
+  {
+    if(const int ec = io_uring_register_buffers(&result->ring, iovecs.data(), iovecs.size()); ec < 0)
+    {
+      //still usable, reads just wont use fixed buffers
+      spdlog::info("io_uring buffer registration failed: {}", std::strerror(-ec));
+      result->registered.clear();
+      result->free_buffers.clear();
+    }
+  }
+
+  result->wait_for_completions();
+  spdlog::debug("io_uring initialized with {} entries and {} registered buffers",
+                entries, result->registered.size());
+
+  return std::unique_ptr<uring_context>(new uring_context(std::move(result)));
+}
+
+bool uring_context::is_compiled_in()
+{
+  return true;
+}
+
+void uring_context::async_read(int fd, uint64_t offset, unsigned char* data, size_t size, handler callback)
+{
+  auto op = std::make_unique<operation>();
+  op->type = operation::kind::READ;
+  op->fd = fd;
+  op->offset = offset;
+  op->buffers.push_back(iovec{data, size});
+  op->buffer_index = impl_->find_buffer_index(data, size);
+  op->total = size;
+  op->callback = std::move(callback);
+  impl_->enqueue(std::move(op));
+}
+
+void uring_context::async_write(int fd, std::vector<iovec> buffers, handler callback)
+{
+  auto op = std::make_unique<operation>();
+  op->type = operation::kind::WRITE;
+  op->fd = fd;
+  op->total = 0;
+  for(const auto& buffer : buffers)
+  {
+    op->total += buffer.iov_len;
+  }
+  op->buffers = std::move(buffers);
+  op->callback = std::move(callback);
+  impl_->enqueue(std::move(op));
+}
+
+void uring_context::async_receive(int fd, unsigned char* data, size_t size, handler callback)
+{
+  auto op = std::make_unique<operation>();
+  op->type = operation::kind::RECEIVE;
+  op->fd = fd;
+  op->buffers.push_back(iovec{data, size});
+  op->total = size;
+  op->callback = std::move(callback);
+  impl_->enqueue(std::move(op));
+}
+
+std::optional<std::span<unsigned char>> uring_context::acquire_buffer()
+{
+  std::scoped_lock lk{impl_->buffer_mutex};
+
+  if(impl_->free_buffers.empty())
+  {
+    return std::nullopt;
+  }
+
+  const auto index = impl_->free_buffers.back();
+  impl_->free_buffers.pop_back();
+  return std::span<unsigned char>{impl_->registered[index]};
+}
+
+void uring_context::release_buffer(std::span<unsigned char> buffer)
+{
+  const auto index = impl_->find_buffer_index(buffer.data(), buffer.size());
+
+  if(!index.has_value())
+  {
+    return;
+  }
+
+  std::scoped_lock lk{impl_->buffer_mutex};
+  impl_->free_buffers.push_back(index.value());
+}
+
+size_t uring_context::get_buffer_size() const
+{
+  return impl_->buffer_size;
+}
+
+} //closing namespace mfsync::filetransfer
+
+#else
+
+namespace mfsync::filetransfer
+{
+
+struct uring_context::impl
+{
+};
+
+uring_context::uring_context(std::unique_ptr<impl> impl)
+  : impl_(std::move(impl))
+{
+}
+
+uring_context::~uring_context() = default;
+
+std::unique_ptr<uring_context> uring_context::create(boost::asio::any_io_executor,
+                                                     unsigned,
+                                                     size_t,
+                                                     size_t)
+{
+  spdlog::info("mfsync was built without io_uring support");
+  return nullptr;
+}
+
+bool uring_context::is_compiled_in()
+{
+  return false;
+}
+
+void uring_context::async_read(int, uint64_t, unsigned char*, size_t, handler callback)
+{
+  callback(boost::asio::error::operation_not_supported, 0);
+}
+
+void uring_context::async_write(int, std::vector<iovec>, handler callback)
+{
+  callback(boost::asio::error::operation_not_supported, 0);
+}
+
+void uring_context::async_receive(int, unsigned char*, size_t, handler callback)
+{
+  callback(boost::asio::error::operation_not_supported, 0);
+}
+
+std::optional<std::span<unsigned char>> uring_context::acquire_buffer()
+{
+  return std::nullopt;
+}
+
+void uring_context::release_buffer(std::span<unsigned char>)
+{
+}
+
+size_t uring_context::get_buffer_size() const
+{
+  return 0;
+}
+
+} //closing namespace mfsync::filetransfer
+
+#endif
@@ -2,9 +2,32 @@
 
 #include <catch2/catch.hpp>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <csignal>
+
 #include "mfsync/file_handler.h"
 #include "mfsync/protocol.h"
+#include "mfsync/resume_journal.h"
 #include "mfsync/file_receive_handler.h"
+#include "mfsync/segmented_download.h"
+#include "mfsync/chunk_size_controller.h"
+#include "mfsync/compression.h"
+#include "mfsync/content_chunking.h"
+#include "mfsync/delta.h"
+#include "mfsync/fec.h"
+#include "mfsync/mapped_file.h"
+#include "mfsync/multicast_transfer.h"
+#include "mfsync/rate_limiter.h"
+#include "mfsync/send_pipeline.h"
+#include "mfsync/server_session.h"
+#include "mfsync/socket_options.h"
+#include "mfsync/stream_output.h"
+#include "mfsync/sha256.h"
+#include "mfsync/transfer_options.h"
 
 TEST_CASE("storage test", "[file_handler]") {
     auto handler = mfsync::file_handler();
@@ -194,3 +217,1044 @@ TEST_CASE("request files by directory test", "[file_receive_handler]") {
   const auto request_queue_size = receive_handler.fill_request_queue_test();
   REQUIRE(request_queue_size == 3);
 }
+
+TEST_CASE("frame header serialization", "[protocol]") {
+  using mfsync::protocol::frame_type;
+
+  for(uint32_t size : { 0u, 1u, 1024u, 65536u, 4194304u, 0xffffffffu })
+  {
+    const auto header = mfsync::protocol::create_frame_header(frame_type::DATA, size ^ 0xabcdu, size);
+    const auto frame = mfsync::protocol::get_frame_from_header(header);
+    REQUIRE(frame.has_value());
+    REQUIRE(frame.value().type == frame_type::DATA);
+    REQUIRE(frame.value().stream_id == (size ^ 0xabcdu));
+    REQUIRE(frame.value().length == size);
+  }
+
+  const auto error = mfsync::protocol::create_frame(frame_type::ERROR, 7, "denied");
+  REQUIRE(error.size() == mfsync::protocol::FRAME_HEADER_SIZE + 6);
+  REQUIRE(error.ends_with("denied"));
+
+  mfsync::protocol::frame_header unknown{};
+  unknown[0] = 0xff;
+  REQUIRE_FALSE(mfsync::protocol::get_frame_from_header(unknown).has_value());
+}
+
+TEST_CASE("capability negotiation", "[protocol]") {
+  using mfsync::protocol::MIN_CHUNKSIZE;
+  using mfsync::protocol::MAX_CHUNKSIZE;
+
+  const auto negotiated = mfsync::protocol::negotiate({ .max_chunksize = 1024 * 1024 },
+                                                      { .max_chunksize = 256 * 1024 });
+  REQUIRE(negotiated.max_chunksize == 256 * 1024);
+
+  const auto unannounced = mfsync::protocol::negotiate({ .max_chunksize = 1024 * 1024 }, {});
+  REQUIRE(unannounced.max_chunksize == MIN_CHUNKSIZE);
+
+  const auto too_large = mfsync::protocol::negotiate({ .max_chunksize = 1ul << 40 },
+                                                     { .max_chunksize = 1ul << 40 });
+  REQUIRE(too_large.max_chunksize == MAX_CHUNKSIZE);
+
+  REQUIRE(mfsync::protocol::negotiate({ .plaintext = true }, { .plaintext = true }).plaintext);
+  REQUIRE_FALSE(mfsync::protocol::negotiate({ .plaintext = true }, {}).plaintext);
+  REQUIRE_FALSE(mfsync::protocol::negotiate({}, { .plaintext = true }).plaintext);
+
+  REQUIRE(mfsync::protocol::negotiate({ .max_streams = 4 }, { .max_streams = 2 }).max_streams == 2);
+  REQUIRE(mfsync::protocol::negotiate({ .max_streams = 4 }, {}).max_streams == 0);
+
+  REQUIRE(mfsync::protocol::negotiate({ .max_streams = 4, .max_bundle_files = 64 },
+                                      { .max_streams = 4, .max_bundle_files = 16 })
+              .max_bundle_files == 16);
+  REQUIRE(mfsync::protocol::negotiate({ .max_streams = 4, .max_bundle_files = 64 },
+                                      { .max_streams = 4 })
+              .max_bundle_files == 0);
+  REQUIRE(mfsync::protocol::negotiate({ .max_bundle_files = 64 }, { .max_bundle_files = 64 })
+              .max_bundle_files == 0);
+}
+
+TEST_CASE("bundle serialization", "[protocol]") {
+  mfsync::file_bundle bundle;
+
+  for(uint32_t i = 1; i <= 3; ++i)
+  {
+    const mfsync::file_information info{ "file" + std::to_string(i), std::nullopt, i };
+    bundle.files.push_back(mfsync::requested_file{ info, 0, 4096, i });
+  }
+
+  const nlohmann::json j = bundle;
+  const auto deserialized = j.get<mfsync::file_bundle>();
+  REQUIRE(deserialized.files.size() == 3);
+
+  for(size_t i = 0; i < bundle.files.size(); ++i)
+  {
+    REQUIRE(deserialized.files[i] == bundle.files[i]);
+    REQUIRE(deserialized.files[i].stream_id == bundle.files[i].stream_id);
+  }
+}
+
+TEST_CASE("deque pops matching element", "[deque]") {
+  mfsync::concurrent::deque<int> deque;
+  deque.push_back(1);
+  deque.push_back(2);
+  deque.push_back(3);
+
+  REQUIRE(deque.try_pop_if([](int value) { return value % 2 == 0; }) == 2);
+  REQUIRE_FALSE(deque.try_pop_if([](int value) { return value > 3; }).has_value());
+  REQUIRE(deque.size() == 2);
+  REQUIRE(deque.try_pop() == 1);
+}
+
+TEST_CASE("io engine selection", "[transfer_options]") {
+  using mfsync::filetransfer::io_engine;
+
+  REQUIRE(mfsync::filetransfer::get_io_engine("asio") == io_engine::ASIO);
+  REQUIRE(mfsync::filetransfer::get_io_engine("io_uring") == io_engine::IO_URING);
+  REQUIRE(mfsync::filetransfer::get_io_engine("mmap") == io_engine::MMAP);
+  REQUIRE_FALSE(mfsync::filetransfer::get_io_engine("epoll").has_value());
+}
+
+TEST_CASE("incremental sha256", "[sha256]") {
+  const std::string data = "abc";
+
+  mfsync::sha256 whole;
+  whole.update(data.data(), data.size());
+
+  mfsync::sha256 split;
+  split.update(data.data(), 1);
+  split.update(data.data() + 1, 2);
+
+  const auto expected = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+  REQUIRE(whole.finalize() == expected);
+  REQUIRE(split.finalize() == expected);
+}
+
+TEST_CASE("write behind buffer keeps positions", "[ofstream_wrapper]") {
+  const auto path = std::filesystem::temp_directory_path() / "mfsync_write_behind_test";
+
+  {
+    mfsync::ofstream_wrapper output;
+    output.open(path.string(), std::ios::out | std::ios::binary);
+    REQUIRE(!!output);
+
+    //consecutive writes are merged, a jump writes out what was buffered
+    REQUIRE(output.write("abc", 3, 0));
+    REQUIRE(output.write("def", 3, 3));
+    REQUIRE(output.write("xy", 2, 8));
+    REQUIRE(output.write("gh", 2, 6));
+  }
+
+  std::ifstream input(path, std::ios::binary);
+  const std::string content{std::istreambuf_iterator<char>(input), {}};
+  REQUIRE(content == "abcdefghxy");
+
+  //reserved space doesnt count as received data
+  {
+    mfsync::ofstream_wrapper output;
+    output.open(path.string(), std::ios::in | std::ios::out | std::ios::binary);
+    REQUIRE(output.preallocate(1024 * 1024));
+  }
+
+  REQUIRE(std::filesystem::file_size(path) == content.size());
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("resume journal keeps the verified prefix", "[resume_journal]") {
+  using mfsync::resume_journal;
+  const auto directory = std::filesystem::temp_directory_path();
+  const auto tmp_path = directory / "mfsync_resume_test.mfsync";
+  const auto journal_path = directory / "mfsync_resume_test.mfsync-chunks";
+  std::filesystem::remove(tmp_path);
+  std::filesystem::remove(journal_path);
+
+  const mfsync::file_information file_info{.file_name = "mfsync_resume_test",
+                                           .sha256sum = "abc",
+                                           .size = 2 * resume_journal::CHUNK_SIZE + 100};
+  std::string data(file_info.size, 'a');
+  data[resume_journal::CHUNK_SIZE + 5] = 'b';
+
+  {
+    auto journal = resume_journal::open(journal_path, tmp_path, file_info);
+    REQUIRE(journal.is_open());
+    REQUIRE(journal.get_verified() == 0);
+
+    //the last chunk is shorter, it is journaled once the file is complete
+    journal.update(0, data.data(), 1000);
+    journal.update(1000, data.data() + 1000, data.size() - 1000);
+    REQUIRE(journal.get_verified() == file_info.size);
+  }
+
+  {
+    std::ofstream output(tmp_path, std::ios::binary);
+    output << data;
+  }
+
+  REQUIRE(resume_journal::open(journal_path, tmp_path, file_info).get_verified() == file_info.size);
+
+  //a torn write in the second chunk
+  {
+    std::fstream output(tmp_path, std::ios::in | std::ios::out | std::ios::binary);
+    output.seekp(resume_journal::CHUNK_SIZE + 5);
+    output << 'a';
+  }
+
+  REQUIRE(resume_journal::open(journal_path, tmp_path, file_info).get_verified()
+          == resume_journal::CHUNK_SIZE);
+
+  //only the verified hashes were kept
+  std::filesystem::resize_file(tmp_path, resume_journal::CHUNK_SIZE);
+  auto journal = resume_journal::open(journal_path, tmp_path, file_info);
+  REQUIRE(journal.get_verified() == resume_journal::CHUNK_SIZE);
+
+  //a write that doesnt continue the hashed part stops the journal
+  journal.update(resume_journal::CHUNK_SIZE + 1, data.data(), 1);
+  REQUIRE_FALSE(journal.is_open());
+
+  //the journal of another version of the file is ignored
+  auto other = file_info;
+  other.sha256sum = "def";
+  REQUIRE(resume_journal::open(journal_path, tmp_path, other).get_verified() == 0);
+
+  std::filesystem::remove(tmp_path);
+  std::filesystem::remove(journal_path);
+}
+
+TEST_CASE("mapped file covers the whole file", "[mapped_file]") {
+  const auto path = std::filesystem::temp_directory_path() / "mfsync_mapped_file_test";
+
+  {
+    std::ofstream output(path, std::ios::binary);
+    output << "mapped content";
+  }
+
+  const auto descriptor = mfsync::file_descriptor::open(path, O_RDONLY);
+  REQUIRE(descriptor.has_value());
+
+  auto mapping = mfsync::mapped_file::map(descriptor.value());
+  REQUIRE(mapping.has_value());
+  REQUIRE(mapping.value().is_mapped());
+
+  const std::string content(reinterpret_cast<const char*>(mapping.value().data()),
+                            mapping.value().size());
+  REQUIRE(content == "mapped content");
+
+  mapping.value().unmap();
+  REQUIRE(!mapping.value().is_mapped());
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("positional reads and writes are complete", "[file_descriptor]") {
+  const auto path = std::filesystem::temp_directory_path() / "mfsync_file_descriptor_test";
+  std::filesystem::remove(path);
+
+  const auto descriptor = mfsync::file_descriptor::open(path, O_RDWR | O_CREAT);
+  REQUIRE(descriptor.has_value());
+
+  const std::string content = "positional content";
+  REQUIRE(descriptor.value().write_at(content.data(), content.size(), 4));
+  REQUIRE(std::filesystem::file_size(path) == content.size() + 4);
+
+  std::string read(content.size(), '\0');
+  REQUIRE(descriptor.value().read_at(read.data(), read.size(), 4) == read.size());
+  REQUIRE(read == content);
+
+  //reads stop at the end of the file
+  REQUIRE(descriptor.value().read_at(read.data(), read.size(), 8) == read.size() - 4);
+  REQUIRE(descriptor.value().read_at(read.data(), read.size(), 100) == 0);
+
+  const mfsync::file_descriptor closed;
+  REQUIRE(!closed.write_at(content.data(), content.size(), 0));
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("chunk size adapts to throughput", "[chunk_size_controller]") {
+  using namespace std::chrono_literals;
+  mfsync::filetransfer::chunk_size_controller controller{64 * 1024, 4 * 1024, 4 * 1024 * 1024};
+
+  //fast link: 64KiB written within 100us
+  for(int i = 0; i < 20; ++i)
+  {
+    controller.update(controller.get_chunksize(), 100us);
+  }
+  REQUIRE(controller.get_chunksize() == 4 * 1024 * 1024);
+
+  //slow link: every chunk takes a second
+  for(int i = 0; i < 40; ++i)
+  {
+    controller.update(controller.get_chunksize(), 1s);
+  }
+  REQUIRE(controller.get_chunksize() == 4 * 1024);
+}
+
+TEST_CASE("send pipeline bounds", "[send_pipeline]") {
+  mfsync::filetransfer::send_pipeline pipeline{2, 1024};
+
+  REQUIRE(pipeline.try_start_write() == nullptr);
+
+  //only one chunk is prepared at a time
+  REQUIRE(pipeline.try_start_prepare(512));
+  REQUIRE(!pipeline.try_start_prepare(512));
+  pipeline.finish_prepare({ .header = {}, .payload = std::vector<unsigned char>(512) });
+
+  //chunk one is on the wire while chunk two is prepared
+  auto* first = pipeline.try_start_write();
+  REQUIRE(first != nullptr);
+  REQUIRE(pipeline.try_start_write() == nullptr);
+  REQUIRE(pipeline.try_start_prepare(512));
+  pipeline.finish_prepare({ .header = {}, .payload = std::vector<unsigned char>(512) });
+  REQUIRE(pipeline.get_buffered_bytes() == 1024);
+
+  //depth and byte bound are reached
+  REQUIRE(!pipeline.try_start_prepare(1));
+
+  pipeline.finish_write();
+  REQUIRE(pipeline.get_buffered_bytes() == 512);
+  REQUIRE(!pipeline.try_start_prepare(1024));
+  REQUIRE(pipeline.try_start_prepare(512));
+  pipeline.finish_prepare();
+
+  REQUIRE(!pipeline.try_complete());
+  REQUIRE(pipeline.try_start_write() != nullptr);
+  pipeline.finish_write();
+  REQUIRE(pipeline.try_complete());
+  REQUIRE(!pipeline.try_complete());
+}
+
+TEST_CASE("token bucket shapes and prioritizes", "[rate_limiter]") {
+  using namespace std::chrono_literals;
+  using mfsync::filetransfer::priority;
+  using mfsync::filetransfer::token_bucket;
+
+  const auto now = token_bucket::clock::now();
+  token_bucket unlimited;
+  REQUIRE(unlimited.reserve(1000000, priority::INTERACTIVE, now) == 0s);
+
+  //an idle bucket lets a short burst through
+  token_bucket bucket{1000};
+  REQUIRE(bucket.reserve(100, priority::INTERACTIVE, now) == 0s);
+  REQUIRE(bucket.reserve(1000, priority::BACKGROUND, now) == 1s);
+
+  //interactive bytes pass the queued background ones, which wait for them
+  REQUIRE(bucket.reserve(500, priority::INTERACTIVE, now) == 500ms);
+  REQUIRE(bucket.reserve(500, priority::BACKGROUND, now) == 2s);
+
+  //peers are limited separately
+  mfsync::filetransfer::rate_limiter limiter{{.peer_upload = 1000}};
+  const auto delay = limiter.reserve(mfsync::filetransfer::direction::UPLOAD, "a", 1100,
+                                     priority::INTERACTIVE);
+  REQUIRE(delay > 900ms);
+  REQUIRE(delay <= 1s);
+  REQUIRE(limiter.reserve(mfsync::filetransfer::direction::UPLOAD, "b", 100,
+                          priority::INTERACTIVE) == 0s);
+  REQUIRE(limiter.reserve(mfsync::filetransfer::direction::DOWNLOAD, "a", 100000,
+                          priority::INTERACTIVE) == 0s);
+
+  limiter.set_limits({});
+  REQUIRE(limiter.reserve(mfsync::filetransfer::direction::UPLOAD, "a", 100000,
+                          priority::INTERACTIVE) == 0s);
+}
+
+TEST_CASE("socket options per role", "[socket_options]") {
+  nlohmann::json j = {{"client", {{"receive_buffer", 1 << 20}}}};
+
+  REQUIRE(mfsync::add_socket_option(j, "server.send_buffer=262144"));
+  REQUIRE(mfsync::add_socket_option(j, "server.congestion=bbr"));
+  REQUIRE(mfsync::add_socket_option(j, "server.cork=true"));
+  REQUIRE(mfsync::add_socket_option(j, "discovery.tos=184"));
+  REQUIRE_FALSE(mfsync::add_socket_option(j, "server.send_buffer=large"));
+  REQUIRE_FALSE(mfsync::add_socket_option(j, "server.unknown=1"));
+  REQUIRE_FALSE(mfsync::add_socket_option(j, "relay.tos=1"));
+  REQUIRE_FALSE(mfsync::add_socket_option(j, "server.tos"));
+
+  const auto options = j.get<mfsync::socket_options>();
+  REQUIRE(options.get(mfsync::socket_role::SERVER).send_buffer == 262144);
+  REQUIRE(options.server.congestion == "bbr");
+  REQUIRE(options.server.cork);
+  REQUIRE(options.client.receive_buffer == 1 << 20);
+  REQUIRE(options.discovery.tos == 184);
+  REQUIRE(options.client.tos == -1);
+
+  boost::asio::io_context context;
+  boost::asio::ip::tcp::socket socket{context, boost::asio::ip::tcp::v4()};
+  mfsync::socket_tuning tuning;
+  tuning.send_buffer = 65536;
+  tuning.no_delay = true;
+  mfsync::apply_socket_tuning(socket.native_handle(), tuning);
+
+  boost::asio::socket_base::send_buffer_size send_buffer;
+  boost::asio::ip::tcp::no_delay no_delay;
+  socket.get_option(send_buffer);
+  socket.get_option(no_delay);
+  //linux doubles the size to make room for its bookkeeping
+  REQUIRE(send_buffer.value() >= 65536);
+  REQUIRE(no_delay.value());
+}
+
+TEST_CASE("stream output writes to a pipe", "[stream_output]") {
+  std::array<int, 2> fds{};
+  REQUIRE(::pipe(fds.data()) == 0);
+
+  mfsync::stream_output output{fds[1], 10, 20};
+  REQUIRE(output.get_offset() == 10);
+  REQUIRE(output.get_length() == 20);
+
+  const std::string first = "hello ";
+  const std::string second = "world";
+  REQUIRE(output.write(reinterpret_cast<const unsigned char*>(first.data()), first.size()));
+  REQUIRE(output.write(reinterpret_cast<const unsigned char*>(second.data()), second.size()));
+  REQUIRE_FALSE(output.is_done());
+
+  std::array<char, 32> buffer{};
+  REQUIRE(::read(fds[0], buffer.data(), buffer.size()) == 11);
+  REQUIRE(std::string(buffer.data(), 11) == "hello world");
+
+  output.finish(true);
+  REQUIRE(output.is_done());
+  REQUIRE_FALSE(output.failed());
+
+  //the consumer went away
+  ::signal(SIGPIPE, SIG_IGN);
+  ::close(fds[0]);
+  REQUIRE_FALSE(output.write(reinterpret_cast<const unsigned char*>(first.data()), first.size()));
+  REQUIRE(output.failed());
+  ::close(fds[1]);
+}
+
+TEST_CASE("chunks are compressed adaptively", "[compression]") {
+  using namespace mfsync::filetransfer;
+
+  //the preferred codec both sides have is used, none on unencrypted links
+  REQUIRE(mfsync::protocol::negotiate({ .compression = { "zstd", "lz4" } },
+                                      { .compression = { "lz4" } }).compression
+          == std::vector<std::string>{ "lz4" });
+  REQUIRE(mfsync::protocol::negotiate({ .compression = { "zstd" } }, {}).compression.empty());
+  REQUIRE(mfsync::protocol::negotiate({ .plaintext = true, .compression = { "zstd" } },
+                                      { .plaintext = true, .compression = { "zstd" } })
+              .compression.empty());
+  REQUIRE_FALSE(get_codec("gzip").has_value());
+
+  std::vector<unsigned char> text(256 * 1024);
+  for(size_t i = 0; i < text.size(); ++i)
+  {
+    text[i] = "mfsync compresses text "[i % 23];
+  }
+
+  std::vector<unsigned char> random(text.size());
+  uint32_t state = 1;
+  for(auto& byte : random)
+  {
+    state = state * 1103515245 + 12345;
+    byte = state >> 24;
+  }
+
+  //a build that enables codecs has to run the checks below for them
+  const auto codecs = get_supported_codecs();
+#ifdef MFSYNC_USE_ZSTD
+  REQUIRE(std::find(codecs.begin(), codecs.end(), "zstd") != codecs.end());
+#endif
+#ifdef MFSYNC_USE_LZ4
+  REQUIRE(std::find(codecs.begin(), codecs.end(), "lz4") != codecs.end());
+#endif
+
+  for(const auto& name : codecs)
+  {
+    const auto compression_codec = get_codec(name);
+    REQUIRE(compression_codec.has_value());
+
+    chunk_compressor compressor{compression_codec.value()};
+    std::vector<unsigned char> compressed;
+    std::vector<unsigned char> restored;
+
+    REQUIRE(compressor.compress(text.data(), text.size(), 0, compressed));
+    REQUIRE(compressed.size() < text.size() / 10);
+    REQUIRE(decompress_chunk(compression_codec.value(), compressed.data(), compressed.size(),
+                             text.size(), restored));
+    REQUIRE(restored == text);
+
+    //a chunk may not claim to grow larger than the negotiated maximum
+    REQUIRE_FALSE(decompress_chunk(compression_codec.value(), compressed.data(),
+                                   compressed.size(), text.size() - 1, restored));
+
+    //incompressible data is sent as it is and the next chunk isnt even tried
+    REQUIRE_FALSE(compressor.compress(random.data(), random.size(), 0, compressed));
+    REQUIRE_FALSE(compressor.compress(text.data(), text.size(), 0, compressed));
+    REQUIRE(compressor.compress(text.data(), text.size(), 0, compressed));
+
+    //on a link that is much slower than compressing the level goes up
+    const auto level = compressor.get_level();
+    REQUIRE(compressor.compress(text.data(), text.size(), 1, compressed));
+    REQUIRE(compressor.get_level() == level + 1);
+  }
+
+  chunk_compressor disabled;
+  std::vector<unsigned char> compressed;
+  REQUIRE_FALSE(disabled.compress(text.data(), text.size(), 0, compressed));
+}
+
+TEST_CASE("delta rebuilds a file that changed in place", "[delta]") {
+  std::vector<unsigned char> basis(1024 * 1024);
+  uint32_t state = 7;
+  for(auto& byte : basis)
+  {
+    state = state * 1103515245 + 12345;
+    byte = state >> 24;
+  }
+
+  //a few bytes overwritten, some inserted and the tail cut off
+  auto changed = basis;
+  std::fill(changed.begin() + 100000, changed.begin() + 100100, 0);
+  changed.insert(changed.begin() + 500000, 3333, 42);
+  changed.resize(changed.size() - 10000);
+
+  const auto path = std::filesystem::temp_directory_path() / "mfsync_delta_basis";
+  {
+    std::ofstream output{path, std::ios::binary};
+    output.write(reinterpret_cast<const char*>(basis.data()), basis.size());
+  }
+
+  auto descriptor = mfsync::file_descriptor::open(path, O_RDONLY);
+  REQUIRE(descriptor.has_value());
+  const auto signature = mfsync::create_signature(descriptor.value(), basis.size());
+  std::filesystem::remove(path);
+  REQUIRE(signature.has_value());
+  REQUIRE(mfsync::is_valid_signature(signature.value()));
+
+  //the signature travels as a binary payload of its own
+  const auto payload = mfsync::protocol::create_signature_payload(signature.value());
+  REQUIRE(payload.size() == signature.value().weak.size() * mfsync::protocol::SIGNATURE_ENTRY_SIZE);
+  const auto received = mfsync::protocol::get_signature_from_payload(payload.data(), payload.size(),
+                                                                     signature.value().block_size);
+  REQUIRE(received.has_value());
+  REQUIRE(received.value().block_size == signature.value().block_size);
+  REQUIRE(received.value().weak == signature.value().weak);
+  REQUIRE(received.value().strong == signature.value().strong);
+  REQUIRE_FALSE(mfsync::protocol::get_signature_from_payload(payload.data(), payload.size() - 1,
+                                                             signature.value().block_size).has_value());
+
+  mfsync::delta_encoder encoder{received.value()};
+  const auto block_size = encoder.get_block_size();
+  std::vector<unsigned char> rebuilt;
+  size_t literal_bytes = 0;
+
+  for(size_t offset = 0; offset < changed.size(); )
+  {
+    const auto size = std::min(64 * 1024 + block_size, changed.size() - offset);
+    const auto step = encoder.next(changed.data() + offset, size, 64 * 1024);
+    REQUIRE(step.length > 0);
+
+    if(step.step_type == mfsync::delta_step::type::COPY)
+    {
+      const auto payload = mfsync::protocol::create_copy_payload(step.block, step.count);
+      const auto copy = mfsync::protocol::get_copy_from_payload(payload.data(), payload.size());
+      REQUIRE(copy.has_value());
+      REQUIRE(copy.value().first == step.block);
+      REQUIRE(copy.value().second == step.count);
+
+      const auto begin = basis.begin() + step.block * block_size;
+      rebuilt.insert(rebuilt.end(), begin, begin + step.count * block_size);
+    }
+    else
+    {
+      rebuilt.insert(rebuilt.end(), changed.begin() + offset, changed.begin() + offset + step.length);
+      literal_bytes += step.length;
+    }
+
+    offset += step.length;
+  }
+
+  REQUIRE(rebuilt == changed);
+  //only the blocks around the changes are sent
+  REQUIRE(literal_bytes < 8 * block_size);
+}
+
+TEST_CASE("content defined chunks survive insertions", "[content_chunking]") {
+  std::vector<unsigned char> original(6 * 1024 * 1024);
+  uint32_t state = 11;
+  for(auto& byte : original)
+  {
+    state = state * 1103515245 + 12345;
+    byte = state >> 24;
+  }
+
+  //a copy under another name with data inserted near the front
+  auto changed = original;
+  changed.insert(changed.begin() + 300000, 1000, 7);
+
+  const auto path = std::filesystem::temp_directory_path() / "mfsync_chunking_original";
+  {
+    std::ofstream output{path, std::ios::binary};
+    output.write(reinterpret_cast<const char*>(original.data()), original.size());
+  }
+
+  auto descriptor = mfsync::file_descriptor::open(path, O_RDONLY);
+  REQUIRE(descriptor.has_value());
+  const auto chunks = mfsync::chunk_file(descriptor.value(), original.size());
+  std::filesystem::remove(path);
+  REQUIRE(chunks.has_value());
+
+  //reading the file in batches cuts the same chunks as a single pass
+  std::vector<mfsync::content_chunk> single_pass;
+  REQUIRE(mfsync::cut_chunks(original.data(), original.size(), 0, true, single_pass) == original.size());
+  REQUIRE(single_pass.size() == chunks.value().size());
+
+  size_t offset = 0;
+  for(size_t i = 0; i < chunks.value().size(); ++i)
+  {
+    const auto& chunk = chunks.value()[i];
+    REQUIRE(chunk.offset == offset);
+    REQUIRE(chunk.hash == single_pass[i].hash);
+    REQUIRE(chunk.length <= mfsync::MAX_CONTENT_CHUNK_SIZE);
+    REQUIRE((chunk.length >= mfsync::MIN_CONTENT_CHUNK_SIZE || i + 1 == chunks.value().size()));
+    offset += chunk.length;
+  }
+
+  REQUIRE(offset == original.size());
+  REQUIRE(original.size() / chunks.value().size() < 2 * mfsync::AVG_CONTENT_CHUNK_SIZE);
+
+  //without a trailing end, the last chunk is left for the next call
+  std::vector<mfsync::content_chunk> head;
+  const auto covered = mfsync::cut_chunks(original.data(), 1024 * 1024, 0, false, head);
+  REQUIRE(covered > 1024 * 1024 - mfsync::MAX_CONTENT_CHUNK_SIZE);
+  REQUIRE(covered <= 1024 * 1024);
+
+  mfsync::chunk_index index;
+  index.add_file("original", chunks.value());
+  REQUIRE(index.contains_file("original"));
+
+  //the manifest of the changed file travels in frames of hashes and lengths
+  std::vector<mfsync::content_chunk> changed_chunks;
+  mfsync::cut_chunks(changed.data(), changed.size(), 0, true, changed_chunks);
+  std::vector<unsigned char> payload;
+  for(const auto& chunk : changed_chunks)
+  {
+    mfsync::protocol::append_manifest_entry(payload, chunk);
+  }
+
+  REQUIRE(payload.size() == changed_chunks.size() * mfsync::protocol::MANIFEST_ENTRY_SIZE);
+  const auto manifest = mfsync::protocol::get_manifest_from_payload(payload.data(), payload.size(), 0);
+  REQUIRE(manifest.has_value());
+  REQUIRE(manifest.value().size() == changed_chunks.size());
+  REQUIRE(!mfsync::protocol::get_manifest_from_payload(payload.data(), payload.size() - 1, 0).has_value());
+
+  //only the chunks around the insertion have to be fetched
+  size_t missing_bytes = 0;
+  for(size_t i = 0; i < manifest.value().size(); ++i)
+  {
+    const auto& chunk = manifest.value()[i];
+    REQUIRE(chunk.offset == changed_chunks[i].offset);
+    const auto location = index.find(chunk.hash);
+
+    if(!location.has_value())
+    {
+      missing_bytes += chunk.length;
+      continue;
+    }
+
+    REQUIRE(location.value().file_name == "original");
+    REQUIRE(location.value().length == chunk.length);
+    REQUIRE(std::equal(changed.begin() + chunk.offset, changed.begin() + chunk.offset + chunk.length,
+                       original.begin() + location.value().offset));
+  }
+
+  REQUIRE(missing_bytes > 1000);
+  REQUIRE(missing_bytes <= 2 * mfsync::MAX_CONTENT_CHUNK_SIZE + 1000);
+
+  index.remove_file("original");
+  REQUIRE(index.size() == 0);
+  REQUIRE(!index.find(chunks.value().front().hash).has_value());
+
+  //manifests are read from encrypted streams only
+  const mfsync::capabilities local{.plaintext = true, .dedup = true};
+  REQUIRE(mfsync::protocol::negotiate({.dedup = true}, {.dedup = true}).dedup);
+  REQUIRE(!mfsync::protocol::negotiate(local, local).dedup);
+  REQUIRE(!mfsync::protocol::negotiate({.dedup = true}, {}).dedup);
+}
+
+TEST_CASE("segments are handed out and rebalanced", "[segmented_download]") {
+  //the first 100 bytes were received before
+  mfsync::filetransfer::segment_map segments{100, 350, 100, 40};
+  REQUIRE(segments.get_bytes_done() == 100);
+
+  const auto first = segments.acquire();
+  const auto second = segments.acquire();
+  const auto third = segments.acquire();
+  REQUIRE((first.has_value() && second.has_value() && third.has_value()));
+  REQUIRE(first.value().begin == 100);
+  REQUIRE(second.value().begin == 200);
+  REQUIRE(third.value().end == 350);
+  REQUIRE_FALSE(segments.has_unassigned());
+
+  //bytes behind the end of a segment belong to someone else
+  REQUIRE(segments.clip(third.value().key, 300, 80) == 50);
+  segments.advance(third.value().key, 350);
+  REQUIRE(segments.is_done(third.value().key));
+  REQUIRE(segments.get_contiguous_end() == 100);
+
+  //a slow source loses the back half of its segment
+  segments.advance(first.value().key, 120);
+  const auto tail = segments.acquire();
+  REQUIRE(tail.has_value());
+  REQUIRE(tail.value().begin == 250);
+  REQUIRE(tail.value().end == 300);
+  REQUIRE(segments.clip(second.value().key, 240, 20) == 10);
+
+  //an aborted segment is continued where it stopped
+  segments.release(first.value().key);
+  REQUIRE(segments.has_unassigned());
+  const auto resumed = segments.acquire();
+  REQUIRE(resumed.has_value());
+  REQUIRE(resumed.value().begin == 120);
+  REQUIRE(resumed.value().end == 200);
+
+  segments.advance(resumed.value().key, 200);
+  segments.advance(second.value().key, 260);
+  REQUIRE(segments.get_contiguous_end() == 250);
+  REQUIRE_FALSE(segments.is_complete());
+
+  segments.advance(tail.value().key, 300);
+  REQUIRE(segments.is_complete());
+  REQUIRE(segments.get_bytes_done() == 350);
+  REQUIRE(segments.get_contiguous_end() == 350);
+
+  //nothing is left that is worth splitting
+  REQUIRE_FALSE(segments.acquire().has_value());
+}
+
+TEST_CASE("segments resume around written ranges", "[segmented_download]") {
+  //overlapping ranges and ranges behind the end of the file are cut
+  const mfsync::byte_ranges written{ { 0, 50 }, { 40, 60 }, { 120, 200 }, { 300, 400 } };
+  mfsync::filetransfer::segment_map segments{350, written, 100, 40};
+
+  REQUIRE(segments.get_bytes_done() == 60 + 80 + 50);
+  REQUIRE(segments.get_contiguous_end() == 60);
+  REQUIRE(segments.get_written() == mfsync::byte_ranges{ { 0, 60 }, { 120, 200 }, { 300, 350 } });
+
+  const auto gap = segments.acquire();
+  REQUIRE(gap.has_value());
+  REQUIRE(gap.value().begin == 60);
+  REQUIRE(gap.value().end == 120);
+
+  const auto second_gap = segments.acquire();
+  REQUIRE(second_gap.has_value());
+  REQUIRE(second_gap.value().begin == 200);
+  REQUIRE(second_gap.value().end == 300);
+
+  segments.advance(gap.value().key, 120);
+  segments.advance(second_gap.value().key, 250);
+  REQUIRE(segments.get_written() == mfsync::byte_ranges{ { 0, 250 }, { 300, 350 } });
+}
+
+TEST_CASE("cast blocks are restored from any data_shards packets", "[multicast]") {
+  constexpr size_t data_shards = 10;
+  constexpr size_t parity_shards = 4;
+  constexpr size_t symbol_size = 100;
+
+  REQUIRE(mfsync::reed_solomon::is_valid(data_shards, parity_shards));
+  REQUIRE(!mfsync::reed_solomon::is_valid(0, parity_shards));
+  REQUIRE(!mfsync::reed_solomon::is_valid(200, 57));
+
+  mfsync::reed_solomon code{data_shards, parity_shards};
+  std::vector<std::vector<unsigned char>> shards(data_shards + parity_shards);
+  uint32_t state = 5;
+  for(size_t i = 0; i < data_shards; ++i)
+  {
+    shards[i].resize(symbol_size);
+    for(auto& byte : shards[i])
+    {
+      state = state * 1103515245 + 12345;
+      byte = state >> 24;
+    }
+  }
+
+  code.encode(shards);
+  const auto original = shards;
+
+  //every way of losing as many packets as there are parity shards
+  for(size_t lost = 0; lost < (1u << (data_shards + parity_shards)); ++lost)
+  {
+    if(static_cast<size_t>(std::popcount(lost)) != parity_shards)
+    {
+      continue;
+    }
+
+    auto received = original;
+    std::vector<bool> present(data_shards + parity_shards, true);
+    for(size_t i = 0; i < present.size(); ++i)
+    {
+      if(lost & (1u << i))
+      {
+        present[i] = false;
+        received[i].assign(symbol_size, 0xff);
+      }
+    }
+
+    REQUIRE(code.reconstruct(received, present));
+    for(size_t i = 0; i < data_shards; ++i)
+    {
+      REQUIRE(received[i] == original[i]);
+    }
+  }
+
+  //one more lost packet cant be made up for
+  std::vector<bool> present(data_shards + parity_shards, true);
+  for(size_t i = 0; i <= parity_shards; ++i)
+  {
+    present[i] = false;
+  }
+  auto received = original;
+  REQUIRE(!code.reconstruct(received, present));
+
+  const mfsync::multicast::packet_header header{ .transfer_id = 0xdeadbeef,
+                                                 .round = 2,
+                                                 .block = 70000,
+                                                 .shard = 39,
+                                                 .type = mfsync::multicast::packet_type::END };
+  const auto bytes = mfsync::multicast::create_packet_header(header);
+  const auto parsed = mfsync::multicast::get_packet_header(bytes.data(), bytes.size());
+  REQUIRE(parsed.has_value());
+  REQUIRE(parsed.value().transfer_id == header.transfer_id);
+  REQUIRE(parsed.value().round == header.round);
+  REQUIRE(parsed.value().block == header.block);
+  REQUIRE(parsed.value().shard == header.shard);
+  REQUIRE(parsed.value().type == header.type);
+  REQUIRE(!mfsync::multicast::get_packet_header(bytes.data(), bytes.size() - 1).has_value());
+
+  mfsync::cast_offer offer{ .transfer_id = 1,
+                            .address = mfsync::protocol::MULTICAST_ADDRESS,
+                            .port = mfsync::protocol::MULTICAST_DATA_PORT,
+                            .key = std::string(64, 'a'),
+                            .symbol_size = mfsync::multicast::CAST_SYMBOL_SIZE,
+                            .data_shards = mfsync::multicast::CAST_DATA_SHARDS,
+                            .parity_shards = mfsync::multicast::CAST_PARITY_SHARDS };
+  REQUIRE(mfsync::multicast::is_valid_cast_offer(offer));
+  offer.address = "10.0.0.1";
+  REQUIRE(!mfsync::multicast::is_valid_cast_offer(offer));
+}
+
+TEST_CASE("files are relayed while they are received", "[file_handler]") {
+  using mfsync::resume_journal;
+  const auto directory = std::filesystem::temp_directory_path() / "mfsync_relay_test";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+
+  auto handler = mfsync::file_handler();
+  handler.init_storage(directory.string());
+  handler.relay_partial_files(true);
+
+  const mfsync::file_information file_info{ .file_name = "relayed",
+                                            .size = resume_journal::CHUNK_SIZE * 3 / 2 };
+  mfsync::requested_file requested{ .file_info = file_info };
+  auto output = handler.create_file(requested);
+  REQUIRE(output.has_value());
+
+  //nothing is offered before the first chunk is verified
+  REQUIRE(handler.get_partial_files().empty());
+  REQUIRE(handler.get_relayable_size(file_info) == 0);
+
+  const std::vector<char> data(file_info.size, 'r');
+  REQUIRE(output.value().write(data.data(), resume_journal::CHUNK_SIZE, 0));
+  REQUIRE(output.value().flush());
+
+  const auto partial = handler.get_partial_files();
+  REQUIRE(partial.size() == 1);
+  REQUIRE(handler.get_relayable_size(file_info) == resume_journal::CHUNK_SIZE);
+
+  auto descriptor = handler.open_partial_file(file_info);
+  REQUIRE(descriptor.has_value());
+  char first = 0;
+  REQUIRE(::pread(descriptor.value().get(), &first, 1, 0) == 1);
+  REQUIRE(first == 'r');
+
+  //partial files are listed as such, hosts that have them complete are preferred
+  const auto message = mfsync::protocol::create_message_from_file_info({}, 8000, partial);
+  const auto listed = mfsync::protocol::get_available_files_from_message(
+      message, boost::asio::ip::make_address("10.0.0.2"), "relay");
+  REQUIRE(listed.has_value());
+  REQUIRE(listed.value().size() == 1);
+  REQUIRE(listed.value().begin()->partial);
+
+  auto other = mfsync::file_handler();
+  other.add_available_file(*listed.value().begin());
+  auto complete = *listed.value().begin();
+  complete.partial = false;
+  complete.public_key = "origin";
+  other.add_available_file(complete);
+  REQUIRE(!other.get_available_file("relayed").value().partial);
+  REQUIRE(other.get_sources(file_info).size() == 1);
+
+  //once the file is stored all of it can be sent, the descriptor still reads it
+  REQUIRE(output.value().write(data.data() + resume_journal::CHUNK_SIZE,
+                               file_info.size - resume_journal::CHUNK_SIZE,
+                               resume_journal::CHUNK_SIZE));
+  REQUIRE(output.value().flush());
+  REQUIRE(handler.finalize_file(file_info));
+  output.value().close();
+
+  REQUIRE(handler.get_relayable_size(file_info) == file_info.size);
+  REQUIRE(handler.get_partial_files().empty());
+  REQUIRE(::pread(descriptor.value().get(), &first, 1, file_info.size - 1) == 1);
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("stored files are indexed in the background", "[file_handler]") {
+  const auto directory = std::filesystem::temp_directory_path() / "mfsync_chunk_index_test";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+
+  std::vector<unsigned char> data(2 * 1024 * 1024);
+  for(size_t i = 0; i < data.size(); ++i)
+  {
+    data[i] = static_cast<unsigned char>((i * 2654435761u) >> 13);
+  }
+
+  {
+    std::ofstream stored{directory / "stored", std::ios::binary};
+    stored.write(reinterpret_cast<const char*>(data.data()), data.size());
+  }
+
+  auto handler = mfsync::file_handler();
+  handler.index_chunks(true);
+  handler.init_storage(directory.string());
+
+  const mfsync::file_information file_info{ .file_name = "copy", .size = data.size() };
+  mfsync::requested_file requested{ .file_info = file_info };
+  auto output = handler.create_file(requested);
+  REQUIRE(output.has_value());
+
+  std::vector<mfsync::content_chunk> chunks;
+  mfsync::cut_chunks(data.data(), data.size(), 0, true, chunks);
+
+  //copying only looks the chunks up, it finds them once the indexer got to the stored file
+  mfsync::byte_ranges written;
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{10};
+  while(written.empty() && std::chrono::steady_clock::now() < deadline)
+  {
+    written = handler.copy_stored_chunks(file_info, chunks, {});
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+  }
+
+  REQUIRE(written.size() == 1);
+  REQUIRE(written.front() == std::make_pair(size_t{0}, data.size()));
+  REQUIRE(handler.finalize_file(file_info));
+  output.value().close();
+
+  std::ifstream copy{directory / "copy", std::ios::binary};
+  const std::vector<unsigned char> copied{std::istreambuf_iterator<char>{copy}, {}};
+  REQUIRE(copied == data);
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("sessions serve files while they are received", "[server_session]") {
+  using mfsync::resume_journal;
+  namespace protocol = mfsync::protocol;
+  const auto directory = std::filesystem::temp_directory_path() / "mfsync_relay_session_test";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+
+  auto handler = mfsync::file_handler();
+  handler.init_storage(directory.string());
+  handler.relay_partial_files(true);
+
+  const mfsync::file_information file_info{ .file_name = "relayed",
+                                            .size = resume_journal::CHUNK_SIZE * 3 / 2 };
+  mfsync::requested_file created{ .file_info = file_info };
+  auto output = handler.create_file(created);
+  REQUIRE(output.has_value());
+
+  std::vector<char> data(file_info.size);
+  for(size_t i = 0; i < data.size(); ++i)
+  {
+    data[i] = static_cast<char>(i * 7);
+  }
+
+  REQUIRE(output.value().write(data.data(), resume_journal::CHUNK_SIZE, 0));
+  REQUIRE(output.value().flush());
+
+  mfsync::crypto::crypto_handler relay_crypto, receiver_crypto;
+  relay_crypto.init(directory / "relay.key");
+  receiver_crypto.init(directory / "receiver.key");
+  const auto relay_key = relay_crypto.get_public_key();
+
+  boost::asio::io_context io_context;
+  boost::asio::ip::tcp::acceptor acceptor{io_context,
+    boost::asio::ip::tcp::endpoint{boost::asio::ip::make_address("127.0.0.1"), 0}};
+  boost::asio::ip::tcp::socket receiver{io_context};
+  receiver.connect(acceptor.local_endpoint());
+
+  mfsync::filetransfer::progress_handler progress;
+  auto session = std::make_shared<mfsync::filetransfer::server_session>(
+      acceptor.accept(), handler, relay_crypto);
+  session->set_progress(&progress);
+  session->start();
+  auto work = boost::asio::make_work_guard(io_context);
+  std::thread runner{[&io_context]() { io_context.run(); }};
+
+  //the receiver side of the handshake, done the way client_session does it
+  const auto salt = receiver_crypto.encode(receiver_crypto.generate_salt());
+  auto derived = receiver_crypto.derive(relay_key, salt);
+  boost::asio::write(receiver, boost::asio::buffer(protocol::create_handshake_message(
+      derived->get_public_key(), salt,
+      {.max_chunksize = protocol::MAX_CHUNKSIZE, .max_streams = 1, .max_bundle_files = 1})));
+
+  boost::asio::streambuf response;
+  const auto length = boost::asio::read_until(receiver, response, protocol::MFSYNC_HEADER_END);
+  const std::string message(boost::asio::buffers_begin(response.data()),
+                            boost::asio::buffers_begin(response.data()) + length);
+  response.consume(length);
+  REQUIRE(protocol::converter<mfsync::capabilities>::from_message(message, relay_key, *derived)
+            .has_value());
+  derived->use_directional_nonces(relay_key, true);
+
+  const mfsync::requested_file requested{ .file_info = file_info,
+                                          .chunksize = protocol::CHUNKSIZE,
+                                          .stream_id = 1 };
+  boost::asio::write(receiver, boost::asio::buffer(
+      protocol::converter<mfsync::requested_file>::to_message(requested, relay_key, *derived)));
+
+  //receives data frames until the stream ends or more than expected arrived
+  std::vector<char> received;
+  const auto receive = [&](size_t until)
+  {
+    while(received.size() < until)
+    {
+      protocol::frame_header header;
+      boost::asio::read(receiver, boost::asio::buffer(header));
+      const auto frame = protocol::get_frame_from_header(header);
+      REQUIRE(frame.has_value());
+      std::vector<unsigned char> payload(frame.value().length);
+      boost::asio::read(receiver, boost::asio::buffer(payload));
+
+      if(frame.value().type == protocol::frame_type::END)
+      {
+        return;
+      }
+
+      REQUIRE(frame.value().type == protocol::frame_type::DATA);
+      std::vector<unsigned char> plain;
+      REQUIRE(derived->decrypt_buf(relay_key, 1, received.size(), payload.data(),
+                                   payload.size(), plain));
+      received.insert(received.end(), plain.begin(), plain.end());
+    }
+  };
+
+  //only the verified part is sent, the session waits for the rest
+  receive(resume_journal::CHUNK_SIZE);
+  REQUIRE(received.size() == resume_journal::CHUNK_SIZE);
+
+  REQUIRE(output.value().write(data.data() + resume_journal::CHUNK_SIZE,
+                               file_info.size - resume_journal::CHUNK_SIZE,
+                               resume_journal::CHUNK_SIZE));
+  REQUIRE(output.value().flush());
+  REQUIRE(handler.finalize_file(file_info));
+  output.value().close();
+
+  receive(file_info.size + 1);
+  REQUIRE(received == data);
+
+  receiver.close();
+  work.reset();
+  io_context.stop();
+  runner.join();
+  std::filesystem::remove_all(directory);
+}
@@ -11,6 +11,7 @@
 #include <catch2/catch.hpp>
 
 #include "mfsync/crypto.h"
+#include "mfsync/protocol.h"
 #include "spdlog/spdlog.h"
 
 TEST_CASE("crypto base test", "[crypto]") {
@@ -36,3 +37,240 @@ TEST_CASE("crypto base test", "[crypto]") {
   const auto decr = B.decrypt(A.get_public_key(), encr.value());
   REQUIRE(decr.has_value());
 }
+
+TEST_CASE("directional nonces", "[crypto]") {
+  using namespace mfsync::crypto;
+
+  crypto_handler A, B;
+  A.init("testA.key");
+  B.init("testB.key");
+
+  const auto salt = A.encode(A.generate_salt());
+  A.trust_key(B.get_public_key(), salt);
+  B.trust_key(A.get_public_key(), salt);
+
+  A.use_directional_nonces(B.get_public_key(), true);
+  B.use_directional_nonces(A.get_public_key(), false);
+
+  // both sides send before reading what the other side sent
+  const auto from_a = A.encrypt(B.get_public_key(), "request");
+  const auto from_b = B.encrypt(A.get_public_key(), "checksum");
+  REQUIRE(from_a.has_value());
+  REQUIRE(from_b.has_value());
+  REQUIRE(from_a.value().count != from_b.value().count);
+
+  REQUIRE(B.decrypt(A.get_public_key(), from_a.value()).has_value());
+  REQUIRE(A.decrypt(B.get_public_key(), from_b.value()).has_value());
+}
+
+TEST_CASE("dropped END frames dont shift the message nonces", "[crypto]") {
+  using namespace mfsync;
+  using namespace mfsync::crypto;
+
+  crypto_handler server, client;
+  server.init("testA.key");
+  client.init("testB.key");
+
+  const auto salt = server.encode(server.generate_salt());
+  server.trust_key(client.get_public_key(), salt);
+  client.trust_key(server.get_public_key(), salt);
+  server.use_directional_nonces(client.get_public_key(), false);
+  client.use_directional_nonces(server.get_public_key(), true);
+
+  // a plaintext segment the client cancelled, its END is dropped unopened
+  requested_file cancelled;
+  cancelled.stream_id = 1;
+  cancelled.file_info.size = 16384;
+  cancelled.offset = 4096;
+  cancelled.length = 8192;
+  protocol::converter<transfer_checksum>::to_message(
+      {.sha256sum = "cancelled"}, cancelled, client.get_public_key(), server);
+
+  // messages and the checksum of the next file are still opened
+  const auto message = server.encrypt(client.get_public_key(), "window");
+  REQUIRE(message.has_value());
+  REQUIRE(client.decrypt(server.get_public_key(), message.value()).has_value());
+
+  requested_file next;
+  next.stream_id = 2;
+  next.file_info.size = 100;
+  const auto end = protocol::converter<transfer_checksum>::to_message(
+      {.sha256sum = "next"}, next, client.get_public_key(), server);
+  const auto checksum = protocol::converter<transfer_checksum>::from_message(
+      end, next, server.get_public_key(), client);
+  REQUIRE(checksum.has_value());
+  REQUIRE(checksum.value().sha256sum == "next");
+
+  // the END of one stream doesnt open as the END of another
+  REQUIRE(!protocol::converter<transfer_checksum>::from_message(
+               end, cancelled, server.get_public_key(), client)
+               .has_value());
+}
+
+TEST_CASE("group cipher", "[crypto]") {
+  using namespace mfsync::crypto;
+
+  const auto sender = group_cipher::generate();
+  const auto receiver = group_cipher::create(sender->get_encoded_key());
+  REQUIRE(receiver != nullptr);
+  REQUIRE(group_cipher::create("abcd") == nullptr);
+
+  std::array<byte, group_cipher::NONCE_SIZE> nonce{1, 2, 3};
+  const std::string plain{"a symbol of a cast"};
+  std::vector<byte> packet(plain.size() + group_cipher::TAG_SIZE);
+  sender->encrypt(nonce.data(), nonce.data(), nonce.size(),
+                  reinterpret_cast<const byte*>(plain.data()), plain.size(), packet.data());
+
+  std::string decrypted(plain.size(), '\0');
+  REQUIRE(receiver->decrypt(nonce.data(), nonce.data(), nonce.size(), packet.data(),
+                            packet.size(), reinterpret_cast<byte*>(decrypted.data())));
+  REQUIRE(decrypted == plain);
+
+  // the header is authenticated with the packet
+  nonce[0] = 9;
+  REQUIRE(!receiver->decrypt(nonce.data(), nonce.data(), nonce.size(), packet.data(),
+                             packet.size(), reinterpret_cast<byte*>(decrypted.data())));
+}
+
+TEST_CASE("file chunks are sealed one by one", "[crypto]") {
+  using namespace mfsync::crypto;
+
+  crypto_handler A, B;
+  A.init("testA.key");
+  B.init("testB.key");
+
+  const auto salt = A.encode(A.generate_salt());
+  A.trust_key(B.get_public_key(), salt);
+  B.trust_key(A.get_public_key(), salt);
+
+  std::vector<unsigned char> sealed;
+  std::vector<unsigned char> opened;
+  size_t offset = 0;
+
+  // the cipher is keyed once, every chunk is opened on its own
+  for (unsigned char value : {1, 2, 3}) {
+    const std::vector<unsigned char> plain(1000 * value, value);
+    A.encrypt_buf(B.get_public_key(), 1, offset, plain.data(), plain.size(), sealed);
+    REQUIRE(sealed.size() == plain.size() + chunk_cipher::TAG_SIZE);
+    REQUIRE(B.decrypt_buf(A.get_public_key(), 1, offset, sealed.data(), sealed.size(), opened));
+    REQUIRE(opened == plain);
+    offset += plain.size();
+  }
+
+  sealed[0] ^= 1;
+  REQUIRE(!B.decrypt_buf(A.get_public_key(), 1, offset, sealed.data(), sealed.size(), opened));
+  REQUIRE(!B.decrypt_buf(A.get_public_key(), 1, offset, sealed.data(),
+                         chunk_cipher::TAG_SIZE - 1, opened));
+
+  // files are read straight into the buffer they are sealed in
+  const auto path = std::filesystem::temp_directory_path() / "mfsync_chunk_cipher_test";
+  {
+    std::ofstream output(path, std::ios::binary);
+    output << "a file that is shorter than the block";
+  }
+
+  std::ifstream input(path, std::ios::binary);
+  A.encrypt_file_to_buf(B.get_public_key(), 1, offset, input, 4096, sealed);
+  REQUIRE(sealed.size() == std::filesystem::file_size(path) + chunk_cipher::TAG_SIZE);
+  REQUIRE(B.decrypt_buf(A.get_public_key(), 1, offset, sealed.data(), sealed.size(), opened));
+  REQUIRE(std::string(opened.begin(), opened.end()) == "a file that is shorter than the block");
+
+  A.encrypt_file_to_buf(B.get_public_key(), 1, offset, input, 4096, sealed);
+  REQUIRE(sealed.empty());
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("records are opened by stream and offset", "[crypto]") {
+  using namespace mfsync::crypto;
+
+  crypto_handler A, B;
+  A.init("testA.key");
+  B.init("testB.key");
+
+  const auto salt = A.encode(A.generate_salt());
+  A.trust_key(B.get_public_key(), salt);
+  B.trust_key(A.get_public_key(), salt);
+
+  REQUIRE(get_record_nonce(1, 0) != get_record_nonce(2, 0));
+  REQUIRE(get_record_nonce(1, 0) != get_record_nonce(1, 1));
+
+  // the same data at different places of the file is sealed differently
+  const std::vector<unsigned char> plain(4096, 42);
+  std::vector<std::vector<unsigned char>> records(4);
+
+  for (size_t i = 0; i < records.size(); ++i) {
+    A.encrypt_buf(B.get_public_key(), 7, i * plain.size(), plain.data(), plain.size(),
+                  records[i]);
+  }
+
+  REQUIRE(records[0] != records[1]);
+
+  // records dont depend on each other, they can be opened in any order
+  std::vector<unsigned char> opened;
+
+  for (size_t i = records.size(); i-- > 0;) {
+    REQUIRE(B.decrypt_buf(A.get_public_key(), 7, i * plain.size(), records[i].data(),
+                          records[i].size(), opened));
+    REQUIRE(opened == plain);
+  }
+
+  // a record that is replayed at another offset or on another stream is refused
+  REQUIRE(!B.decrypt_buf(A.get_public_key(), 7, plain.size(), records[0].data(),
+                         records[0].size(), opened));
+  REQUIRE(!B.decrypt_buf(A.get_public_key(), 8, 0, records[0].data(), records[0].size(),
+                         opened));
+}
+
+TEST_CASE("large chunks are sealed as records in parallel", "[crypto]") {
+  using namespace mfsync::crypto;
+
+  REQUIRE(get_sealed_size(0) == RECORD_TAG_SIZE);
+  REQUIRE(get_sealed_size(RECORD_SIZE) == RECORD_SIZE + RECORD_TAG_SIZE);
+  REQUIRE(get_sealed_size(RECORD_SIZE + 1) == RECORD_SIZE + 1 + 2 * RECORD_TAG_SIZE);
+
+  for (size_t size : {size_t{0}, size_t{1}, RECORD_SIZE - 1, RECORD_SIZE, RECORD_SIZE + 1,
+                      3 * RECORD_SIZE + 100}) {
+    REQUIRE(get_plain_size(get_sealed_size(size)) == size);
+  }
+
+  REQUIRE(!get_plain_size(RECORD_TAG_SIZE - 1).has_value());
+  REQUIRE(!get_plain_size(RECORD_SIZE + 2 * RECORD_TAG_SIZE).has_value());
+
+  // every index is handed out exactly once, no matter which thread takes it
+  crypto_pool counting_pool{3};
+  std::vector<std::atomic<int>> calls(100);
+  counting_pool.run(calls.size(), [&calls](size_t i) { ++calls[i]; });
+
+  for (const auto& call : calls) {
+    REQUIRE(call == 1);
+  }
+
+  crypto_handler A, B;
+  A.init("testA.key");
+  B.init("testB.key");
+  A.set_pool(std::make_shared<crypto_pool>(3));
+
+  const auto salt = A.encode(A.generate_salt());
+  auto derived = A.derive(B.get_public_key(), salt);
+  B.trust_key(A.get_public_key(), salt);
+
+  std::vector<unsigned char> plain(4 * RECORD_SIZE + 100);
+
+  for (size_t i = 0; i < plain.size(); ++i) {
+    plain[i] = static_cast<unsigned char>(i * 31);
+  }
+
+  // sealed on the pool of the derived handler, opened one record after another
+  std::vector<unsigned char> sealed;
+  std::vector<unsigned char> opened;
+  derived->encrypt_buf(B.get_public_key(), 3, 4096, plain.data(), plain.size(), sealed);
+  REQUIRE(sealed.size() == get_sealed_size(plain.size()));
+  REQUIRE(B.decrypt_buf(derived->get_public_key(), 3, 4096, sealed.data(), sealed.size(),
+                        opened));
+  REQUIRE(opened == plain);
+
+  // any altered record spoils the chunk
+  sealed[2 * (RECORD_SIZE + RECORD_TAG_SIZE) + 10] ^= 1;
+  REQUIRE(!B.decrypt_buf(derived->get_public_key(), 3, 4096, sealed.data(), sealed.size(),
+                         opened));
+}